@@ -12,12 +12,18 @@
 #include <iostream>
 #include <iomanip>
 #include <getopt.h>
+#include <unistd.h>
+#include <pthread.h>
 
-#include "extract.hpp"
+#include "bitrate.hpp"
+#include "stats.hpp"
 
 static int show_zero = 0;
 static int viz_hack = 0;
 static const char* iface = NULL;
+static const char* output_name = NULL;
+static bool live = false;
+static double lateness = LIVE_LATENESS;
 const char* program_name = NULL;
 
 static void handle_sigint(int signum){
@@ -29,113 +35,7 @@ static void handle_sigint(int signum){
 	keep_running = false;
 }
 
-class Output {
-public:
-	virtual void write_header(double sampleFrequency, double tSample){};
-	virtual void write_trailer(){};
-	virtual void write_sample(double t, double bitrate) = 0;
-};
-
-class DefaultOutput: public Output {
-public:
-	virtual void write_header(double sampleFrequency, double tSample){
-		fprintf(stdout, "sampleFrequency: %.2fHz\n", sampleFrequency);
-		fprintf(stdout, "tSample:         %fs\n", tSample);
-		fprintf(stdout, "\n");
-		fprintf(stdout, "Time                      \t   Bitrate (bps)\n");
-	}
-
-	virtual void write_sample(double t, double bitrate){
-		fprintf(stdout, "%.15f\t%.15f\n", t, bitrate);
-	}
-};
-
-class CSVOutput: public Output {
-public:
-	CSVOutput(char delimiter, bool show_header)
-		: delimiter(delimiter)
-		, show_header(show_header){
-
-	}
-
-	virtual void write_header(double sampleFrequency, double tSample){
-		if ( show_header ){
-			fprintf(stdout, "\"Time (tSample: %f)\"%c\"Bitrate (bps)\"\n", tSample, delimiter);
-		}
-	}
-
-	virtual void write_sample(double t, double bitrate){
-		fprintf(stdout, "%.15f%c%.15f\n", t, delimiter, bitrate);
-	}
-
-private:
-	char delimiter;
-	bool show_header;
-};
-
-static double my_round (double value){
-	static const double bias = 0.0005;
-	return (floor(value + bias));
-}
-
-class BitrateCalculator: public Extractor {
-public:
-	BitrateCalculator()
-		: Extractor()
-		, bits(0.0){
-
-		set_formatter(FORMAT_DEFAULT);
-	}
-
-	void set_formatter(enum Formatter format){
-		switch (format){
-		case FORMAT_DEFAULT: output = new DefaultOutput; break;
-		case FORMAT_CSV:     output = new CSVOutput(';', false); break;
-		case FORMAT_TSV:     output = new CSVOutput('\t', false); break;
-		case FORMAT_MATLAB:  output = new CSVOutput('\t', true); break;
-		}
-	}
-
-	using Extractor::set_formatter;
-
-	virtual void reset(){
-		bits = 0.0;
-		Extractor::reset();
-	}
-
-protected:
-	virtual void write_header(int index){
-		output->write_header(sampleFrequency, to_double(tSample));
-	}
-
-	virtual void write_trailer(int index){
-		output->write_trailer();
-	}
-
-	virtual void write_sample(double t){
-		const double bitrate = my_round(bits / to_double(tSample));
-
-		if ( viz_hack ){
-			t *= sampleFrequency;
-		}
-
-		if ( show_zero || bitrate > 0 ){
-			output->write_sample(t, bitrate);
-		}
-
-		bits = 0.0;
-	}
-
-	virtual void accumulate(qd_real fraction, unsigned long packet_bits, const cap_head* cp, int counter){
-		bits += my_round(to_double(fraction) * packet_bits);
-	}
-
-private:
-	Output* output;
-	double bits;
-};
-
-static const char* short_options = "p:i:q:m:l:f:zxtTh";
+static const char* short_options = "p:i:q:m:l:f:e:o:A:j:PL::zxtTh";
 static struct option long_options[]= {
 	{"packets",          required_argument, 0, 'p'},
 	{"iface",            required_argument, 0, 'i'},
@@ -143,6 +43,12 @@ static struct option long_options[]= {
 	{"sampleFrequency",  required_argument, 0, 'm'},
 	{"linkCapacity",     required_argument, 0, 'l'},
 	{"format",           required_argument, 0, 'f'},
+	{"engine",           required_argument, 0, 'e'},
+	{"output",           required_argument, 0, 'o'},
+	{"archives",         required_argument, 0, 'A'},
+	{"jobs",             required_argument, 0, 'j'},
+	{"pipeline",         no_argument,       0, 'P'},
+	{"live",             optional_argument, 0, 'L'},
 	{"show-zero",        no_argument,       0, 'z'},
 	{"no-show-zero",     no_argument,       0, 'x'},
 	{"relative-time",    no_argument,       0, 't'},
@@ -161,12 +67,19 @@ static void show_usage(void){
 	printf("  -i, --iface                 For ethernet-based streams, this is the interface\n"
 	       "                              to listen on. For other streams it is ignored.\n"
 	       "  -m, --sampleFrequency       Sampling frequency in Hz. Prefixes: k, m, g.\n"
+	       "                              Several comma-separated frequencies are\n"
+	       "                              calculated in a single pass, e.g. 1k,100,1.\n"
+	       "                              Each must be an integer fraction of the\n"
+	       "                              highest and requires --output.\n"
 	       "  -q, --level                 Level to calculate bitrate on. At level N, only\n"
 	       "                              packet size at particular layer is considered.\n"
 	       "                                - link: all bits captured at physical level.\n"
 	       "                                - network: payload field at link layer.\n"
 	       "                                - transport: payload at network layer.\n"
 	       "                                - application: payload field at transport level.\n"
+	       "                                - all: link, network, transport and application\n"
+	       "                                  in a single pass, one column each. Only a single\n"
+	       "                                  frequency and the column formats are supported.\n"
 	       "                              Default is link-layer.\n"
 	       "  -l, --linkCapacity          Link capacity in BPS, default is 100e6 (100 Mbps).\n"
 	       "  -p, --packets=N             Stop after N packets.\n"
@@ -174,12 +87,82 @@ static void show_usage(void){
 	       "  -x, --no-show-zero          Don't show bitrate when zero [default]\n"
 	       "  -f, --format=FORMAT         Set a specific output format. See below for list\n"
 	       "                              of supported formats.\n"
+	       "  -o, --output=FILE           Write to FILE instead of stdout. With multiple\n"
+	       "                              frequencies each is written to FILE.FREQUENCY.\n"
+	       "                              With --format=shm FILE names the shared-memory\n"
+	       "                              ring [default: /bitrate], see shmtail. With\n"
+	       "                              --format=rrd it is the query socket [default:\n"
+	       "                              /tmp/bitrate.sock].\n"
+	       "  -A, --archives=LIST         Round-robin archives kept by --format=rrd as\n"
+	       "                              RESOLUTION:RETENTION pairs [default: %s].\n"
+	       "                              Every interval is kept (as --show-zero) and the\n"
+	       "                              archives are served until interrupted, see\n"
+	       "                              rrstore.hpp for the queries.\n"
+	       "  -j, --jobs=N                Split the stream into time shards processed by N\n"
+	       "                              threads. The output is identical to a single\n"
+	       "                              thread. Not supported with the rle format or\n"
+	       "                              multiple frequencies.\n"
+	       "  -P, --pipeline              Read, calculate and write in separate threads and\n"
+	       "                              show which stage is the bottleneck.\n"
+	       "  -L, --live[=MS]             Write each sample when the clock passes the end\n"
+	       "                              of its interval plus MS milliseconds of allowed\n"
+	       "                              lateness [default: %g], instead of when the next\n"
+	       "                              packet arrives. For live streams.\n"
+	       "  -e, --engine=ENGINE         Time arithmetic used for sampling, see below for\n"
+	       "                              list of engines [default: qd].\n"
 	       "  -t, --relative-time         Show timestamps relative to the first packet.\n"
 	       "  -T, --absolute-time         Show timestamps with absolute values (default).\n"
-	       "  -h, --help                  This text.\n\n");
+	       "  -h, --help                  This text.\n\n", RRSTORE_ARCHIVES, LIVE_LATENESS);
 
 	output_format_list();
+	output_engine_list();
 	filter_from_argv_usage();
+	stats_from_argv_usage();
+}
+
+/**
+ * Calculate the bitrate at every level in a single pass, see --level all.
+ */
+static int run_all_levels(const BitrateCalculator& app, struct filter* filter, int argc, char** argv, int jobs, bool pipeline){
+	if ( !app.single_output() ){
+		fprintf(stderr, "%s: --level all only supports a single sampling frequency.\n", program_name);
+		return 1;
+	}
+	if ( jobs > 1 || pipeline ){
+		fprintf(stderr, "%s: --jobs and --pipeline are not supported with --level all, ignored.\n", program_name);
+	}
+
+	LevelBitrateCalculator levels;
+	levels.set_parameters(app);
+	levels.set_show_zero(show_zero);
+	levels.set_viz_hack(viz_hack);
+
+	FILE* dst = stdout;
+	if ( output_name && !(dst = fopen(output_name, "w")) ){
+		fprintf(stderr, "%s: %s: %s\n", program_name, output_name, strerror(errno));
+		return 1;
+	}
+	levels.set_output(dst);
+
+	/* handle C-c */
+	signal(SIGINT, handle_sigint);
+
+	int ret;
+	stream_t stream;
+	if ( (ret=stream_from_getopt(&stream, argv, optind, argc, iface, "-", program_name, 0)) != 0 ) {
+		return ret; /* Error already shown */
+	}
+	stream_print_info(stream, stderr);
+
+	levels.reset();
+	levels.process_stream(stream, filter);
+
+	if ( dst != stdout ){
+		fclose(dst);
+	}
+	stream_close(stream);
+	filter_close(filter);
+	return 0;
 }
 
 int main(int argc, char **argv){
@@ -195,8 +178,14 @@ int main(int argc, char **argv){
 	if ( filter_from_argv(&argc, argv, &filter) != 0 ){
 		return 0; /* error already shown */
 	}
+	if ( stats_from_argv(&argc, argv) != 0 ){
+		return 1;
+	}
 
 	BitrateCalculator app;
+	int jobs = 1;
+	bool pipeline = false;
+	bool all_levels = false;
 
 	int op, option_index = -1;
 	while ( (op = getopt_long(argc, argv, short_options, long_options, &option_index)) != -1 ){
@@ -209,22 +198,64 @@ int main(int argc, char **argv){
 			app.set_formatter(optarg);
 			break;
 
+		case 'e': /* --engine */
+			app.set_time_engine(optarg);
+			break;
+
 		case 'p':
 			app.set_max_packets(atoi(optarg));
 			break;
 
 		case 'm' : /* --sampleFrequency */
-			app.set_sampling_frequency(optarg);
+			app.set_sampling_frequencies(optarg);
 			break;
 
 		case 'q': /* --level */
-			app.set_extraction_level(optarg);
+			all_levels = strcasecmp(optarg, "all") == 0;
+			if ( !all_levels ){
+				app.set_extraction_level(optarg);
+			}
 			break;
 
 		case 'l': /* --link */
 			app.set_link_capacity(optarg);
 			break;
 
+		case 'o': /* --output */
+			output_name = optarg;
+			break;
+
+		case 'A': /* --archives */
+			if ( rrstore_parse(optarg, nullptr) ){
+				app.set_archives(optarg);
+			} else {
+				fprintf(stderr, "%s: invalid --archives \"%s\", using %s.\n", program_name, optarg, RRSTORE_ARCHIVES);
+			}
+			break;
+
+		case 'j': /* --jobs */
+			jobs = atoi(optarg);
+			if ( jobs < 1 ){
+				fprintf(stderr, "%s: invalid --jobs \"%s\", using 1.\n", program_name, optarg);
+				jobs = 1;
+			}
+			break;
+
+		case 'P': /* --pipeline */
+			pipeline = true;
+			break;
+
+		case 'L': /* --live */
+			live = true;
+			if ( optarg ){
+				lateness = atof(optarg);
+				if ( lateness < 0.0 ){
+					fprintf(stderr, "%s: invalid --live \"%s\", using %g.\n", program_name, optarg, LIVE_LATENESS);
+					lateness = LIVE_LATENESS;
+				}
+			}
+			break;
+
 		case 'i':
 			iface = optarg;
 			break;
@@ -254,6 +285,53 @@ int main(int argc, char **argv){
 		}
 	}
 
+	if ( live && ( jobs > 1 || pipeline ) ){
+		fprintf(stderr, "%s: --jobs and --pipeline are not supported with --live, ignored.\n", program_name);
+		jobs = 1;
+		pipeline = false;
+	}
+	if ( live ){
+		app.set_live(lateness / 1000.0);
+	}
+
+	/* viz-hacked timestamps only work in the text formats: run-length records
+	 * regenerate them from tSample and the binary formats store them as
+	 * integer nanoseconds, which they overflow */
+	const enum Formatter viz_format = app.get_formatter();
+	if ( viz_hack && viz_format != FORMAT_DEFAULT && viz_format != FORMAT_CSV && viz_format != FORMAT_TSV && viz_format != FORMAT_MATLAB ){
+		fprintf(stderr, "%s: --viz-hack is only supported with the text formats, ignored.\n", program_name);
+		viz_hack = 0;
+	}
+
+	if ( all_levels ){
+		return run_all_levels(app, &filter, argc, argv, jobs, pipeline);
+	}
+
+	if ( jobs > 1 && !app.can_shard() ){
+		fprintf(stderr, "%s: --jobs is not supported with rle, shm or rrd output or multiple frequencies, using 1.\n", program_name);
+		jobs = 1;
+	}
+
+	/* the archives must account for every interval */
+	const bool serve = app.get_formatter() == FORMAT_RRD;
+	if ( serve ){
+		show_zero = 1;
+	}
+
+	/* with several jobs or a writer thread the output file is managed here,
+	 * as each shard or the writer needs the stream, see below */
+	const bool own_output = jobs > 1 || ( pipeline && app.single_output() && app.get_formatter() != FORMAT_SHM && !serve );
+	FILE* dst = stdout;
+	if ( !own_output && app.open_output(output_name) != 0 ){
+		return 1; /* error already shown */
+	} else if ( own_output && output_name && !(dst = fopen(output_name, "w")) ){
+		fprintf(stderr, "%s: %s: %s\n", program_name, output_name, strerror(errno));
+		return 1;
+	}
+
+	app.set_show_zero(show_zero);
+	app.set_viz_hack(viz_hack);
+
 	/* handle C-c */
 	signal(SIGINT, handle_sigint);
 
@@ -267,9 +345,41 @@ int main(int argc, char **argv){
 	stream_print_info(stream, stderr);
 
 	app.reset();
-	app.process_stream(stream, &filter);
+	if ( jobs > 1 ){
+		app.process_stream_sharded(stream, &filter, [&app](FILE* fp){
+			BitrateCalculator* shard = new BitrateCalculator;
+			shard->set_parameters(app);
+			shard->set_output(fp);
+			return shard;
+		}, dst, jobs);
+	} else if ( pipeline && own_output ){
+		app.process_stream_pipelined(stream, &filter, dst, [&app](FILE* fp){ app.set_output(fp); });
+	} else if ( pipeline ){
+		app.process_stream_pipelined(stream, &filter, dst, nullptr);
+	} else {
+		app.process_stream(stream, &filter);
+	}
+
+	/* keep answering queries for the archives */
+	if ( serve && keep_running ){
+		fprintf(stderr, "%s: end of stream, serving queries until interrupted.\n", program_name);
+
+		/* SIGINT is blocked between testing keep_running and waiting, else
+		 * it could arrive in between and the wait would never return */
+		sigset_t block, old;
+		sigemptyset(&block);
+		sigaddset(&block, SIGINT);
+		pthread_sigmask(SIG_BLOCK, &block, &old);
+		while ( keep_running ){
+			sigsuspend(&old);
+		}
+		pthread_sigmask(SIG_SETMASK, &old, nullptr);
+	}
 
 	/* Release resources */
+	if ( dst != stdout ){
+		fclose(dst);
+	}
 	stream_close(stream);
 	filter_close(&filter);
 
@@ -0,0 +1,562 @@
+#ifndef BITRATE_H
+#define BITRATE_H
+
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <deque>
+
+#include "extract.hpp"
+#include "output.hpp"
+
+class BitrateCalculator final: public StaticExtractor<BitrateCalculator> {
+	friend class StaticExtractor<BitrateCalculator>;
+
+public:
+	BitrateCalculator()
+		: StaticExtractor()
+		, format(FORMAT_DEFAULT)
+		, show_zero(false)
+		, viz_hack(false)
+		, archives(RRSTORE_ARCHIVES)
+		, bits(0.0){
+
+	}
+
+	virtual ~BitrateCalculator(){
+		for ( struct series& cur: series ){
+			delete cur.output;
+			if ( cur.fp && cur.fp != stdout ){
+				fclose(cur.fp);
+			}
+		}
+	}
+
+	void set_formatter(enum Formatter format){
+		this->format = format;
+	}
+
+	/**
+	 * Write samples where the bitrate is zero.
+	 */
+	void set_show_zero(bool state){
+		show_zero = state;
+	}
+
+	/**
+	 * Scale timestamps by the sampling frequency, i.e. show sample index.
+	 */
+	void set_viz_hack(bool state){
+		viz_hack = state;
+	}
+
+	/**
+	 * Archives kept by the rrd format, see rrstore_parse.
+	 */
+	void set_archives(const char* spec){
+		archives = spec;
+	}
+
+	using Extractor::set_formatter;
+
+	enum Formatter get_formatter() const {
+		return format;
+	}
+
+	/**
+	 * Copy sampling parameters and output settings from another calculator.
+	 */
+	void set_parameters(const BitrateCalculator& src){
+		Extractor::set_parameters(src);
+		format = src.format;
+		show_zero = src.show_zero;
+		viz_hack = src.viz_hack;
+		archives = src.archives;
+	}
+
+	/**
+	 * Tells if the output can be produced by process_stream_sharded, i.e. it
+	 * is a single series where each sample only depends on its own interval.
+	 */
+	bool can_shard() const {
+		return single_output() && format != FORMAT_RLE && format != FORMAT_SHM && format != FORMAT_RRD;
+	}
+
+	/**
+	 * Tells if a single series is written, i.e. set_output can be used.
+	 */
+	bool single_output() const {
+		return resolutions.size() == 1;
+	}
+
+	/**
+	 * Write the (single) series to dst, which is not closed by the calculator.
+	 * Replaces the current output, if any.
+	 */
+	void set_output(FILE* dst){
+		if ( series.empty() ){
+			series.push_back({&resolutions[0], nullptr, create_output(dst), 0.0, 0.0, 0, 0});
+		} else {
+			delete series[0].output;
+			series[0].output = create_output(dst);
+		}
+	}
+
+	/**
+	 * Create the output for each sampling frequency. With a single frequency
+	 * the series is written to basename (or stdout if NULL), otherwise each
+	 * series is written to "BASENAME.FREQUENCY". With the shm and rrd formats
+	 * basename names the rings (default "/bitrate") or query sockets (default
+	 * "/tmp/bitrate.sock") instead.
+	 * @return 0 on success.
+	 */
+	int open_output(const char* basename){
+		if ( !basename && resolutions.size() > 1 ){
+			fprintf(stderr, "%s: --output is required with multiple sampling frequencies.\n", program_name);
+			return 1;
+		}
+
+		for ( const struct resolution& res: resolutions ){
+			FILE* fp = stdout;
+			if ( basename ){
+				std::string filename = basename;
+				if ( resolutions.size() > 1 ){
+					filename += "." + res.name;
+				}
+				if ( format == FORMAT_SHM || format == FORMAT_RRD ){
+					series.push_back({&res, nullptr, create_output(nullptr, filename.c_str()), 0.0, 0.0, 0, 0});
+					continue;
+				}
+				if ( !(fp = fopen(filename.c_str(), "w")) ){
+					fprintf(stderr, "%s: %s: %s\n", program_name, filename.c_str(), strerror(errno));
+					return 1;
+				}
+			}
+			series.push_back({&res, fp, create_output(fp), 0.0, 0.0, 0, 0});
+		}
+
+		return 0;
+	}
+
+	virtual void reset(){
+		bits = 0.0;
+		for ( struct series& cur: series ){
+			cur.bits = 0.0;
+			cur.packet = 0.0;
+			cur.index = 0;
+			cur.filled = 0;
+		}
+		Extractor::reset();
+	}
+
+protected:
+	virtual void write_header(int index){
+		for ( struct series& cur: series ){
+			struct sample_info info = get_sample_info();
+			info.sampleFrequency = cur.res->sampleFrequency;
+			info.tSample = to_double(cur.res->tSample);
+			cur.output->write_header(info);
+		}
+	}
+
+	virtual void write_reference(){
+		for ( struct series& cur: series ){
+			cur.output->write_reference(ref_sec, ref_psec);
+		}
+	}
+
+	virtual void write_trailer(int index){
+		for ( struct series& cur: series ){
+			if ( cur.filled > 0 || cur.packet > 0.0 ){
+				write_aggregate(cur);
+			}
+			cur.output->write_trailer();
+		}
+	}
+
+	virtual void write_sample(double t){
+		const double bitrate = my_round(bits / to_double(tSample));
+
+		if ( viz_hack ){
+			t *= sampleFrequency;
+		}
+
+		if ( show_zero || bitrate > 0 ){
+			series[0].output->write_sample(t, bitrate);
+			stats_add(STAT_SAMPLES);
+		}
+
+		aggregate(0.0, 1);
+		bits = 0.0;
+	}
+
+	virtual void write_empty_samples(uint64_t n){
+		write_repeated(0.0, n);
+		aggregate(0.0, n);
+	}
+
+	virtual void accumulate(qd_real fraction, unsigned long packet_bits, const cap_head* cp, int counter){
+		const double packet_part = to_double(fraction) * packet_bits;
+		bits += my_round(packet_part);
+
+		for ( auto cur = series.begin() + 1; cur != series.end(); ++cur ){
+			if ( counter == 1 ){
+				flush_packet(*cur);
+			}
+			cur->packet += packet_part;
+		}
+	}
+
+	virtual void accumulate_samples(qd_real fraction, unsigned long packet_bits, const cap_head* cp, int counter, uint64_t n){
+		const double packet_part = to_double(fraction) * packet_bits;
+		write_repeated(my_round(my_round(packet_part) / to_double(tSample)), n);
+		aggregate(packet_part, n);
+	}
+
+private:
+	/**
+	 * Output for one sampling frequency. Lower frequencies are derived by
+	 * summing factor consecutive base samples. Packets are rounded once per
+	 * sample (as if sampled at this frequency) so the part of the current
+	 * packet is kept unrounded until the packet or sample ends.
+	 */
+	struct series {
+		const struct resolution* res;
+		FILE* fp;                       /* closed with the calculator, may be NULL */
+		Output<double>* output;
+		double bits;                    /* bits in the current sample */
+		double packet;                  /* unrounded bits of the current packet */
+		uint64_t index;                 /* current sample */
+		uint64_t filled;                /* base samples summed into current sample */
+	};
+
+	Output<double>* create_output(FILE* dst, const char* name = nullptr) const {
+		switch (format){
+		case FORMAT_DEFAULT: return new DefaultOutput<double>(label, dst);
+		case FORMAT_CSV:     return new CSVOutput<double>(label, ';', false, dst);
+		case FORMAT_TSV:     return new CSVOutput<double>(label, '\t', false, dst);
+		case FORMAT_MATLAB:  return new CSVOutput<double>(label, '\t', true, dst);
+		case FORMAT_RLE:     return new RLEOutput<double>(label, dst);
+		case FORMAT_BINARY:  return new BinaryOutput<double>(label, dst);
+		case FORMAT_SHM:     return new ShmOutput<double>(label, name);
+		case FORMAT_RRD:     return new RoundRobinOutput<double>(label, name, archives.c_str());
+		}
+		return new DefaultOutput<double>(label, dst);
+	}
+
+	/**
+	 * Write the same bitrate for N consecutive intervals.
+	 */
+	void write_repeated(double bitrate, uint64_t n){
+		if ( !(show_zero || bitrate > 0) ) return;
+
+		series[0].output->write_run(n, bitrate, [this](uint64_t i){
+			const double t = sample_time(i);
+			return viz_hack ? t * sampleFrequency : t;
+		});
+		stats_add(STAT_SAMPLES, n);
+	}
+
+	/**
+	 * Feed N base samples to the lower frequencies, each with packet_bits
+	 * (unrounded) bits of the current packet.
+	 */
+	void aggregate(double packet_bits, uint64_t n){
+		for ( auto cur = series.begin() + 1; cur != series.end(); ++cur ){
+			const uint64_t factor = cur->res->factor;
+			uint64_t left = n;
+			while ( left > 0 ){
+				/* whole samples are written in one step */
+				if ( cur->filled == 0 && cur->packet == 0.0 && left >= factor ){
+					const uint64_t m = left / factor;
+					write_aggregate_run(*cur, my_round(packet_bits * factor), m);
+					left -= m * factor;
+					continue;
+				}
+
+				const uint64_t take = std::min(left, factor - cur->filled);
+				cur->packet += packet_bits * take;
+				cur->filled += take;
+				left -= take;
+				if ( cur->filled == factor ){
+					write_aggregate(*cur);
+				}
+			}
+		}
+	}
+
+	void flush_packet(struct series& cur){
+		cur.bits += my_round(cur.packet);
+		cur.packet = 0.0;
+	}
+
+	void write_aggregate(struct series& cur){
+		flush_packet(cur);
+		write_aggregate_run(cur, cur.bits, 1);
+		cur.bits = 0.0;
+		cur.filled = 0;
+	}
+
+	void write_aggregate_run(struct series& cur, double sample_bits, uint64_t n){
+		const double bitrate = my_round(sample_bits / to_double(cur.res->tSample));
+		if ( show_zero || bitrate > 0 ){
+			const uint64_t first = cur.index;
+			cur.output->write_run(n, bitrate, [this, &cur, first](uint64_t i){
+				const double t = resolution_time(*cur.res, first + i);
+				return viz_hack ? t * cur.res->sampleFrequency : t;
+			});
+		}
+		cur.index += n;
+	}
+
+	static constexpr const char* label = "Bitrate (bps)";
+
+	enum Formatter format;
+	bool show_zero;
+	bool viz_hack;
+	std::string archives;
+	std::vector<struct series> series;
+	double bits;
+};
+
+/**
+ * Bitrate at the link, network, transport and application levels in a single
+ * pass, written as one row per sample with a column for each level. Each
+ * level is sampled by its own column extractor (see LevelGroup) and rows are
+ * written once every column has reached them.
+ */
+class LevelBitrateCalculator: public LevelGroup {
+public:
+	LevelBitrateCalculator()
+		: LevelGroup()
+		, format(FORMAT_DEFAULT)
+		, dst(stdout)
+		, show_zero(false)
+		, viz_hack(false)
+		, row(0) {
+
+		for ( int i = 0; i < LEVELS; i++ ){
+			columns[i].set_extraction_level((enum Level)(LEVEL_LINK + i));
+			add(&columns[i]);
+		}
+	}
+
+	/**
+	 * Only the column formats are supported, others fall back to default.
+	 */
+	virtual void set_formatter(enum Formatter format){
+		switch (format){
+		case FORMAT_DEFAULT:
+		case FORMAT_CSV:
+		case FORMAT_TSV:
+		case FORMAT_MATLAB:
+			this->format = format;
+			break;
+		default:
+			fprintf(stderr, "%s: output format not supported with all levels, using default.\n", program_name);
+			this->format = FORMAT_DEFAULT;
+		}
+	}
+
+	using Extractor::set_formatter;
+
+	/**
+	 * Copy sampling parameters and output settings from a single-level
+	 * calculator.
+	 */
+	void set_parameters(const BitrateCalculator& src){
+		Extractor::set_parameters(src);
+		set_formatter(src.get_formatter());
+	}
+
+	void set_show_zero(bool state){
+		show_zero = state;
+	}
+
+	void set_viz_hack(bool state){
+		viz_hack = state;
+	}
+
+	/**
+	 * Write the rows to dst, which is not closed by the calculator.
+	 */
+	void set_output(FILE* dst){
+		this->dst = dst;
+	}
+
+	virtual void reset(){
+		for ( Column& cur: columns ){
+			cur.runs.clear();
+			cur.bits = 0.0;
+		}
+		row = 0;
+		LevelGroup::reset();
+	}
+
+protected:
+	virtual void write_header(int index){
+		static const char* labels[LEVELS] = {"Link (bps)", "Network (bps)", "Transport (bps)", "Application (bps)"};
+		LevelGroup::write_header(index);
+
+		switch (format){
+		case FORMAT_DEFAULT:
+			fprintf(dst, "sampleFrequency: %.2fHz\n", sampleFrequency);
+			fprintf(dst, "tSample:         %fs\n", to_double(tSample));
+			fprintf(dst, "\n");
+			fprintf(dst, "Time                      ");
+			for ( int i = 0; i < LEVELS; i++ ){
+				fprintf(dst, "\t   %s", labels[i]);
+			}
+			fprintf(dst, "\n");
+			break;
+		case FORMAT_MATLAB:
+			fprintf(dst, "\"Time (tSample: %f)\"", to_double(tSample));
+			for ( int i = 0; i < LEVELS; i++ ){
+				fprintf(dst, "\t\"%s\"", labels[i]);
+			}
+			fprintf(dst, "\n");
+			break;
+		default:
+			break;
+		}
+	}
+
+	virtual void write_trailer(int index){
+		write_rows(true);
+		LevelGroup::write_trailer(index);
+	}
+
+	virtual void sample_packet(const cap_head* cp){
+		LevelGroup::sample_packet(cp);
+		write_rows(false);
+	}
+
+	virtual void flush_sample(bool timeout){
+		LevelGroup::flush_sample(timeout);
+		write_rows(false);
+	}
+
+private:
+	static const int LEVELS = LEVEL_APPLICATION - LEVEL_LINK + 1;
+
+	/**
+	 * Consecutive samples with the same bitrate.
+	 */
+	struct run {
+		double bitrate;
+		uint64_t n;
+	};
+
+	/**
+	 * Bitrate at a single level, using the same rounding as
+	 * BitrateCalculator. Samples are queued as runs until the row is written.
+	 */
+	class Column final: public StaticExtractor<Column> {
+		friend class StaticExtractor<Column>;
+
+	public:
+		Column(): bits(0.0) {}
+
+		virtual void set_formatter(enum Formatter format){}
+		using Extractor::set_formatter;
+
+		std::deque<struct run> runs;
+		double bits;
+
+	protected:
+		virtual void write_sample(double t){
+			push(my_round(bits / to_double(tSample)), 1);
+			bits = 0.0;
+		}
+
+		virtual void write_empty_samples(uint64_t n){
+			push(0.0, n);
+		}
+
+		virtual void accumulate(qd_real fraction, unsigned long packet_bits, const cap_head* cp, int counter){
+			bits += my_round(to_double(fraction) * packet_bits);
+		}
+
+		virtual void accumulate_samples(qd_real fraction, unsigned long packet_bits, const cap_head* cp, int counter, uint64_t n){
+			push(my_round(my_round(to_double(fraction) * packet_bits) / to_double(tSample)), n);
+		}
+
+	private:
+		void push(double bitrate, uint64_t n){
+			if ( !runs.empty() && runs.back().bitrate == bitrate ){
+				runs.back().n += n;
+			} else {
+				runs.push_back({bitrate, n});
+			}
+		}
+	};
+
+	/**
+	 * Write the rows all columns have samples for. At the end of the stream
+	 * the remaining rows are written as well, as columns which are behind had
+	 * nothing more to accumulate.
+	 */
+	void write_rows(bool final){
+		for (;;){
+			uint64_t n = UINT64_MAX;
+			bool any = false;
+			for ( const Column& cur: columns ){
+				if ( !cur.runs.empty() ){
+					n = std::min(n, cur.runs.front().n);
+					any = true;
+				} else if ( !final ){
+					return;
+				}
+			}
+			if ( !any ) return;
+
+			double value[LEVELS];
+			bool nonzero = false;
+			for ( int i = 0; i < LEVELS; i++ ){
+				value[i] = columns[i].runs.empty() ? 0.0 : columns[i].runs.front().bitrate;
+				nonzero |= value[i] > 0;
+			}
+
+			if ( show_zero || nonzero ){
+				for ( uint64_t i = 0; i < n; i++ ){
+					write_row(row + i, value);
+				}
+				stats_add(STAT_SAMPLES, n);
+			}
+			row += n;
+
+			for ( Column& cur: columns ){
+				if ( cur.runs.empty() ) continue;
+				if ( (cur.runs.front().n -= n) == 0 ){
+					cur.runs.pop_front();
+				}
+			}
+		}
+	}
+
+	void write_row(uint64_t index, const double* value){
+		double t = resolution_time(resolutions[0], index);
+		if ( viz_hack ){
+			t *= sampleFrequency;
+		}
+
+		const char delimiter = format == FORMAT_CSV ? ';' : '\t';
+		fprintf(dst, "%.15f", t);
+		for ( int i = 0; i < LEVELS; i++ ){
+			fprintf(dst, "%c%.15f", delimiter, value[i]);
+		}
+		fprintf(dst, "\n");
+	}
+
+	enum Formatter format;
+	FILE* dst;
+	bool show_zero;
+	bool viz_hack;
+	Column columns[LEVELS];
+	uint64_t row;                     /* index of the next row to write */
+};
+
+#endif /* BITRATE_H */
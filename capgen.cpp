@@ -0,0 +1,155 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <caputils/caputils.h>
+
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <getopt.h>
+
+#include "synthetic.hpp"
+
+const char* program_name = NULL;
+
+static const char* short_options = "n:r:s:J:g:G:F:u:S:T:h";
+static struct option long_options[]= {
+	{"packets",          required_argument, 0, 'n'},
+	{"rate",             required_argument, 0, 'r'},
+	{"sizes",            required_argument, 0, 's'},
+	{"jumbo",            required_argument, 0, 'J'},
+	{"idle",             required_argument, 0, 'g'},
+	{"idle-length",      required_argument, 0, 'G'},
+	{"flows",            required_argument, 0, 'F'},
+	{"udp",              required_argument, 0, 'u'},
+	{"seed",             required_argument, 0, 'S'},
+	{"start",            required_argument, 0, 'T'},
+	{"help",             no_argument,       0, 'h'},
+	{0, 0, 0, 0} /* sentinel */
+};
+
+static void show_usage(void){
+	printf("%s-" VERSION " (libcap_utils-%s)\n", program_name, caputils_version(NULL));
+	printf("Usage: %s [OPTIONS] FILENAME\n", program_name);
+	printf("Writes a synthetic capture of Ethernet/IPv4 TCP and UDP packets for\n"
+	       "benchmarks and tests. The same options give the same capture.\n\n"
+	       "  -n, --packets=N             Number of packets [default: 1000000].\n"
+	       "  -r, --rate=PPS              Mean packets per second [default: 100000].\n"
+	       "  -s, --sizes=MIX             Frame sizes with weights, e.g. 64:7,576:4,1500:1\n"
+	       "                              [default].\n"
+	       "  -J, --jumbo=FRACTION        Fraction of 9000 byte frames [default: 0].\n"
+	       "  -g, --idle=P                Probability of an idle gap after each packet\n"
+	       "                              [default: 0.0001].\n"
+	       "  -G, --idle-length=SECONDS   Mean length of idle gaps [default: 0.05].\n"
+	       "  -F, --flows=N               Number of flows [default: 1000].\n"
+	       "  -u, --udp=FRACTION          Fraction of UDP flows [default: 0.2].\n"
+	       "  -S, --seed=N                Random seed [default: 4711].\n"
+	       "  -T, --start=SECONDS         Timestamp of the first packet [default: 1700000000].\n"
+	       "  -h, --help                  This text.\n\n");
+}
+
+int main(int argc, char **argv){
+	/* extract program name from path. e.g. /path/to/MArCd -> MArCd */
+	const char* separator = strrchr(argv[0], '/');
+	if ( separator ){
+		program_name = separator + 1;
+	} else {
+		program_name = argv[0];
+	}
+
+	struct synthetic_config config = synthetic_defaults();
+	uint64_t packets = 1000000;
+
+	int op, option_index = -1;
+	while ( (op = getopt_long(argc, argv, short_options, long_options, &option_index)) != -1 ){
+		switch (op){
+		case 0:   /* long opt */
+		case '?': /* unknown opt */
+			break;
+
+		case 'n': /* --packets */
+			packets = strtoull(optarg, NULL, 10);
+			break;
+
+		case 'r': /* --rate */
+			config.packet_rate = atof(optarg);
+			break;
+
+		case 's': /* --sizes */
+			if ( synthetic_parse_sizes(optarg, config.sizes) != 0 ){
+				fprintf(stderr, "%s: invalid size mix \"%s\", sizes must be 64-65535 bytes.\n", program_name, optarg);
+				return 1;
+			}
+			break;
+
+		case 'J': /* --jumbo */
+			config.jumbo = atof(optarg);
+			break;
+
+		case 'g': /* --idle */
+			config.idle_probability = atof(optarg);
+			break;
+
+		case 'G': /* --idle-length */
+			config.idle_length = atof(optarg);
+			break;
+
+		case 'F': /* --flows */
+			config.flows = atoi(optarg);
+			break;
+
+		case 'u': /* --udp */
+			config.udp = atof(optarg);
+			break;
+
+		case 'S': /* --seed */
+			config.seed = strtoull(optarg, NULL, 10);
+			break;
+
+		case 'T': /* --start */
+			config.start = strtoull(optarg, NULL, 10);
+			break;
+
+		case 'h':
+			show_usage();
+			return 0;
+
+		default:
+			fprintf (stderr, "%s: ?? getopt returned character code 0%o ??\n", program_name, op);
+		}
+	}
+
+	if ( config.packet_rate <= 0.0 || config.idle_length <= 0.0 || config.flows < 1 ||
+	     config.jumbo < 0.0 || config.jumbo > 1.0 || config.idle_probability < 0.0 || config.idle_probability > 1.0 ){
+		fprintf(stderr, "%s: invalid rate, idle gaps, jumbo fraction or flows.\n", program_name);
+		return 1;
+	}
+
+	if ( optind >= argc ){
+		fprintf(stderr, "%s: no output filename given, see --help.\n", program_name);
+		return 1;
+	}
+
+	int ret;
+	stream_t st;
+	stream_addr_t addr;
+	if ( (ret=stream_addr_str(&addr, argv[optind], 0)) != 0 ||
+	     (ret=stream_create(&st, &addr, NULL, "synth", "synthetic capture")) != 0 ){
+		fprintf(stderr, "%s: %s: %s\n", program_name, argv[optind], caputils_error_string(ret));
+		return 1;
+	}
+
+	SyntheticTraffic traffic(config);
+	for ( uint64_t i = 0; i < packets; i++ ){
+		const cap_head* cp = traffic.next();
+		if ( (ret=stream_write(st, cp, traffic.record_size())) != 0 ){
+			fprintf(stderr, "%s: %s: %s\n", program_name, argv[optind], caputils_error_string(ret));
+			break;
+		}
+	}
+
+	stream_close(st);
+	return ret != 0;
+}
@@ -0,0 +1,342 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <caputils/caputils.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <csignal>
+#include <string>
+#include <getopt.h>
+
+#include "extract.hpp"
+#include "bitrate.hpp"
+#include "pktrate.hpp"
+#include "timescale.hpp"
+#include "wavelet.hpp"
+#include "stats.hpp"
+
+enum Analysis {
+	ANALYSIS_BITRATE   = (1<<0),
+	ANALYSIS_PKTRATE   = (1<<1),
+	ANALYSIS_TIMESCALE = (1<<2),
+	ANALYSIS_WAVELET   = (1<<3),
+};
+
+struct analysis_entry { const char* name; const char* desc; enum Analysis analysis; };
+static const struct analysis_entry analysis_lut[] = {
+	{"bitrate",   "bitrate per sampling interval",       ANALYSIS_BITRATE},
+	{"pktrate",   "packets per sampling interval",       ANALYSIS_PKTRATE},
+	{"timescale", "bitrate moments per timescale",       ANALYSIS_TIMESCALE},
+	{"wavelet",   "wavelet spectrum of the packet rate", ANALYSIS_WAVELET},
+	{nullptr, nullptr, (enum Analysis)0} /* sentinel */
+};
+
+static int show_zero = 0;
+static int viz_hack = 0;
+static const char* iface = NULL;
+static const char* output_name = NULL;
+const char* program_name = NULL;
+
+static void handle_sigint(int signum){
+	if ( !keep_running ){
+		fprintf(stderr, "\rGot SIGINT again, terminating.\n");
+		abort();
+	}
+	fprintf(stderr, "\rAborting capture.\n");
+	keep_running = false;
+}
+
+static int analysis_from_string(const char* str){
+	int mask = 0;
+	char* tmp = strdup(str);
+	char* saveptr = nullptr;
+	for ( char* tok = strtok_r(tmp, ",", &saveptr); tok; tok = strtok_r(nullptr, ",", &saveptr) ){
+		const struct analysis_entry* cur = analysis_lut;
+		while ( cur->name && strcasecmp(cur->name, tok) != 0 ){
+			cur++;
+		}
+
+		if ( cur->name ){
+			mask |= cur->analysis;
+		} else {
+			fprintf(stderr, "%s: unrecognised analysis \"%s\", ignored.\n", program_name, tok);
+		}
+	}
+	free(tmp);
+	return mask;
+}
+
+static void analysis_list(){
+	printf("Supported analyses:\n");
+	const struct analysis_entry* cur = analysis_lut;
+	while ( cur->name ){
+		printf(" * %-10s (%s)\n", cur->name, cur->desc);
+		cur++;
+	}
+	printf("\n");
+}
+
+/**
+ * Open BASENAME.NAME for writing, or stdout if no basename was given.
+ */
+static FILE* open_output(const char* name){
+	if ( !output_name ){
+		return stdout;
+	}
+
+	const std::string filename = std::string(output_name) + "." + name;
+	FILE* fp = fopen(filename.c_str(), "w");
+	if ( !fp ){
+		fprintf(stderr, "%s: %s: %s\n", program_name, filename.c_str(), strerror(errno));
+	}
+	return fp;
+}
+
+static const char* short_options = "p:i:q:m:l:f:e:o:a:s:n:zxtTh";
+static struct option long_options[]= {
+	{"packets",          required_argument, 0, 'p'},
+	{"iface",            required_argument, 0, 'i'},
+	{"level",            required_argument, 0, 'q'},
+	{"sampleFrequency",  required_argument, 0, 'm'},
+	{"linkCapacity",     required_argument, 0, 'l'},
+	{"format",           required_argument, 0, 'f'},
+	{"engine",           required_argument, 0, 'e'},
+	{"output",           required_argument, 0, 'o'},
+	{"analysis",         required_argument, 0, 'a'},
+	{"timescale",        required_argument, 0, 's'},
+	{"moments",          required_argument, 0, 'n'},
+	{"show-zero",        no_argument,       0, 'z'},
+	{"no-show-zero",     no_argument,       0, 'x'},
+	{"relative-time",    no_argument,       0, 't'},
+	{"absolute-time",    no_argument,       0, 'T'},
+	{"viz-hack",         no_argument,       &viz_hack, 1},
+	{"help",             no_argument,       0, 'h'},
+	{0, 0, 0, 0} /* sentinel */
+};
+
+static void show_usage(void){
+	printf("%s-" VERSION " (libcap_utils-%s)\n", program_name, caputils_version(NULL));
+	printf("Usage: %s [OPTIONS] STREAM\n", program_name);
+	printf("Runs several analyses on a single pass over the stream.\n\n"
+	       "  -i, --iface                 For ethernet-based streams, this is the interface\n"
+	       "                              to listen on. For other streams it is ignored.\n"
+	       "  -a, --analysis=LIST         Comma-separated list of analyses, see below\n"
+	       "                              [default: all].\n"
+	       "  -o, --output=BASENAME       Write each analysis to BASENAME.ANALYSIS. Required\n"
+	       "                              unless a single analysis is selected.\n"
+	       "  -m, --sampleFrequency       Sampling frequency in Hz. Prefixes: k, m, g.\n"
+	       "                              Several comma-separated frequencies are supported\n"
+	       "                              by bitrate, the others use the highest.\n"
+	       "  -q, --level                 Level to calculate bitrate on, see bitrate(1).\n"
+	       "  -l, --linkCapacity          Link capacity in BPS, default is 100e6 (100 Mbps).\n"
+	       "  -p, --packets=N             Stop after N packets.\n"
+	       "  -z, --show-zero             Show samples when zero.\n"
+	       "  -x, --no-show-zero          Don't show samples when zero [default]\n"
+	       "  -f, --format=FORMAT         Set a specific output format. See below for list\n"
+	       "                              of supported formats.\n"
+	       "  -e, --engine=ENGINE         Time arithmetic used for sampling, see below for\n"
+	       "                              list of engines [default: qd].\n"
+	       "  -s, --timescale=SCALE       Set timescale [default: 10].\n"
+	       "  -n, --moments=MOMENTS       Show N moments [default: 3].\n"
+	       "  -t, --relative-time         Show timestamps relative to the first packet.\n"
+	       "  -T, --absolute-time         Show timestamps with absolute values (default).\n"
+	       "  -h, --help                  This text.\n\n");
+
+	analysis_list();
+	output_format_list();
+	output_engine_list();
+	filter_from_argv_usage();
+	stats_from_argv_usage();
+}
+
+int main(int argc, char **argv){
+	/* extract program name from path. e.g. /path/to/MArCd -> MArCd */
+	const char* separator = strrchr(argv[0], '/');
+	if ( separator ){
+		program_name = separator + 1;
+	} else {
+		program_name = argv[0];
+	}
+
+	struct filter filter;
+	if ( filter_from_argv(&argc, argv, &filter) != 0 ){
+		return 0; /* error already shown */
+	}
+	if ( stats_from_argv(&argc, argv) != 0 ){
+		return 1;
+	}
+
+	ExtractorGroup app;
+	BitrateCalculator* bitrate = new BitrateCalculator;
+	PacketRate* pktrate = new PacketRate;
+	Timescale* timescale = new Timescale;
+	Wavelet* wavelet = new Wavelet;
+	const char* format = nullptr;
+	int analysis = ANALYSIS_BITRATE | ANALYSIS_PKTRATE | ANALYSIS_TIMESCALE | ANALYSIS_WAVELET;
+
+	int op, option_index = -1;
+	while ( (op = getopt_long(argc, argv, short_options, long_options, &option_index)) != -1 ){
+		switch (op){
+		case 0:   /* long opt */
+		case '?': /* unknown opt */
+			break;
+
+		case 'f': /* --format */
+			format = optarg;
+			break;
+
+		case 'e': /* --engine */
+			app.set_time_engine(optarg);
+			break;
+
+		case 'p':
+			app.set_max_packets(atoi(optarg));
+			break;
+
+		case 'm' : /* --sampleFrequency */
+			app.set_sampling_frequencies(optarg);
+			break;
+
+		case 'q': /* --level */
+			app.set_extraction_level(optarg);
+			break;
+
+		case 'l': /* --link */
+			app.set_link_capacity(optarg);
+			break;
+
+		case 'o': /* --output */
+			output_name = optarg;
+			break;
+
+		case 'a': /* --analysis */
+			analysis = analysis_from_string(optarg);
+			break;
+
+		case 's': /* --timescale */
+			timescale->set_timescale(atoi(optarg));
+			break;
+
+		case 'n': /* --moments */
+			timescale->set_moments(atoi(optarg));
+			break;
+
+		case 'i':
+			iface = optarg;
+			break;
+
+		case 'z':
+			show_zero = 1;
+			break;
+
+		case 'x':
+			show_zero = 0;
+			break;
+
+		case 't': /* --relative-time */
+			app.set_relative_time(true);
+			break;
+
+		case 'T': /* --absolute-time */
+			app.set_relative_time(false);
+			break;
+
+		case 'h':
+			show_usage();
+			return 0;
+
+		default:
+			fprintf (stderr, "%s: ?? getopt returned character code 0%o ??\n", program_name, op);
+		}
+	}
+
+	if ( analysis == 0 ){
+		fprintf(stderr, "%s: no analysis selected.\n", program_name);
+		return 1;
+	}
+
+	if ( !output_name && (analysis & (analysis - 1)) != 0 ){
+		fprintf(stderr, "%s: --output is required with multiple analyses.\n", program_name);
+		return 1;
+	}
+
+	if ( analysis & ANALYSIS_BITRATE   ) app.add(bitrate);
+	if ( analysis & ANALYSIS_PKTRATE   ) app.add(pktrate);
+	if ( analysis & ANALYSIS_TIMESCALE ) app.add(timescale);
+	if ( analysis & ANALYSIS_WAVELET   ) app.add(wavelet);
+
+	if ( format ){
+		app.set_formatter(format);
+	}
+
+	/* viz-hacked timestamps only work in the text formats: run-length records
+	 * regenerate them from tSample and the binary formats store them as
+	 * integer nanoseconds, which they overflow */
+	const enum Formatter viz_format = bitrate->get_formatter();
+	if ( viz_hack && viz_format != FORMAT_DEFAULT && viz_format != FORMAT_CSV && viz_format != FORMAT_TSV && viz_format != FORMAT_MATLAB ){
+		fprintf(stderr, "%s: --viz-hack is only supported with the text formats, ignored.\n", program_name);
+		viz_hack = 0;
+	}
+	bitrate->set_show_zero(show_zero);
+	bitrate->set_viz_hack(viz_hack);
+	pktrate->set_show_zero(show_zero);
+	wavelet->set_show_zero(show_zero);
+
+	/* sampling parameters are copied to each analysis here, so outputs
+	 * depending on them must be opened after */
+	app.reset();
+
+	FILE* pktrate_fp = nullptr;
+	FILE* timescale_fp = nullptr;
+	FILE* wavelet_fp = nullptr;
+	int ret = 0;
+
+	if ( analysis & ANALYSIS_BITRATE ){
+		const std::string basename = output_name ? std::string(output_name) + ".bitrate" : "";
+		ret |= bitrate->open_output(output_name ? basename.c_str() : nullptr);
+	}
+	if ( analysis & ANALYSIS_PKTRATE ){
+		if ( (pktrate_fp = open_output("pktrate")) ) pktrate->set_output(pktrate_fp); else ret = 1;
+	}
+	if ( analysis & ANALYSIS_TIMESCALE ){
+		if ( (timescale_fp = open_output("timescale")) ) timescale->set_output(timescale_fp); else ret = 1;
+	}
+	if ( analysis & ANALYSIS_WAVELET ){
+		if ( (wavelet_fp = open_output("wavelet")) ) wavelet->set_output(wavelet_fp); else ret = 1;
+	}
+
+	if ( ret == 0 ){
+		/* handle C-c */
+		signal(SIGINT, handle_sigint);
+
+		/* Open stream(s) */
+		stream_t stream;
+		if ( (ret=stream_from_getopt(&stream, argv, optind, argc, iface, "-", program_name, 0)) == 0 ) {
+			stream_print_info(stream, stderr);
+
+			app.process_stream(stream, &filter);
+			if ( analysis & ANALYSIS_TIMESCALE ) timescale->write_summary();
+			if ( analysis & ANALYSIS_WAVELET   ) wavelet->wavelet();
+
+			stream_close(stream);
+		}
+	}
+
+	/* Release resources, outputs must be flushed before closing the files */
+	delete bitrate;
+	delete pktrate;
+	delete timescale;
+	delete wavelet;
+	for ( FILE* fp: {pktrate_fp, timescale_fp, wavelet_fp} ){
+		if ( fp && fp != stdout ){
+			fclose(fp);
+		}
+	}
+	filter_close(&filter);
+
+	return ret;
+}
@@ -3,11 +3,24 @@
 #endif
 
 #include "extract.hpp"
+#include "layers.hpp"
+#include "ring.hpp"
+#include "stats.hpp"
 #include <caputils/packet.h>
 
+#include <algorithm>
+#include <atomic>
+#include <cinttypes>
+#include <cmath>
+#include <condition_variable>
 #include <cstdlib>
 #include <cstring>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <csignal>
 #include <errno.h>
+#include <pthread.h>
 #include <netinet/ip.h>
 #include <netinet/tcp.h>
 #include <netinet/udp.h>
@@ -17,7 +30,6 @@
 extern "C" int is_marker(const struct cap_header* cp, struct marker* ptr, int port);
 
 bool keep_running = true;
-extern const char* program_name;
 
 void output_format_list(){
 	printf("Supported output formats:\n");
@@ -29,6 +41,16 @@ void output_format_list(){
 	printf("\n");
 }
 
+void output_engine_list(){
+	printf("Supported time engines:\n");
+	const struct engine_entry* cur = engine_lut;
+	while ( cur->name ){
+		printf(" * %-10s (%s)\n", cur->name, cur->desc);
+		cur++;
+	}
+	printf("\n");
+}
+
 static int prefix_to_multiplier(char prefix){
 	prefix = tolower(prefix);
 	switch ( prefix ){
@@ -64,7 +86,11 @@ Extractor::Extractor()
 	, first_packet(true)
 	, relative_time(false)
 	, max_packets(0)
-	, level(LEVEL_LINK) {
+	, level(LEVEL_LINK)
+	, engine(ENGINE_QD)
+	, live_lateness(-1.0)
+	, clip_begin(0)
+	, clip_end(UINT64_MAX) {
 
 	set_sampling_frequency(1.0); /* default to 1Hz */
 	set_link_capacity("100m");   /* default to 100mbps */
@@ -78,12 +104,11 @@ void Extractor::set_ignore_marker(bool state){
 	ignore_marker = state;
 }
 
-void Extractor::set_sampling_frequency(double hz){
-	sampleFrequency = hz;
-	tSample = 1.0 / sampleFrequency;
+void Extractor::set_live(double lateness){
+	live_lateness = lateness;
 }
 
-void Extractor::set_sampling_frequency(const char* str){
+static double parse_frequency(const char* str){
 	char* tmp = strdup(str);
 	const char prefix = pop_prefix(tmp);
 	int multiplier = prefix_to_multiplier(prefix);
@@ -93,8 +118,66 @@ void Extractor::set_sampling_frequency(const char* str){
 		multiplier = 1;
 	}
 
-	set_sampling_frequency(atof(tmp) * multiplier);
+	const double hz = atof(tmp) * multiplier;
 	free(tmp);
+	return hz;
+}
+
+void Extractor::set_sampling_frequency(double hz){
+	char name[64];
+	snprintf(name, sizeof(name), "%g", hz);
+
+	sampleFrequency = hz;
+	tSample = 1.0 / sampleFrequency;
+	resolutions.assign(1, {name, sampleFrequency, tSample, 1});
+}
+
+void Extractor::set_sampling_frequency(const char* str){
+	set_sampling_frequency(parse_frequency(str));
+	resolutions[0].name = str;
+}
+
+void Extractor::set_sampling_frequencies(const char* str){
+	std::vector<struct resolution> list;
+
+	char* tmp = strdup(str);
+	char* saveptr = nullptr;
+	for ( char* tok = strtok_r(tmp, ",", &saveptr); tok; tok = strtok_r(nullptr, ",", &saveptr) ){
+		const double hz = parse_frequency(tok);
+		if ( hz <= 0.0 ){
+			fprintf(stderr, "%s: invalid sampling frequency \"%s\", ignored.\n", program_name, tok);
+			continue;
+		}
+		list.push_back({tok, hz, 1.0 / hz, 1});
+	}
+	free(tmp);
+
+	if ( list.empty() ){
+		fprintf(stderr, "%s: no valid sampling frequency in \"%s\", ignored.\n", program_name, str);
+		return;
+	}
+
+	std::stable_sort(list.begin(), list.end(), [](const struct resolution& a, const struct resolution& b){
+		return a.sampleFrequency > b.sampleFrequency;
+	});
+
+	set_sampling_frequency(list[0].sampleFrequency);
+	resolutions[0].name = list[0].name;
+
+	for ( auto it = list.begin() + 1; it != list.end(); ++it ){
+		const double ratio = sampleFrequency / it->sampleFrequency;
+		const uint64_t factor = llround(ratio);
+		if ( factor == 1 ){
+			fprintf(stderr, "%s: duplicate sampling frequency \"%s\", ignored.\n", program_name, it->name.c_str());
+			continue;
+		}
+		if ( fabs(ratio - factor) > 1e-9 * ratio ){
+			fprintf(stderr, "%s: sampling frequency \"%s\" is not an integer fraction of \"%s\", ignored.\n", program_name, it->name.c_str(), list[0].name.c_str());
+			continue;
+		}
+		it->factor = factor;
+		resolutions.push_back(*it);
+	}
 }
 
 void Extractor::set_max_packets(size_t n){
@@ -119,6 +202,10 @@ void Extractor::set_link_capacity(const char* str){
 	free(tmp);
 }
 
+void Extractor::set_extraction_level(enum Level level){
+	this->level = level;
+}
+
 void Extractor::set_extraction_level(const char* str){
 	level = level_from_string(str);
 	if ( level == LEVEL_INVALID ){
@@ -131,6 +218,50 @@ void Extractor::set_relative_time(bool state){
 	relative_time = state;
 }
 
+void Extractor::set_time_engine(enum TimeEngine engine){
+	this->engine = engine;
+}
+
+void Extractor::set_time_engine(const char* str){
+	const struct engine_entry* cur = engine_lut;
+	while ( cur->name ){
+		if ( strcasecmp(cur->name, str) == 0 ){
+			return set_time_engine(cur->engine);
+		}
+		cur++;
+	}
+
+	fprintf(stderr, "%s: unrecognised time engine \"%s\", ignored.\n", program_name, str);
+}
+
+bool Extractor::has_integer_tsample() const {
+	const double ps = PICODIVIDER / sampleFrequency;
+	return ps >= 1.0 && fabs(ps - llround(ps)) < 1e-3;
+}
+
+void Extractor::set_parameters(const Extractor& src){
+	sampleFrequency = src.sampleFrequency;
+	tSample = src.tSample;
+	resolutions = src.resolutions;
+	relative_time = src.relative_time;
+	link_capacity = src.link_capacity;
+	level = src.level;
+	engine = src.engine;
+	max_packets = src.max_packets;
+	ignore_marker = src.ignore_marker;
+	live_lateness = src.live_lateness;
+}
+
+struct sample_info Extractor::get_sample_info() const {
+	struct sample_info info;
+	info.sampleFrequency = sampleFrequency;
+	info.tSample = to_double(tSample);
+	info.level = level;
+	info.link_capacity = link_capacity;
+	info.relative_time = relative_time;
+	return info;
+}
+
 void Extractor::set_formatter(const char* str){
 	const struct formatter_entry* cur = formatter_lut;
 	while ( cur->name ){
@@ -148,39 +279,104 @@ void Extractor::reset(){
 	counter = 1;
 }
 
+/* header/trailer index, incremented for each processed stream */
+static std::atomic<int> stream_index(0);
+
+/**
+ * Scheduling state of process_stream in live mode, see set_live.
+ */
+struct live_state {
+	double offset;                    /* smallest arrival time - timestamp seen */
+	double end;                       /* end of the current interval */
+	double closed;                    /* packets before this are late */
+};
+
+static double wall_time(){
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+static double packet_time(const cap_head* cp){
+	return (double)cp->ts.tv_sec + (double)cp->ts.tv_psec / PICODIVIDER;
+}
+
+/**
+ * Close the intervals whose deadline has passed and set the read timeout to
+ * the next deadline. Samples are flushed right away as nothing else is
+ * written until the next interval is closed.
+ */
+void Extractor::live_schedule(struct live_state* live, struct timeval* tv){
+	if ( std::isinf(live->offset) ) return; /* no packet yet */
+
+	const double until = wall_time() - live->offset - live_lateness;
+	const double end = flush_until(until);
+	if ( end != live->end ){
+		fflush(nullptr);
+		live->end = end;
+	}
+	live->closed = std::min(until, end - to_double(tSample));
+
+	const double timeout = std::max(end - until, 0.0);
+	if ( timeout < 1.0 ){
+		tv->tv_sec = 0;
+		tv->tv_usec = (suseconds_t)ceil(timeout * 1e6);
+	}
+}
+
 void Extractor::process_stream(const stream_t st, struct filter* filter){
-	static int index = 0;
 	const stream_stat_t* stat = stream_get_stat(st);
 	int ret = 0;
 
-	write_header(index);
+	validate_engine();
+	write_header(stream_index);
+	stats_begin_stream(stat);
+
+	const bool live = live_lateness >= 0.0;
+	struct live_state ls = {INFINITY, INFINITY, -INFINITY};
 
 	while ( keep_running && ( max_packets == 0 || stat->matched < max_packets ) ) {
 		/* A short timeout is used to allow the application to "breathe", i.e
 		 * terminate if SIGINT was received. */
 		struct timeval tv = {1,0};
+		if ( live ){
+			live_schedule(&ls, &tv);
+		}
 
 		/* Read the next packet */
 		cap_head* cp;
-		ret = stream_read(st, &cp, filter, &tv);
+		stats_next_packet();
+		{
+			StageTimer timer(STAGE_READ);
+			ret = stream_read(st, &cp, filter, &tv);
+		}
 		if ( ret == EAGAIN ){
-			if ( !first_packet ){
-				do_sample();
+			if ( !live ){
+				flush_sample(true);
 			}
 			continue; /* timeout */
 		} else if ( ret != 0 ){
 			break; /* shutdown or error */
 		}
 
-		calculate_samples(cp);
+		stats_add(STAT_MATCHED);
+		if ( live ){
+			const double t = packet_time(cp);
+			ls.offset = std::min(ls.offset, wall_time() - t);
+			if ( t < ls.closed ){
+				stats_add(STAT_LATE);
+			}
+		}
+		sample_packet(cp);
 	}
 
 	/* push the final sample */
-	do_sample();
+	flush_sample(false);
+	stats_end_stream(stat);
 
 	/* only write trailer if app isn't terminating */
 	if ( keep_running ){
-		write_trailer(index++);
+		write_trailer(stream_index++);
 	}
 
 	/* if ret == -1 the stream was closed properly (e.g EOF or TCP shutdown)
@@ -191,6 +387,425 @@ void Extractor::process_stream(const stream_t st, struct filter* filter){
 	}
 }
 
+/**
+ * Start fn in a new thread with all signals blocked, so SIGINT and friends
+ * are always handled by the main thread.
+ */
+template <class Fn>
+static std::thread start_thread(Fn fn){
+	sigset_t all, old;
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+	std::thread thread(fn);
+	pthread_sigmask(SIG_SETMASK, &old, nullptr);
+	return thread;
+}
+
+#define PIPELINE_PACKETS    4096    /* slots in the packet ring */
+#define PIPELINE_SNAPLEN    256     /* bytes of each packet passed to the extractor */
+#define PIPELINE_CHUNKS     16      /* slots in the output ring */
+#define PIPELINE_CHUNK_SIZE 65536
+
+/**
+ * Packet passed from the reader to the compute thread. The size is extracted
+ * by the reader so only the headers are kept.
+ */
+struct packet_desc {
+	bool timeout;                     /* no packet, the read timed out */
+	unsigned long bits;               /* packet size at the extraction level */
+	alignas(cap_head) char raw[sizeof(cap_head) + PIPELINE_SNAPLEN];
+};
+
+/**
+ * Formatted output passed from the compute to the writer thread.
+ */
+struct output_chunk {
+	size_t size;
+	char data[PIPELINE_CHUNK_SIZE];
+};
+
+static ssize_t pipeline_write(void* cookie, const char* buf, size_t size){
+	SPSCRing<struct output_chunk>* ring = (SPSCRing<struct output_chunk>*)cookie;
+	size_t left = size;
+	while ( left > 0 ){
+		struct output_chunk* chunk = ring->claim();
+		chunk->size = std::min(left, sizeof(chunk->data));
+		memcpy(chunk->data, buf, chunk->size);
+		ring->publish();
+		buf += chunk->size;
+		left -= chunk->size;
+	}
+	return size;
+}
+
+/**
+ * Show how full a ring was on average. A ring which is mostly full means the
+ * consumer is the bottleneck, mostly empty means the producer is.
+ */
+static void print_ring_stats(const char* producer, const char* consumer, const struct ring_stats& stats, size_t capacity){
+	const double occupancy = stats.items > 0 ? 100.0 * stats.occupancy / ((double)stats.items * capacity) : 0.0;
+	fprintf(stderr, "%s: %s -> %s: %" PRIu64 " items, %.1f%% full on average, %s stalled %" PRIu64 " times, %s stalled %" PRIu64 " times.\n",
+	        program_name, producer, consumer, stats.items, occupancy, producer, stats.full, consumer, stats.empty);
+}
+
+void Extractor::process_stream_pipelined(const stream_t st, struct filter* filter, FILE* dst, const std::function<void(FILE*)>& set_output){
+	const stream_stat_t* stat = stream_get_stat(st);
+	int ret = 0;
+
+	SPSCRing<struct packet_desc> packets(PIPELINE_PACKETS);
+	SPSCRing<struct output_chunk> output(set_output ? PIPELINE_CHUNKS : 0);
+
+	FILE* fp = nullptr;
+	std::thread writer;
+	if ( set_output ){
+		fp = fopencookie(&output, "w", {nullptr, pipeline_write, nullptr, nullptr});
+		setvbuf(fp, nullptr, _IOFBF, PIPELINE_CHUNK_SIZE);
+		set_output(fp);
+
+		writer = start_thread([&output, dst](){
+			const struct output_chunk* chunk;
+			while ( (chunk = output.front()) ){
+				fwrite(chunk->data, 1, chunk->size, dst);
+				output.release();
+			}
+			fflush(dst);
+		});
+	}
+
+	stats_begin_stream(stat);
+	std::thread reader = start_thread([&](){
+		while ( keep_running && ( max_packets == 0 || stat->matched < max_packets ) ) {
+			struct timeval tv = {1,0};
+
+			cap_head* cp;
+			stats_next_packet();
+			{
+				StageTimer timer(STAGE_READ);
+				ret = stream_read(st, &cp, filter, &tv);
+			}
+			if ( ret != 0 && ret != EAGAIN ){
+				break; /* shutdown or error */
+			}
+			if ( ret == 0 ){
+				stats_add(STAT_MATCHED);
+			}
+
+			struct packet_desc* desc = packets.claim();
+			desc->timeout = ret == EAGAIN;
+			if ( !desc->timeout ){
+				const uint32_t caplen = std::min(cp->caplen, (uint32_t)PIPELINE_SNAPLEN);
+				desc->bits = packet_size(cp) * 8;
+				memcpy(desc->raw, cp, sizeof(cap_head) + caplen);
+				((cap_head*)desc->raw)->caplen = caplen;
+			}
+			packets.publish();
+		}
+		packets.close();
+	});
+
+	validate_engine();
+	write_header(stream_index);
+
+	const struct packet_desc* desc;
+	while ( (desc = packets.front()) ){
+		stats_next_packet();
+		if ( !desc->timeout ){
+			calculate_samples((const cap_head*)desc->raw, desc->bits);
+		} else if ( !first_packet ){
+			do_sample();
+		}
+		packets.release();
+	}
+	reader.join();
+	stats_end_stream(stat);
+
+	/* push the final sample */
+	do_sample();
+
+	/* only write trailer if app isn't terminating */
+	if ( keep_running ){
+		write_trailer(stream_index++);
+	}
+
+	if ( set_output ){
+		set_output(dst);
+		fclose(fp);
+		output.close();
+		writer.join();
+	}
+
+	print_ring_stats("reader", "compute", packets.stats(), packets.capacity());
+	if ( set_output ){
+		print_ring_stats("compute", "writer", output.stats(), output.capacity());
+	}
+
+	if ( ret > 0 && ret != EINTR ){
+		fprintf(stderr, "stream_read() returned 0x%08X: %s\n", ret, caputils_error_string(ret));
+	}
+}
+
+void Extractor::validate_engine(){
+	if ( engine == ENGINE_INTEGER ){
+		if ( has_integer_tsample() ){
+			tSample_ps = llround(PICODIVIDER / sampleFrequency);
+		} else {
+			fprintf(stderr, "%s: sampling interval is not a whole number of picoseconds, using qd time engine.\n", program_name);
+			engine = ENGINE_QD;
+		}
+	}
+}
+
+/**
+ * A range of sampling intervals [lo, hi) and the packets affecting them.
+ * Packets are stored back-to-back, each padded to 8 bytes.
+ */
+struct shard {
+	int index;
+	uint64_t lo;
+	uint64_t hi;
+	uint64_t max_interval;            /* highest interval a packet begins in */
+	bool last;
+	bool done;
+	FILE* out;
+	long header_size;                 /* bytes before the first sample in out */
+	std::vector<char> packets;
+	std::vector<size_t> offset;       /* offset of each packet */
+	std::vector<uint64_t> reach;      /* highest interval reached by packets 0..i */
+};
+
+static void shard_append(struct shard* s, const cap_head* cp, uint64_t end_interval){
+	const size_t offset = s->packets.size();
+	s->packets.resize(offset + ((sizeof(cap_head) + cp->caplen + 7) & ~(size_t)7));
+	memcpy(&s->packets[offset], cp, sizeof(cap_head) + cp->caplen);
+	s->offset.push_back(offset);
+	s->reach.push_back(s->reach.empty() ? end_interval : std::max(s->reach.back(), end_interval));
+}
+
+void Extractor::process_stream_sharded(const stream_t st, struct filter* filter, const std::function<Extractor*(FILE*)>& factory, FILE* dst, int jobs, size_t shard_packets){
+	const stream_stat_t* stat = stream_get_stat(st);
+	int ret = 0;
+
+	validate_engine();
+
+	std::mutex mutex;
+	std::condition_variable work_cond;
+	std::condition_variable done_cond;
+	std::deque<struct shard*> queue;    /* shards waiting for a worker */
+	std::deque<struct shard*> pending;  /* shards not yet merged, in order */
+	bool finished = false;
+
+	/* each shard starts from the same reference as a sequential run would,
+	 * only writing the intervals it owns */
+	auto process_shard = [&](struct shard* s){
+		s->out = tmpfile();
+		if ( !s->out ){
+			fprintf(stderr, "%s: tmpfile: %s\n", program_name, strerror(errno));
+			return;
+		}
+
+		Extractor* ex = factory(s->out);
+		ex->reset();
+		ex->validate_engine();
+		ex->ref_time = ref_time;
+		ex->start_time = ref_time;
+		ex->end_time = ref_time + tSample;
+		ex->ref_sec = ref_sec;
+		ex->ref_psec = ref_psec;
+		ex->start_ps = 0;
+		ex->first_packet = false;
+		ex->clip_begin = s->lo;
+		ex->clip_end = s->hi;
+
+		/* outputs may depend on the header and reference being written (e.g.
+		 * binary timestamps) so they are written by all shards but only kept
+		 * once */
+		ex->write_header(0);
+		ex->write_reference();
+		fflush(s->out);
+		s->header_size = s->index == 0 ? 0 : ftell(s->out);
+
+		for ( size_t offset: s->offset ){
+			stats_next_packet();
+			ex->calculate_samples((const cap_head*)&s->packets[offset]);
+		}
+
+		if ( s->last ){
+			ex->do_sample();
+			if ( keep_running ){
+				ex->write_trailer(0);
+			}
+		} else if ( ex->counter - 1 < s->hi ){
+			/* the following shard begins with a packet in interval hi so all
+			 * intervals up to it are written */
+			ex->do_sample();
+			if ( ex->counter - 1 < s->hi ){
+				ex->skip_empty_samples(s->hi - (ex->counter - 1));
+			}
+		}
+
+		delete ex;
+		fflush(s->out);
+	};
+
+	std::vector<std::thread> workers;
+	for ( int i = 0; i < jobs; i++ ){
+		workers.push_back(start_thread([&](){
+			std::unique_lock<std::mutex> lock(mutex);
+			for (;;){
+				work_cond.wait(lock, [&](){ return !queue.empty() || finished; });
+				if ( queue.empty() ) return;
+				struct shard* s = queue.front();
+				queue.pop_front();
+
+				lock.unlock();
+				process_shard(s);
+				lock.lock();
+
+				s->done = true;
+				done_cond.notify_all();
+			}
+		}));
+	}
+
+	/* write finished shards in order, waiting until fewer than limit remains */
+	auto merge = [&](size_t limit){
+		std::unique_lock<std::mutex> lock(mutex);
+		for (;;){
+			while ( !pending.empty() && pending.front()->done ){
+				struct shard* s = pending.front();
+				pending.pop_front();
+				lock.unlock();
+				if ( s->out ){
+					char buf[65536];
+					size_t n;
+					fseek(s->out, s->header_size, SEEK_SET);
+					while ( (n = fread(buf, 1, sizeof(buf), s->out)) > 0 ){
+						fwrite(buf, 1, n, dst);
+					}
+					fclose(s->out);
+				}
+				delete s;
+				lock.lock();
+			}
+			if ( pending.size() < limit ) return;
+			done_cond.wait(lock);
+		}
+	};
+
+	auto submit = [&](struct shard* s){
+		std::lock_guard<std::mutex> lock(mutex);
+		queue.push_back(s);
+		pending.push_back(s);
+		work_cond.notify_one();
+	};
+
+	stats_begin_stream(stat);
+	struct shard* cur = new shard{0, 0, UINT64_MAX, 0, false, false, nullptr, 0, {}, {}, {}};
+	while ( keep_running && ( max_packets == 0 || stat->matched < max_packets ) ) {
+		struct timeval tv = {1,0};
+
+		cap_head* cp;
+		stats_next_packet();
+		{
+			StageTimer timer(STAGE_READ);
+			ret = stream_read(st, &cp, filter, &tv);
+		}
+		if ( ret == EAGAIN ){
+			continue; /* timeout */
+		} else if ( ret != 0 ){
+			break; /* shutdown or error */
+		}
+		stats_add(STAT_MATCHED);
+
+		if ( first_packet ){
+			if ( !valid_first_packet(cp) ){
+				continue;
+			}
+
+			ref_time = reference_time(cp->ts.tv_sec, cp->ts.tv_psec);
+			ref_sec = cp->ts.tv_sec;
+			ref_psec = cp->ts.tv_psec;
+			first_packet = false;
+		}
+
+		/* a shard may only end where no interval is shared with the next, i.e.
+		 * at the first packet beginning after all packets in it. Packets
+		 * reaching into the next shard are processed by both. When packets
+		 * overlap, a packet is accumulated from the interval the previous one
+		 * ended in, so everything after the first packet reaching the next
+		 * shard is processed by both as well. Splitting is postponed if that
+		 * would copy too many packets, e.g. on a saturated link. */
+		const uint64_t interval = packet_interval(cp);
+		if ( cur->offset.size() >= shard_packets && interval > cur->max_interval ){
+			const size_t first = std::lower_bound(cur->reach.begin(), cur->reach.end(), interval - 1) - cur->reach.begin();
+			if ( cur->offset.size() - first <= shard_packets / 2 ){
+				struct shard* next = new shard{cur->index + 1, interval, UINT64_MAX, interval, false, false, nullptr, 0, {}, {}, {}};
+				cur->hi = interval;
+				for ( size_t i = first; i < cur->offset.size(); i++ ){
+					const cap_head* prev = (const cap_head*)&cur->packets[cur->offset[i]];
+					shard_append(next, prev, packet_end_interval(prev));
+				}
+				submit(cur);
+				cur = next;
+				merge(2 * jobs);
+			}
+		}
+
+		shard_append(cur, cp, packet_end_interval(cp));
+		cur->max_interval = std::max(cur->max_interval, interval);
+	}
+
+	stats_end_stream(stat);
+	cur->last = true;
+	submit(cur);
+
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		finished = true;
+		work_cond.notify_all();
+	}
+	merge(1);
+	for ( std::thread& worker: workers ){
+		worker.join();
+	}
+
+	if ( ret > 0 && ret != EINTR ){
+		fprintf(stderr, "stream_read() returned 0x%08X: %s\n", ret, caputils_error_string(ret));
+	}
+}
+
+/**
+ * Sampling interval the packet begins in, i.e. the interval a sequential run
+ * would be at when the packet is accumulated.
+ */
+uint64_t Extractor::packet_interval(const cap_head* cp) const {
+	if ( engine == ENGINE_INTEGER ){
+		const int64_t current_ps = ((int64_t)cp->ts.tv_sec - (int64_t)ref_sec) * PICOSECONDS + ((int64_t)cp->ts.tv_psec - (int64_t)ref_psec);
+		return current_ps > 0 ? current_ps / tSample_ps : 0;
+	}
+
+	/* same comparisons as calculate_samples_qd: the interval is the first one
+	 * whose end is after the packet */
+	const qd_real current_time = qd_real((double)cp->ts.tv_sec) + qd_real((double)cp->ts.tv_psec/PICODIVIDER);
+	auto end = [this](uint64_t i){ return (ref_time + (double)i * tSample) + tSample; };
+	const double estimate = floor(to_double((current_time - ref_time) / tSample));
+	uint64_t i = estimate > 0 ? (uint64_t)estimate : 0;
+	while ( i > 0 && current_time < end(i - 1) ) i--;
+	while ( current_time >= end(i) ) i++;
+	return i;
+}
+
+/**
+ * Approximate sampling interval the packet ends in. May be off by one.
+ */
+uint64_t Extractor::packet_end_interval(const cap_head* cp){
+	/* the shard worker sizes (and counts) the packet again */
+	const unsigned long packet_bits = packet_size(cp, false) * 8;
+	const qd_real end_time = qd_real((double)cp->ts.tv_sec) + qd_real((double)cp->ts.tv_psec/PICODIVIDER) + estimate_transfertime(packet_bits);
+	const double estimate = ceil(to_double((end_time - ref_time) / tSample));
+	return estimate > 0 ? (uint64_t)estimate : 0;
+}
+
 qd_real Extractor::estimate_transfertime(unsigned long bits){
 	return qd_real((double)bits) / link_capacity;
 }
@@ -200,6 +815,7 @@ bool Extractor::valid_first_packet(const cap_head* cp){
 
 	/* ignore marker packets */
 	if ( is_marker(cp, nullptr, 0) ){
+		stats_add(STAT_IGNORED);
 		return false;
 	}
 
@@ -210,6 +826,7 @@ bool Extractor::valid_first_packet(const cap_head* cp){
 	if ( ip && ip->ip_p == IPPROTO_ICMP ){
 		const struct icmphdr* icmp = (const struct icmphdr*)((char*)ip + 4*ip->ip_hl);
 		if ( icmp->type == ICMP_DEST_UNREACH && icmp->code == ICMP_PORT_UNREACH ){
+			stats_add(STAT_IGNORED);
 			return false;
 		}
 	}
@@ -217,54 +834,134 @@ bool Extractor::valid_first_packet(const cap_head* cp){
 	return true;
 }
 
+size_t Extractor::packet_size(const cap_head* cp, bool count_stats) const {
+	struct layer_sizes sizes;
+	decode_layers(cp, level, &sizes);
+	if ( count_stats && sizes.depth < level ){
+		layer_stats_add(&sizes);
+	}
+	return sizes.size[level];
+}
+
 void Extractor::calculate_samples(const cap_head* cp){
-	const unsigned long packet_bits = layer_size(level, cp) * 8;
-	const qd_real current_time = qd_real((double)cp->ts.tv_sec) + qd_real((double)cp->ts.tv_psec/PICODIVIDER);
-	const qd_real transfertime_packet = estimate_transfertime(packet_bits);
+	StageTimer timer(STAGE_SAMPLE);
+	calculate_samples(cp, packet_size(cp) * 8);
+}
 
-	if ( first_packet ) {
-		if ( !valid_first_packet(cp) ){
-			return;
-		}
+void Extractor::calculate_samples(const cap_head* cp, unsigned long packet_bits){
+	StageTimer timer(STAGE_SAMPLE);
+	split_packet(VirtualEvents{this}, cp, packet_bits);
+}
 
-		ref_time = current_time;
-		start_time = ref_time;
-		end_time = ref_time + tSample;
-		first_packet = false;
+/**
+ * Number of empty intervals between the current interval and the one holding
+ * current_time.
+ */
+uint64_t Extractor::idle_intervals(const qd_real& current_time) const {
+	const uint64_t current = counter - 1;
+	uint64_t target = (uint64_t)floor(to_double((current_time - ref_time) / tSample));
+	if ( target > current && ref_time + (double)target * tSample > current_time ){
+		target--;
 	}
+	return target > current ? target - current : 0;
+}
 
-	while ( keep_running && current_time >= end_time ){
-		do_sample();
+/**
+ * Number of whole sampling intervals that fits in transfertime.
+ */
+uint64_t Extractor::covered_intervals(const qd_real& transfertime) const {
+	uint64_t n = (uint64_t)floor(to_double(transfertime / tSample));
+	if ( n > 0 && (double)n * tSample > transfertime ){
+		n--;
 	}
+	return n;
+}
 
-	/* split large packets into multiple samples */
-	int packet_samples = 1;
-	qd_real remaining_transfertime = transfertime_packet;
-	remaining_samplinginterval = end_time - current_time;
-	while ( keep_running && remaining_transfertime >= remaining_samplinginterval ){
-		const qd_real fraction = remaining_samplinginterval / transfertime_packet;
-		accumulate(fraction, packet_bits, cp, packet_samples++);
-		remaining_transfertime -= remaining_samplinginterval;
-		do_sample();
-	}
+void Extractor::do_sample(){
+	do_sample(VirtualEvents{this});
+}
 
-	/* If the previous loop was broken by keep_running we should not sample the remaining data */
-	if ( !keep_running ) return;
+/**
+ * Number of the n intervals starting at the current one which are before,
+ * and inside, the clip range.
+ */
+void Extractor::clip_intervals(uint64_t n, uint64_t* before, uint64_t* inside) const {
+	const uint64_t first = counter - 1;
+	*before = first < clip_begin ? std::min(n, clip_begin - first) : 0;
+	const uint64_t begin = first + *before;
+	*inside = begin < clip_end ? std::min(n - *before, clip_end - begin) : 0;
+}
 
-	// handle small packets or the remaining fractional packets which are in next interval
-	const qd_real fraction = remaining_transfertime / transfertime_packet;
-	accumulate(fraction, packet_bits, cp, packet_samples++);
-	remaining_samplinginterval = end_time - current_time - transfertime_packet;
+void Extractor::skip_empty_samples(uint64_t n){
+	skip_empty_samples(VirtualEvents{this}, n);
 }
 
-void Extractor::do_sample(){
-	const double t = to_double(relative_time ? (start_time - ref_time) : start_time);
-	write_sample(t);
+void Extractor::advance(uint64_t n){
+	if ( n == 0 ) return;
 
 	// reset start_time ; end_time; remaining_sampling interval
-	start_time = ref_time + counter++ * tSample;
+	start_time = ref_time + (double)(counter + n - 1) * tSample;
+	counter += n;
 	end_time = start_time + tSample;
 	remaining_samplinginterval = tSample;
+	start_ps += n * tSample_ps;
+}
+
+double Extractor::sample_time(uint64_t i) const {
+	const qd_real t = ref_time + (double)(counter - 1 + i) * tSample;
+	return to_double(relative_time ? (t - ref_time) : t);
+}
+
+double Extractor::resolution_time(const struct resolution& res, uint64_t index) const {
+	const qd_real t = ref_time + (double)index * res.tSample;
+	return to_double(relative_time ? (t - ref_time) : t);
+}
+
+void Extractor::write_empty_samples(uint64_t n){
+	for ( uint64_t i = 0; i < n; i++ ){
+		write_sample(sample_time(i));
+	}
+}
+
+void Extractor::accumulate_samples(qd_real fraction, unsigned long bits, const cap_head* cp, int counter, uint64_t n){
+	for ( uint64_t i = 0; i < n; i++ ){
+		{
+			StageTimer timer(STAGE_ACCUMULATE);
+			accumulate(fraction, bits, cp, counter + i);
+		}
+		write_sample(sample_time(i));
+	}
+}
+
+void Extractor::sample_packet(const cap_head* cp){
+	calculate_samples(cp);
+}
+
+void Extractor::flush_sample(bool timeout){
+	if ( !timeout || !first_packet ){
+		do_sample();
+	}
+}
+
+/**
+ * End of the current interval in seconds. The integer engine doesn't keep
+ * end_time until the first interval is closed.
+ */
+double Extractor::interval_end() const {
+	if ( engine == ENGINE_INTEGER ){
+		return (double)ref_sec + ((double)ref_psec + (double)(start_ps + tSample_ps)) / PICODIVIDER;
+	}
+	return to_double(end_time);
+}
+
+double Extractor::flush_until(double until){
+	if ( first_packet ) return INFINITY;
+
+	double end;
+	while ( (end = interval_end()) <= until && keep_running ){
+		do_sample();
+	}
+	return end;
 }
 
 void Extractor::write_header(int index){
@@ -274,3 +971,166 @@ void Extractor::write_header(int index){
 void Extractor::write_trailer(int index){
 	/* do nothing */
 }
+
+void Extractor::write_reference(){
+	/* do nothing */
+}
+
+void ExtractorGroup::add(Extractor* extractor){
+	extractors.push_back(extractor);
+}
+
+void ExtractorGroup::reset(){
+	Extractor::reset();
+	for ( Extractor* cur: extractors ){
+		cur->set_parameters(*this);
+		cur->reset();
+	}
+}
+
+void ExtractorGroup::set_formatter(enum Formatter format){
+	for ( Extractor* cur: extractors ){
+		cur->set_formatter(format);
+	}
+}
+
+/**
+ * Current sampling interval, copied before each event.
+ */
+void ExtractorGroup::sync(Extractor* extractor) const {
+	extractor->ref_time = ref_time;
+	extractor->ref_sec = ref_sec;
+	extractor->ref_psec = ref_psec;
+	extractor->start_time = start_time;
+	extractor->end_time = end_time;
+	extractor->remaining_samplinginterval = remaining_samplinginterval;
+	extractor->counter = counter;
+}
+
+void ExtractorGroup::write_header(int index){
+	for ( Extractor* cur: extractors ){
+		sync(cur);
+		cur->write_header(index);
+	}
+}
+
+void ExtractorGroup::write_trailer(int index){
+	for ( Extractor* cur: extractors ){
+		sync(cur);
+		cur->write_trailer(index);
+	}
+}
+
+void ExtractorGroup::write_reference(){
+	for ( Extractor* cur: extractors ){
+		sync(cur);
+		cur->write_reference();
+	}
+}
+
+void ExtractorGroup::write_sample(double t){
+	for ( Extractor* cur: extractors ){
+		sync(cur);
+		cur->write_sample(t);
+	}
+}
+
+void ExtractorGroup::accumulate(qd_real fraction, unsigned long bits, const cap_head* cp, int counter){
+	for ( Extractor* cur: extractors ){
+		sync(cur);
+		cur->accumulate(fraction, bits, cp, counter);
+	}
+}
+
+void ExtractorGroup::write_empty_samples(uint64_t n){
+	for ( Extractor* cur: extractors ){
+		sync(cur);
+		cur->write_empty_samples(n);
+	}
+}
+
+void ExtractorGroup::accumulate_samples(qd_real fraction, unsigned long bits, const cap_head* cp, int counter, uint64_t n){
+	for ( Extractor* cur: extractors ){
+		sync(cur);
+		cur->accumulate_samples(fraction, bits, cp, counter, n);
+	}
+}
+
+void LevelGroup::add(Extractor* extractor){
+	extractors.push_back(extractor);
+}
+
+void LevelGroup::reset(){
+	Extractor::reset();
+	max_level = LEVEL_PHYSICAL;
+	for ( Extractor* cur: extractors ){
+		const enum Level level = cur->level;
+		cur->set_parameters(*this);
+		cur->level = level;
+		cur->reset();
+		max_level = std::max(max_level, level);
+	}
+}
+
+void LevelGroup::set_formatter(enum Formatter format){
+	for ( Extractor* cur: extractors ){
+		cur->set_formatter(format);
+	}
+}
+
+void LevelGroup::write_header(int index){
+	/* process_stream validated the engine of the group only */
+	for ( Extractor* cur: extractors ){
+		cur->engine = engine;
+		cur->tSample_ps = tSample_ps;
+		cur->write_header(index);
+	}
+}
+
+void LevelGroup::write_trailer(int index){
+	for ( Extractor* cur: extractors ){
+		cur->write_trailer(index);
+	}
+}
+
+void LevelGroup::write_sample(double t){
+	/* each extractor writes its own samples */
+}
+
+void LevelGroup::accumulate(qd_real fraction, unsigned long bits, const cap_head* cp, int counter){
+	/* each extractor accumulates its own packets */
+}
+
+void LevelGroup::sample_packet(const cap_head* cp){
+	struct layer_sizes sizes;
+	decode_layers(cp, max_level, &sizes);
+	if ( sizes.depth < max_level ){
+		layer_stats_add(&sizes);
+	}
+
+	for ( Extractor* cur: extractors ){
+		cur->calculate_samples(cp, sizes.size[cur->level] * 8);
+	}
+
+	/* all extractors start at the same packet, so the group shares their
+	 * reference time for resolution_time */
+	if ( first_packet && !extractors.empty() && !extractors[0]->first_packet ){
+		ref_time = extractors[0]->ref_time;
+		start_time = extractors[0]->start_time;
+		first_packet = false;
+	}
+}
+
+void LevelGroup::flush_sample(bool timeout){
+	for ( Extractor* cur: extractors ){
+		cur->flush_sample(timeout);
+	}
+}
+
+double LevelGroup::flush_until(double until){
+	double end = INFINITY;
+	for ( Extractor* cur: extractors ){
+		end = std::min(end, cur->flush_until(until));
+	}
+	return end;
+}
@@ -4,12 +4,23 @@
 #include <caputils/caputils.h>
 #include <caputils/packet.h>
 #include <qd/qd_real.h>
+#include <cmath>
+#include <cstdio>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "stats.hpp"
 
 enum Formatter {
 	FORMAT_DEFAULT = 500,             /* Human-readable */
 	FORMAT_CSV,                       /* CSV (semi-colon separated) */
 	FORMAT_TSV,                       /* TSV (tab-separated) */
 	FORMAT_MATLAB,                    /* Matlab format (TSV with header) */
+	FORMAT_RLE,                       /* Run-length encoded (index, count, value) */
+	FORMAT_BINARY,                    /* Little-endian binary records, see samplefile.hpp */
+	FORMAT_SHM,                       /* Shared-memory ring, see shmring.hpp */
+	FORMAT_RRD,                       /* Round-robin archives queried on a socket, see rrstore.hpp */
 };
 
 struct formatter_entry { const char* name; const char* desc; enum Formatter fmt; };
@@ -18,16 +29,81 @@ const struct formatter_entry formatter_lut[] = {
 	{"csv",     "semi-colon separated", FORMAT_CSV},
 	{"tsv",     "tab-separated",        FORMAT_TSV},
 	{"matlab",  "suitable for matlab",  FORMAT_MATLAB},
+	{"rle",     "run-length encoded",   FORMAT_RLE},
+	{"binary",  "binary records",       FORMAT_BINARY},
+	{"shm",     "shared-memory ring",   FORMAT_SHM},
+	{"rrd",     "round-robin archives", FORMAT_RRD},
 	{nullptr, nullptr, (enum Formatter)0} /* sentinel */
 };
 
 void output_format_list();
 
+enum TimeEngine {
+	ENGINE_QD,                        /* quad-double arithmetic (reference) */
+	ENGINE_INTEGER,                   /* integer picoseconds */
+};
+
+struct engine_entry { const char* name; const char* desc; enum TimeEngine engine; };
+const struct engine_entry engine_lut[] = {
+	{"qd",      "quad-double arithmetic (reference)", ENGINE_QD},
+	{"int",     "integer picoseconds",                ENGINE_INTEGER},
+	{nullptr, nullptr, (enum TimeEngine)0} /* sentinel */
+};
+
+void output_engine_list();
+
+/* default lateness allowed in live mode (ms), see Extractor::set_live */
+#define LIVE_LATENESS 2.0
+
+/**
+ * Sampling parameters, for outputs describing them in a header.
+ */
+struct sample_info {
+	double sampleFrequency;           /* Hz */
+	double tSample;                   /* seconds */
+	enum Level level;
+	unsigned long link_capacity;      /* bits per second */
+	bool relative_time;
+};
+
+/**
+ * One of several sampling frequencies processed in a single pass, see
+ * Extractor::set_sampling_frequencies.
+ */
+struct resolution {
+	std::string name;                 /* as given by the user, e.g. "1k" */
+	double sampleFrequency;           /* Hz */
+	qd_real tSample;                  /* seconds */
+	uint64_t factor;                  /* base sampling intervals per sample */
+};
+
 /**
  * Controls whenever the application should run or not.
  */
 extern bool keep_running;
 
+/**
+ * Name of the running application, used in messages.
+ */
+extern const char* program_name;
+
+/**
+ * Round a number of bits down. The bias absorbs errors from splitting
+ * packets into fractions.
+ */
+inline double my_round(double value){
+	static const double bias = 0.0005;
+	return (floor(value + bias));
+}
+
+/**
+ * A capture timestamp in the arithmetic the sample times are calculated in.
+ * Sample i is at reference_time(first packet) + i * tSample.
+ */
+inline qd_real reference_time(uint64_t sec, uint64_t psec){
+	return qd_real((double)sec) + qd_real((double)psec/PICODIVIDER);
+}
+
 /**
  * This class reads packets, splits them into time-based interval, and calls
  * Extractor::accumulate. To calculate bitrate simply add the number of bits
@@ -48,6 +124,39 @@ public:
 	 */
 	void process_stream(const stream_t st, struct filter* filter);
 
+	/**
+	 * Process packets in stream using several threads.
+	 *
+	 * The stream is read by the calling thread and split into shards of
+	 * consecutive sampling intervals. Each shard is processed by a new
+	 * extractor which only writes the intervals belonging to the shard, and the
+	 * outputs are concatenated in order. Packets spanning a shard boundary are
+	 * given to both shards so the output is the same as process_stream.
+	 * Packets are assumed to be sorted by timestamp.
+	 *
+	 * @param factory Creates an extractor writing to the given file. It must use
+	 *                the same parameters as this extractor (see set_parameters).
+	 * @param dst Where the concatenated output is written.
+	 * @param jobs Number of worker threads.
+	 * @param shard_packets Minimum number of packets in each shard.
+	 */
+	void process_stream_sharded(const stream_t st, struct filter* filter, const std::function<Extractor*(FILE*)>& factory, FILE* dst, int jobs, size_t shard_packets = 100000);
+
+	/**
+	 * Process packets in stream using a pipeline of three threads connected by
+	 * lock-free rings: a reader (stream_read, filter and packet sizes), the
+	 * extractor and a writer. The output is the same as process_stream. The
+	 * occupancy of each ring is shown when done, to tell which stage is the
+	 * bottleneck.
+	 *
+	 * @param dst Where the writer thread writes the output.
+	 * @param set_output Called with the stream the extractor should write to
+	 *                   before processing and with dst afterwards. If empty
+	 *                   there is no writer thread and the extractor writes
+	 *                   its output itself.
+	 */
+	void process_stream_pipelined(const stream_t st, struct filter* filter, FILE* dst, const std::function<void(FILE*)>& set_output);
+
 	/**
 	 * Stop processing packets.
 	 * This has the same effect as setting the global keep_running to false.
@@ -70,9 +179,18 @@ public:
 	 */
 	void set_sampling_frequency(const char* str);
 
+	/**
+	 * Set several sampling frequencies from a comma-separated list, e.g.
+	 * "1k,100,10,1,0.1". Packets are sampled at the highest frequency and
+	 * the others must be an integer fraction of it so tools can derive them
+	 * by summing base samples. See resolutions.
+	 */
+	void set_sampling_frequencies(const char* str);
+
 	/**
 	 * Set level to extract size from.
 	 */
+	void set_extraction_level(enum Level level);
 	void set_extraction_level(const char* str);
 
 	/**
@@ -97,6 +215,42 @@ public:
 	 */
 	void set_relative_time(bool state);
 
+	/**
+	 * Set the arithmetic used to split packets into sampling intervals.
+	 * The integer engine requires the sampling interval to be a whole number of
+	 * picoseconds, otherwise it falls back to the quad-double engine.
+	 */
+	void set_time_engine(enum TimeEngine engine);
+	void set_time_engine(const char* str);
+
+	/**
+	 * Close sampling intervals on time in live streams. Normally an interval
+	 * is closed when a packet beyond it arrives, or by a read timeout up to a
+	 * second later. In live mode process_stream closes each interval when the
+	 * wall clock passes its end plus lateness seconds, so samples are written
+	 * within a few milliseconds even when the link is quiet.
+	 *
+	 * Capture timestamps are mapped to the wall clock by the smallest offset
+	 * seen between the arrival and the timestamp of a packet, so clock skew of
+	 * the capture device doesn't matter. Lateness should cover the jitter of
+	 * the delivery. Packets arriving after their interval was closed are added
+	 * to the current interval (and counted as late, see stats.hpp).
+	 *
+	 * @param lateness Seconds, negative to disable (default).
+	 */
+	void set_live(double lateness);
+
+	/**
+	 * Copy sampling parameters (frequency, level, link capacity, time engine,
+	 * etc) from another extractor.
+	 */
+	void set_parameters(const Extractor& src);
+
+	/**
+	 * Get the current sampling parameters.
+	 */
+	struct sample_info get_sample_info() const;
+
 	/**
 	 * Set the output formatter.
 	 * If the app does not handle a specific format it should warn and set to default.
@@ -117,11 +271,38 @@ protected:
 	 */
 	virtual void write_trailer(int index);
 
+	/**
+	 * Write the reference time (ref_sec, ref_psec), i.e. the start of the
+	 * first interval. Called once the first packet is read, before any sample
+	 * is written.
+	 */
+	virtual void write_reference();
+
 	/**
 	 * Write a sample.
 	 */
 	virtual void write_sample(double t) = 0;
 
+	/**
+	 * Split a packet into sampling intervals. Called by process_stream for
+	 * each packet read.
+	 */
+	virtual void sample_packet(const cap_head* cp);
+
+	/**
+	 * Write the current sample and move time forward. Called by process_stream
+	 * when a read times out (once the first packet has been seen) and at the
+	 * end of the stream.
+	 */
+	virtual void flush_sample(bool timeout);
+
+	/**
+	 * Write all samples of intervals ending at or before until (seconds, in
+	 * capture time). Called by process_stream in live mode, see set_live.
+	 * @return End of the current interval, infinity before the first packet.
+	 */
+	virtual double flush_until(double until);
+
 	/**
 	 * Accumulate value from packet.
 	 *
@@ -132,27 +313,123 @@ protected:
 	 */
 	virtual void accumulate(qd_real fraction, unsigned long bits, const cap_head* cp, int counter) = 0;
 
+	/**
+	 * Write N consecutive samples where nothing was accumulated, e.g. an idle
+	 * period between two packets. Use sample_time() for the timestamps.
+	 * The default implementation calls write_sample N times.
+	 */
+	virtual void write_empty_samples(uint64_t n);
+
+	/**
+	 * Accumulate the same fraction of a packet into N consecutive intervals and
+	 * write them, i.e. intervals completely covered by a single packet.
+	 * The default implementation calls accumulate and write_sample N times.
+	 *
+	 * @param counter Number of times this packet has been sampled, for the
+	 *                first of the N intervals.
+	 */
+	virtual void accumulate_samples(qd_real fraction, unsigned long bits, const cap_head* cp, int counter, uint64_t n);
+
+	/**
+	 * Timestamp of the i:th sample counted from the current interval. This is
+	 * the same value write_sample would be called with.
+	 */
+	double sample_time(uint64_t i) const;
+
+	/**
+	 * Split a packet of packet_bits (at the selected level) into sampling
+	 * intervals. The default implementation calls the events through the
+	 * vtable, StaticExtractor overrides it with direct calls.
+	 */
+	virtual void calculate_samples(const cap_head* cp, unsigned long packet_bits);
+
 	/**
 	 * Calculate bitrate for current sample and move time forward.
 	 */
 	void do_sample();
 
+	/**
+	 * Fall back to the qd engine if the integer engine can't represent the
+	 * sampling interval. Called by process_stream before the first packet.
+	 */
+	void validate_engine();
+
+	/**
+	 * Move time forward N intervals without writing any samples.
+	 */
+	void advance(uint64_t n);
+
+	/**
+	 * Timestamp of the index:th sample (counting from 0) of a resolution.
+	 */
+	double resolution_time(const struct resolution& res, uint64_t index) const;
+
 	/**
 	 * Estimate how long it takes (in seconds) to N bits over the current link speed.
 	 */
 	qd_real estimate_transfertime(unsigned long bits);
 
 	qd_real ref_time;
+	uint64_t ref_sec;                 /* timestamp of the first packet, see reference_time */
+	uint64_t ref_psec;
 	qd_real start_time;
 	qd_real end_time;
 	qd_real remaining_samplinginterval;
 	double sampleFrequency;
 	qd_real tSample;
-	int counter;
+	uint64_t counter;
+
+	/* Requested sampling frequencies, highest first. The first entry is the
+	 * frequency packets are sampled at (factor 1). */
+	std::vector<struct resolution> resolutions;
 
 private:
+	friend class ExtractorGroup;
+	friend class LevelGroup;
+	template <class Derived> friend class StaticExtractor;
+
+	/**
+	 * Events of the packet splitting, dispatched through the vtable.
+	 */
+	struct VirtualEvents {
+		Extractor* self;
+		void accumulate(qd_real fraction, unsigned long bits, const cap_head* cp, int counter){ self->accumulate(fraction, bits, cp, counter); }
+		void write_sample(double t){ self->write_sample(t); }
+		void write_empty_samples(uint64_t n){ self->write_empty_samples(n); }
+		void accumulate_samples(qd_real fraction, unsigned long bits, const cap_head* cp, int counter, uint64_t n){ self->accumulate_samples(fraction, bits, cp, counter, n); }
+	};
+
+	/**
+	 * Size of the packet at the selected level, see decode_layers.
+	 * @param count_stats Count packets that can't be decoded to the level (see
+	 *                    layer_stats_add). False when the packet is sized
+	 *                    again later, e.g. by a shard worker.
+	 */
+	size_t packet_size(const cap_head* cp, bool count_stats = true) const;
+
 	void calculate_samples(const cap_head* cp);
 	bool valid_first_packet(const cap_head* cp);
+	uint64_t packet_interval(const cap_head* cp) const;
+	uint64_t packet_end_interval(const cap_head* cp);
+	void clip_intervals(uint64_t n, uint64_t* before, uint64_t* inside) const;
+	void skip_empty_samples(uint64_t n);
+
+	/* The packet splitting is written once for any Events (VirtualEvents or
+	 * StaticExtractor::Events), see the end of this file. */
+	template <class Events> void split_packet(Events ev, const cap_head* cp, unsigned long packet_bits);
+	template <class Events> void calculate_samples_qd(Events ev, const cap_head* cp, unsigned long packet_bits);
+	template <class Events> void calculate_samples_integer(Events ev, const cap_head* cp, unsigned long packet_bits);
+	template <class Events> void do_sample(Events ev);
+	template <class Events> void clipped_accumulate(Events ev, qd_real fraction, unsigned long bits, const cap_head* cp, int packet_samples);
+	template <class Events> void skip_empty_samples(Events ev, uint64_t n);
+	template <class Events> void skip_covered_samples(Events ev, qd_real fraction, unsigned long bits, const cap_head* cp, int packet_samples, uint64_t n);
+	static double scaled_fraction(__int128 num, __int128 den, long double skew = 0.0L);
+	static double double_error(double seconds, int64_t ps);
+	bool has_integer_tsample() const;
+	uint64_t idle_intervals(const qd_real& current_time) const;
+	uint64_t covered_intervals(const qd_real& transfertime) const;
+	double interval_end() const;
+	void live_schedule(struct live_state* live, struct timeval* tv);
 
 	bool ignore_marker;
 	bool first_packet;
@@ -160,6 +437,373 @@ private:
 	unsigned int max_packets;
 	unsigned long link_capacity;
 	enum Level level;
+	enum TimeEngine engine;
+	double live_lateness;
+
+	static const int64_t PICOSECONDS = 1000000000000LL;
+
+	/* Integer engine state. Times are picoseconds relative to the first packet
+	 * (ref_sec, ref_psec). Transfer times are kept exact by scaling durations
+	 * with the link capacity, i.e. a packet of N bits lasts N * 1e12 units. */
+	int64_t start_ps;
+	int64_t tSample_ps;
+
+	/* Only intervals [clip_begin, clip_end) are written, see
+	 * process_stream_sharded. */
+	uint64_t clip_begin;
+	uint64_t clip_end;
 };
 
+/**
+ * Runs several extractors on a single pass over a stream.
+ *
+ * Packets are only split into sampling intervals once, by the group. Each
+ * event (accumulate, write_sample, ...) is then forwarded to every extractor
+ * in the order they were added, with the sampling parameters and current time
+ * of the group, so each extractor behaves as if it processed the stream
+ * itself. Extractors are not owned by the group.
+ */
+class ExtractorGroup: public Extractor {
+public:
+	void add(Extractor* extractor);
+
+	/**
+	 * Copies the sampling parameters to each extractor and resets them.
+	 */
+	virtual void reset();
+
+	/**
+	 * Set the output formatter of each extractor.
+	 */
+	virtual void set_formatter(enum Formatter format);
+	using Extractor::set_formatter;
+
+protected:
+	virtual void write_header(int index);
+	virtual void write_trailer(int index);
+	virtual void write_reference();
+	virtual void write_sample(double t);
+	virtual void accumulate(qd_real fraction, unsigned long bits, const cap_head* cp, int counter);
+	virtual void write_empty_samples(uint64_t n);
+	virtual void accumulate_samples(qd_real fraction, unsigned long bits, const cap_head* cp, int counter, uint64_t n);
+
+private:
+	void sync(Extractor* extractor) const;
+
+	std::vector<Extractor*> extractors;
+};
+
+/**
+ * Runs one extractor per level on a single pass over a stream.
+ *
+ * Unlike ExtractorGroup each extractor splits packets into sampling intervals
+ * itself, with the size at its own level, as a packet lasts longer on the link
+ * than its payload does. The headers of each packet are only decoded once and
+ * the sizes at every level are handed to the extractors. The extractors are
+ * sampled from the same first packet so their intervals line up, but they may
+ * be a few intervals apart while a packet spans several. Extractors are not
+ * owned by the group and keep their own level.
+ */
+class LevelGroup: public Extractor {
+public:
+	void add(Extractor* extractor);
+
+	/**
+	 * Copies the sampling parameters (except the level) to each extractor and
+	 * resets them.
+	 */
+	virtual void reset();
+
+	/**
+	 * Set the output formatter of each extractor.
+	 */
+	virtual void set_formatter(enum Formatter format);
+	using Extractor::set_formatter;
+
+protected:
+	virtual void write_header(int index);
+	virtual void write_trailer(int index);
+	virtual void write_sample(double t);
+	virtual void accumulate(qd_real fraction, unsigned long bits, const cap_head* cp, int counter);
+	virtual void sample_packet(const cap_head* cp);
+	virtual void flush_sample(bool timeout);
+	virtual double flush_until(double until);
+
+private:
+	std::vector<Extractor*> extractors;
+	enum Level max_level;
+};
+
+/**
+ * Extractor calling accumulate, write_sample, write_empty_samples and
+ * accumulate_samples of Derived directly instead of through the vtable, so
+ * they are inlined into the loop splitting packets into sampling intervals.
+ * A tool derives from it with itself as the argument:
+ *
+ *   class MyTool final: public StaticExtractor<MyTool> {
+ *     friend class StaticExtractor<MyTool>;
+ *   protected:
+ *     virtual void accumulate(qd_real fraction, unsigned long bits, const cap_head* cp, int counter);
+ *     virtual void write_sample(double t);
+ *   };
+ *
+ * The functions are still virtual, so the tool works as any other extractor
+ * in a group or behind an Extractor pointer. Derived should be final: the
+ * specialised calls don't see overrides in further subclasses.
+ */
+template <class Derived>
+class StaticExtractor: public Extractor {
+protected:
+	virtual void sample_packet(const cap_head* cp){
+		StageTimer timer(STAGE_SAMPLE);
+		split_packet(events(), cp, packet_size(cp) * 8);
+	}
+
+	virtual void calculate_samples(const cap_head* cp, unsigned long packet_bits){
+		StageTimer timer(STAGE_SAMPLE);
+		split_packet(events(), cp, packet_bits);
+	}
+
+private:
+	struct Events {
+		Derived* self;
+		void accumulate(qd_real fraction, unsigned long bits, const cap_head* cp, int counter){ self->Derived::accumulate(fraction, bits, cp, counter); }
+		void write_sample(double t){ self->Derived::write_sample(t); }
+		void write_empty_samples(uint64_t n){ self->Derived::write_empty_samples(n); }
+		void accumulate_samples(qd_real fraction, unsigned long bits, const cap_head* cp, int counter, uint64_t n){ self->Derived::accumulate_samples(fraction, bits, cp, counter, n); }
+	};
+
+	Events events(){
+		return Events{static_cast<Derived*>(this)};
+	}
+};
+
+/**
+ * Fraction (num + skew)/den rounded to double. All operands are in the scaled
+ * transfertime unit (picoseconds times link capacity).
+ */
+inline double Extractor::scaled_fraction(__int128 num, __int128 den, long double skew){
+	/* the operands usually fit 64 bits, which converts without a libgcc call */
+	auto widen = [](__int128 x){
+		return x == (int64_t)x ? (long double)(int64_t)x : (long double)x;
+	};
+	return (double)((widen(num) + skew) / widen(den));
+}
+
+/**
+ * Picoseconds the qd engine is off from the exact time ps, as it holds it as
+ * a double number of seconds: the fraction of a second of timestamps
+ * (psec / PICODIVIDER) and the sampling interval. Computed exactly, the
+ * mantissa times 10^12 and ps * 2^shift are within 2^93 of each other.
+ */
+inline double Extractor::double_error(double seconds, int64_t ps){
+	int exp;
+	const double mantissa = frexp(seconds, &exp);
+	if ( mantissa == 0.0 || exp > 53 ) return 0.0;
+
+	const int shift = 53 - exp;
+	const __int128 scaled = (__int128)(int64_t)ldexp(mantissa, 53) * PICOSECONDS;
+	return ldexp((double)(scaled - ((__int128)ps << shift)), -shift);
+}
+
+template <class Events>
+void Extractor::split_packet(Events ev, const cap_head* cp, unsigned long packet_bits){
+	switch ( engine ){
+	case ENGINE_QD:      calculate_samples_qd(ev, cp, packet_bits); break;
+	case ENGINE_INTEGER: calculate_samples_integer(ev, cp, packet_bits); break;
+	}
+}
+
+template <class Events>
+void Extractor::calculate_samples_qd(Events ev, const cap_head* cp, unsigned long packet_bits){
+	const qd_real current_time = qd_real((double)cp->ts.tv_sec) + qd_real((double)cp->ts.tv_psec/PICODIVIDER);
+	const qd_real transfertime_packet = estimate_transfertime(packet_bits);
+
+	if ( first_packet ) {
+		if ( !valid_first_packet(cp) ){
+			return;
+		}
+
+		ref_time = current_time;
+		start_time = ref_time;
+		end_time = ref_time + tSample;
+		ref_sec = cp->ts.tv_sec;
+		ref_psec = cp->ts.tv_psec;
+		first_packet = false;
+		write_reference();
+	}
+
+	if ( keep_running && current_time >= end_time ){
+		do_sample(ev);
+
+		/* skip idle intervals in one step */
+		const uint64_t idle = idle_intervals(current_time);
+		if ( idle > 0 ){
+			skip_empty_samples(ev, idle);
+		}
+
+		/* idle_intervals may undershoot by one due to rounding */
+		while ( keep_running && current_time >= end_time ){
+			do_sample(ev);
+		}
+	}
+
+	/* split large packets into multiple samples */
+	int packet_samples = 1;
+	qd_real remaining_transfertime = transfertime_packet;
+	remaining_samplinginterval = end_time - current_time;
+	while ( keep_running && remaining_transfertime >= remaining_samplinginterval ){
+		const qd_real fraction = remaining_samplinginterval / transfertime_packet;
+		clipped_accumulate(ev, fraction, packet_bits, cp, packet_samples++);
+		remaining_transfertime -= remaining_samplinginterval;
+		do_sample(ev);
+
+		/* intervals completely covered by this packet are written in one step */
+		const uint64_t covered = covered_intervals(remaining_transfertime);
+		if ( covered > 0 ){
+			skip_covered_samples(ev, tSample / transfertime_packet, packet_bits, cp, packet_samples, covered);
+			packet_samples += covered;
+			remaining_transfertime -= (double)covered * tSample;
+		}
+	}
+
+	/* If the previous loop was broken by keep_running we should not sample the remaining data */
+	if ( !keep_running ) return;
+
+	// handle small packets or the remaining fractional packets which are in next interval
+	const qd_real fraction = remaining_transfertime / transfertime_packet;
+	clipped_accumulate(ev, fraction, packet_bits, cp, packet_samples++);
+	remaining_samplinginterval = end_time - current_time - transfertime_packet;
+	if ( packet_samples > 2 ){
+		stats_add(STAT_SPLIT);
+	}
+}
+
+template <class Events>
+void Extractor::calculate_samples_integer(Events ev, const cap_head* cp, unsigned long packet_bits){
+
+	if ( first_packet ) {
+		if ( !valid_first_packet(cp) ){
+			return;
+		}
+
+		/* sample timestamps use the same arithmetic as the qd engine so both
+		 * engines produce identical output */
+		ref_time = reference_time(cp->ts.tv_sec, cp->ts.tv_psec);
+		start_time = ref_time;
+		ref_sec = cp->ts.tv_sec;
+		ref_psec = cp->ts.tv_psec;
+		start_ps = 0;
+		first_packet = false;
+		write_reference();
+	}
+
+	const int64_t current_ps = ((int64_t)cp->ts.tv_sec - (int64_t)ref_sec) * PICOSECONDS + ((int64_t)cp->ts.tv_psec - (int64_t)ref_psec);
+
+	if ( keep_running && current_ps >= start_ps + tSample_ps ){
+		do_sample(ev);
+
+		/* skip idle intervals in one step */
+		const uint64_t idle = (current_ps - start_ps) / tSample_ps;
+		if ( idle > 0 ){
+			skip_empty_samples(ev, idle);
+		}
+	}
+
+	/* split large packets into multiple samples */
+	int packet_samples = 1;
+	const __int128 transfertime_packet = (__int128)packet_bits * PICOSECONDS;
+	__int128 remaining_transfertime = transfertime_packet;
+	__int128 remaining_interval = (__int128)(start_ps + tSample_ps - current_ps) * link_capacity;
+
+	/* The qd engine sees the interval ends a fraction of a picosecond from the
+	 * exact ones (see double_error). Fractions of split packets are skewed the
+	 * same way, or bits on a rounding tie would round to another integer than
+	 * with the qd engine. */
+	long double interval_skew = 0.0L;
+	long double transfertime_skew = 0.0L;
+	long double tsample_skew = 0.0L;
+	if ( remaining_transfertime >= remaining_interval ){
+		const double tsample_error = double_error(to_double(tSample), tSample_ps);
+		const double ref_error = double_error((double)ref_psec / PICODIVIDER, ref_psec);
+		const double current_error = double_error((double)cp->ts.tv_psec / PICODIVIDER, cp->ts.tv_psec);
+		tsample_skew = (long double)tsample_error * link_capacity;
+		interval_skew = ((long double)ref_error + (long double)counter * tsample_error - current_error) * link_capacity;
+	}
+
+	while ( keep_running && remaining_transfertime >= remaining_interval ){
+		const double fraction = scaled_fraction(remaining_interval, transfertime_packet, interval_skew);
+		clipped_accumulate(ev, fraction, packet_bits, cp, packet_samples++);
+		remaining_transfertime -= remaining_interval;
+		transfertime_skew -= interval_skew;
+		do_sample(ev);
+		remaining_interval = (__int128)tSample_ps * link_capacity;
+		interval_skew = tsample_skew;
+
+		/* intervals completely covered by this packet are written in one step */
+		const uint64_t covered = remaining_transfertime / remaining_interval;
+		if ( covered > 0 ){
+			skip_covered_samples(ev, scaled_fraction(remaining_interval, transfertime_packet, interval_skew), packet_bits, cp, packet_samples, covered);
+			packet_samples += covered;
+			remaining_transfertime -= covered * remaining_interval;
+			transfertime_skew -= covered * interval_skew;
+		}
+	}
+
+	/* If the previous loop was broken by keep_running we should not sample the remaining data */
+	if ( !keep_running ) return;
+
+	// handle small packets or the remaining fractional packets which are in next interval
+	const double fraction = packet_samples == 1 ? 1.0 : scaled_fraction(remaining_transfertime, transfertime_packet, transfertime_skew);
+	clipped_accumulate(ev, fraction, packet_bits, cp, packet_samples++);
+	if ( packet_samples > 2 ){
+		stats_add(STAT_SPLIT);
+	}
+}
+
+template <class Events>
+void Extractor::do_sample(Events ev){
+	if ( counter - 1 >= clip_begin && counter - 1 < clip_end ){
+		StageTimer timer(STAGE_OUTPUT);
+		const double t = to_double(relative_time ? (start_time - ref_time) : start_time);
+		ev.write_sample(t);
+	}
+	advance(1);
+}
+
+template <class Events>
+void Extractor::clipped_accumulate(Events ev, qd_real fraction, unsigned long bits, const cap_head* cp, int packet_samples){
+	if ( counter - 1 >= clip_begin && counter - 1 < clip_end ){
+		StageTimer timer(STAGE_ACCUMULATE);
+		ev.accumulate(fraction, bits, cp, packet_samples);
+	}
+}
+
+template <class Events>
+void Extractor::skip_empty_samples(Events ev, uint64_t n){
+	uint64_t before, inside;
+	clip_intervals(n, &before, &inside);
+	advance(before);
+	if ( inside > 0 ){
+		StageTimer timer(STAGE_OUTPUT);
+		ev.write_empty_samples(inside);
+		advance(inside);
+		stats_add(STAT_SKIPPED, inside);
+	}
+	advance(n - before - inside);
+}
+
+template <class Events>
+void Extractor::skip_covered_samples(Events ev, qd_real fraction, unsigned long bits, const cap_head* cp, int packet_samples, uint64_t n){
+	uint64_t before, inside;
+	clip_intervals(n, &before, &inside);
+	advance(before);
+	if ( inside > 0 ){
+		StageTimer timer(STAGE_OUTPUT);
+		ev.accumulate_samples(fraction, bits, cp, packet_samples + before, inside);
+		advance(inside);
+	}
+	advance(n - before - inside);
+}
+
 #endif /* EXTRACT_H */
@@ -0,0 +1,513 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <caputils/caputils.h>
+
+#include <cerrno>
+#include <chrono>
+#include <cinttypes>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <string>
+#include <vector>
+#include <getopt.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#include "bitrate.hpp"
+#include "haar.hpp"
+#include "layers.hpp"
+#include "pktrate.hpp"
+#include "synthetic.hpp"
+#include "timescale.hpp"
+
+static uint64_t num_packets = 1000000;
+static int rounds = 3;
+static const char* frequency = "1k";
+static const char* capture = nullptr;
+static const char* only = nullptr;
+static struct synthetic_config config = synthetic_defaults();
+const char* program_name = NULL;
+
+/* results are written here so the compiler can't drop the work */
+static volatile size_t sink;
+
+/**
+ * Packets generated once and replayed from memory by the microbenchmarks.
+ */
+struct packet_buffer {
+	std::vector<char> data;
+	std::vector<size_t> offset;
+
+	const cap_head* operator[](size_t i) const {
+		return (const cap_head*)&data[offset[i]];
+	}
+};
+
+/**
+ * Extractor which only counts, so the benchmark measures the splitting of
+ * packets into sampling intervals.
+ */
+class NullExtractor: public Extractor {
+public:
+	NullExtractor(): bits(0.0), samples(0) {}
+
+	virtual void set_formatter(enum Formatter format){}
+	using Extractor::set_formatter;
+
+	void start(){
+		validate_engine();
+	}
+
+	void packet(const cap_head* cp){
+		sample_packet(cp);
+	}
+
+	void sample(){
+		do_sample();
+	}
+
+	double bits;
+	uint64_t samples;
+
+protected:
+	virtual void write_sample(double t){
+		samples++;
+	}
+
+	virtual void accumulate(qd_real fraction, unsigned long packet_bits, const cap_head* cp, int counter){
+		bits += to_double(fraction) * packet_bits;
+	}
+};
+
+/**
+ * NullExtractor with the events called directly, see StaticExtractor.
+ */
+class StaticNullExtractor final: public StaticExtractor<StaticNullExtractor> {
+	friend class StaticExtractor<StaticNullExtractor>;
+
+public:
+	StaticNullExtractor(): bits(0.0), samples(0) {}
+
+	virtual void set_formatter(enum Formatter format){}
+	using Extractor::set_formatter;
+
+	void start(){
+		validate_engine();
+	}
+
+	void packet(const cap_head* cp){
+		sample_packet(cp);
+	}
+
+	double bits;
+	uint64_t samples;
+
+protected:
+	virtual void write_sample(double t){
+		samples++;
+	}
+
+	virtual void accumulate(qd_real fraction, unsigned long packet_bits, const cap_head* cp, int counter){
+		bits += to_double(fraction) * packet_bits;
+	}
+};
+
+/**
+ * Split every packet into sampling intervals at hz with extractor T.
+ */
+template <class T>
+static void split_packets(const struct packet_buffer& packets, const char* hz, const char* engine = "qd"){
+	T ex;
+	ex.set_sampling_frequency(hz);
+	ex.set_time_engine(engine);
+	ex.reset();
+	ex.start();
+	const size_t n = packets.offset.size();
+	for ( size_t i = 0; i < n; i++ ){
+		ex.packet(packets[i]);
+	}
+	sink = ex.samples;
+}
+
+/**
+ * Run func and return the fastest of the rounds in seconds.
+ */
+template <class F>
+static double measure(F func){
+	double best = 0.0;
+	for ( int i = 0; i < rounds; i++ ){
+		const auto begin = std::chrono::steady_clock::now();
+		func();
+		const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - begin;
+		if ( i == 0 || elapsed.count() < best ){
+			best = elapsed.count();
+		}
+	}
+	return best;
+}
+
+static long peak_rss_kb(){
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	return usage.ru_maxrss;
+}
+
+/**
+ * Run a benchmark of n items in a child process, so the peak RSS reported is
+ * that of the benchmark alone.
+ */
+static void run(const char* name, const char* unit, uint64_t n, const std::function<void()>& func){
+	if ( only && !strstr(name, only) ) return;
+
+	fflush(stdout);
+	const pid_t pid = fork();
+	if ( pid < 0 ){
+		fprintf(stderr, "%s: fork: %s\n", program_name, strerror(errno));
+		return;
+	} else if ( pid > 0 ){
+		waitpid(pid, nullptr, 0);
+		return;
+	}
+
+	const double t = measure(func);
+	printf("  %-28s %12.0f %6s/s %9.2f ns/%-6s %8ld KiB\n", name, n / t, unit, 1e9 * t / n, unit, peak_rss_kb());
+	fflush(stdout);
+	_exit(0);
+}
+
+static void bench_micro(const struct packet_buffer& packets){
+	const size_t n = packets.offset.size();
+	printf("Microbenchmarks (%zu packets, %s Hz)\n", n, frequency);
+	printf("  %-28s %21s %22s %12s\n", "", "throughput", "latency", "peak RSS");
+
+	run("decode_layers", "pkt", n, [&](){
+		struct layer_sizes sizes;
+		size_t sum = 0;
+		for ( size_t i = 0; i < n; i++ ){
+			decode_layers(packets[i], LEVEL_APPLICATION, &sizes);
+			sum += sizes.size[LEVEL_APPLICATION];
+		}
+		sink = sum;
+	});
+
+	for ( const char* hz: {frequency, "1m"} ){
+		char name[64];
+		snprintf(name, sizeof(name), "calculate_samples@%s", hz);
+		run(name, "pkt", n, [&](){ split_packets<NullExtractor>(packets, hz); });
+		snprintf(name, sizeof(name), "calculate_samples/static@%s", hz);
+		run(name, "pkt", n, [&](){ split_packets<StaticNullExtractor>(packets, hz); });
+		snprintf(name, sizeof(name), "calculate_samples/int@%s", hz);
+		run(name, "pkt", n, [&](){ split_packets<StaticNullExtractor>(packets, hz, "int"); });
+	}
+
+	run("do_sample", "sample", n, [&](){
+		NullExtractor ex;
+		ex.set_sampling_frequency(frequency);
+		ex.reset();
+		ex.packet(packets[0]);
+		for ( size_t i = 0; i < n; i++ ){
+			ex.sample();
+		}
+	});
+
+	/* bursty values so run-length encoding sees both runs and changes */
+	std::vector<double> values(n);
+	for ( size_t i = 0; i < n; i++ ){
+		values[i] = (i / 7) % 3 == 0 ? 0.0 : (double)(packets[i]->len * 8000);
+	}
+
+	/* private ring and socket so a running tool isn't disturbed */
+	const std::string shm_name = "/extract_bench." + std::to_string(getpid());
+	const std::string rrd_name = "/tmp/extract_bench." + std::to_string(getpid()) + ".sock";
+	const struct formatter_entry* cur = formatter_lut;
+	for ( ; cur->name; cur++ ){
+		char name[64];
+		snprintf(name, sizeof(name), "write_sample/%s", cur->name);
+		run(name, "sample", n, [&](){
+			FILE* dst = fopen("/dev/null", "w");
+			const char* label = "Bitrate (bps)";
+			Output<double>* output = nullptr;
+			switch ( cur->fmt ){
+			case FORMAT_DEFAULT: output = new DefaultOutput<double>(label, dst); break;
+			case FORMAT_CSV:     output = new CSVOutput<double>(label, ';', false, dst); break;
+			case FORMAT_TSV:     output = new CSVOutput<double>(label, '\t', false, dst); break;
+			case FORMAT_MATLAB:  output = new CSVOutput<double>(label, '\t', true, dst); break;
+			case FORMAT_RLE:     output = new RLEOutput<double>(label, dst); break;
+			case FORMAT_BINARY:  output = new BinaryOutput<double>(label, dst); break;
+			case FORMAT_SHM:     output = new ShmOutput<double>(label, shm_name.c_str()); break;
+			case FORMAT_RRD:     output = new RoundRobinOutput<double>(label, rrd_name.c_str()); break;
+			}
+
+			NullExtractor ex;
+			ex.set_sampling_frequency(frequency);
+			output->write_header(ex.get_sample_info());
+			const double tSample = 1.0 / ex.get_sample_info().sampleFrequency;
+			for ( size_t i = 0; i < n; i++ ){
+				output->write_sample(1700000000.0 + i * tSample, values[i]);
+			}
+			output->write_trailer();
+			delete output;
+			fclose(dst);
+		});
+	}
+	ShmRingWriter::unlink(shm_name.c_str());
+
+	run("Bins::feed", "value", n, [&](){
+		Bins bins(10, 3);
+		for ( size_t i = 0; i < n; i++ ){
+			bins.feed(values[i]);
+		}
+	});
+
+	run("HaarPyramid::feed", "value", n, [&](){
+		HaarPyramid pyramid;
+		pyramid.feed(values.data(), n);
+		pyramid.flush();
+	});
+
+	printf("\n");
+}
+
+static stream_t open_capture(const char* filename){
+	stream_t st;
+	stream_addr_t addr;
+	int ret;
+	if ( (ret=stream_addr_str(&addr, filename, 0)) != 0 || (ret=stream_open(&st, &addr, NULL, 0)) != 0 ){
+		fprintf(stderr, "%s: %s: %s\n", program_name, filename, caputils_error_string(ret));
+		exit(1);
+	}
+	return st;
+}
+
+static uint64_t count_packets(const char* filename){
+	stream_t st = open_capture(filename);
+	cap_head* cp;
+	struct timeval tv = {1,0};
+	uint64_t n = 0;
+	while ( stream_read(st, &cp, nullptr, &tv) == 0 ){
+		n++;
+	}
+	stream_close(st);
+	return n;
+}
+
+/**
+ * Process the capture with a tool writing to /dev/null.
+ */
+static void process(const char* filename, Extractor& app){
+	stream_t st = open_capture(filename);
+	app.reset();
+	app.process_stream(st, nullptr);
+	stream_close(st);
+}
+
+static void bench_throughput(const char* filename, uint64_t n){
+	printf("Throughput (%s, %" PRIu64 " packets, %s Hz)\n", filename, n, frequency);
+	printf("  %-28s %21s %22s %12s\n", "", "throughput", "latency", "peak RSS");
+
+	FILE* null = fopen("/dev/null", "w");
+	for ( const char* engine: {"qd", "int"} ){
+		for ( const char* level: {"link", "application"} ){
+			char name[64];
+			snprintf(name, sizeof(name), "bitrate/%s/%s", level, engine);
+			run(name, "pkt", n, [&](){
+				BitrateCalculator app;
+				app.set_sampling_frequency(frequency);
+				app.set_extraction_level(level);
+				app.set_time_engine(engine);
+				app.set_output(null);
+				process(filename, app);
+			});
+		}
+	}
+
+	run("bitrate/all", "pkt", n, [&](){
+		LevelBitrateCalculator app;
+		app.set_sampling_frequency(frequency);
+		app.set_output(null);
+		process(filename, app);
+	});
+
+	run("pktrate", "pkt", n, [&](){
+		PacketRate app;
+		app.set_sampling_frequency(frequency);
+		app.set_output(null);
+		process(filename, app);
+	});
+
+	run("timescale", "pkt", n, [&](){
+		Timescale app;
+		app.set_sampling_frequency(frequency);
+		app.set_output(null);
+		process(filename, app);
+	});
+
+	fclose(null);
+	printf("\n");
+}
+
+static const char* short_options = "n:m:r:c:b:s:J:g:F:S:h";
+static struct option long_options[]= {
+	{"packets",          required_argument, 0, 'n'},
+	{"sampleFrequency",  required_argument, 0, 'm'},
+	{"rounds",           required_argument, 0, 'r'},
+	{"capture",          required_argument, 0, 'c'},
+	{"bench",            required_argument, 0, 'b'},
+	{"sizes",            required_argument, 0, 's'},
+	{"jumbo",            required_argument, 0, 'J'},
+	{"idle",             required_argument, 0, 'g'},
+	{"flows",            required_argument, 0, 'F'},
+	{"seed",             required_argument, 0, 'S'},
+	{"help",             no_argument,       0, 'h'},
+	{0, 0, 0, 0} /* sentinel */
+};
+
+static void show_usage(void){
+	printf("%s-" VERSION "\n", program_name);
+	printf("Usage: %s [OPTIONS]\n", program_name);
+	printf("Benchmarks the packet processing of the tools on a synthetic trace (see\n"
+	       "capgen), first each step on packets in memory and then whole tools\n"
+	       "reading a capture file. Each benchmark runs in its own process.\n\n"
+	       "  -n, --packets=N             Packets in the synthetic trace [default: 1000000].\n"
+	       "  -m, --sampleFrequency=HZ    Sampling frequency [default: 1k].\n"
+	       "  -r, --rounds=N              Report the fastest of N runs [default: 3].\n"
+	       "  -c, --capture=FILE          Measure throughput on FILE instead of the\n"
+	       "                              synthetic trace.\n"
+	       "  -b, --bench=NAME            Only run benchmarks whose name contains NAME.\n"
+	       "  -s, --sizes=MIX             Frame sizes of the trace, see capgen.\n"
+	       "  -J, --jumbo=FRACTION        Fraction of 9000 byte frames.\n"
+	       "  -g, --idle=P                Probability of an idle gap after each packet.\n"
+	       "  -F, --flows=N               Number of flows.\n"
+	       "  -S, --seed=N                Random seed.\n"
+	       "  -h, --help                  This text.\n\n");
+}
+
+int main(int argc, char **argv){
+	/* extract program name from path. e.g. /path/to/MArCd -> MArCd */
+	const char* separator = strrchr(argv[0], '/');
+	if ( separator ){
+		program_name = separator + 1;
+	} else {
+		program_name = argv[0];
+	}
+
+	int op, option_index = -1;
+	while ( (op = getopt_long(argc, argv, short_options, long_options, &option_index)) != -1 ){
+		switch (op){
+		case 0:   /* long opt */
+		case '?': /* unknown opt */
+			break;
+
+		case 'n': /* --packets */
+			num_packets = strtoull(optarg, NULL, 10);
+			break;
+
+		case 'm': /* --sampleFrequency */
+			frequency = optarg;
+			break;
+
+		case 'r': /* --rounds */
+			rounds = atoi(optarg);
+			break;
+
+		case 'c': /* --capture */
+			capture = optarg;
+			break;
+
+		case 'b': /* --bench */
+			only = optarg;
+			break;
+
+		case 's': /* --sizes */
+			if ( synthetic_parse_sizes(optarg, config.sizes) != 0 ){
+				fprintf(stderr, "%s: invalid size mix \"%s\".\n", program_name, optarg);
+				return 1;
+			}
+			break;
+
+		case 'J': /* --jumbo */
+			config.jumbo = atof(optarg);
+			break;
+
+		case 'g': /* --idle */
+			config.idle_probability = atof(optarg);
+			break;
+
+		case 'F': /* --flows */
+			config.flows = atoi(optarg);
+			break;
+
+		case 'S': /* --seed */
+			config.seed = strtoull(optarg, NULL, 10);
+			break;
+
+		case 'h':
+			show_usage();
+			return 0;
+
+		default:
+			fprintf (stderr, "%s: ?? getopt returned character code 0%o ??\n", program_name, op);
+		}
+	}
+
+	if ( num_packets < 1 || rounds < 1 || config.flows < 1 ){
+		fprintf(stderr, "%s: invalid number of packets, rounds or flows.\n", program_name);
+		return 1;
+	}
+
+	/* the trace is generated once, in memory for the microbenchmarks and as a
+	 * temporary capture for the throughput benchmarks */
+	char filename[] = "/tmp/extract_bench.XXXXXX";
+	const int fd = capture ? -1 : mkstemp(filename);
+	if ( !capture && fd == -1 ){
+		fprintf(stderr, "%s: %s: %s\n", program_name, filename, strerror(errno));
+		return 1;
+	}
+
+	struct packet_buffer packets;
+	SyntheticTraffic traffic(config);
+	stream_t st = nullptr;
+	stream_addr_t addr;
+	int ret;
+	if ( !capture && ((ret=stream_addr_str(&addr, filename, 0)) != 0 || (ret=stream_create(&st, &addr, NULL, "synth", "extract_bench")) != 0) ){
+		fprintf(stderr, "%s: %s: %s\n", program_name, filename, caputils_error_string(ret));
+		unlink(filename);
+		return 1;
+	}
+	for ( uint64_t i = 0; i < num_packets; i++ ){
+		const cap_head* cp = traffic.next();
+		packets.offset.push_back(packets.data.size());
+		packets.data.insert(packets.data.end(), (const char*)cp, (const char*)cp + traffic.record_size());
+		if ( st ){
+			stream_write(st, cp, traffic.record_size());
+		}
+	}
+	if ( st ){
+		stream_close(st);
+		close(fd);
+	}
+
+	bench_micro(packets);
+
+	/* free the in-memory trace so it isn't part of the throughput RSS */
+	std::vector<char>().swap(packets.data);
+	std::vector<size_t>().swap(packets.offset);
+
+	if ( capture ){
+		bench_throughput(capture, count_packets(capture));
+	} else {
+		bench_throughput(filename, num_packets);
+	}
+
+	if ( !capture ){
+		unlink(filename);
+	}
+
+	return 0;
+}
@@ -0,0 +1,437 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <caputils/caputils.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <csignal>
+#include <cmath>
+#include <cinttypes>
+#include <getopt.h>
+#include <algorithm>
+#include <arpa/inet.h>
+
+#include "extract.hpp"
+#include "flowtable.hpp"
+#include "stats.hpp"
+
+static double flow_timeout = 60.0;
+static size_t max_flows = 1 << 20;
+static const char* iface = NULL;
+const char* program_name = NULL;
+
+static void handle_sigint(int signum){
+	if ( !keep_running ){
+		fprintf(stderr, "\rGot SIGINT again, terminating.\n");
+		abort();
+	}
+	fprintf(stderr, "\rAborting capture.\n");
+	keep_running = false;
+}
+
+class FlowOutput {
+public:
+	virtual ~FlowOutput(){}
+	virtual void write_header(const struct sample_info& info){}
+	virtual void write_trailer(){}
+	virtual void write_record(double t, const struct flow_key& key, uint64_t bits) = 0;
+
+protected:
+	static const char* address(uint32_t addr, char* buf){
+		return inet_ntop(AF_INET, &addr, buf, INET_ADDRSTRLEN);
+	}
+};
+
+class DefaultFlowOutput: public FlowOutput {
+public:
+	virtual void write_header(const struct sample_info& info){
+		fprintf(stdout, "sampleFrequency: %.2fHz\n", info.sampleFrequency);
+		fprintf(stdout, "tSample:         %fs\n", info.tSample);
+		fprintf(stdout, "\n");
+		fprintf(stdout, "Time                      \tVLAN\tProto\t         Source\tSport\t    Destination\tDport\t      Bits\n");
+	}
+
+	virtual void write_record(double t, const struct flow_key& key, uint64_t bits){
+		char src[INET_ADDRSTRLEN];
+		char dst[INET_ADDRSTRLEN];
+		fprintf(stdout, "%.15f\t%4u\t%5u\t%15s\t%5u\t%15s\t%5u\t%10" PRIu64 "\n",
+		        t, key.vlan, key.proto,
+		        address(key.src, src), ntohs(key.sport),
+		        address(key.dst, dst), ntohs(key.dport),
+		        bits);
+	}
+};
+
+class CSVFlowOutput: public FlowOutput {
+public:
+	CSVFlowOutput(char delimiter, bool show_header)
+		: delimiter(delimiter)
+		, show_header(show_header) {
+
+	}
+
+	virtual void write_header(const struct sample_info& info){
+		if ( !show_header ) return;
+		const char d = delimiter;
+		fprintf(stdout, "\"Time (tSample: %f)\"%c\"VLAN\"%c\"Proto\"%c\"Source\"%c\"Sport\"%c\"Destination\"%c\"Dport\"%c\"Bits\"\n",
+		        info.tSample, d, d, d, d, d, d, d);
+	}
+
+	virtual void write_record(double t, const struct flow_key& key, uint64_t bits){
+		char src[INET_ADDRSTRLEN];
+		char dst[INET_ADDRSTRLEN];
+		const char d = delimiter;
+		fprintf(stdout, "%.15f%c%u%c%u%c%s%c%u%c%s%c%u%c%" PRIu64 "\n",
+		        t, d, key.vlan, d, key.proto,
+		        d, address(key.src, src), d, ntohs(key.sport),
+		        d, address(key.dst, dst), d, ntohs(key.dport),
+		        d, bits);
+	}
+
+private:
+	char delimiter;
+	bool show_header;
+};
+
+/**
+ * Bits per sampling interval for each flow.
+ *
+ * Each flow keeps a short run-length encoded series of its recent intervals
+ * which is written when full, when the flow is evicted after being idle for
+ * flow_timeout seconds and at the end of the stream. Records are thus grouped
+ * per flow and not ordered by time across flows.
+ */
+class FlowRate final: public StaticExtractor<FlowRate> {
+	friend class StaticExtractor<FlowRate>;
+
+public:
+	FlowRate()
+		: StaticExtractor()
+		, output(nullptr)
+		, table(nullptr)
+		, timeout_intervals(1)
+		, next_sweep(0)
+		, forced_sweep(UINT64_MAX)
+		, dropped(0) {
+
+		set_formatter(FORMAT_DEFAULT);
+	}
+
+	virtual ~FlowRate(){
+		delete table;
+		delete output;
+	}
+
+	virtual void set_formatter(enum Formatter format){
+		delete output;
+		switch (format){
+		case FORMAT_DEFAULT: output = new DefaultFlowOutput; break;
+		case FORMAT_CSV:     output = new CSVFlowOutput(';', false); break;
+		case FORMAT_TSV:     output = new CSVFlowOutput('\t', false); break;
+		case FORMAT_MATLAB:  output = new CSVFlowOutput('\t', true); break;
+		default:
+			fprintf(stderr, "%s: unsupported output format, using default.\n", program_name);
+			output = new DefaultFlowOutput;
+		}
+	}
+
+	using Extractor::set_formatter;
+
+	virtual void reset(){
+		delete table;
+		table = new FlowTable(max_flows);
+		timeout_intervals = std::max<uint64_t>(1, (uint64_t)ceil(flow_timeout * sampleFrequency));
+		next_sweep = timeout_intervals;
+		forced_sweep = UINT64_MAX;
+		dropped = 0;
+		Extractor::reset();
+	}
+
+protected:
+	virtual void write_header(int index){
+		output->write_header(get_sample_info());
+	}
+
+	virtual void write_trailer(int index){
+		table->sweep([this](struct flow_entry& flow){
+			flush(flow);
+			return true;
+		});
+		output->write_trailer();
+
+		if ( dropped > 0 ){
+			fprintf(stderr, "%s: flow table full, %" PRIu64 " packets were not accounted (see --max-flows).\n", program_name, dropped);
+		}
+	}
+
+	virtual void write_sample(double t){
+		expire(counter - 1);
+	}
+
+	virtual void write_empty_samples(uint64_t n){
+		expire(counter - 1 + n - 1);
+	}
+
+	virtual void accumulate(qd_real fraction, unsigned long packet_bits, const cap_head* cp, int packet_samples){
+		struct flow_entry* flow = lookup(cp, packet_samples);
+		if ( !flow ) return;
+
+		const uint64_t index = counter - 1;
+		if ( flow->last != index ){
+			push(*flow, flow->last, 1, flow->bits);
+			flow->last = index;
+			flow->bits = 0;
+		}
+		flow->bits += my_round(to_double(fraction) * packet_bits);
+	}
+
+	virtual void accumulate_samples(qd_real fraction, unsigned long packet_bits, const cap_head* cp, int packet_samples, uint64_t n){
+		struct flow_entry* flow = lookup(cp, packet_samples);
+		if ( flow ){
+			const uint64_t index = counter - 1;
+			push(*flow, flow->last, 1, flow->bits);
+			push(*flow, index, n, my_round(to_double(fraction) * packet_bits));
+			flow->last = index + n - 1;
+			flow->bits = 0;
+		}
+		expire(counter - 1 + n - 1);
+	}
+
+private:
+	struct flow_entry* lookup(const cap_head* cp, int packet_samples){
+		struct flow_key key;
+		flow_key_from_packet(cp, &key);
+
+		struct flow_entry* flow = table->find_or_insert(key);
+		if ( flow ) return flow;
+
+		/* table is full, evict every flow without traffic in the current
+		 * interval (at most once per interval) and try again */
+		const uint64_t index = counter - 1;
+		if ( forced_sweep != index ){
+			forced_sweep = index;
+			evict_idle(index, 1);
+			flow = table->find_or_insert(key);
+		}
+
+		if ( !flow && packet_samples == 1 ){
+			dropped++;
+		}
+		return flow;
+	}
+
+	/**
+	 * Evict idle flows when the interval has been reached.
+	 */
+	void expire(uint64_t index){
+		if ( index < next_sweep ) return;
+		evict_idle(index, timeout_intervals);
+		next_sweep = index + timeout_intervals;
+	}
+
+	void evict_idle(uint64_t index, uint64_t idle){
+		table->sweep([this, index, idle](struct flow_entry& flow){
+			if ( flow.last + idle > index ) return false;
+			flush(flow);
+			return true;
+		});
+	}
+
+	/**
+	 * Append a run of intervals to the flow series.
+	 */
+	void push(struct flow_entry& flow, uint64_t index, uint64_t count, uint64_t bits){
+		if ( bits == 0 ) return;
+
+		if ( flow.num_samples > 0 ){
+			struct flow_sample& prev = flow.series[flow.num_samples - 1];
+			if ( prev.bits == bits && prev.index + prev.count == index ){
+				prev.count += count;
+				return;
+			}
+		}
+
+		if ( flow.num_samples == FLOW_SERIES_SIZE ){
+			write_series(flow);
+		}
+
+		flow.series[flow.num_samples++] = {index, count, bits};
+	}
+
+	void flush(struct flow_entry& flow){
+		push(flow, flow.last, 1, flow.bits);
+		flow.bits = 0;
+		write_series(flow);
+	}
+
+	void write_series(struct flow_entry& flow){
+		for ( uint32_t i = 0; i < flow.num_samples; i++ ){
+			const struct flow_sample& cur = flow.series[i];
+			for ( uint64_t j = 0; j < cur.count; j++ ){
+				output->write_record(resolution_time(resolutions[0], cur.index + j), flow.key, cur.bits);
+			}
+		}
+		flow.num_samples = 0;
+	}
+
+	FlowOutput* output;
+	FlowTable* table;
+	uint64_t timeout_intervals;
+	uint64_t next_sweep;
+	uint64_t forced_sweep;
+	uint64_t dropped;
+};
+
+static const char* short_options = "p:i:q:m:l:f:e:n:w:tTh";
+static struct option long_options[]= {
+	{"packets",          required_argument, 0, 'p'},
+	{"iface",            required_argument, 0, 'i'},
+	{"level",            required_argument, 0, 'q'},
+	{"sampleFrequency",  required_argument, 0, 'm'},
+	{"linkCapacity",     required_argument, 0, 'l'},
+	{"format",           required_argument, 0, 'f'},
+	{"engine",           required_argument, 0, 'e'},
+	{"max-flows",        required_argument, 0, 'n'},
+	{"flow-timeout",     required_argument, 0, 'w'},
+	{"relative-time",    no_argument,       0, 't'},
+	{"absolute-time",    no_argument,       0, 'T'},
+	{"help",             no_argument,       0, 'h'},
+	{0, 0, 0, 0} /* sentinel */
+};
+
+static void show_usage(void){
+	printf("%s-" VERSION " (libcap_utils-%s)\n", program_name, caputils_version(NULL));
+	printf("Usage: %s [OPTIONS] STREAM\n", program_name);
+	printf("Calculates the number of bits per sampling interval for each flow (IPv4\n"
+	       "5-tuple and VLAN). Records are grouped per flow, not ordered by time.\n\n"
+	       "  -i, --iface                 For ethernet-based streams, this is the interface\n"
+	       "                              to listen on. For other streams it is ignored.\n"
+	       "  -m, --sampleFrequency       Sampling frequency in Hz. Prefixes: k, m, g.\n"
+	       "  -q, --level                 Level to calculate bitrate on, see bitrate(1).\n"
+	       "  -l, --linkCapacity          Link capacity in BPS, default is 100e6 (100 Mbps).\n"
+	       "  -p, --packets=N             Stop after N packets.\n"
+	       "  -n, --max-flows=N           Maximum number of concurrent flows [default: 1048576].\n"
+	       "                              Packets of new flows are not accounted when full.\n"
+	       "  -w, --flow-timeout=SEC      Evict flows idle for SEC seconds [default: 60].\n"
+	       "  -f, --format=FORMAT         Set a specific output format. See below for list\n"
+	       "                              of supported formats (rle and binary are not).\n"
+	       "  -e, --engine=ENGINE         Time arithmetic used for sampling, see below for\n"
+	       "                              list of engines [default: qd].\n"
+	       "  -t, --relative-time         Show timestamps relative to the first packet.\n"
+	       "  -T, --absolute-time         Show timestamps with absolute values (default).\n"
+	       "  -h, --help                  This text.\n\n");
+
+	output_format_list();
+	output_engine_list();
+	filter_from_argv_usage();
+	stats_from_argv_usage();
+}
+
+int main(int argc, char **argv){
+	/* extract program name from path. e.g. /path/to/MArCd -> MArCd */
+	const char* separator = strrchr(argv[0], '/');
+	if ( separator ){
+		program_name = separator + 1;
+	} else {
+		program_name = argv[0];
+	}
+
+	struct filter filter;
+	if ( filter_from_argv(&argc, argv, &filter) != 0 ){
+		return 0; /* error already shown */
+	}
+	if ( stats_from_argv(&argc, argv) != 0 ){
+		return 1;
+	}
+
+	FlowRate app;
+
+	int op, option_index = -1;
+	while ( (op = getopt_long(argc, argv, short_options, long_options, &option_index)) != -1 ){
+		switch (op){
+		case 0:   /* long opt */
+		case '?': /* unknown opt */
+			break;
+
+		case 'f': /* --format */
+			app.set_formatter(optarg);
+			break;
+
+		case 'e': /* --engine */
+			app.set_time_engine(optarg);
+			break;
+
+		case 'p':
+			app.set_max_packets(atoi(optarg));
+			break;
+
+		case 'm' : /* --sampleFrequency */
+			app.set_sampling_frequency(optarg);
+			break;
+
+		case 'q': /* --level */
+			app.set_extraction_level(optarg);
+			break;
+
+		case 'l': /* --link */
+			app.set_link_capacity(optarg);
+			break;
+
+		case 'n': /* --max-flows */
+			max_flows = strtoul(optarg, nullptr, 10);
+			if ( max_flows == 0 || max_flows > UINT32_MAX / 2 ){
+				fprintf(stderr, "%s: invalid --max-flows \"%s\", using 1048576.\n", program_name, optarg);
+				max_flows = 1 << 20;
+			}
+			break;
+
+		case 'w': /* --flow-timeout */
+			flow_timeout = atof(optarg);
+			break;
+
+		case 'i':
+			iface = optarg;
+			break;
+
+		case 't': /* --relative-time */
+			app.set_relative_time(true);
+			break;
+
+		case 'T': /* --absolute-time */
+			app.set_relative_time(false);
+			break;
+
+		case 'h':
+			show_usage();
+			return 0;
+
+		default:
+			fprintf (stderr, "%s: ?? getopt returned character code 0%o ??\n", program_name, op);
+		}
+	}
+
+	/* handle C-c */
+	signal(SIGINT, handle_sigint);
+
+	int ret;
+
+	/* Open stream(s) */
+	stream_t stream;
+	if ( (ret=stream_from_getopt(&stream, argv, optind, argc, iface, "-", program_name, 0)) != 0 ) {
+		return ret; /* Error already shown */
+	}
+	stream_print_info(stream, stderr);
+
+	app.reset();
+	app.process_stream(stream, &filter);
+
+	/* Release resources */
+	stream_close(stream);
+	filter_close(&filter);
+
+	return 0;
+}
@@ -0,0 +1,145 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "flowtable.hpp"
+#include <caputils/packet.h>
+
+#include <cstring>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+
+void flow_key_from_packet(const cap_head* cp, struct flow_key* key){
+	memset(key, 0, sizeof(struct flow_key));
+
+	const struct ether_vlan_header* vlan = nullptr;
+	const struct ip* ip = find_ipv4_header(cp->ethhdr, &vlan);
+	if ( vlan ){
+		key->vlan = ntohs(vlan->tag) & 0x0fff;
+	}
+
+	if ( !ip ) return;
+
+	key->src = ip->ip_src.s_addr;
+	key->dst = ip->ip_dst.s_addr;
+	key->proto = ip->ip_p;
+
+	/* ports, if captured */
+	const char* end = cp->payload + cp->caplen;
+	const char* transport = (const char*)ip + 4*ip->ip_hl;
+	switch ( ip->ip_p ){
+	case IPPROTO_TCP:
+	case IPPROTO_UDP:
+		if ( transport + 4 <= end ){
+			memcpy(&key->sport, transport, 2);
+			memcpy(&key->dport, transport + 2, 2);
+		}
+		break;
+	}
+}
+
+bool operator==(const struct flow_key& a, const struct flow_key& b){
+	return memcmp(&a, &b, sizeof(struct flow_key)) == 0;
+}
+
+static uint64_t fmix64(uint64_t k){
+	k ^= k >> 33;
+	k *= 0xff51afd7ed558ccdULL;
+	k ^= k >> 33;
+	k *= 0xc4ceb9fe1a85ec53ULL;
+	k ^= k >> 33;
+	return k;
+}
+
+static uint32_t flow_hash(const struct flow_key& key){
+	uint64_t word[2];
+	memcpy(word, &key, sizeof(word));
+	return (uint32_t)fmix64(word[0] ^ fmix64(word[1]));
+}
+
+static size_t table_size(size_t max_flows){
+	size_t n = 16;
+	while ( n < 2 * max_flows ) n <<= 1;
+	return n;
+}
+
+FlowTable::FlowTable(size_t max_flows)
+	: max_flows(max_flows)
+	, mask(table_size(max_flows) - 1)
+	, used(0)
+	, slots(mask + 1, {0, 0}) {
+
+}
+
+struct flow_entry* FlowTable::find_or_insert(const struct flow_key& key){
+	const uint32_t hash = flow_hash(key);
+	size_t pos = hash & mask;
+
+	while ( slots[pos].index != 0 ){
+		if ( slots[pos].hash == hash ){
+			struct flow_entry& entry = entries[slots[pos].index - 1];
+			if ( entry.key == key ) return &entry;
+		}
+		pos = (pos + 1) & mask;
+	}
+
+	if ( used == max_flows ){
+		return nullptr;
+	}
+
+	uint32_t index;
+	if ( free_entries.empty() ){
+		index = entries.size();
+		entries.emplace_back();
+		in_use.push_back(true);
+	} else {
+		index = free_entries.back();
+		free_entries.pop_back();
+		in_use[index] = true;
+	}
+
+	struct flow_entry& entry = entries[index];
+	memset(&entry, 0, sizeof(struct flow_entry));
+	entry.key = key;
+	entry.hash = hash;
+
+	slots[pos].hash = hash;
+	slots[pos].index = index + 1;
+	used++;
+
+	return &entry;
+}
+
+void FlowTable::sweep(const std::function<bool(struct flow_entry&)>& visit){
+	for ( size_t i = 0; i < entries.size(); i++ ){
+		if ( !in_use[i] || !visit(entries[i]) ) continue;
+
+		/* locate the slot referring to this entry */
+		size_t pos = entries[i].hash & mask;
+		while ( slots[pos].index != i + 1 ){
+			pos = (pos + 1) & mask;
+		}
+		remove(pos);
+	}
+}
+
+void FlowTable::remove(size_t pos){
+	const uint32_t index = slots[pos].index - 1;
+	in_use[index] = false;
+	free_entries.push_back(index);
+	used--;
+
+	/* backward-shift deletion: move following entries of the probe sequence
+	 * into the hole unless they would end up before their home slot */
+	size_t hole = pos;
+	size_t next = (pos + 1) & mask;
+	while ( slots[next].index != 0 ){
+		const size_t home = slots[next].hash & mask;
+		if ( ((next - home) & mask) >= ((next - hole) & mask) ){
+			slots[hole] = slots[next];
+			hole = next;
+		}
+		next = (next + 1) & mask;
+	}
+	slots[hole] = {0, 0};
+}
@@ -0,0 +1,96 @@
+#ifndef FLOWTABLE_H
+#define FLOWTABLE_H
+
+#include <caputils/caputils.h>
+#include <cstdint>
+#include <cstddef>
+#include <functional>
+#include <vector>
+
+/**
+ * Flow identifier: IPv4 5-tuple and VLAN id. Addresses and ports are stored
+ * in network byte order. Non-IPv4 packets use an all-zero tuple so they are
+ * only separated by VLAN.
+ */
+struct flow_key {
+	uint32_t src;
+	uint32_t dst;
+	uint16_t sport;
+	uint16_t dport;
+	uint16_t vlan;                    /* 0 if untagged */
+	uint8_t proto;
+	uint8_t reserved;
+};
+
+/**
+ * Fill key from the packet headers.
+ */
+void flow_key_from_packet(const cap_head* cp, struct flow_key* key);
+
+bool operator==(const struct flow_key& a, const struct flow_key& b);
+
+/**
+ * Consecutive sampling intervals with the same number of bits.
+ */
+struct flow_sample {
+	uint64_t index;                   /* first sampling interval */
+	uint64_t count;                   /* number of intervals */
+	uint64_t bits;                    /* bits per interval */
+};
+
+#define FLOW_SERIES_SIZE 8
+
+struct flow_entry {
+	struct flow_key key;
+	uint64_t last;                    /* last interval with traffic */
+	uint64_t bits;                    /* bits in the last interval */
+	uint32_t hash;
+	uint32_t num_samples;             /* samples in series (excluding the last interval) */
+	struct flow_sample series[FLOW_SERIES_SIZE];
+};
+
+/**
+ * Fixed-size hash table of flows using open addressing with linear probing.
+ *
+ * The probe array only holds the hash and an index into a dense array of
+ * entries so probing touches 8 bytes per slot. The probe array is allocated
+ * for at most max_flows entries at a load factor of 0.5 and never grows, i.e.
+ * memory is bounded by max_flows. Removal uses backward-shift deletion so no
+ * tombstones accumulate.
+ */
+class FlowTable {
+public:
+	FlowTable(size_t max_flows);
+
+	/**
+	 * Find the entry for key or insert a new zeroed entry.
+	 * @return nullptr if the table is full.
+	 */
+	struct flow_entry* find_or_insert(const struct flow_key& key);
+
+	/**
+	 * Call visit for every entry and remove it if it returns true.
+	 */
+	void sweep(const std::function<bool(struct flow_entry&)>& visit);
+
+	size_t size() const { return used; }
+	size_t capacity() const { return max_flows; }
+
+private:
+	struct slot {
+		uint32_t hash;
+		uint32_t index;                 /* entry index + 1, 0 if empty */
+	};
+
+	void remove(size_t pos);
+
+	const size_t max_flows;
+	const size_t mask;
+	size_t used;
+	std::vector<struct slot> slots;
+	std::vector<struct flow_entry> entries;
+	std::vector<uint32_t> free_entries;
+	std::vector<bool> in_use;
+};
+
+#endif /* FLOWTABLE_H */
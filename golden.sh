@@ -0,0 +1,243 @@
+#!/bin/sh
+#
+# Golden-output regression: runs each tool over a corpus of synthetic captures
+# (see capgen) in the reference mode (qd time engine, a single thread, scalar
+# wavelet kernel) and in every optimised mode, and compares the outputs with
+# samplediff. The largest absolute and relative error of each column is
+# reported for every mode. The optimised modes include the run-length and
+# binary formats expanded with samplecat, several frequencies in one pass,
+# bitrate -q all, consumer and the sample store of timescale and wavelet.
+#
+# Usage: ./golden.sh [SAMPLEDIFF OPTIONS]
+#   e.g. ./golden.sh --rel=1e-12 to allow a relative error of 1e-12.
+#   Set KEEP=1 to keep the captures and outputs.
+#
+# Exit status is 0 if every mode is within tolerance.
+
+BIN=$(dirname "$0")
+WORK=$(mktemp -d "${TMPDIR:-/tmp}/golden.XXXXXX")
+[ -n "$KEEP" ] || trap 'rm -rf "$WORK"' EXIT
+
+failed=0
+total=0
+
+# generate NAME CAPGEN-OPTIONS...
+generate(){
+	name=$1; shift
+	"$BIN/capgen" "$@" "$WORK/$name.cap" || exit 1
+}
+
+# begin NAME: start a mode, its outputs are kept in $out.*
+begin(){
+	out="$WORK/$(echo "$1" | tr -c 'a-zA-Z0-9.\n' '_')"
+	broken=
+	: > "$out.err"
+}
+
+# run OUTPUT TOOL OPTIONS...
+#   Run a tool of the current mode with its output in OUTPUT. Its messages are
+#   kept in $out.err. The mode fails if the tool fails, or if it rejected,
+#   replaced or ignored an option it was given (e.g. "--jobs ..., using 1.")
+#   as the mode would then not test what it claims to.
+run(){
+	dst=$1 prog=$2
+	shift 2
+	"$BIN/$prog" "$@" > "$dst" 2> "$dst.err"
+	status=$?
+	if [ $status -ne 0 ] || [ -s "$dst.err" ]; then
+		echo "$prog $*: exit status $status" >> "$out.err"
+		cat "$dst.err" >> "$out.err"
+	fi
+	if [ $status -ne 0 ] || grep -q -e ', using ' -e ', ignored\.$' -e 'unrecognized option' -e 'invalid option' "$dst.err"; then
+		broken=1
+	fi
+}
+
+# verdict TOOL CAPTURE CANDIDATE REFERENCE REFERENCE-FILE CANDIDATE-FILE [SAMPLEDIFF OPTIONS...]
+#   Compare two outputs of the current mode and report them. A mode may
+#   compare several pairs of outputs, each is counted.
+verdict(){
+	mode=$(printf "%-10s %-8s %-34s vs %s" "$1" "$2" "$3" "$4")
+	reffile=$5 candfile=$6
+	shift 6
+	total=$((total + 1))
+	bad=$broken
+	for file in "$reffile" "$candfile"; do
+		if [ ! -s "$file" ]; then
+			echo "$(basename "$file"): no output" >> "$out.err"
+			bad=1
+		fi
+	done
+
+	if [ -z "$bad" ] && "$BIN/samplediff" --quiet "$@" $DIFFFLAGS "$reffile" "$candfile" > "$candfile.diff" 2>&1; then
+		echo "ok    $mode"
+	else
+		echo "FAIL  $mode"
+		failed=$((failed + 1))
+		sed 's/^/      /' "$out.err"
+	fi
+	[ -f "$candfile.diff" ] && sed 's/^/      /' "$candfile.diff"
+}
+
+# skip TOOL CAPTURE CANDIDATE REASON
+skip(){
+	printf "skip  %-10s %-8s %-34s (%s)\n" "$1" "$2" "$3" "$4"
+}
+
+# check TOOL "CAPTURE..." "REFERENCE OPTIONS" "CANDIDATE OPTIONS" [SAMPLEDIFF OPTIONS...]
+check(){
+	tool=$1 cap=$(echo $2 | tr ' ' '+') ref=$3 cand=$4
+	files=$(for name in $2; do printf '%s ' "$WORK/$name.cap"; done)
+	shift 4
+	begin "$tool.$cap.$cand"
+	run "$out.ref" "$tool" $ref $files
+	run "$out.cand" "$tool" $cand $files
+	verdict "$tool" "$cap" "$cand" "$ref" "$out.ref" "$out.cand" "$@"
+}
+
+# check_expanded TOOL CAPTURE "REFERENCE OPTIONS" "CANDIDATE OPTIONS" FORMAT
+#   The tsv output against FORMAT (rle or binary) expanded with samplecat.
+check_expanded(){
+	tool=$1 cap=$2 ref=$3 cand=$4 format=$5
+	begin "$tool.$cap.$cand.$format"
+	run "$out.ref" "$tool" $ref -f tsv "$WORK/$cap.cap"
+	run "$out.$format" "$tool" $cand -f $format "$WORK/$cap.cap"
+	run "$out.cand" samplecat "$out.$format"
+	verdict "$tool" "$cap" "$cand -f $format" "$ref -f tsv" "$out.ref" "$out.cand"
+}
+
+# check_frequencies TOOL CAPTURE "REFERENCE OPTIONS" "CANDIDATE OPTIONS" LIST
+#   Each frequency of a single -m LIST -o pass against a pass of its own.
+check_frequencies(){
+	tool=$1 cap=$2 ref=$3 cand=$4 list=$5
+	begin "$tool.$cap.$cand.$list"
+	run "$out.stdout" "$tool" $cand -m $list -o "$out.cand" "$WORK/$cap.cap"
+	for hz in $(echo $list | tr ',' ' '); do
+		run "$out.ref.$hz" "$tool" $ref -m $hz "$WORK/$cap.cap"
+		verdict "$tool" "$cap" "$cand -m $list -o ($hz)" "$ref -m $hz" "$out.ref.$hz" "$out.cand.$hz"
+	done
+}
+
+# check_levels CAPTURE "REFERENCE OPTIONS" "CANDIDATE OPTIONS"
+#   bitrate -q all against a pass per level, with the columns pasted together.
+check_levels(){
+	cap=$1 ref=$2 cand=$3
+	begin "bitrate.$cap.$cand.all"
+	columns="$out.link"
+	run "$out.link" bitrate $ref -q link "$WORK/$cap.cap"
+	for level in network transport application; do
+		run "$out.$level" bitrate $ref -q $level "$WORK/$cap.cap"
+		cut -f 2 "$out.$level" > "$out.$level.value"
+		columns="$columns $out.$level.value"
+	done
+	paste $columns > "$out.ref"
+	run "$out.cand" bitrate $cand -q all "$WORK/$cap.cap"
+	verdict bitrate "$cap" "$cand -q all" "$ref -q LEVEL" "$out.ref" "$out.cand"
+}
+
+# check_consumer CAPTURE "REFERENCE OPTIONS" "CANDIDATE OPTIONS"
+#   Each analysis of a single consumer pass against its own tool.
+check_consumer(){
+	cap=$1 ref=$2 cand=$3
+	begin "consumer.$cap.$cand"
+	run "$out.stdout" consumer $cand -o "$out.cand" "$WORK/$cap.cap"
+	for tool in bitrate pktrate timescale wavelet; do
+		run "$out.ref.$tool" $tool $ref "$WORK/$cap.cap"
+		verdict consumer "$cap" "$cand ($tool)" "$tool $ref" "$out.ref.$tool" "$out.cand.$tool"
+	done
+}
+
+# check_store TOOL CAPTURE "OPTIONS"
+#   The pass writing a sample store (-s) and a replay of the store (-S)
+#   against a pass without it.
+check_store(){
+	tool=$1 cap=$2 opts=$3
+	begin "$tool.$cap.$opts.store"
+	run "$out.ref" "$tool" $opts "$WORK/$cap.cap"
+	run "$out.write" "$tool" $opts -s "$out.store" "$WORK/$cap.cap"
+	verdict "$tool" "$cap" "$opts -s FILE" "$opts" "$out.ref" "$out.write"
+	run "$out.replay" "$tool" $opts -S "$out.store"
+	verdict "$tool" "$cap" "$opts -S FILE" "$opts" "$out.ref" "$out.replay"
+}
+
+# kernels of wavelet supported by this cpu
+kernels=$("$BIN/wavelet" --help | sed -n '/^Supported wavelet kernels:/,/^$/s/^ \* \([a-z0-9]*\).*/\1/p')
+
+DIFFFLAGS="$*"
+
+generate default -n 200000
+generate jumbo   -n 100000 -s 64:1,1500:4 -J 0.1
+generate idle    -n 50000 -r 20000 -g 0.005 -G 0.02
+generate flows   -n 200000 -r 1000000 -F 100000 -u 0.5
+
+# consecutive captures with idle time between them, for tools taking several
+generate part1   -n 20000 -r 20000 -g 0.005 -G 0.02 -S 1 -T 1700000000
+generate part2   -n 20000 -r 20000 -g 0.005 -G 0.02 -S 2 -T 1700000010
+generate part3   -n 20000 -r 20000 -g 0.005 -G 0.02 -S 3 -T 1700000014
+
+for cap in default jumbo idle flows; do
+	for hz in 1000 20000; do
+		for tool in bitrate pktrate; do
+			ref="-z -f tsv -m $hz -e qd"
+			for cand in "-j 4" "-P" "-P -e int"; do
+				check $tool $cap "$ref" "$ref $cand"
+			done
+
+			# sparse and dense runs, and the runs through the writer thread
+			opts="-m $hz -e qd"
+			for cand in "-z" "-x" "-z -P"; do
+				check_expanded $tool $cap "$opts ${cand%% *}" "$opts $cand" rle
+			done
+			for cand in "-z" "-z -P"; do
+				check_expanded $tool $cap "$opts -z" "$opts $cand" binary
+			done
+		done
+
+		ref="-z -f tsv -m $hz -e qd"
+		for cand in "" "-e int"; do
+			check_levels $cap "$ref" "$ref $cand"
+		done
+
+		for level in link application; do
+			ref="-z -f tsv -m $hz -q $level -e qd"
+			for cand in "-e int" "-e int -j 4"; do
+				check bitrate $cap "$ref" "$ref $cand"
+			done
+		done
+		check pktrate $cap "-z -f tsv -m $hz -e qd" "-z -f tsv -m $hz -e int"
+	done
+
+	ref="-z -f tsv -e qd"
+	for cand in "" "-e int" "-P"; do
+		check_frequencies bitrate $cap "$ref" "$ref $cand" 1k,100,10
+	done
+
+	check_consumer $cap "-f tsv -m 1k -e qd" "-f tsv -m 1k -e qd"
+
+	ref="-m 1k -H -e qd"
+	check timescale $cap "$ref" "$ref -e int"
+	check_store timescale $cap "$ref"
+
+	ref="-m 10k -e qd -k scalar"
+	for kernel in sse2 avx2; do
+		if echo "$kernels" | grep -qx $kernel; then
+			check wavelet $cap "$ref" "$ref -k $kernel"
+		else
+			skip wavelet $cap "$ref -k $kernel" "not supported by this cpu"
+		fi
+	done
+	for cand in "-e int" "-j 4"; do
+		check wavelet $cap "$ref" "$ref $cand"
+	done
+	check_store wavelet $cap "$ref"
+done
+
+# files are sampled in parallel and merged in order
+ref="-m 1k -H -e qd"
+for cand in "-e int" "-j 2" "-j 4"; do
+	check timescale "part1 part2 part3" "$ref" "$ref $cand"
+done
+
+echo
+echo "$((total - failed)) of $total modes within tolerance."
+[ $failed -eq 0 ]
@@ -0,0 +1,201 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "haar.hpp"
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <thread>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define HAAR_X86
+#include <immintrin.h>
+#endif
+
+/**
+ * Add the pairs from first to pairs (less than 4 after the vector loop) and
+ * reduce the lanes.
+ */
+static void haar_tail(const double* in, size_t first, size_t pairs, double* c, double accC[4], double accD[4], struct haar_energy* energy){
+	for ( size_t i = first; i < pairs; i++ ){
+		const double a = in[2*i];
+		const double b = in[2*i+1];
+		const double sum = (a + b) * M_SQRT1_2;
+		const double diff = (a - b) * M_SQRT1_2;
+		c[i] = sum;
+		accC[i % 4] += sum * sum;
+		accD[i % 4] += diff * diff;
+	}
+
+	energy->sumC = (accC[0] + accC[1]) + (accC[2] + accC[3]);
+	energy->sumD = (accD[0] + accD[1]) + (accD[2] + accD[3]);
+}
+
+static void haar_level_scalar(const double* in, size_t pairs, double* c, struct haar_energy* energy){
+	double accC[4] = {0.0, 0.0, 0.0, 0.0};
+	double accD[4] = {0.0, 0.0, 0.0, 0.0};
+	haar_tail(in, 0, pairs, c, accC, accD, energy);
+}
+
+#ifdef HAAR_X86
+__attribute__((target("sse2")))
+static void haar_level_sse2(const double* in, size_t pairs, double* c, struct haar_energy* energy){
+	const __m128d scale = _mm_set1_pd(M_SQRT1_2);
+	__m128d accC_lo = _mm_setzero_pd(), accC_hi = _mm_setzero_pd();
+	__m128d accD_lo = _mm_setzero_pd(), accD_hi = _mm_setzero_pd();
+
+	size_t i = 0;
+	for ( ; i + 4 <= pairs; i += 4 ){
+		/* pairs i,i+1 in lo and i+2,i+3 in hi */
+		const __m128d x0 = _mm_loadu_pd(in + 2*i);
+		const __m128d x1 = _mm_loadu_pd(in + 2*i + 2);
+		const __m128d x2 = _mm_loadu_pd(in + 2*i + 4);
+		const __m128d x3 = _mm_loadu_pd(in + 2*i + 6);
+		const __m128d a_lo = _mm_unpacklo_pd(x0, x1), b_lo = _mm_unpackhi_pd(x0, x1);
+		const __m128d a_hi = _mm_unpacklo_pd(x2, x3), b_hi = _mm_unpackhi_pd(x2, x3);
+		const __m128d sum_lo  = _mm_mul_pd(_mm_add_pd(a_lo, b_lo), scale);
+		const __m128d sum_hi  = _mm_mul_pd(_mm_add_pd(a_hi, b_hi), scale);
+		const __m128d diff_lo = _mm_mul_pd(_mm_sub_pd(a_lo, b_lo), scale);
+		const __m128d diff_hi = _mm_mul_pd(_mm_sub_pd(a_hi, b_hi), scale);
+		_mm_storeu_pd(c + i, sum_lo);
+		_mm_storeu_pd(c + i + 2, sum_hi);
+		accC_lo = _mm_add_pd(accC_lo, _mm_mul_pd(sum_lo, sum_lo));
+		accC_hi = _mm_add_pd(accC_hi, _mm_mul_pd(sum_hi, sum_hi));
+		accD_lo = _mm_add_pd(accD_lo, _mm_mul_pd(diff_lo, diff_lo));
+		accD_hi = _mm_add_pd(accD_hi, _mm_mul_pd(diff_hi, diff_hi));
+	}
+
+	double accC[4], accD[4];
+	_mm_storeu_pd(accC, accC_lo);
+	_mm_storeu_pd(accC + 2, accC_hi);
+	_mm_storeu_pd(accD, accD_lo);
+	_mm_storeu_pd(accD + 2, accD_hi);
+	haar_tail(in, i, pairs, c, accC, accD, energy);
+}
+
+__attribute__((target("avx2")))
+static void haar_level_avx2(const double* in, size_t pairs, double* c, struct haar_energy* energy){
+	const __m256d scale = _mm256_set1_pd(M_SQRT1_2);
+	__m256d accC = _mm256_setzero_pd();
+	__m256d accD = _mm256_setzero_pd();
+
+	size_t i = 0;
+	for ( ; i + 4 <= pairs; i += 4 ){
+		const __m256d x0 = _mm256_loadu_pd(in + 2*i);
+		const __m256d x1 = _mm256_loadu_pd(in + 2*i + 4);
+		/* a and b hold the pairs in order 0,2,1,3, restored by the permute */
+		const __m256d a = _mm256_unpacklo_pd(x0, x1);
+		const __m256d b = _mm256_unpackhi_pd(x0, x1);
+		const __m256d sum  = _mm256_permute4x64_pd(_mm256_mul_pd(_mm256_add_pd(a, b), scale), 0xd8);
+		const __m256d diff = _mm256_permute4x64_pd(_mm256_mul_pd(_mm256_sub_pd(a, b), scale), 0xd8);
+		_mm256_storeu_pd(c + i, sum);
+		accC = _mm256_add_pd(accC, _mm256_mul_pd(sum, sum));
+		accD = _mm256_add_pd(accD, _mm256_mul_pd(diff, diff));
+	}
+
+	double lanesC[4], lanesD[4];
+	_mm256_storeu_pd(lanesC, accC);
+	_mm256_storeu_pd(lanesD, accD);
+	haar_tail(in, i, pairs, c, lanesC, lanesD, energy);
+}
+#endif /* HAAR_X86 */
+
+static bool always_supported(){
+	return true;
+}
+
+#ifdef HAAR_X86
+static bool sse2_supported(){
+	return __builtin_cpu_supports("sse2");
+}
+
+static bool avx2_supported(){
+	return __builtin_cpu_supports("avx2");
+}
+#endif
+
+struct haar_kernel { const char* name; bool (*supported)(); haar_level_func func; };
+static const struct haar_kernel haar_kernel_lut[] = {
+	/* fastest first */
+#ifdef HAAR_X86
+	{"avx2",   avx2_supported,   haar_level_avx2},
+	{"sse2",   sse2_supported,   haar_level_sse2},
+#endif
+	{"scalar", always_supported, haar_level_scalar},
+	{nullptr, nullptr, nullptr} /* sentinel */
+};
+
+static const struct haar_kernel* fastest_kernel(){
+#ifdef HAAR_X86
+	__builtin_cpu_init(); /* runs before constructors of libgcc may have */
+#endif
+	const struct haar_kernel* cur = haar_kernel_lut;
+	while ( !cur->supported() ){
+		cur++;
+	}
+	return cur;
+}
+
+static const struct haar_kernel* kernel = fastest_kernel();
+
+void haar_level(const double* in, size_t pairs, double* c, struct haar_energy* energy){
+	kernel->func(in, pairs, c, energy);
+}
+
+void haar_block_transform(const double* in, double* scratch, struct haar_block* out){
+	size_t n = HAAR_BLOCK_SIZE;
+	for ( size_t octave = 0; octave < HAAR_BLOCK_OCTAVES; octave++ ){
+		haar_level(in, n / 2, scratch, &out->energy[octave]);
+		in = scratch;
+		n /= 2;
+	}
+	out->coarse = scratch[0];
+}
+
+void haar_blocks_parallel(const double* in, size_t blocks, struct haar_block* out, int jobs){
+	/* contiguous ranges of blocks per thread, each result has a fixed slot
+	 * so the order of completion doesn't matter */
+	auto worker = [=](size_t first, size_t last){
+		std::vector<double> scratch(HAAR_BLOCK_SIZE);
+		for ( size_t i = first; i < last; i++ ){
+			haar_block_transform(in + i * HAAR_BLOCK_SIZE, scratch.data(), &out[i]);
+		}
+	};
+
+	const size_t threads = std::min<size_t>(jobs, blocks);
+	std::vector<std::thread> pool;
+	for ( size_t i = 1; i < threads; i++ ){
+		pool.emplace_back(worker, blocks * i / threads, blocks * (i + 1) / threads);
+	}
+	worker(0, blocks / std::max<size_t>(threads, 1));
+
+	for ( std::thread& thread: pool ){
+		thread.join();
+	}
+}
+
+bool haar_set_kernel(const char* name){
+	for ( const struct haar_kernel* cur = haar_kernel_lut; cur->name; cur++ ){
+		if ( strcasecmp(cur->name, name) == 0 ){
+			if ( !cur->supported() ) return false;
+			kernel = cur;
+			return true;
+		}
+	}
+	return false;
+}
+
+const char* haar_kernel_name(){
+	return kernel->name;
+}
+
+void haar_kernel_list(){
+	printf("Supported wavelet kernels:\n");
+	for ( const struct haar_kernel* cur = haar_kernel_lut; cur->name; cur++ ){
+		if ( !cur->supported() ) continue;
+		printf(" * %s%s\n", cur->name, cur == kernel ? " (default)" : "");
+	}
+	printf("\n");
+}
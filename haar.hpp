@@ -0,0 +1,315 @@
+#ifndef HAAR_H
+#define HAAR_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <vector>
+
+/**
+ * Energy of the coefficients of one level of a Haar transform, in the same
+ * order for every kernel: pair i is added to lane i % 4 and the lanes are
+ * summed pairwise at the end, so all kernels give identical results.
+ */
+struct haar_energy {
+	double sumC;                      /* sum of squared approximation coefficients */
+	double sumD;                      /* sum of squared detail coefficients */
+};
+
+/**
+ * Calculate one level of a Haar transform.
+ *
+ * @param in Series of 2*pairs values.
+ * @param pairs Number of pairs.
+ * @param c Approximation coefficients (pairs values), may be the same as in.
+ * @param energy Energy of the coefficients of this level.
+ */
+typedef void (*haar_level_func)(const double* in, size_t pairs, double* c, struct haar_energy* energy);
+
+/**
+ * Calculate one level using the selected kernel, by default the fastest one
+ * supported by the CPU.
+ */
+void haar_level(const double* in, size_t pairs, double* c, struct haar_energy* energy);
+
+/**
+ * Select kernel by name.
+ * @return false if the kernel is unknown or not supported by the CPU.
+ */
+bool haar_set_kernel(const char* name);
+
+/**
+ * Name of the selected kernel.
+ */
+const char* haar_kernel_name();
+
+/**
+ * Print the kernels supported by the CPU.
+ */
+void haar_kernel_list();
+
+#define HAAR_BLOCK_OCTAVES 12
+#define HAAR_BLOCK_SIZE (1<<HAAR_BLOCK_OCTAVES)
+
+/* blocks per thread and batch in haar_blocks_parallel */
+#define HAAR_PARALLEL_BLOCKS 256
+
+/**
+ * Result of transforming an aligned block of HAAR_BLOCK_SIZE values: the
+ * energy of the octaves that are complete within the block and the single
+ * approximation coefficient passed on to the next octave.
+ */
+struct haar_block {
+	struct haar_energy energy[HAAR_BLOCK_OCTAVES];
+	double coarse;
+};
+
+/**
+ * Transform one block of HAAR_BLOCK_SIZE values.
+ * @param scratch Buffer of HAAR_BLOCK_SIZE values, may be the same as in.
+ */
+void haar_block_transform(const double* in, double* scratch, struct haar_block* out);
+
+/**
+ * Transform consecutive blocks using jobs threads.
+ */
+void haar_blocks_parallel(const double* in, size_t blocks, struct haar_block* out, int jobs);
+
+/**
+ * Online Haar wavelet decomposition (Mallat pyramid) of a series.
+ *
+ * Each octave keeps the approximation coefficient waiting for its pair and
+ * the energy of the coefficients calculated so far. When the pair is
+ * complete the detail and approximation coefficients are calculated and the
+ * approximation is passed to the next octave, so memory is O(log n) and the
+ * spectrum is available at any time. All complete pairs are used, i.e. the
+ * series isn't truncated to a power of two.
+ *
+ * Values are collected in a block of HAAR_BLOCK_SIZE and transformed one
+ * level at a time in place using the vectorized kernel from haar.hpp.
+ *
+ * Full blocks starting on a block boundary are transformed independently of
+ * the pyramid and their energies added afterwards in block order, so the
+ * fine octaves of large series can be calculated in parallel with a result
+ * identical to feeding them one block at a time.
+ */
+class HaarPyramid {
+public:
+	HaarPyramid(){
+		/* a 64-bit counter allows at most 64 octaves, so the arrays never move */
+		pending.reserve(64);
+		has_pending.reserve(64);
+		sumD.reserve(64);
+		sumC.reserve(64);
+		count.reserve(64);
+		block.reserve(HAAR_BLOCK_SIZE);
+	}
+
+	/**
+	 * Called for each value.
+	 */
+	void feed(double value){
+		block.push_back(value);
+		if ( block.size() == HAAR_BLOCK_SIZE ){
+			flush();
+		}
+	}
+
+	/**
+	 * Same as calling feed(value) n times.
+	 */
+	void feed_repeated(double value, uint64_t n){
+		while ( n > 0 ){
+			const size_t chunk = std::min<uint64_t>(n, HAAR_BLOCK_SIZE - block.size());
+			block.insert(block.end(), chunk, value);
+			n -= chunk;
+			if ( block.size() == HAAR_BLOCK_SIZE ){
+				flush();
+			}
+		}
+	}
+
+	/**
+	 * Same as calling feed for each value.
+	 */
+	void feed(const double* value, size_t n){
+		while ( n > 0 ){
+			const size_t chunk = std::min(n, HAAR_BLOCK_SIZE - block.size());
+			block.insert(block.end(), value, value + chunk);
+			value += chunk;
+			n -= chunk;
+			if ( block.size() == HAAR_BLOCK_SIZE ){
+				flush();
+			}
+		}
+	}
+
+	/**
+	 * Same as calling feed for each value, with full blocks transformed by
+	 * jobs threads.
+	 */
+	void feed(const double* value, size_t n, int jobs){
+		/* complete the current block */
+		const size_t head = std::min(n, (HAAR_BLOCK_SIZE - block.size()) % HAAR_BLOCK_SIZE);
+		feed(value, head);
+		value += head;
+		n -= head;
+
+		if ( jobs > 1 && block.empty() && aligned() ){
+			std::vector<struct haar_block> result;
+			while ( n >= HAAR_BLOCK_SIZE ){
+				const size_t blocks = std::min<size_t>(n / HAAR_BLOCK_SIZE, (size_t)jobs * HAAR_PARALLEL_BLOCKS);
+				result.resize(blocks);
+				haar_blocks_parallel(value, blocks, result.data(), jobs);
+				for ( const struct haar_block& cur: result ){
+					merge(cur);
+				}
+				value += blocks * HAAR_BLOCK_SIZE;
+				n -= blocks * HAAR_BLOCK_SIZE;
+			}
+		}
+
+		feed(value, n);
+	}
+
+	/**
+	 * Pass the collected values through the pyramid.
+	 */
+	void flush(){
+		if ( block.size() == HAAR_BLOCK_SIZE && aligned() ){
+			struct haar_block result;
+			haar_block_transform(block.data(), block.data(), &result);
+			merge(result);
+			block.clear();
+			return;
+		}
+
+		double* x = block.data();
+		size_t n = block.size();
+
+		for ( size_t octave = 0; n > 0; octave++ ){
+			if ( octave == count.size() ){
+				add_octave();
+			}
+
+			/* complete the pair left by the previous block, its approximation
+			 * replaces the first value so the next octave gets them in order */
+			size_t first = 0;
+			if ( has_pending[octave] ){
+				const double c = (pending[octave] + x[0]) * M_SQRT1_2;
+				const double d = (pending[octave] - x[0]) * M_SQRT1_2;
+				has_pending[octave] = false;
+				sumD[octave] += d * d;
+				sumC[octave] += c * c;
+				count[octave]++;
+				x[0] = c;
+				first = 1;
+			}
+
+			const size_t pairs = (n - first) / 2;
+			struct haar_energy energy;
+			haar_level(x + first, pairs, x + first, &energy);
+			sumD[octave] += energy.sumD;
+			sumC[octave] += energy.sumC;
+			count[octave] += pairs;
+
+			if ( (n - first) % 2 == 1 ){
+				pending[octave] = x[first + 2 * pairs];
+				has_pending[octave] = true;
+			}
+
+			n = first + pairs;
+		}
+
+		block.clear();
+	}
+
+	/**
+	 * Write the log2 of the mean detail energy (D) and the natural log of the
+	 * mean approximation energy (C) of each octave, finest first. Bands are
+	 * numbered from the coarsest (0).
+	 */
+	void write_spectrum(FILE* dst, double tSample){
+		flush();
+
+		size_t octaves = 0;
+		while ( octaves < count.size() && count[octaves] > 0 ){
+			octaves++;
+		}
+
+		fprintf(dst, "Ts\tBand\tD coeff\tC Coeff\n");
+		for ( size_t octave = 0; octave < octaves; octave++ ){
+			const double meanD = sumD[octave] / count[octave];
+			const double meanC = sumC[octave] / count[octave];
+			fprintf(dst, "%5.5g\t%d\t%f\t%f\n", tSample * pow(2, octave), (int)(octaves - octave - 1), log2(meanD), log(meanC));
+		}
+	}
+
+private:
+	void add_octave(){
+		pending.push_back(0.0);
+		has_pending.push_back(false);
+		sumD.push_back(0.0);
+		sumC.push_back(0.0);
+		count.push_back(0);
+	}
+
+	/**
+	 * True if no octave within a block has a pending coefficient, i.e. the
+	 * next value starts a new block.
+	 */
+	bool aligned() const {
+		const size_t octaves = std::min<size_t>(HAAR_BLOCK_OCTAVES, count.size());
+		for ( size_t octave = 0; octave < octaves; octave++ ){
+			if ( has_pending[octave] ) return false;
+		}
+		return true;
+	}
+
+	/**
+	 * Add a transformed block, same operations as flush() does on a full
+	 * aligned block.
+	 */
+	void merge(const struct haar_block& result){
+		for ( size_t octave = 0; octave < HAAR_BLOCK_OCTAVES; octave++ ){
+			if ( octave == count.size() ){
+				add_octave();
+			}
+			sumD[octave] += result.energy[octave].sumD;
+			sumC[octave] += result.energy[octave].sumC;
+			count[octave] += HAAR_BLOCK_SIZE >> (octave + 1);
+		}
+
+		double value = result.coarse;
+		for ( size_t octave = HAAR_BLOCK_OCTAVES; ; octave++ ){
+			if ( octave == count.size() ){
+				add_octave();
+			}
+
+			if ( !has_pending[octave] ){
+				pending[octave] = value;
+				has_pending[octave] = true;
+				return;
+			}
+
+			const double c = (pending[octave] + value) * M_SQRT1_2;
+			const double d = (pending[octave] - value) * M_SQRT1_2;
+			has_pending[octave] = false;
+			sumD[octave] += d * d;
+			sumC[octave] += c * c;
+			count[octave]++;
+			value = c;
+		}
+	}
+
+	std::vector<double> pending;      /* approximation waiting for its pair */
+	std::vector<bool> has_pending;
+	std::vector<double> sumD;         /* sum of squared detail coefficients */
+	std::vector<double> sumC;         /* sum of squared approximation coefficients */
+	std::vector<uint64_t> count;      /* coefficient pairs */
+	std::vector<double> block;        /* values not yet transformed */
+};
+
+#endif /* HAAR_H */
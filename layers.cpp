@@ -0,0 +1,385 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "layers.hpp"
+
+#include <atomic>
+#include <cinttypes>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+
+extern const char* program_name;
+
+static uint16_t be16(const uint8_t* ptr){
+	return (uint16_t)((ptr[0] << 8) | ptr[1]);
+}
+
+/**
+ * Decoded link layer payload: the protocol and its offset in the frame.
+ */
+struct link_state {
+	const uint8_t* ptr;
+	const uint8_t* end;               /* end of captured data */
+	uint16_t type;                    /* ethertype */
+};
+
+enum LinkResult {
+	LINK_NEXT,                        /* another header follows, decode type */
+	LINK_TRUNCATED,
+	LINK_UNKNOWN,                     /* MPLS payload isn't IP */
+};
+
+/**
+ * Skip a VLAN tag (802.1Q, 802.1ad and the pre-standard QinQ type).
+ */
+static enum LinkResult link_vlan(struct link_state* state){
+	if ( state->ptr + 4 > state->end ) return LINK_TRUNCATED;
+	state->type = be16(state->ptr + 2);
+	state->ptr += 4;
+	return LINK_NEXT;
+}
+
+/**
+ * Skip an MPLS label stack. The payload has no type field so it is assumed
+ * to be IP and the version nibble decides which.
+ */
+static enum LinkResult link_mpls(struct link_state* state){
+	for (;;){
+		if ( state->ptr + 4 > state->end ) return LINK_TRUNCATED;
+		const bool bottom = state->ptr[2] & 0x01;
+		state->ptr += 4;
+		if ( bottom ) break;
+	}
+
+	if ( state->ptr + 1 > state->end ) return LINK_TRUNCATED;
+	switch ( state->ptr[0] >> 4 ){
+	case 4: state->type = 0x0800; return LINK_NEXT;
+	case 6: state->type = 0x86dd; return LINK_NEXT;
+	default: return LINK_UNKNOWN;
+	}
+}
+
+/**
+ * Decoded network layer payload.
+ */
+struct network_state {
+	const uint8_t* ptr;               /* network header, then transport header */
+	const uint8_t* end;
+	size_t payload;                   /* bytes after the network headers */
+	uint8_t proto;                    /* transport protocol */
+	bool fragment;                    /* not the first fragment, i.e. no transport header */
+};
+
+enum NetworkResult {
+	NETWORK_DONE,
+	NETWORK_TRUNCATED,
+	NETWORK_MALFORMED,
+	NETWORK_ENCRYPTED,                /* ESP, the transport header can't be read */
+};
+
+static enum NetworkResult network_ipv4(struct network_state* state){
+	const uint8_t* ip = state->ptr;
+	if ( ip + 20 > state->end ) return NETWORK_TRUNCATED;
+
+	const size_t header = 4 * (ip[0] & 0x0f);
+	const size_t total = be16(ip + 2);
+	if ( header < 20 || total < header ) return NETWORK_MALFORMED;
+
+	state->payload = total - header;
+	state->proto = ip[9];
+	state->fragment = (be16(ip + 6) & 0x1fff) != 0;
+	state->ptr = ip + header;
+	return NETWORK_DONE;
+}
+
+static enum NetworkResult network_ipv6(struct network_state* state){
+	const uint8_t* ip = state->ptr;
+	if ( ip + 40 > state->end ) return NETWORK_TRUNCATED;
+
+	size_t payload = be16(ip + 4);
+	uint8_t next = ip[6];
+	const uint8_t* ptr = ip + 40;
+
+	/* extension headers */
+	for (;;){
+		size_t len;
+		switch ( next ){
+		case 0:   /* hop-by-hop options */
+		case 43:  /* routing */
+		case 60:  /* destination options */
+		case 135: /* mobility */
+			if ( ptr + 2 > state->end ) return NETWORK_TRUNCATED;
+			len = 8 * (ptr[1] + 1);
+			break;
+
+		case 44:  /* fragment */
+			if ( ptr + 8 > state->end ) return NETWORK_TRUNCATED;
+			len = 8;
+			if ( (be16(ptr + 2) & 0xfff8) != 0 ){
+				state->fragment = true;
+			}
+			break;
+
+		case 51:  /* authentication header */
+			if ( ptr + 2 > state->end ) return NETWORK_TRUNCATED;
+			len = 4 * (ptr[1] + 2);
+			break;
+
+		case 50:  /* ESP */
+			state->payload = payload;
+			state->proto = next;
+			state->ptr = ptr;
+			return NETWORK_ENCRYPTED;
+
+		default:
+			state->payload = payload;
+			state->proto = next;
+			state->ptr = ptr;
+			return NETWORK_DONE;
+		}
+
+		if ( len > payload ) return NETWORK_MALFORMED;
+		payload -= len;
+		next = ptr[0];
+		ptr += len;
+	}
+}
+
+typedef enum LinkResult (*link_func)(struct link_state* state);
+typedef enum NetworkResult (*network_func)(struct network_state* state);
+
+struct ethertype_entry { uint16_t type; const char* name; link_func link; network_func network; };
+static const struct ethertype_entry ethertype_lut[] = {
+	{0x0800, "IPv4",      nullptr,   network_ipv4},
+	{0x86dd, "IPv6",      nullptr,   network_ipv6},
+	{0x8100, "802.1Q",    link_vlan, nullptr},
+	{0x88a8, "802.1ad",   link_vlan, nullptr},
+	{0x9100, "QinQ",      link_vlan, nullptr},
+	{0x8847, "MPLS",      link_mpls, nullptr},
+	{0x8848, "MPLS",      link_mpls, nullptr},
+	{0x0806, "ARP",       nullptr,   nullptr},
+	{0x8035, "RARP",      nullptr,   nullptr},
+	{0x88cc, "LLDP",      nullptr,   nullptr},
+	{0x8863, "PPPoE",     nullptr,   nullptr},
+	{0x8864, "PPPoE",     nullptr,   nullptr},
+	{0x88e5, "MACsec",    nullptr,   nullptr},
+	{0x8809, "Slow",      nullptr,   nullptr},
+	{0x88f7, "PTP",       nullptr,   nullptr},
+	{0, nullptr, nullptr, nullptr} /* sentinel */
+};
+
+/**
+ * Get the size of the transport header.
+ * @return false if the header isn't captured.
+ */
+typedef bool (*transport_func)(const uint8_t* ptr, const uint8_t* end, size_t* header);
+
+static bool transport_tcp(const uint8_t* ptr, const uint8_t* end, size_t* header){
+	if ( ptr + 13 > end ) return false;
+	const size_t offset = ptr[12] >> 4;
+	*header = offset >= 5 ? 4 * offset : SIZE_MAX; /* SIZE_MAX is reported as malformed */
+	return true;
+}
+
+template <size_t N>
+static bool transport_fixed(const uint8_t* ptr, const uint8_t* end, size_t* header){
+	*header = N;
+	return true;
+}
+
+struct proto_entry { uint8_t proto; const char* name; transport_func header; };
+static const struct proto_entry proto_lut[] = {
+	{6,   "TCP",      transport_tcp},
+	{17,  "UDP",      transport_fixed<8>},
+	{136, "UDP-Lite", transport_fixed<8>},
+	{132, "SCTP",     transport_fixed<12>},
+	{1,   "ICMP",     transport_fixed<8>},
+	{58,  "ICMPv6",   transport_fixed<4>},
+	{2,   "IGMP",     transport_fixed<8>},
+	{59,  "none",     transport_fixed<0>}, /* IPv6 no next header */
+	{50,  "ESP",      nullptr},
+	{47,  "GRE",      nullptr},
+	{4,   "IPIP",     nullptr},
+	{41,  "IPv6",     nullptr},
+	{89,  "OSPF",     nullptr},
+	{103, "PIM",      nullptr},
+	{112, "VRRP",     nullptr},
+	{0, nullptr, nullptr} /* sentinel */
+};
+
+#define NUM_ETHERTYPES (sizeof(ethertype_lut) / sizeof(ethertype_lut[0]) - 1)
+#define NUM_PROTOS (sizeof(proto_lut) / sizeof(proto_lut[0]) - 1)
+
+/* reasons for stopping, the named protocols of the tables follow */
+enum Reason {
+	REASON_NONE = 0,
+	REASON_TRUNCATED,
+	REASON_MALFORMED,
+	REASON_LLC,
+	REASON_MPLS,
+	REASON_ETHERTYPE,                 /* not in ethertype_lut */
+	REASON_PROTO,                     /* not in proto_lut */
+	REASON_NAMED_ETHERTYPE,
+	REASON_NAMED_PROTO = REASON_NAMED_ETHERTYPE + NUM_ETHERTYPES,
+	NUM_REASONS = REASON_NAMED_PROTO + NUM_PROTOS,
+};
+
+static const char* reason_name(int reason){
+	switch ( reason ){
+	case REASON_TRUNCATED: return "truncated headers";
+	case REASON_MALFORMED: return "malformed headers";
+	case REASON_LLC:       return "802.3/LLC (e.g. STP)";
+	case REASON_MPLS:      return "MPLS non-IP payload";
+	case REASON_ETHERTYPE: return "other ethertype";
+	case REASON_PROTO:     return "other IP protocol";
+	}
+
+	if ( reason >= REASON_NAMED_PROTO ){
+		return proto_lut[reason - REASON_NAMED_PROTO].name;
+	}
+	return ethertype_lut[reason - REASON_NAMED_ETHERTYPE].name;
+}
+
+static const struct ethertype_entry* find_ethertype(uint16_t type){
+	const struct ethertype_entry* cur = ethertype_lut;
+	while ( cur->name && cur->type != type ){
+		cur++;
+	}
+	return cur->name ? cur : nullptr;
+}
+
+static const struct proto_entry* find_proto(uint8_t proto){
+	const struct proto_entry* cur = proto_lut;
+	while ( cur->name && cur->proto != proto ){
+		cur++;
+	}
+	return cur->name ? cur : nullptr;
+}
+
+void decode_layers(const cap_head* cp, enum Level max_level, struct layer_sizes* sizes){
+	memset(sizes, 0, sizeof(struct layer_sizes));
+	sizes->size[LEVEL_PHYSICAL] = layer_size(LEVEL_PHYSICAL, cp);
+	sizes->size[LEVEL_LINK] = cp->len;
+	sizes->depth = LEVEL_LINK;
+	if ( max_level <= LEVEL_LINK ) return;
+
+	/* link layer */
+	const uint8_t* frame = (const uint8_t*)cp->payload;
+	struct link_state link = {frame + 14, frame + cp->caplen, 0};
+	if ( cp->caplen < 14 ){
+		sizes->reason = REASON_TRUNCATED;
+		return;
+	}
+	link.type = be16(frame + 12);
+
+	const struct ethertype_entry* ethertype = nullptr;
+	for (;;){
+		if ( link.type < 0x0600 ){
+			ethertype = nullptr; /* 802.3 length field */
+			break;
+		}
+
+		ethertype = find_ethertype(link.type);
+		if ( !ethertype || !ethertype->link ) break;
+
+		const enum LinkResult ret = ethertype->link(&link);
+		if ( ret == LINK_TRUNCATED ){
+			sizes->reason = REASON_TRUNCATED;
+			return;
+		} else if ( ret == LINK_UNKNOWN ){
+			ethertype = nullptr;
+			sizes->reason = REASON_MPLS;
+			break;
+		}
+	}
+
+	const size_t link_header = link.ptr - frame;
+	if ( link_header > cp->len ){
+		sizes->reason = REASON_MALFORMED;
+		return;
+	}
+	sizes->size[LEVEL_NETWORK] = cp->len - link_header;
+	sizes->depth = LEVEL_NETWORK;
+	if ( max_level <= LEVEL_NETWORK ) return;
+
+	/* network layer */
+	if ( !ethertype || !ethertype->network ){
+		if ( sizes->reason != REASON_NONE ){
+			/* already set */
+		} else if ( link.type < 0x0600 ){
+			sizes->reason = REASON_LLC;
+		} else if ( ethertype ){
+			sizes->reason = REASON_NAMED_ETHERTYPE + (ethertype - ethertype_lut);
+		} else {
+			sizes->reason = REASON_ETHERTYPE;
+		}
+		return;
+	}
+
+	struct network_state network = {link.ptr, link.end, 0, 0, false};
+	const enum NetworkResult ret = ethertype->network(&network);
+	switch ( ret ){
+	case NETWORK_TRUNCATED: sizes->reason = REASON_TRUNCATED; return;
+	case NETWORK_MALFORMED: sizes->reason = REASON_MALFORMED; return;
+	case NETWORK_DONE:
+	case NETWORK_ENCRYPTED:
+		break;
+	}
+	sizes->size[LEVEL_TRANSPORT] = network.payload;
+	sizes->depth = LEVEL_TRANSPORT;
+	if ( max_level <= LEVEL_TRANSPORT ) return;
+
+	/* transport layer, later fragments only carry application data */
+	if ( network.fragment ){
+		sizes->size[LEVEL_APPLICATION] = network.payload;
+		sizes->depth = LEVEL_APPLICATION;
+		return;
+	}
+
+	const struct proto_entry* proto = find_proto(network.proto);
+	if ( !proto || !proto->header ){
+		sizes->reason = proto ? REASON_NAMED_PROTO + (proto - proto_lut) : REASON_PROTO;
+		return;
+	}
+
+	size_t header;
+	if ( !proto->header(network.ptr, network.end, &header) ){
+		sizes->reason = REASON_TRUNCATED;
+		return;
+	} else if ( header > network.payload ){
+		sizes->reason = REASON_MALFORMED;
+		return;
+	}
+	sizes->size[LEVEL_APPLICATION] = network.payload - header;
+	sizes->depth = LEVEL_APPLICATION;
+}
+
+static std::atomic<uint64_t> layer_stats[NUM_REASONS];
+static std::once_flag layer_stats_once;
+
+static void layer_stats_atexit(){
+	layer_stats_report(stderr);
+}
+
+void layer_stats_add(const struct layer_sizes* sizes){
+	std::call_once(layer_stats_once, [](){ atexit(layer_stats_atexit); });
+	layer_stats[sizes->reason].fetch_add(1, std::memory_order_relaxed);
+}
+
+void layer_stats_report(FILE* dst){
+	uint64_t total = 0;
+	for ( int i = 0; i < NUM_REASONS; i++ ){
+		total += layer_stats[i].load(std::memory_order_relaxed);
+	}
+	if ( total == 0 ) return;
+
+	fprintf(dst, "%s: %" PRIu64 " packets couldn't be decoded to the selected level and were counted as 0 bytes:\n", program_name, total);
+	for ( int i = 0; i < NUM_REASONS; i++ ){
+		const uint64_t n = layer_stats[i].load(std::memory_order_relaxed);
+		if ( n == 0 ) continue;
+		fprintf(dst, "  %-24s %" PRIu64 "\n", reason_name(i), n);
+	}
+}
@@ -0,0 +1,45 @@
+#ifndef LAYERS_H
+#define LAYERS_H
+
+#include <caputils/caputils.h>
+#include <caputils/packet.h>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+
+/**
+ * Size of a packet at each level, see the --level usage text:
+ *
+ *   link         all captured bits, i.e. the frame length
+ *   network      payload of the link layer (after VLAN tags and MPLS labels)
+ *   transport    payload of the network layer (after IPv6 extension headers)
+ *   application  payload of the transport layer
+ *
+ * Levels deeper than depth couldn't be decoded and have size 0, which is
+ * also what libcap_utils' layer_size returns for them.
+ */
+struct layer_sizes {
+	size_t size[LEVEL_APPLICATION + 1];  /* bytes, indexed by enum Level */
+	enum Level depth;                    /* deepest level with a known size */
+	int reason;                          /* why decoding stopped, index into the layer stats */
+};
+
+/**
+ * Parse the headers of a packet once and calculate the size at every level
+ * up to max_level.
+ */
+void decode_layers(const cap_head* cp, enum Level max_level, struct layer_sizes* sizes);
+
+/**
+ * Count a packet whose size at the selected level couldn't be decoded, by
+ * reason. The counters are shared by all threads and written to stderr at
+ * exit instead of logging each packet.
+ */
+void layer_stats_add(const struct layer_sizes* sizes);
+
+/**
+ * Write the number of packets which couldn't be decoded, per reason.
+ */
+void layer_stats_report(FILE* dst);
+
+#endif /* LAYERS_H */
@@ -0,0 +1,415 @@
+#ifndef OUTPUT_H
+#define OUTPUT_H
+
+#include <cstdio>
+#include <cstdint>
+#include <cinttypes>
+#include <cmath>
+#include <string>
+#include <functional>
+#include <cstring>
+#include <new>
+#include <vector>
+
+#include "extract.hpp"
+#include "samplefile.hpp"
+#include "shmring.hpp"
+#include "rrstore.hpp"
+
+/**
+ * printf conversions for sample values.
+ */
+template <typename T> struct sample_format;
+
+template <> struct sample_format<double> {
+	static const char* column(){ return "%.15f"; }
+	static const char* padded(){ return "%.15f"; }
+	typedef double binary_type;
+	static const enum SampleValue binary = SAMPLE_DOUBLE;
+};
+
+template <> struct sample_format<unsigned long> {
+	static const char* column(){ return "%ld"; }
+	static const char* padded(){ return "%10ld"; }
+	typedef uint64_t binary_type;
+	static const enum SampleValue binary = SAMPLE_U64;
+};
+
+/**
+ * Writes a series of (time, value) samples.
+ */
+template <typename T>
+class Output {
+public:
+	Output(const char* label, FILE* dst)
+		: label(label)
+		, dst(dst) {
+
+	}
+
+	virtual ~Output(){}
+
+	virtual void write_header(const struct sample_info& info){};
+	virtual void write_trailer(){};
+
+	/**
+	 * Start of the first interval (the time of the first packet), written
+	 * once it is read, see reference_time.
+	 */
+	virtual void write_reference(uint64_t sec, uint64_t psec){};
+
+	virtual void write_sample(double t, T value) = 0;
+
+	/**
+	 * Write the same value for N consecutive samples.
+	 * @param time Timestamp of the i:th sample.
+	 */
+	virtual void write_run(uint64_t n, T value, const std::function<double(uint64_t)>& time){
+		for ( uint64_t i = 0; i < n; i++ ){
+			write_sample(time(i), value);
+		}
+	}
+
+protected:
+	const char* label;
+	FILE* dst;
+};
+
+template <typename T>
+class DefaultOutput: public Output<T> {
+public:
+	DefaultOutput(const char* label, FILE* dst = stdout)
+		: Output<T>(label, dst)
+		, format(std::string("%.15f\t") + sample_format<T>::padded() + "\n") {
+
+	}
+
+	virtual void write_header(const struct sample_info& info){
+		fprintf(this->dst, "sampleFrequency: %.2fHz\n", info.sampleFrequency);
+		fprintf(this->dst, "tSample:         %fs\n", info.tSample);
+		fprintf(this->dst, "\n");
+		fprintf(this->dst, "Time                      \t   %s\n", this->label);
+	}
+
+	virtual void write_sample(double t, T value){
+		fprintf(this->dst, format.c_str(), t, value);
+	}
+
+private:
+	const std::string format;
+};
+
+template <typename T>
+class CSVOutput: public Output<T> {
+public:
+	CSVOutput(const char* label, char delimiter, bool show_header, FILE* dst = stdout)
+		: Output<T>(label, dst)
+		, delimiter(delimiter)
+		, show_header(show_header)
+		, format(std::string("%.15f%c") + sample_format<T>::column() + "\n") {
+
+	}
+
+	virtual void write_header(const struct sample_info& info){
+		if ( show_header ){
+			fprintf(this->dst, "\"Time (tSample: %f)\"%c\"%s\"\n", info.tSample, delimiter, this->label);
+		}
+	}
+
+	virtual void write_sample(double t, T value){
+		fprintf(this->dst, format.c_str(), t, delimiter, value);
+	}
+
+private:
+	char delimiter;
+	bool show_header;
+	const std::string format;
+};
+
+/**
+ * Collapses consecutive samples with the same value into a single
+ * (index, count, value) record, where index is the interval of the first
+ * sample counted from the reference time. Expand with samplecat, which
+ * regenerates the timestamps exactly as the extractor does.
+ */
+template <typename T>
+class RLEOutput: public Output<T> {
+public:
+	RLEOutput(const char* label, FILE* dst = stdout)
+		: Output<T>(label, dst)
+		, format(std::string("%lu\t%lu\t") + sample_format<T>::column() + "\n")
+		, tSample(0.0)
+		, relative_time(false)
+		, ref_time(0.0)
+		, start(0)
+		, count(0)
+		, value(0) {
+
+	}
+
+	virtual ~RLEOutput(){
+		flush();
+	}
+
+	virtual void write_header(const struct sample_info& info){
+		tSample = info.tSample;
+		relative_time = info.relative_time;
+		fprintf(this->dst, "# run-length encoded samples\n");
+		fprintf(this->dst, "# sampleFrequency: %.17g\n", info.sampleFrequency);
+		fprintf(this->dst, "# tSample: %.17g\n", info.tSample);
+		fprintf(this->dst, "# relative: %d\n", info.relative_time ? 1 : 0);
+		fprintf(this->dst, "# Index\tCount\t%s\n", this->label);
+	}
+
+	virtual void write_trailer(){
+		flush();
+	}
+
+	virtual void write_reference(uint64_t sec, uint64_t psec){
+		flush();
+		ref_time = reference_time(sec, psec);
+		fprintf(this->dst, "# reference: %" PRIu64 " %" PRIu64 "\n", sec, psec);
+	}
+
+	virtual void write_sample(double t, T value){
+		const unsigned long index = interval(t);
+		if ( !continues(index, value) ){
+			flush();
+			start = index;
+			this->value = value;
+		}
+		count++;
+	}
+
+	virtual void write_run(uint64_t n, T value, const std::function<double(uint64_t)>& time){
+		if ( n == 0 ) return;
+		write_sample(time(0), value);
+		count += n - 1;
+	}
+
+private:
+	/**
+	 * Interval a sample timestamp belongs to. The timestamps are within an
+	 * ulp of the exact interval start so rounding recovers the index.
+	 */
+	unsigned long interval(double t) const {
+		const qd_real offset = relative_time ? qd_real(t) : qd_real(t) - ref_time;
+		return (unsigned long)llround(to_double(offset) / tSample);
+	}
+
+	/**
+	 * Tells if the sample is next in the current run. Samples might be left out
+	 * (e.g. zeros) so the index must follow as well.
+	 */
+	bool continues(unsigned long index, T value) const {
+		return count > 0 && value == this->value && index == start + count;
+	}
+
+	void flush(){
+		if ( count == 0 ) return;
+		fprintf(this->dst, format.c_str(), start, count, value);
+		count = 0;
+	}
+
+	const std::string format;
+	double tSample;
+	bool relative_time;
+	qd_real ref_time;
+	unsigned long start;              /* index of the first sample in the run */
+	unsigned long count;
+	T value;
+};
+
+/**
+ * Header of a binary series of T sampled as described by info.
+ */
+template <typename T>
+struct samplefile_header series_header(const struct sample_info& info){
+	struct samplefile_header header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, SAMPLEFILE_MAGIC, 8);
+	header.version = SAMPLEFILE_VERSION;
+	header.kind = SAMPLE_SERIES;
+	header.value_type = sample_format<T>::binary;
+	header.time_exponent = info.relative_time ? -12 : -9;
+	header.level = info.level;
+	header.relative_time = info.relative_time;
+	header.link_capacity = info.link_capacity;
+	header.sampleFrequency = info.sampleFrequency;
+	header.tSample = info.tSample;
+	return header;
+}
+
+/**
+ * Fixed-size little-endian records, see samplefile.hpp. Timestamps are the
+ * same instants as in the text formats, rounded to whole nanoseconds
+ * (picoseconds for relative time).
+ */
+template <typename T>
+class BinaryOutput: public Output<T> {
+public:
+	BinaryOutput(const char* label, FILE* dst = stdout)
+		: Output<T>(label, dst)
+		, writer(dst) {
+
+		memset(&header, 0, sizeof(header));
+	}
+
+	virtual void write_header(const struct sample_info& info){
+		header = series_header<T>(info);
+		writer.write_header(header);
+	}
+
+	virtual void write_sample(double t, T value){
+		writer.write_sample(samplefile_time(&header, t), (typename sample_format<T>::binary_type)value);
+	}
+
+private:
+	SampleWriter writer;
+	struct samplefile_header header;
+};
+
+/**
+ * Publishes the samples to a shared-memory ring, see shmring.hpp. The ring is
+ * created by the first header, later streams keep writing to it.
+ */
+template <typename T>
+class ShmOutput: public Output<T> {
+public:
+	/**
+	 * @param name Ring name, "/PROGRAM" if NULL.
+	 */
+	ShmOutput(const char* label, const char* name = nullptr)
+		: Output<T>(label, nullptr)
+		, name(name ? name : std::string("/") + program_name) {
+
+		memset(&header, 0, sizeof(header));
+	}
+
+	virtual void write_header(const struct sample_info& info){
+		if ( ring.is_open() ) return;
+
+		header = series_header<T>(info);
+		const int ret = ring.open(name.c_str(), header);
+		if ( ret != 0 ){
+			fprintf(stderr, "%s: shared memory %s: %s\n", program_name, name.c_str(), strerror(ret));
+		}
+	}
+
+	virtual void write_sample(double t, T value){
+		if ( !ring.is_open() ) return;
+		ring.write_sample(samplefile_time(&header, t), (typename sample_format<T>::binary_type)value);
+	}
+
+private:
+	const std::string name;
+	ShmRingWriter ring;
+	struct samplefile_header header;
+};
+
+/**
+ * Keeps the samples in round-robin archives and answers queries for them on
+ * a Unix socket, see rrstore.hpp. The archives are allocated and the socket
+ * opened by the first header, later streams keep adding to them. Archives
+ * finer than the sampling interval are left out.
+ */
+template <typename T>
+class RoundRobinOutput: public Output<T> {
+public:
+	/**
+	 * @param path Socket, "/tmp/PROGRAM.sock" if NULL.
+	 * @param archives Archive list, RRSTORE_ARCHIVES if NULL.
+	 */
+	RoundRobinOutput(const char* label, const char* path = nullptr, const char* archives = nullptr)
+		: Output<T>(label, nullptr)
+		, path(path ? path : std::string("/tmp/") + program_name + ".sock")
+		, archives(archives ? archives : RRSTORE_ARCHIVES)
+		, store(nullptr)
+		, server(nullptr) {
+
+	}
+
+	virtual ~RoundRobinOutput(){
+		delete server;
+		delete store;
+	}
+
+	virtual void write_header(const struct sample_info& info){
+		if ( store ) return;
+
+		std::vector<struct rr_archive_spec> spec;
+		if ( !rrstore_parse(archives.c_str(), &spec) ){
+			fprintf(stderr, "%s: invalid archives \"%s\", using %s.\n", program_name, archives.c_str(), RRSTORE_ARCHIVES);
+			rrstore_parse(RRSTORE_ARCHIVES, &spec);
+		}
+
+		/* bins finer than the samples would mostly be empty */
+		for ( auto cur = spec.begin(); cur != spec.end(); ){
+			if ( cur->resolution < info.tSample * (1 - 1e-9) ){
+				fprintf(stderr, "%s: archive %s is finer than the sampling interval, skipped.\n", program_name, cur->name.c_str());
+				cur = spec.erase(cur);
+			} else {
+				++cur;
+			}
+		}
+		if ( spec.empty() ){
+			fprintf(stderr, "%s: no archive left for %s, not serving queries.\n", program_name, path.c_str());
+			return;
+		}
+
+		try {
+			store = new RoundRobinStore(spec, this->label, info.tSample);
+		} catch ( std::bad_alloc& ){
+			fprintf(stderr, "%s: not enough memory for archives %s.\n", program_name, archives.c_str());
+			return;
+		}
+
+		server = new RoundRobinServer(store);
+		const int ret = server->start(path.c_str());
+		if ( ret != 0 ){
+			fprintf(stderr, "%s: %s: %s\n", program_name, path.c_str(), strerror(ret));
+			return;
+		}
+		fprintf(stderr, "%s: serving queries on %s (%.1f MiB of archives)\n", program_name, path.c_str(), store->memory() / 1048576.0);
+	}
+
+	virtual void write_sample(double t, T value){
+		if ( !store ) return;
+		store->add(t, (double)value);
+	}
+
+private:
+	const std::string path;
+	const std::string archives;
+	RoundRobinStore* store;
+	RoundRobinServer* server;
+};
+
+/**
+ * Header for a sample store holding quantity sampled as described by info.
+ */
+inline struct samplefile_header store_header(const struct sample_info& info, enum SampleQuantity quantity){
+	struct samplefile_header header;
+	memset(&header, 0, sizeof(header));
+	header.time_exponent = info.relative_time ? -12 : -9;
+	header.level = info.level;
+	header.relative_time = info.relative_time;
+	header.link_capacity = info.link_capacity;
+	header.sampleFrequency = info.sampleFrequency;
+	header.tSample = info.tSample;
+	header.quantity = quantity;
+	return header;
+}
+
+/**
+ * Set the sampling parameters of app to those a sample store was written
+ * with.
+ */
+inline void set_store_parameters(Extractor& app, const struct samplefile_header& header){
+	app.set_sampling_frequency(header.sampleFrequency);
+	app.set_extraction_level((enum Level)header.level);
+	app.set_link_capacity((unsigned long)header.link_capacity);
+	app.set_relative_time(header.relative_time != 0);
+}
+
+#endif /* OUTPUT_H */
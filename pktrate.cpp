@@ -12,11 +12,16 @@
 #include <iostream>
 #include <iomanip>
 #include <getopt.h>
+#include <unistd.h>
+#include <pthread.h>
 
-#include "extract.hpp"
+#include "pktrate.hpp"
+#include "stats.hpp"
 
 static int show_zero = 0;
 static const char* iface = NULL;
+static bool live = false;
+static double lateness = LIVE_LATENESS;
 const char* program_name = NULL;
 
 static void handle_sigint(int signum){
@@ -28,110 +33,18 @@ static void handle_sigint(int signum){
 	keep_running = false;
 }
 
-class Output {
-public:
-	virtual void write_header(double sampleFrequency, double tSample){};
-	virtual void write_trailer(){};
-	virtual void write_sample(double t, unsigned long pkts) = 0;
-};
-
-class DefaultOutput: public Output {
-public:
-	virtual void write_header(double sampleFrequency, double tSample){
-		fprintf(stdout, "sampleFrequency: %.2fHz\n", sampleFrequency);
-		fprintf(stdout, "tSample:         %fs\n", tSample);
-		fprintf(stdout, "\n");
-		fprintf(stdout, "Time                      \t   Packets\n");
-	}
-
-	virtual void write_sample(double t, unsigned long pkts){
-		fprintf(stdout, "%.15f\t%10ld\n", t, pkts);
-	}
-};
-
-class CSVOutput: public Output {
-public:
-	CSVOutput(char delimiter, bool show_header)
-		: delimiter(delimiter)
-		, show_header(show_header){
-
-	}
-
-	virtual void write_header(double sampleFrequency, double tSample){
-		if ( show_header ){
-			fprintf(stdout, "\"Time (tSample: %f)\"%c\"Packets\"\n", tSample, delimiter);
-		}
-	}
-
-	virtual void write_sample(double t, unsigned long pkts){
-		fprintf(stdout, "%.15f%c%ld\n", t, delimiter, pkts);
-	}
-
-private:
-	char delimiter;
-	bool show_header;
-};
-
-class PacketRate: public Extractor {
-public:
-	PacketRate()
-		: Extractor()
-		, pkts(0){
-
-		set_formatter(FORMAT_DEFAULT);
-	}
-
-	virtual void set_formatter(enum Formatter format){
-		switch (format){
-		case FORMAT_DEFAULT: output = new DefaultOutput; break;
-		case FORMAT_CSV:     output = new CSVOutput(';', false); break;
-		case FORMAT_TSV:     output = new CSVOutput('\t', false); break;
-		case FORMAT_MATLAB:  output = new CSVOutput('\t', true); break;
-		}
-	}
-
-	using Extractor::set_formatter;
-
-	virtual void reset(){
-		pkts = 0;
-		Extractor::reset();
-	}
-
-protected:
-	virtual void write_header(int index){
-		output->write_header(sampleFrequency, to_double(tSample));
-	}
-
-	virtual void write_trailer(int index){
-		output->write_trailer();
-	}
-
-	virtual void write_sample(double t){
-		if ( show_zero || pkts > 0 ){
-			output->write_sample(t, pkts);
-		}
-
-		pkts = 0;
-	}
-
-	virtual void accumulate(qd_real fraction, unsigned long packet_bits, const cap_head* cp, int counter){
-		if ( counter == 1 ){
-			pkts += 1;
-		}
-	}
-
-private:
-	Output* output;
-	unsigned long pkts;
-};
-
-static const char* short_options = "p:i:q:m:f:zxtTh";
+static const char* short_options = "p:i:q:m:f:e:A:j:PL::zxtTh";
 static struct option long_options[]= {
 	{"packets",          required_argument, 0, 'p'},
 	{"iface",            required_argument, 0, 'i'},
 	{"level",            required_argument, 0, 'q'},
 	{"sampleFrequency",  required_argument, 0, 'm'},
 	{"format",           required_argument, 0, 'f'},
+	{"engine",           required_argument, 0, 'e'},
+	{"archives",         required_argument, 0, 'A'},
+	{"jobs",             required_argument, 0, 'j'},
+	{"pipeline",         no_argument,       0, 'P'},
+	{"live",             optional_argument, 0, 'L'},
 	{"show-zero",        no_argument,       0, 'z'},
 	{"no-show-zero",     no_argument,       0, 'x'},
 	{"relative-time",    no_argument,       0, 't'},
@@ -160,13 +73,24 @@ static void show_usage(void){
 	       "  -z, --show-zero             Show bitrate when zero.\n"
 	       "  -x, --no-show-zero          Don't show bitrate when zero [default]\n"
 	       "  -f, --format=FORMAT         Set a specific output format. See below for list of supported formats.\n"
+	       "  -e, --engine=ENGINE         Time arithmetic used for sampling, see below [default: qd].\n"
+	       "  -A, --archives=LIST         Round-robin archives kept by --format=rrd as RESOLUTION:RETENTION pairs\n"
+	       "                              [default: %s]. Every interval is kept (as --show-zero) and the archives\n"
+	       "                              are served on /tmp/pktrate.sock until interrupted, see rrstore.hpp.\n"
+	       "  -j, --jobs=N                Split the stream into time shards processed by N threads.\n"
+	       "                              The output is identical to a single thread. Not supported with rle.\n"
+	       "  -P, --pipeline              Read, calculate and write in separate threads and show which stage is the bottleneck.\n"
+	       "  -L, --live[=MS]             Write each sample when the clock passes the end of its interval plus MS milliseconds\n"
+	       "                              of allowed lateness [default: %g], instead of when the next packet arrives.\n"
 	       "  -t, --relative-time         Show timestamps relative to the first packet.\n"
 	       "  -T, --absolute-time         Show timestamps with absolute values (default).\n"
-	       "  -h, --help                  This text.\n\n");
+	       "  -h, --help                  This text.\n\n", RRSTORE_ARCHIVES, LIVE_LATENESS);
 
 
 	output_format_list();
+	output_engine_list();
 	filter_from_argv_usage();
+	stats_from_argv_usage();
 }
 
 int main(int argc, char **argv){
@@ -182,8 +106,13 @@ int main(int argc, char **argv){
 	if ( filter_from_argv(&argc, argv, &filter) != 0 ){
 		return 0; /* error already shown */
 	}
+	if ( stats_from_argv(&argc, argv) != 0 ){
+		return 1;
+	}
 
 	PacketRate app;
+	int jobs = 1;
+	bool pipeline = false;
 
 	int op, option_index = -1;
 	while ( (op = getopt_long(argc, argv, short_options, long_options, &option_index)) != -1 ){
@@ -196,6 +125,18 @@ int main(int argc, char **argv){
 			app.set_formatter(optarg);
 			break;
 
+		case 'e': /* --engine */
+			app.set_time_engine(optarg);
+			break;
+
+		case 'A': /* --archives */
+			if ( rrstore_parse(optarg, nullptr) ){
+				app.set_archives(optarg);
+			} else {
+				fprintf(stderr, "%s: invalid --archives \"%s\", using %s.\n", program_name, optarg, RRSTORE_ARCHIVES);
+			}
+			break;
+
 		case 'p':
 			app.set_max_packets(atoi(optarg));
 			break;
@@ -212,6 +153,29 @@ int main(int argc, char **argv){
 			app.set_link_capacity(optarg);
 			break;
 
+		case 'j': /* --jobs */
+			jobs = atoi(optarg);
+			if ( jobs < 1 ){
+				fprintf(stderr, "%s: invalid --jobs \"%s\", using 1.\n", program_name, optarg);
+				jobs = 1;
+			}
+			break;
+
+		case 'P': /* --pipeline */
+			pipeline = true;
+			break;
+
+		case 'L': /* --live */
+			live = true;
+			if ( optarg ){
+				lateness = atof(optarg);
+				if ( lateness < 0.0 ){
+					fprintf(stderr, "%s: invalid --live \"%s\", using %g.\n", program_name, optarg, LIVE_LATENESS);
+					lateness = LIVE_LATENESS;
+				}
+			}
+			break;
+
 		case 'i':
 			iface = optarg;
 			break;
@@ -241,6 +205,24 @@ int main(int argc, char **argv){
 		}
 	}
 
+	if ( live && ( jobs > 1 || pipeline ) ){
+		fprintf(stderr, "%s: --jobs and --pipeline are not supported with --live, ignored.\n", program_name);
+		jobs = 1;
+		pipeline = false;
+	}
+	if ( live ){
+		app.set_live(lateness / 1000.0);
+	}
+
+	/* the archives must account for every interval */
+	const bool serve = app.get_formatter() == FORMAT_RRD;
+	app.set_show_zero(show_zero || serve);
+
+	if ( jobs > 1 && !app.can_shard() ){
+		fprintf(stderr, "%s: --jobs is not supported with rle, shm or rrd output, using 1.\n", program_name);
+		jobs = 1;
+	}
+
 	/* handle C-c */
 	signal(SIGINT, handle_sigint);
 
@@ -254,7 +236,36 @@ int main(int argc, char **argv){
 	stream_print_info(stream, stderr);
 
 	app.reset();
-	app.process_stream(stream, &filter);
+	if ( jobs > 1 ){
+		app.process_stream_sharded(stream, &filter, [&app](FILE* fp){
+			PacketRate* shard = new PacketRate;
+			shard->set_parameters(app);
+			shard->set_output(fp);
+			return shard;
+		}, stdout, jobs);
+	} else if ( pipeline && ( app.get_formatter() == FORMAT_SHM || serve ) ){
+		app.process_stream_pipelined(stream, &filter, stdout, nullptr);
+	} else if ( pipeline ){
+		app.process_stream_pipelined(stream, &filter, stdout, [&app](FILE* fp){ app.set_output(fp); });
+	} else {
+		app.process_stream(stream, &filter);
+	}
+
+	/* keep answering queries for the archives */
+	if ( serve && keep_running ){
+		fprintf(stderr, "%s: end of stream, serving queries until interrupted.\n", program_name);
+
+		/* SIGINT is blocked between testing keep_running and waiting, else
+		 * it could arrive in between and the wait would never return */
+		sigset_t block, old;
+		sigemptyset(&block);
+		sigaddset(&block, SIGINT);
+		pthread_sigmask(SIG_BLOCK, &block, &old);
+		while ( keep_running ){
+			sigsuspend(&old);
+		}
+		pthread_sigmask(SIG_SETMASK, &old, nullptr);
+	}
 
 	/* Release resources */
 	stream_close(stream);
@@ -0,0 +1,150 @@
+#ifndef PKTRATE_H
+#define PKTRATE_H
+
+#include <cstdio>
+#include <string>
+
+#include "extract.hpp"
+#include "output.hpp"
+
+class PacketRate final: public StaticExtractor<PacketRate> {
+	friend class StaticExtractor<PacketRate>;
+
+public:
+	PacketRate()
+		: StaticExtractor()
+		, output(nullptr)
+		, format(FORMAT_DEFAULT)
+		, dst(stdout)
+		, show_zero(false)
+		, archives(RRSTORE_ARCHIVES)
+		, pkts(0){
+
+		set_formatter(FORMAT_DEFAULT);
+	}
+
+	virtual ~PacketRate(){
+		delete output;
+	}
+
+	virtual void set_formatter(enum Formatter format){
+		this->format = format;
+		delete output;
+		switch (format){
+		case FORMAT_DEFAULT: output = new DefaultOutput<unsigned long>(label, dst); break;
+		case FORMAT_CSV:     output = new CSVOutput<unsigned long>(label, ';', false, dst); break;
+		case FORMAT_TSV:     output = new CSVOutput<unsigned long>(label, '\t', false, dst); break;
+		case FORMAT_MATLAB:  output = new CSVOutput<unsigned long>(label, '\t', true, dst); break;
+		case FORMAT_RLE:     output = new RLEOutput<unsigned long>(label, dst); break;
+		case FORMAT_BINARY:  output = new BinaryOutput<unsigned long>(label, dst); break;
+		case FORMAT_SHM:     output = new ShmOutput<unsigned long>(label); break;
+		case FORMAT_RRD:     output = new RoundRobinOutput<unsigned long>(label, nullptr, archives.c_str()); break;
+		}
+	}
+
+	using Extractor::set_formatter;
+
+	enum Formatter get_formatter() const {
+		return format;
+	}
+
+	/**
+	 * Write to dst instead of stdout. The stream is not closed.
+	 */
+	void set_output(FILE* dst){
+		this->dst = dst;
+		set_formatter(format);
+	}
+
+	/**
+	 * Copy sampling parameters and output settings from another instance.
+	 */
+	void set_parameters(const PacketRate& src){
+		Extractor::set_parameters(src);
+		show_zero = src.show_zero;
+		archives = src.archives;
+		set_formatter(src.format);
+	}
+
+	/**
+	 * Tells if the output can be produced by process_stream_sharded.
+	 */
+	bool can_shard() const {
+		return format != FORMAT_RLE && format != FORMAT_SHM && format != FORMAT_RRD;
+	}
+
+	/**
+	 * Archives kept by the rrd format, see rrstore_parse.
+	 */
+	void set_archives(const char* spec){
+		archives = spec;
+		set_formatter(format);
+	}
+
+	/**
+	 * Write samples where no packets arrived.
+	 */
+	void set_show_zero(bool state){
+		show_zero = state;
+	}
+
+	virtual void reset(){
+		pkts = 0;
+		Extractor::reset();
+	}
+
+protected:
+	virtual void write_header(int index){
+		output->write_header(get_sample_info());
+	}
+
+	virtual void write_trailer(int index){
+		output->write_trailer();
+	}
+
+	virtual void write_reference(){
+		output->write_reference(ref_sec, ref_psec);
+	}
+
+	virtual void write_sample(double t){
+		if ( show_zero || pkts > 0 ){
+			output->write_sample(t, pkts);
+			stats_add(STAT_SAMPLES);
+		}
+
+		pkts = 0;
+	}
+
+	virtual void write_empty_samples(uint64_t n){
+		if ( !show_zero ) return;
+
+		output->write_run(n, 0, [this](uint64_t i){
+			return sample_time(i);
+		});
+		stats_add(STAT_SAMPLES, n);
+	}
+
+	virtual void accumulate(qd_real fraction, unsigned long packet_bits, const cap_head* cp, int counter){
+		if ( counter == 1 ){
+			pkts += 1;
+		}
+	}
+
+	virtual void accumulate_samples(qd_real fraction, unsigned long packet_bits, const cap_head* cp, int counter, uint64_t n){
+		/* a packet is only counted in the interval it begins in, which is never
+		 * one of the intervals it covers completely */
+		write_empty_samples(n);
+	}
+
+private:
+	static constexpr const char* label = "Packets";
+
+	Output<unsigned long>* output;
+	enum Formatter format;
+	FILE* dst;
+	bool show_zero;
+	std::string archives;
+	unsigned long pkts;
+};
+
+#endif /* PKTRATE_H */
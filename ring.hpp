@@ -0,0 +1,161 @@
+#ifndef RING_H
+#define RING_H
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <thread>
+#include <vector>
+
+/**
+ * Counters describing how full a ring was, used to find which side of it is
+ * the bottleneck: a producer waiting on a full ring is faster than the
+ * consumer, and vice versa.
+ */
+struct ring_stats {
+	uint64_t items;                   /* number of items passed through */
+	uint64_t occupancy;               /* sum of items queued when an item was added */
+	uint64_t full;                    /* times the producer had to wait */
+	uint64_t empty;                   /* times the consumer had to wait */
+};
+
+/**
+ * Bounded lock-free single-producer/single-consumer ring.
+ *
+ * Slots are reused in place: the producer fills the slot returned by claim()
+ * and hands it over with publish(), the consumer reads the slot returned by
+ * front() and gives it back with release(). Each index is only written by
+ * one side and lives on its own cache line.
+ */
+template <typename T>
+class SPSCRing {
+public:
+	/**
+	 * @param capacity Number of slots, rounded up to a power of two.
+	 */
+	SPSCRing(size_t capacity)
+		: head(0)
+		, tail(0)
+		, closed(false)
+		, tail_cache(0)
+		, producer_stats({0, 0, 0, 0})
+		, head_cache(0)
+		, consumer_stats({0, 0, 0, 0}) {
+
+		size_t n = 2;
+		while ( n < capacity ) n <<= 1;
+		mask = n - 1;
+		slots.resize(n);
+	}
+
+	size_t capacity() const { return mask + 1; }
+
+	/**
+	 * Get the next free slot, waiting while the ring is full.
+	 */
+	T* claim(){
+		const uint64_t h = head.load(std::memory_order_relaxed);
+		if ( h - tail_cache > mask ){
+			tail_cache = tail.load(std::memory_order_acquire);
+			if ( h - tail_cache > mask ){
+				producer_stats.full++;
+				for ( unsigned int i = 0; h - tail_cache > mask; i++ ){
+					backoff(i);
+					tail_cache = tail.load(std::memory_order_acquire);
+				}
+			}
+		}
+		producer_stats.items++;
+		producer_stats.occupancy += h - tail_cache;
+		return &slots[h & mask];
+	}
+
+	/**
+	 * Make the claimed slot available to the consumer.
+	 */
+	void publish(){
+		head.store(head.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+	}
+
+	/**
+	 * No more items will be published.
+	 */
+	void close(){
+		closed.store(true, std::memory_order_release);
+	}
+
+	/**
+	 * Get the oldest published slot, waiting while the ring is empty.
+	 * @return nullptr if the ring is empty and closed.
+	 */
+	T* front(){
+		const uint64_t t = tail.load(std::memory_order_relaxed);
+		if ( t == head_cache ){
+			head_cache = head.load(std::memory_order_acquire);
+			if ( t == head_cache ){
+				consumer_stats.empty++;
+				for ( unsigned int i = 0; t == head_cache; i++ ){
+					/* closed must be read before head to not miss the last items */
+					const bool done = closed.load(std::memory_order_acquire);
+					head_cache = head.load(std::memory_order_acquire);
+					if ( t == head_cache && done ) return nullptr;
+					if ( t == head_cache ) backoff(i);
+				}
+			}
+		}
+		return &slots[t & mask];
+	}
+
+	/**
+	 * Give the slot returned by front() back to the producer.
+	 */
+	void release(){
+		tail.store(tail.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+	}
+
+	/**
+	 * Combined statistics, only valid once both sides are done.
+	 */
+	struct ring_stats stats() const {
+		struct ring_stats s = producer_stats;
+		s.empty = consumer_stats.empty;
+		return s;
+	}
+
+private:
+	/**
+	 * Spin briefly, then yield and finally sleep so an idle stage (e.g. a
+	 * reader waiting for live traffic) doesn't keep a core busy.
+	 */
+	static void backoff(unsigned int i){
+		if ( i < 64 ){
+			return;
+		} else if ( i < 1024 ){
+			std::this_thread::yield();
+		} else {
+			std::this_thread::sleep_for(std::chrono::microseconds(50));
+		}
+	}
+
+	/* written by the producer */
+	alignas(64) std::atomic<uint64_t> head;
+
+	/* written by the consumer */
+	alignas(64) std::atomic<uint64_t> tail;
+
+	alignas(64) std::atomic<bool> closed;
+
+	/* private to the producer */
+	alignas(64) uint64_t tail_cache;
+	struct ring_stats producer_stats;
+
+	/* private to the consumer */
+	alignas(64) uint64_t head_cache;
+	struct ring_stats consumer_stats;
+
+	size_t mask;
+	std::vector<T> slots;
+};
+
+#endif /* RING_H */
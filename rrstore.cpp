@@ -0,0 +1,547 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "rrstore.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cinttypes>
+#include <climits>
+#include <cmath>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+static const int64_t NO_BIN = INT64_MIN;
+
+double rrstore_duration(const char* str){
+	static const struct { const char* suffix; double scale; } unit_lut[] = {
+		{"",   1.0},
+		{"us", 1e-6},
+		{"ms", 1e-3},
+		{"s",  1.0},
+		{"m",  60.0},
+		{"h",  3600.0},
+		{"d",  86400.0},
+		{nullptr, 0.0} /* sentinel */
+	};
+
+	char* end;
+	const double value = strtod(str, &end);
+	if ( end == str || !(value > 0.0) ){
+		return -1.0;
+	}
+
+	for ( int i = 0; unit_lut[i].suffix; i++ ){
+		if ( strcmp(end, unit_lut[i].suffix) == 0 ){
+			return value * unit_lut[i].scale;
+		}
+	}
+	return -1.0;
+}
+
+bool rrstore_parse(const char* spec, std::vector<struct rr_archive_spec>* archives){
+	std::vector<struct rr_archive_spec> result;
+	const std::string str = spec;
+	size_t begin = 0;
+	while ( begin <= str.size() ){
+		size_t end = str.find(',', begin);
+		if ( end == std::string::npos ) end = str.size();
+		const std::string item = str.substr(begin, end - begin);
+		begin = end + 1;
+
+		const size_t colon = item.find(':');
+		if ( colon == std::string::npos ){
+			return false;
+		}
+
+		struct rr_archive_spec cur;
+		cur.name = item.substr(0, colon);
+		cur.resolution = rrstore_duration(cur.name.c_str());
+		const double retention = rrstore_duration(item.substr(colon + 1).c_str());
+		if ( cur.resolution <= 0.0 || retention < cur.resolution ){
+			return false;
+		}
+		cur.bins = (uint64_t)ceil(retention / cur.resolution - 1e-9);
+		result.push_back(cur);
+	}
+
+	if ( archives ){
+		*archives = result;
+	}
+	return !result.empty();
+}
+
+RoundRobinArchive::RoundRobinArchive(const struct rr_archive_spec& spec)
+	: spec(spec)
+	, bin(new struct rr_bin[spec.bins]())
+	, head(NO_BIN)
+	, first(NO_BIN)
+	, dropped(0)
+	, started(false)
+	, cur(NO_BIN) {
+
+	memset(&acc, 0, sizeof(acc));
+}
+
+RoundRobinArchive::~RoundRobinArchive(){
+	delete [] bin;
+}
+
+void RoundRobinArchive::add(int64_t index, double value){
+	if ( !started || index > cur ){
+		if ( !started ){
+			first.store(index, std::memory_order_relaxed);
+			started = true;
+		}
+		cur = index;
+		acc.index = index;
+		acc.count = 0;
+		acc.sum = 0.0;
+		acc.min = value;
+		acc.max = value;
+	} else if ( index < cur ){
+		dropped.fetch_add(1, std::memory_order_relaxed);
+		return;
+	}
+
+	acc.count++;
+	acc.sum += value;
+	acc.min = std::min(acc.min, value);
+	acc.max = std::max(acc.max, value);
+	publish(cur);
+}
+
+/**
+ * Write the current bin, see shmring.cpp for the protocol.
+ */
+void RoundRobinArchive::publish(int64_t index){
+	struct rr_bin& slot = bin[slot_of(index)];
+	const uint64_t seq = 2 * (uint64_t)index;
+	slot.seq.store(seq + 1, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+	slot.count.store(acc.count, std::memory_order_relaxed);
+	slot.sum.store(acc.sum, std::memory_order_relaxed);
+	slot.min.store(acc.min, std::memory_order_relaxed);
+	slot.max.store(acc.max, std::memory_order_relaxed);
+	slot.seq.store(seq + 2, std::memory_order_release);
+	head.store(index, std::memory_order_release);
+}
+
+size_t RoundRobinArchive::slot_of(int64_t index) const {
+	const int64_t n = (int64_t)spec.bins;
+	return (size_t)(((index % n) + n) % n);
+}
+
+bool RoundRobinArchive::window(int64_t* oldest, int64_t* newest) const {
+	const int64_t last = head.load(std::memory_order_acquire);
+	if ( last == NO_BIN ){
+		return false;
+	}
+	*oldest = std::max(first.load(std::memory_order_relaxed), last - (int64_t)spec.bins + 1);
+	*newest = last;
+	return true;
+}
+
+bool RoundRobinArchive::read(int64_t index, struct rr_value* value) const {
+	const struct rr_bin& slot = bin[slot_of(index)];
+	const uint64_t want = 2 * (uint64_t)index + 2;
+
+	/* the writer only holds a bin for a few stores */
+	for ( int retry = 0; retry < 100; retry++ ){
+		const uint64_t seq = slot.seq.load(std::memory_order_acquire);
+		value->count = slot.count.load(std::memory_order_relaxed);
+		value->sum = slot.sum.load(std::memory_order_relaxed);
+		value->min = slot.min.load(std::memory_order_relaxed);
+		value->max = slot.max.load(std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_acquire);
+
+		if ( slot.seq.load(std::memory_order_relaxed) != seq ){
+			continue;
+		}
+		if ( seq == want ){
+			value->index = index;
+			return value->count > 0;
+		}
+		if ( seq != want - 1 ){
+			return false; /* never written or reused */
+		}
+	}
+	return false;
+}
+
+RoundRobinStore::RoundRobinStore(const std::vector<struct rr_archive_spec>& spec, const char* label, double tSample)
+	: label(label)
+	, tSample(tSample) {
+
+	for ( const struct rr_archive_spec& cur: spec ){
+		archives.push_back(new RoundRobinArchive(cur));
+	}
+}
+
+RoundRobinStore::~RoundRobinStore(){
+	for ( RoundRobinArchive* cur: archives ){
+		delete cur;
+	}
+}
+
+void RoundRobinStore::add(double t, double value){
+	const double mid = t + tSample / 2;
+	for ( RoundRobinArchive* cur: archives ){
+		cur->add((int64_t)floor(mid / cur->resolution()), value);
+	}
+}
+
+size_t RoundRobinStore::memory() const {
+	size_t bytes = 0;
+	for ( const RoundRobinArchive* cur: archives ){
+		bytes += cur->memory();
+	}
+	return bytes;
+}
+
+const RoundRobinArchive* RoundRobinStore::find(const char* resolution) const {
+	for ( const RoundRobinArchive* cur: archives ){
+		if ( cur->name() == resolution ) return cur;
+	}
+
+	const double res = rrstore_duration(resolution);
+	for ( const RoundRobinArchive* cur: archives ){
+		if ( fabs(cur->resolution() - res) < cur->resolution() * 1e-9 ) return cur;
+	}
+	return nullptr;
+}
+
+/**
+ * Bins [first, last] overlapping [from, to], clipped to those held.
+ * @return false if an argument is malformed.
+ */
+bool RoundRobinStore::select(const RoundRobinArchive* archive, const char* from, const char* to, int64_t* first, int64_t* last) const {
+	int64_t oldest, newest;
+	if ( !archive->window(&oldest, &newest) ){
+		*first = 0;
+		*last = -1;
+		return true;
+	}
+
+	const double res = archive->resolution();
+	const double end = (newest + 1) * res;
+	const char* arg[2] = {from, to};
+	int64_t bound[2] = {oldest, newest};
+	for ( int i = 0; i < 2; i++ ){
+		if ( !arg[i] ) continue;
+
+		char* tail;
+		double t = strtod(arg[i], &tail);
+		if ( tail == arg[i] || *tail != 0 ){
+			return false;
+		}
+		if ( t < 0.0 ){
+			t += end;
+		}
+		bound[i] = (int64_t)floor(t / res);
+	}
+
+	*first = std::max(bound[0], oldest);
+	*last = std::min(bound[1], newest);
+	return true;
+}
+
+/**
+ * Decimals needed to show a bin start at resolution res.
+ */
+static int time_digits(double res){
+	int digits = 0;
+	while ( digits < 9 && fabs(res - round(res)) > res * 1e-9 ){
+		res *= 10;
+		digits++;
+	}
+	return digits;
+}
+
+std::string RoundRobinStore::query(const char* line) const {
+	char buf[256];
+	std::string reply;
+
+	char cmd[32] = {0,}, res[32] = {0,}, from[64] = {0,}, to[64] = {0,};
+	const int args = sscanf(line, "%31s %31s %63s %63s", cmd, res, from, to);
+	if ( args < 1 ){
+		return "error: empty query\n\n";
+	}
+
+	if ( strcmp(cmd, "info") == 0 ){
+		snprintf(buf, sizeof(buf), "label %s\ntSample %.9g\n", label.c_str(), tSample);
+		reply += buf;
+		for ( const RoundRobinArchive* cur: archives ){
+			const int digits = time_digits(cur->resolution());
+			int64_t oldest, newest;
+			if ( cur->window(&oldest, &newest) ){
+				snprintf(buf, sizeof(buf), "archive %s %.9g %" PRIu64 " %.*f %.*f late %" PRIu64 "\n",
+				         cur->name().c_str(), cur->resolution(), cur->bins(),
+				         digits, oldest * cur->resolution(), digits, (newest + 1) * cur->resolution(), cur->late());
+			} else {
+				snprintf(buf, sizeof(buf), "archive %s %.9g %" PRIu64 " - - late %" PRIu64 "\n",
+				         cur->name().c_str(), cur->resolution(), cur->bins(), cur->late());
+			}
+			reply += buf;
+		}
+		return reply + "\n";
+	}
+
+	const bool range = strcmp(cmd, "range") == 0;
+	if ( !range && strcmp(cmd, "aggregate") != 0 ){
+		return "error: unknown query, expected info, range or aggregate\n\n";
+	}
+	if ( args < 2 ){
+		return "error: missing resolution\n\n";
+	}
+
+	const RoundRobinArchive* archive = find(res);
+	if ( !archive ){
+		return std::string("error: no archive with resolution ") + res + "\n\n";
+	}
+
+	int64_t first, last;
+	if ( !select(archive, args >= 3 ? from : nullptr, args >= 4 ? to : nullptr, &first, &last) ){
+		return "error: malformed time\n\n";
+	}
+
+	const int digits = time_digits(archive->resolution());
+	struct rr_value total = {0, 0, 0.0, NAN, NAN};
+	struct rr_value cur;
+	for ( int64_t i = first; i <= last; i++ ){
+		if ( !archive->read(i, &cur) ) continue;
+
+		if ( range ){
+			snprintf(buf, sizeof(buf), "%.*f\t%" PRIu64 "\t%.15g\t%.15g\t%.15g\t%.15g\n",
+			         digits, i * archive->resolution(), cur.count, cur.sum, cur.sum / cur.count, cur.min, cur.max);
+			reply += buf;
+		} else {
+			total.min = total.count == 0 ? cur.min : std::min(total.min, cur.min);
+			total.max = total.count == 0 ? cur.max : std::max(total.max, cur.max);
+			total.count += cur.count;
+			total.sum += cur.sum;
+		}
+	}
+
+	if ( !range ){
+		snprintf(buf, sizeof(buf), "%" PRIu64 "\t%.15g\t%.15g\t%.15g\t%.15g\n",
+		         total.count, total.sum, total.count > 0 ? total.sum / total.count : NAN, total.min, total.max);
+		reply += buf;
+	}
+
+	return reply + "\n";
+}
+
+RoundRobinServer::RoundRobinServer(const RoundRobinStore* store)
+	: store(store)
+	, listen_fd(-1) {
+
+	wake[0] = wake[1] = -1;
+}
+
+RoundRobinServer::~RoundRobinServer(){
+	stop();
+}
+
+int RoundRobinServer::start(const char* path){
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if ( strlen(path) >= sizeof(addr.sun_path) ){
+		return ENAMETOOLONG;
+	}
+	strcpy(addr.sun_path, path);
+
+	const int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if ( fd == -1 ){
+		return errno;
+	}
+
+	if ( bind(fd, (struct sockaddr*)&addr, sizeof(addr)) == -1 ){
+		int saved = errno;
+
+		/* replace the socket of an instance which didn't exit cleanly */
+		if ( saved == EADDRINUSE ){
+			const int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+			if ( probe != -1 && connect(probe, (struct sockaddr*)&addr, sizeof(addr)) == -1 && errno == ECONNREFUSED ){
+				unlink(path);
+				saved = bind(fd, (struct sockaddr*)&addr, sizeof(addr)) == 0 ? 0 : errno;
+			}
+			if ( probe != -1 ) close(probe);
+		}
+
+		if ( saved != 0 ){
+			close(fd);
+			return saved;
+		}
+	}
+
+	if ( listen(fd, 16) == -1 || pipe2(wake, O_CLOEXEC) == -1 ){
+		const int saved = errno;
+		close(fd);
+		unlink(path);
+		return saved;
+	}
+
+	this->path = path;
+	listen_fd = fd;
+
+	/* signals are left to the main thread */
+	sigset_t all, old;
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+	thread = std::thread(&RoundRobinServer::run, this);
+	pthread_sigmask(SIG_SETMASK, &old, nullptr);
+
+	return 0;
+}
+
+void RoundRobinServer::stop(){
+	if ( !thread.joinable() ) return;
+
+	const char stop = 0;
+	if ( write(wake[1], &stop, 1) != 1 ){
+		fprintf(stderr, "rrstore: failed to stop query server: %s\n", strerror(errno));
+	}
+	thread.join();
+
+	close(wake[0]);
+	close(wake[1]);
+	close(listen_fd);
+	unlink(path.c_str());
+	listen_fd = wake[0] = wake[1] = -1;
+}
+
+void RoundRobinServer::run(){
+	std::vector<struct pollfd> fds = {{wake[0], POLLIN, 0}, {listen_fd, POLLIN, 0}};
+	std::vector<struct client> clients(2);   /* indexed as fds */
+
+	for (;;){
+		if ( poll(fds.data(), fds.size(), -1) == -1 ){
+			if ( errno == EINTR ) continue;
+			fprintf(stderr, "rrstore: poll: %s\n", strerror(errno));
+			break;
+		}
+
+		if ( fds[0].revents ){
+			break;
+		}
+
+		if ( fds[1].revents & POLLIN ){
+			const int fd = accept4(listen_fd, nullptr, nullptr, SOCK_CLOEXEC | SOCK_NONBLOCK);
+			if ( fd != -1 ){
+				fds.push_back({fd, POLLIN, 0});
+				clients.push_back({"", "", 0, false});
+			}
+		}
+
+		for ( size_t i = 2; i < fds.size(); ){
+			if ( fds[i].revents && !serve(&fds[i], &clients[i]) ){
+				close(fds[i].fd);
+				fds.erase(fds.begin() + i);
+				clients.erase(clients.begin() + i);
+				continue;
+			}
+			i++;
+		}
+	}
+
+	for ( size_t i = 2; i < fds.size(); i++ ){
+		close(fds[i].fd);
+	}
+}
+
+/**
+ * Read from a client, answer its complete queries and send as much of the
+ * replies as the socket takes. Updates the events to poll the client for.
+ * @return false when the connection should be closed.
+ */
+bool RoundRobinServer::serve(struct pollfd* pfd, struct client* client){
+	char buf[4096];
+	if ( (pfd->revents & (POLLIN | POLLHUP | POLLERR)) && !client->eof ){
+		const ssize_t bytes = read(pfd->fd, buf, sizeof(buf));
+		if ( bytes == 0 ){
+			client->eof = true;
+		} else if ( bytes > 0 ){
+			client->input.append(buf, bytes);
+		} else if ( errno != EAGAIN && errno != EINTR ){
+			return false;
+		}
+	}
+
+	/* answer until the replies back up or there are no more queries */
+	do {
+		answer(client);
+		if ( !flush(pfd->fd, client) ){
+			return false;
+		}
+	} while ( client->unsent() == 0 && client->input.find('\n') != std::string::npos );
+
+	/* not a query, just a client sending garbage */
+	if ( client->input.size() >= sizeof(buf) && client->input.find('\n') == std::string::npos ){
+		return false;
+	}
+
+	/* all replies sent to a client which is done */
+	if ( client->eof && client->unsent() == 0 ){
+		return false;
+	}
+
+	pfd->events = 0;
+	if ( !client->eof && client->unsent() < RRSTORE_BACKLOG ){
+		pfd->events |= POLLIN;
+	}
+	if ( client->unsent() > 0 ){
+		pfd->events |= POLLOUT;
+	}
+	return true;
+}
+
+/**
+ * Queue replies to the complete queries of a client, until RRSTORE_BACKLOG
+ * bytes are waiting to be sent.
+ */
+void RoundRobinServer::answer(struct client* client){
+	size_t newline;
+	while ( client->unsent() < RRSTORE_BACKLOG && (newline = client->input.find('\n')) != std::string::npos ){
+		std::string line = client->input.substr(0, newline);
+		client->input.erase(0, newline + 1);
+		if ( !line.empty() && line.back() == '\r' ){
+			line.pop_back();
+		}
+
+		/* drop what was sent before the buffer grows */
+		client->output.erase(0, client->offset);
+		client->offset = 0;
+		client->output += store->query(line.c_str());
+	}
+}
+
+/**
+ * Send queued replies until the socket is full.
+ * @return false if the client is gone.
+ */
+bool RoundRobinServer::flush(int fd, struct client* client){
+	while ( client->unsent() > 0 ){
+		const ssize_t n = send(fd, client->output.data() + client->offset, client->unsent(), MSG_NOSIGNAL);
+		if ( n == -1 ){
+			if ( errno == EINTR ) continue;
+			if ( errno == EAGAIN || errno == EWOULDBLOCK ) return true;
+			return false;
+		}
+		client->offset += n;
+	}
+
+	client->output.clear();
+	client->offset = 0;
+	return true;
+}
@@ -0,0 +1,204 @@
+#ifndef RRSTORE_H
+#define RRSTORE_H
+
+#include <atomic>
+#include <poll.h>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <thread>
+
+/**
+ * Round-robin sample stores (--format=rrd).
+ *
+ * A store keeps the latest samples of a series at a few resolutions, each in
+ * an archive with a fixed number of bins allocated when the store is created.
+ * The archives are given as RESOLUTION:RETENTION pairs, e.g.
+ * "1ms:1h,1s:1d,1m:30d" keeps an hour at 1 ms, a day at 1 s and 30 days at
+ * 1 min. Every sample is added to the bin of each archive its interval
+ * midpoint falls in, so a coarser bin is the sum of the finer ones. A bin
+ * holds the number of samples, their sum, minimum and maximum.
+ *
+ * The store has a single writer and is read by the query server without
+ * locks: each bin is a seqlock (as the slots of shmring.hpp) so a reader
+ * detects a bin being updated or reused for a newer interval while it copied
+ * it.
+ *
+ * Queries are lines of text sent to a Unix stream socket, e.g. with
+ * "socat - UNIX-CONNECT:/tmp/bitrate.sock". Each reply is terminated by an
+ * empty line, errors are a single "error: MESSAGE" line.
+ *
+ *   info                        label, tSample and for each archive the
+ *                               resolution, bins, oldest and newest bin
+ *   range RES [FROM [TO]]       TIME COUNT SUM MEAN MIN MAX per bin
+ *   aggregate RES [FROM [TO]]   COUNT SUM MEAN MIN MAX over the bins
+ *
+ * RES selects the archive by resolution (e.g. "1s"). FROM and TO are sample
+ * times in seconds, negative values are relative to the end of the newest
+ * bin, e.g. "range 1s -60" for the last minute. Bins overlapping [FROM, TO]
+ * are included, bins without samples are left out.
+ */
+
+#define RRSTORE_ARCHIVES "1ms:10m,1s:1d,1m:30d"
+
+/* unsent reply bytes after which a client's queries wait */
+#define RRSTORE_BACKLOG (1<<20)
+
+struct rr_archive_spec {
+	std::string name;                 /* resolution as given, e.g. "1ms" */
+	double resolution;                /* seconds */
+	uint64_t bins;
+};
+
+/**
+ * Parse a duration such as "250us", "1ms", "1.5", "1s", "1m", "1h" or "1d".
+ * @return seconds or a negative value if str isn't a duration.
+ */
+double rrstore_duration(const char* str);
+
+/**
+ * Parse an archive list, "RESOLUTION:RETENTION[,...]".
+ * @param archives Set to the archives, may be NULL to only validate spec.
+ * @return false if spec is malformed.
+ */
+bool rrstore_parse(const char* spec, std::vector<struct rr_archive_spec>* archives);
+
+struct rr_bin {
+	std::atomic<uint64_t> seq;        /* 2*index+1 while written, 2*index+2 when consistent */
+	std::atomic<uint64_t> count;
+	std::atomic<double> sum;
+	std::atomic<double> min;
+	std::atomic<double> max;
+};
+
+/**
+ * Consistent copy of a bin.
+ */
+struct rr_value {
+	int64_t index;                    /* bin start is index * resolution */
+	uint64_t count;
+	double sum;
+	double min;
+	double max;
+};
+
+class RoundRobinArchive {
+public:
+	RoundRobinArchive(const struct rr_archive_spec& spec);
+	~RoundRobinArchive();
+
+	const std::string& name() const { return spec.name; }
+	double resolution() const { return spec.resolution; }
+	uint64_t bins() const { return spec.bins; }
+	size_t memory() const { return spec.bins * sizeof(struct rr_bin); }
+
+	/**
+	 * Add a sample to the bin at index (writer only). Samples older than the
+	 * newest bin are ignored and counted.
+	 */
+	void add(int64_t index, double value);
+
+	/**
+	 * Indices of the oldest and newest bin held.
+	 * @return false if no sample has been added yet.
+	 */
+	bool window(int64_t* oldest, int64_t* newest) const;
+
+	/**
+	 * Copy bin index.
+	 * @return false if the bin isn't held (too old, no samples or being
+	 *         updated for too long).
+	 */
+	bool read(int64_t index, struct rr_value* value) const;
+
+	uint64_t late() const { return dropped.load(std::memory_order_relaxed); }
+
+private:
+	void publish(int64_t index);
+	size_t slot_of(int64_t index) const;
+
+	const struct rr_archive_spec spec;
+	struct rr_bin* bin;
+	std::atomic<int64_t> head;        /* newest bin */
+	std::atomic<int64_t> first;       /* first bin written */
+	std::atomic<uint64_t> dropped;
+	bool started;
+
+	/* newest bin, only used by the writer */
+	int64_t cur;
+	struct rr_value acc;
+};
+
+class RoundRobinStore {
+public:
+	RoundRobinStore(const std::vector<struct rr_archive_spec>& archives, const char* label, double tSample);
+	~RoundRobinStore();
+
+	/**
+	 * Add the sample for the interval beginning at t (writer only).
+	 */
+	void add(double t, double value);
+
+	/**
+	 * Answer a query, see above.
+	 */
+	std::string query(const char* line) const;
+
+	size_t memory() const;
+	const std::vector<RoundRobinArchive*>& get_archives() const { return archives; }
+
+private:
+	const RoundRobinArchive* find(const char* resolution) const;
+	bool select(const RoundRobinArchive* archive, const char* from, const char* to, int64_t* first, int64_t* last) const;
+
+	std::vector<RoundRobinArchive*> archives;
+	const std::string label;
+	const double tSample;
+};
+
+/**
+ * Answers queries for a store on a Unix stream socket from a thread of its
+ * own, which blocks all signals. Clients are non-blocking: replies a client
+ * doesn't read are kept until it does, and no more of its queries are
+ * answered while RRSTORE_BACKLOG bytes are unsent, so a slow client doesn't
+ * hold up the others.
+ */
+class RoundRobinServer {
+public:
+	RoundRobinServer(const RoundRobinStore* store);
+	~RoundRobinServer();
+
+	/**
+	 * Listen on path. A stale socket (no one listening) is replaced.
+	 * @return 0 on success or errno.
+	 */
+	int start(const char* path);
+
+	/**
+	 * Close all connections and remove the socket.
+	 */
+	void stop();
+
+private:
+	struct client {
+		std::string input;            /* queries not answered yet */
+		std::string output;           /* replies, sent up to offset */
+		size_t offset;
+		bool eof;                     /* client is done sending */
+
+		size_t unsent() const { return output.size() - offset; }
+	};
+
+	void run();
+	bool serve(struct pollfd* pfd, struct client* client);
+	void answer(struct client* client);
+	bool flush(int fd, struct client* client);
+
+	const RoundRobinStore* store;
+	std::string path;
+	int listen_fd;
+	int wake[2];                      /* self-pipe to stop the thread */
+	std::thread thread;
+};
+
+#endif /* RRSTORE_H */
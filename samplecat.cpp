@@ -0,0 +1,207 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <cmath>
+#include <cinttypes>
+#include <getopt.h>
+#include <qd/qd_real.h>
+
+#include "samplefile.hpp"
+
+static char delimiter = '\t';
+const char* program_name = NULL;
+
+/**
+ * Expand a run-length encoded sample file (see RLEOutput) into one row per
+ * sample. Timestamps are regenerated from the interval index the same way
+ * the extractor calculates them, so the rows are identical to the dense
+ * output.
+ */
+static int expand_rle(FILE* src, const char* filename){
+	char* line = nullptr;
+	size_t size = 0;
+	ssize_t len;
+	qd_real tSample = 0.0;
+	qd_real ref_time = 0.0;
+	bool relative_time = false;
+	bool have_reference = false;
+	unsigned long lineno = 0;
+
+	while ( (len = getline(&line, &size, src)) != -1 ){
+		lineno++;
+		if ( len > 0 && line[len-1] == '\n' ){
+			line[--len] = 0;
+		}
+
+		/* header */
+		if ( line[0] == '#' ){
+			uint64_t sec, psec;
+			if ( strncmp(line, "# tSample:", 10) == 0 ){
+				tSample = atof(line + 10);
+			} else if ( strncmp(line, "# relative:", 11) == 0 ){
+				relative_time = atoi(line + 11) != 0;
+			} else if ( sscanf(line, "# reference: %" SCNu64 " %" SCNu64, &sec, &psec) == 2 ){
+				/* as reference_time in extract.hpp */
+				ref_time = qd_real((double)sec) + qd_real((double)psec/1.0e12);
+				have_reference = true;
+			}
+			continue;
+		}
+
+		/* record: index, count, value */
+		char* end;
+		const unsigned long index = strtoul(line, &end, 10);
+		const unsigned long count = strtoul(end, &end, 10);
+		if ( *end != '\t' ){
+			fprintf(stderr, "%s: %s:%lu: malformed record, ignored.\n", program_name, filename, lineno);
+			continue;
+		}
+		const char* value = end + 1;
+
+		if ( !have_reference || tSample <= 0.0 ){
+			fprintf(stderr, "%s: %s: missing tSample or reference in header.\n", program_name, filename);
+			free(line);
+			return 1;
+		}
+
+		for ( unsigned long i = 0; i < count; i++ ){
+			const qd_real t = ref_time + (double)(index + i) * tSample;
+			fprintf(stdout, "%.15f%c%s\n", to_double(relative_time ? (t - ref_time) : t), delimiter, value);
+		}
+	}
+
+	free(line);
+	return 0;
+}
+
+/**
+ * Print a binary sample file (see BinaryOutput) as text.
+ */
+static int expand_binary(FILE* src, const char* filename){
+	SampleReader reader;
+	if ( reader.open(src) != 0 ){
+		fprintf(stderr, "%s: %s: not a sample file or unsupported version.\n", program_name, filename);
+		return 1;
+	}
+
+	const struct samplefile_header& header = reader.header();
+	const int digits = -header.time_exponent;
+
+	if ( header.kind == SAMPLE_STORE ){
+		fprintf(stderr, "%s: %s: sample store, use --from-store with the analysis that wrote it.\n", program_name, filename);
+		return 1;
+	}
+
+	if ( header.kind == SAMPLE_TIMESCALE ){
+		struct timescale_record rec;
+		while ( reader.read(&rec) ){
+			fprintf(stdout, "%u%c%" PRIu64 "%c%.15f", rec.level, delimiter, rec.samples, delimiter, rec.tscale);
+			for ( uint32_t i = 0; i < header.num_moments; i++ ){
+				fprintf(stdout, "%c%.15f", delimiter, rec.moment[i]);
+			}
+			fputc('\n', stdout);
+		}
+		return 0;
+	}
+
+	const int64_t unit = (int64_t)pow(10, digits);
+	struct sample_record rec;
+	while ( reader.read(&rec) ){
+		const int64_t sec = rec.time / unit;
+		const int64_t frac = rec.time < 0 ? -(rec.time % unit) : rec.time % unit;
+		const char* sign = (rec.time < 0 && sec == 0) ? "-" : "";
+		if ( header.value_type == SAMPLE_U64 ){
+			fprintf(stdout, "%s%" PRId64 ".%0*" PRId64 "%c%" PRIu64 "\n", sign, sec, digits, frac, delimiter, rec.count);
+		} else {
+			fprintf(stdout, "%s%" PRId64 ".%0*" PRId64 "%c%.15f\n", sign, sec, digits, frac, delimiter, rec.value);
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * Detect the input format by peeking at the first byte.
+ */
+static int expand(FILE* src, const char* filename){
+	const int c = getc(src);
+	if ( c == EOF ) return 0;
+	ungetc(c, src);
+
+	if ( c == SAMPLEFILE_MAGIC[0] ){
+		return expand_binary(src, filename);
+	}
+	return expand_rle(src, filename);
+}
+
+static const char* short_options = "d:h";
+static struct option long_options[]= {
+	{"delimiter",        required_argument, 0, 'd'},
+	{"help",             no_argument,       0, 'h'},
+	{0, 0, 0, 0} /* sentinel */
+};
+
+static void show_usage(void){
+	printf("%s-" VERSION "\n", program_name);
+	printf("Usage: %s [OPTIONS] [FILE...]\n", program_name);
+	printf("Expands run-length encoded samples (--format=rle) into a dense series and\n"
+	       "prints binary sample files (--format=binary) as text.\n"
+	       "Reads from stdin if no files are given.\n\n"
+	       "  -d, --delimiter=CHAR        Column delimiter [default: tab].\n"
+	       "  -h, --help                  This text.\n\n");
+}
+
+int main(int argc, char **argv){
+	/* extract program name from path. e.g. /path/to/MArCd -> MArCd */
+	const char* separator = strrchr(argv[0], '/');
+	if ( separator ){
+		program_name = separator + 1;
+	} else {
+		program_name = argv[0];
+	}
+
+	int op, option_index = -1;
+	while ( (op = getopt_long(argc, argv, short_options, long_options, &option_index)) != -1 ){
+		switch (op){
+		case 0:   /* long opt */
+		case '?': /* unknown opt */
+			break;
+
+		case 'd': /* --delimiter */
+			delimiter = optarg[0];
+			break;
+
+		case 'h':
+			show_usage();
+			return 0;
+
+		default:
+			fprintf (stderr, "%s: ?? getopt returned character code 0%o ??\n", program_name, op);
+		}
+	}
+
+	if ( optind == argc ){
+		return expand(stdin, "stdin");
+	}
+
+	int ret = 0;
+	for ( int i = optind; i < argc; i++ ){
+		const char* filename = argv[i];
+		FILE* fp = fopen(filename, "r");
+		if ( !fp ){
+			fprintf(stderr, "%s: %s: %s\n", program_name, filename, strerror(errno));
+			ret = 1;
+			continue;
+		}
+
+		ret |= expand(fp, filename);
+		fclose(fp);
+	}
+
+	return ret;
+}
@@ -0,0 +1,306 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <cmath>
+#include <string>
+#include <vector>
+#include <getopt.h>
+
+const char* program_name = NULL;
+
+/**
+ * Allowed difference of a column. A value passes if it is within either the
+ * absolute or the relative tolerance of the reference.
+ */
+struct tolerance {
+	double abs;
+	double rel;
+};
+
+/**
+ * Largest differences seen in a column.
+ */
+struct column_stats {
+	struct tolerance tol;
+	double max_abs;
+	double max_rel;
+	unsigned long max_line;           /* line of max_abs */
+	unsigned long values;
+	unsigned long failed;
+};
+
+static struct tolerance default_tolerance = {0.0, 0.0};
+static std::vector<struct column_stats> columns;
+static bool quiet = false;
+
+/**
+ * A line split into fields. Fields are separated by tabs, semicolons or
+ * spaces and quotes are removed, so every text format of the tools can be
+ * compared. Numeric fields are compared with a tolerance, others exactly.
+ */
+struct fields {
+	std::vector<std::string> text;
+	std::vector<double> value;
+	std::vector<bool> numeric;
+};
+
+static void split(const char* line, struct fields* f){
+	f->text.clear();
+	f->value.clear();
+	f->numeric.clear();
+
+	const char* cur = line;
+	while ( *cur ){
+		cur += strspn(cur, " \t;\r\n");
+		if ( !*cur ) break;
+		const size_t len = strcspn(cur, " \t;\r\n");
+		std::string field(cur, len);
+		cur += len;
+
+		if ( field.size() >= 2 && field.front() == '"' && field.back() == '"' ){
+			field = field.substr(1, field.size() - 2);
+		}
+
+		char* end;
+		const double value = strtod(field.c_str(), &end);
+		const bool numeric = !field.empty() && *end == 0;
+		f->text.push_back(field);
+		f->value.push_back(numeric ? value : 0.0);
+		f->numeric.push_back(numeric);
+	}
+}
+
+static struct column_stats& column(size_t index){
+	while ( columns.size() <= index ){
+		columns.push_back({default_tolerance, 0.0, 0.0, 0, 0, 0});
+	}
+	return columns[index];
+}
+
+/**
+ * Relative error of value against the reference. Zero if both are zero.
+ */
+static double relative_error(double ref, double value){
+	const double diff = fabs(ref - value);
+	if ( diff == 0.0 ) return 0.0;
+	if ( ref == 0.0 ) return INFINITY;
+	return diff / fabs(ref);
+}
+
+/**
+ * Compare a line of both files.
+ * @return false if the lines have a different structure.
+ */
+static bool compare(const struct fields& ref, const struct fields& cand, unsigned long lineno){
+	if ( ref.text.size() != cand.text.size() ){
+		return false;
+	}
+
+	for ( size_t i = 0; i < ref.text.size(); i++ ){
+		if ( ref.numeric[i] != cand.numeric[i] ){
+			return false;
+		}
+		if ( !ref.numeric[i] ){
+			if ( ref.text[i] != cand.text[i] ) return false;
+			continue;
+		}
+
+		struct column_stats& col = column(i);
+		const double abs_err = fabs(ref.value[i] - cand.value[i]);
+		const double rel_err = relative_error(ref.value[i], cand.value[i]);
+		col.values++;
+		if ( abs_err > col.max_abs ){
+			col.max_abs = abs_err;
+			col.max_line = lineno;
+		}
+		col.max_rel = std::max(col.max_rel, rel_err);
+
+		if ( abs_err > col.tol.abs && rel_err > col.tol.rel ){
+			if ( col.failed++ == 0 && !quiet ){
+				fprintf(stderr, "%s: line %lu column %zu: %s differs from %s (abs %g, rel %g)\n",
+				        program_name, lineno, i + 1, cand.text[i].c_str(), ref.text[i].c_str(), abs_err, rel_err);
+			}
+		}
+	}
+
+	return true;
+}
+
+static void report(){
+	printf("Column   Values   Max abs error   Max rel error      Line   Tolerance (abs/rel)   Status\n");
+	for ( size_t i = 0; i < columns.size(); i++ ){
+		const struct column_stats& col = columns[i];
+		if ( col.values == 0 ) continue;
+		printf("%6zu %8lu %15g %15g %9lu %10g/%-10g %s\n",
+		       i + 1, col.values, col.max_abs, col.max_rel, col.max_line,
+		       col.tol.abs, col.tol.rel, col.failed ? "FAIL" : "ok");
+	}
+}
+
+/**
+ * Parse a tolerance "ABS[:REL]".
+ */
+static int parse_tolerance(const char* str, struct tolerance* tol){
+	char* end;
+	tol->abs = strtod(str, &end);
+	if ( *end == ':' ){
+		tol->rel = strtod(end + 1, &end);
+	}
+	return *end != 0 || tol->abs < 0.0 || tol->rel < 0.0;
+}
+
+static const char* short_options = "a:r:c:qh";
+static struct option long_options[]= {
+	{"abs",              required_argument, 0, 'a'},
+	{"rel",              required_argument, 0, 'r'},
+	{"column",           required_argument, 0, 'c'},
+	{"quiet",            no_argument,       0, 'q'},
+	{"help",             no_argument,       0, 'h'},
+	{0, 0, 0, 0} /* sentinel */
+};
+
+static void show_usage(void){
+	printf("%s-" VERSION "\n", program_name);
+	printf("Usage: %s [OPTIONS] REFERENCE CANDIDATE\n", program_name);
+	printf("Compares the output of a tool in two modes, e.g. the qd time engine and a\n"
+	       "faster one, line by line. Numeric fields are compared with a tolerance and\n"
+	       "the largest absolute and relative error of each column is reported. Other\n"
+	       "fields must be identical. Expand rle and binary outputs with samplecat first.\n\n"
+	       "  -a, --abs=TOLERANCE         Allowed absolute error [default: 0].\n"
+	       "  -r, --rel=TOLERANCE         Allowed relative error [default: 0].\n"
+	       "  -c, --column=N:ABS[:REL]    Tolerances of column N (counting from 1).\n"
+	       "  -q, --quiet                 Only show the summary.\n"
+	       "  -h, --help                  This text.\n\n"
+	       "Exit status is 0 if all values are within tolerance, 1 if not and 2 if the\n"
+	       "files have different lines or fields.\n");
+}
+
+int main(int argc, char **argv){
+	/* extract program name from path. e.g. /path/to/MArCd -> MArCd */
+	const char* separator = strrchr(argv[0], '/');
+	if ( separator ){
+		program_name = separator + 1;
+	} else {
+		program_name = argv[0];
+	}
+
+	std::vector<std::pair<size_t, struct tolerance>> overrides;
+
+	int op, option_index = -1;
+	while ( (op = getopt_long(argc, argv, short_options, long_options, &option_index)) != -1 ){
+		switch (op){
+		case 0:   /* long opt */
+		case '?': /* unknown opt */
+			break;
+
+		case 'a': /* --abs */
+			default_tolerance.abs = atof(optarg);
+			break;
+
+		case 'r': /* --rel */
+			default_tolerance.rel = atof(optarg);
+			break;
+
+		case 'c': /* --column */
+		{
+			char* end;
+			const long index = strtol(optarg, &end, 10);
+			struct tolerance tol = {0.0, 0.0};
+			if ( index < 1 || *end != ':' || parse_tolerance(end + 1, &tol) != 0 ){
+				fprintf(stderr, "%s: invalid column tolerance \"%s\".\n", program_name, optarg);
+				return 2;
+			}
+			overrides.push_back({(size_t)index - 1, tol});
+			break;
+		}
+
+		case 'q': /* --quiet */
+			quiet = true;
+			break;
+
+		case 'h':
+			show_usage();
+			return 0;
+
+		default:
+			fprintf (stderr, "%s: ?? getopt returned character code 0%o ??\n", program_name, op);
+		}
+	}
+
+	if ( argc - optind != 2 ){
+		fprintf(stderr, "%s: expected two files, see --help.\n", program_name);
+		return 2;
+	}
+
+	/* columns with overridden tolerances are created up front, the others on
+	 * first use with the default */
+	for ( const auto& cur: overrides ){
+		column(cur.first);
+	}
+	for ( struct column_stats& col: columns ){
+		col.tol = default_tolerance;
+	}
+	for ( const auto& cur: overrides ){
+		columns[cur.first].tol = cur.second;
+	}
+
+	FILE* fp[2];
+	for ( int i = 0; i < 2; i++ ){
+		const char* filename = argv[optind + i];
+		fp[i] = strcmp(filename, "-") == 0 ? stdin : fopen(filename, "r");
+		if ( !fp[i] ){
+			fprintf(stderr, "%s: %s: %s\n", program_name, filename, strerror(errno));
+			return 2;
+		}
+	}
+
+	char* line[2] = {nullptr, nullptr};
+	size_t size[2] = {0, 0};
+	struct fields f[2];
+	unsigned long lineno = 0;
+	int ret = 0;
+
+	for (;;){
+		const bool more[2] = {
+			getline(&line[0], &size[0], fp[0]) != -1,
+			getline(&line[1], &size[1], fp[1]) != -1,
+		};
+		if ( !more[0] && !more[1] ) break;
+		lineno++;
+
+		if ( more[0] != more[1] ){
+			fprintf(stderr, "%s: %s ends at line %lu.\n", program_name, argv[optind + (more[0] ? 1 : 0)], lineno);
+			ret = 2;
+			break;
+		}
+
+		split(line[0], &f[0]);
+		split(line[1], &f[1]);
+		if ( !compare(f[0], f[1], lineno) ){
+			fprintf(stderr, "%s: line %lu has different fields:\n< %s> %s", program_name, lineno, line[0], line[1]);
+			ret = 2;
+			break;
+		}
+	}
+
+	free(line[0]);
+	free(line[1]);
+	for ( int i = 0; i < 2; i++ ){
+		if ( fp[i] != stdin ) fclose(fp[i]);
+	}
+
+	report();
+
+	if ( ret == 0 ){
+		for ( const struct column_stats& col: columns ){
+			if ( col.failed ) ret = 1;
+		}
+	}
+	return ret;
+}
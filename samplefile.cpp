@@ -0,0 +1,479 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "samplefile.hpp"
+
+#include <cerrno>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <endian.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static int64_t pow10i(int exponent){
+	int64_t x = 1;
+	while ( exponent-- > 0 ) x *= 10;
+	return x;
+}
+
+double samplefile_seconds(const struct samplefile_header* header, int64_t time){
+	const int64_t unit = pow10i(-header->time_exponent);
+	return (double)(time / unit) + (double)(time % unit) / unit;
+}
+
+int64_t samplefile_time(const struct samplefile_header* header, double seconds){
+	/* split to keep the precision of the fractional part */
+	const int64_t unit = pow10i(-header->time_exponent);
+	const double whole = floor(seconds);
+	return (int64_t)whole * unit + llround((seconds - whole) * unit);
+}
+
+static void encode_header(char buf[SAMPLEFILE_HEADER_SIZE], const struct samplefile_header& header){
+	memset(buf, 0, SAMPLEFILE_HEADER_SIZE);
+	char* ptr = buf;
+
+	uint16_t u16;
+	uint32_t u32;
+	uint64_t u64;
+	memcpy(ptr, SAMPLEFILE_MAGIC, 8); ptr += 8;
+	u16 = htole16(header.version);                 memcpy(ptr, &u16, 2); ptr += 2;
+	u16 = htole16(header.kind);                    memcpy(ptr, &u16, 2); ptr += 2;
+	u16 = htole16(header.value_type);              memcpy(ptr, &u16, 2); ptr += 2;
+	u16 = htole16((uint16_t)header.time_exponent); memcpy(ptr, &u16, 2); ptr += 2;
+	u32 = htole32((uint32_t)header.level);         memcpy(ptr, &u32, 4); ptr += 4;
+	u32 = htole32(header.relative_time);           memcpy(ptr, &u32, 4); ptr += 4;
+	u64 = htole64(header.link_capacity);           memcpy(ptr, &u64, 8); ptr += 8;
+	memcpy(&u64, &header.sampleFrequency, 8); u64 = htole64(u64); memcpy(ptr, &u64, 8); ptr += 8;
+	memcpy(&u64, &header.tSample, 8);         u64 = htole64(u64); memcpy(ptr, &u64, 8); ptr += 8;
+	u32 = htole32(header.timescale);               memcpy(ptr, &u32, 4); ptr += 4;
+	u32 = htole32(header.num_moments);             memcpy(ptr, &u32, 4); ptr += 4;
+	u32 = htole32(header.quantity);                memcpy(ptr, &u32, 4); ptr += 4;
+}
+
+/**
+ * @return false if buf doesn't hold a sample file header of a supported version.
+ */
+static bool decode_header(const char buf[SAMPLEFILE_HEADER_SIZE], struct samplefile_header* hdr){
+	if ( memcmp(buf, SAMPLEFILE_MAGIC, 8) != 0 ){
+		return false;
+	}
+
+	const char* ptr = buf + 8;
+	uint16_t u16;
+	uint32_t u32;
+	uint64_t u64;
+	memcpy(hdr->magic, buf, 8);
+	memcpy(&u16, ptr, 2); hdr->version = le16toh(u16);                 ptr += 2;
+	memcpy(&u16, ptr, 2); hdr->kind = le16toh(u16);                    ptr += 2;
+	memcpy(&u16, ptr, 2); hdr->value_type = le16toh(u16);              ptr += 2;
+	memcpy(&u16, ptr, 2); hdr->time_exponent = (int16_t)le16toh(u16);  ptr += 2;
+	memcpy(&u32, ptr, 4); hdr->level = (int32_t)le32toh(u32);          ptr += 4;
+	memcpy(&u32, ptr, 4); hdr->relative_time = le32toh(u32);           ptr += 4;
+	memcpy(&u64, ptr, 8); hdr->link_capacity = le64toh(u64);           ptr += 8;
+	memcpy(&u64, ptr, 8); u64 = le64toh(u64); memcpy(&hdr->sampleFrequency, &u64, 8); ptr += 8;
+	memcpy(&u64, ptr, 8); u64 = le64toh(u64); memcpy(&hdr->tSample, &u64, 8);         ptr += 8;
+	memcpy(&u32, ptr, 4); hdr->timescale = le32toh(u32);               ptr += 4;
+	memcpy(&u32, ptr, 4); hdr->num_moments = le32toh(u32);             ptr += 4;
+	memcpy(&u32, ptr, 4); hdr->quantity = le32toh(u32);                ptr += 4;
+
+	return hdr->version <= SAMPLEFILE_VERSION;
+}
+
+SampleWriter::SampleWriter(FILE* dst)
+	: dst(dst) {
+
+}
+
+void SampleWriter::write_header(const struct samplefile_header& header){
+	char buf[SAMPLEFILE_HEADER_SIZE];
+	encode_header(buf, header);
+	fwrite(buf, sizeof(buf), 1, dst);
+}
+
+void SampleWriter::write_sample(int64_t time, double value){
+	write_u64((uint64_t)time);
+	write_double(value);
+}
+
+void SampleWriter::write_sample(int64_t time, uint64_t value){
+	write_u64((uint64_t)time);
+	write_u64(value);
+}
+
+void SampleWriter::write_level(uint32_t level, uint64_t samples, double tscale, const double* moment, int num_moments){
+	write_u32(level);
+	write_u32(0);
+	write_u64(samples);
+	write_double(tscale);
+	for ( int i = 0; i < num_moments; i++ ){
+		write_double(moment[i]);
+	}
+}
+
+void SampleWriter::write_u32(uint32_t value){
+	value = htole32(value);
+	fwrite(&value, sizeof(value), 1, dst);
+}
+
+void SampleWriter::write_u64(uint64_t value){
+	value = htole64(value);
+	fwrite(&value, sizeof(value), 1, dst);
+}
+
+void SampleWriter::write_double(double value){
+	uint64_t tmp;
+	memcpy(&tmp, &value, sizeof(tmp));
+	write_u64(tmp);
+}
+
+SampleReader::SampleReader()
+	: src(nullptr)
+	, owner(false)
+	, moment(nullptr) {
+
+	memset(&hdr, 0, sizeof(hdr));
+}
+
+SampleReader::~SampleReader(){
+	close();
+}
+
+int SampleReader::open(const char* filename){
+	FILE* fp = fopen(filename, "rb");
+	if ( !fp ){
+		return errno;
+	}
+
+	const int ret = open(fp);
+	owner = true;
+	return ret;
+}
+
+int SampleReader::open(FILE* fp){
+	close();
+	src = fp;
+	owner = false;
+
+	char buf[SAMPLEFILE_HEADER_SIZE];
+	if ( fread(buf, sizeof(buf), 1, src) != 1 || !decode_header(buf, &hdr) ){
+		return EINVAL;
+	}
+
+	if ( hdr.kind == SAMPLE_TIMESCALE ){
+		moment = new double[hdr.num_moments];
+	}
+
+	return 0;
+}
+
+void SampleReader::close(){
+	if ( src && owner ){
+		fclose(src);
+	}
+	src = nullptr;
+	owner = false;
+	delete [] moment;
+	moment = nullptr;
+}
+
+bool SampleReader::read(struct sample_record* rec){
+	if ( !src || hdr.kind != SAMPLE_SERIES ) return false;
+
+	uint64_t time;
+	if ( !read_u64(&time) ) return false;
+	rec->time = (int64_t)time;
+
+	switch ( hdr.value_type ){
+	case SAMPLE_DOUBLE:
+		rec->count = 0;
+		return read_double(&rec->value);
+	case SAMPLE_U64:
+		if ( !read_u64(&rec->count) ) return false;
+		rec->value = (double)rec->count;
+		return true;
+	default:
+		return false;
+	}
+}
+
+bool SampleReader::read(struct timescale_record* rec){
+	if ( !src || hdr.kind != SAMPLE_TIMESCALE ) return false;
+
+	uint32_t reserved;
+	if ( !(read_u32(&rec->level) && read_u32(&reserved) && read_u64(&rec->samples) && read_double(&rec->tscale)) ){
+		return false;
+	}
+
+	for ( uint32_t i = 0; i < hdr.num_moments; i++ ){
+		if ( !read_double(&moment[i]) ) return false;
+	}
+	rec->moment = moment;
+
+	return true;
+}
+
+bool SampleReader::read_u32(uint32_t* value){
+	if ( fread(value, sizeof(*value), 1, src) != 1 ) return false;
+	*value = le32toh(*value);
+	return true;
+}
+
+bool SampleReader::read_u64(uint64_t* value){
+	if ( fread(value, sizeof(*value), 1, src) != 1 ) return false;
+	*value = le64toh(*value);
+	return true;
+}
+
+bool SampleReader::read_double(double* value){
+	uint64_t tmp;
+	if ( !read_u64(&tmp) ) return false;
+	memcpy(value, &tmp, sizeof(tmp));
+	return true;
+}
+
+SampleStoreWriter::SampleStoreWriter(FILE* dst)
+	: dst(dst)
+	, header_written(false)
+	, value(0)
+	, count(0)
+	, previous(0)
+	, records(0)
+	, chunk_samples(0)
+	, total(0) {
+
+	payload.reserve(SAMPLESTORE_CHUNK_SIZE + 32);
+}
+
+SampleStoreWriter::~SampleStoreWriter(){
+	flush();
+}
+
+void SampleStoreWriter::write_header(const struct samplefile_header& header){
+	if ( header_written ) return;
+
+	struct samplefile_header tmp = header;
+	memcpy(tmp.magic, SAMPLEFILE_MAGIC, 8);
+	tmp.version = SAMPLEFILE_VERSION;
+	tmp.kind = SAMPLE_STORE;
+	tmp.value_type = SAMPLE_U64;
+
+	char buf[SAMPLEFILE_HEADER_SIZE];
+	encode_header(buf, tmp);
+	fwrite(buf, sizeof(buf), 1, dst);
+	header_written = true;
+}
+
+void SampleStoreWriter::write(uint64_t value, uint64_t n){
+	if ( n == 0 ) return;
+
+	if ( count > 0 && value != this->value ){
+		write_run();
+	}
+
+	this->value = value;
+	count += n;
+	total += n;
+}
+
+void SampleStoreWriter::flush(){
+	if ( count > 0 ){
+		write_run();
+	}
+	if ( records > 0 ){
+		write_chunk();
+	}
+	fflush(dst);
+}
+
+void SampleStoreWriter::write_run(){
+	const int64_t delta = (int64_t)(value - previous);
+	const uint64_t zigzag = ((uint64_t)delta << 1) ^ (uint64_t)(delta >> 63);
+	put_varint((zigzag << 1) | (count > 1 ? 1 : 0));
+	if ( count > 1 ){
+		put_varint(count - 2);
+	}
+
+	previous = value;
+	records++;
+	chunk_samples += count;
+	count = 0;
+
+	if ( payload.size() >= SAMPLESTORE_CHUNK_SIZE ){
+		write_chunk();
+	}
+}
+
+void SampleStoreWriter::write_chunk(){
+	char buf[SAMPLESTORE_CHUNK_HEADER_SIZE];
+	const uint32_t bytes = htole32((uint32_t)payload.size());
+	const uint32_t n = htole32(records);
+	const uint64_t samples = htole64(chunk_samples);
+	memcpy(buf, &bytes, 4);
+	memcpy(buf + 4, &n, 4);
+	memcpy(buf + 8, &samples, 8);
+	fwrite(buf, sizeof(buf), 1, dst);
+	fwrite(payload.data(), 1, payload.size(), dst);
+
+	payload.clear();
+	previous = 0;
+	records = 0;
+	chunk_samples = 0;
+}
+
+void SampleStoreWriter::put_varint(uint64_t value){
+	while ( value >= 0x80 ){
+		payload.push_back((uint8_t)(value | 0x80));
+		value >>= 7;
+	}
+	payload.push_back((uint8_t)value);
+}
+
+SampleStoreReader::SampleStoreReader()
+	: base(nullptr)
+	, size(0)
+	, chunk(nullptr)
+	, ptr(nullptr)
+	, end(nullptr)
+	, previous(0)
+	, total(0) {
+
+	memset(&hdr, 0, sizeof(hdr));
+}
+
+SampleStoreReader::~SampleStoreReader(){
+	close();
+}
+
+int SampleStoreReader::open(const char* filename){
+	close();
+
+	const int fd = ::open(filename, O_RDONLY);
+	if ( fd == -1 ){
+		return errno;
+	}
+
+	struct stat st;
+	if ( fstat(fd, &st) == -1 ){
+		const int ret = errno;
+		::close(fd);
+		return ret;
+	}
+
+	if ( st.st_size < SAMPLEFILE_HEADER_SIZE ){
+		::close(fd);
+		return EINVAL;
+	}
+
+	void* addr = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	const int ret = errno;
+	::close(fd);
+	if ( addr == MAP_FAILED ){
+		return ret;
+	}
+
+	base = (const uint8_t*)addr;
+	size = st.st_size;
+	madvise(addr, size, MADV_SEQUENTIAL);
+
+	if ( !decode_header((const char*)base, &hdr) || hdr.kind != SAMPLE_STORE ){
+		close();
+		return EINVAL;
+	}
+
+	/* count samples in the complete chunks */
+	rewind();
+	while ( next_chunk() ){
+		uint64_t samples;
+		memcpy(&samples, ptr - SAMPLESTORE_CHUNK_HEADER_SIZE + 8, 8);
+		total += le64toh(samples);
+		ptr = end;
+	}
+	rewind();
+
+	return 0;
+}
+
+void SampleStoreReader::close(){
+	if ( base ){
+		munmap((void*)base, size);
+	}
+	base = nullptr;
+	size = 0;
+	chunk = ptr = end = nullptr;
+	total = 0;
+}
+
+void SampleStoreReader::rewind(){
+	chunk = base + SAMPLEFILE_HEADER_SIZE;
+	ptr = end = chunk;
+	previous = 0;
+}
+
+bool SampleStoreReader::next_chunk(){
+	if ( !base || (size_t)(chunk - base) + SAMPLESTORE_CHUNK_HEADER_SIZE > size ){
+		return false;
+	}
+
+	uint32_t bytes;
+	memcpy(&bytes, chunk, 4);
+	bytes = le32toh(bytes);
+	if ( (size_t)(chunk - base) + SAMPLESTORE_CHUNK_HEADER_SIZE + bytes > size ){
+		return false; /* incomplete */
+	}
+
+	ptr = chunk + SAMPLESTORE_CHUNK_HEADER_SIZE;
+	end = ptr + bytes;
+	chunk = end;
+	previous = 0;
+	return true;
+}
+
+/**
+ * Decode a LEB128 varint.
+ * @return false if it runs past end.
+ */
+static bool get_varint(const uint8_t** ptr, const uint8_t* end, uint64_t* value){
+	uint64_t x = 0;
+	for ( int shift = 0; *ptr < end && shift < 64; shift += 7 ){
+		const uint8_t byte = *(*ptr)++;
+		x |= (uint64_t)(byte & 0x7f) << shift;
+		if ( !(byte & 0x80) ){
+			*value = x;
+			return true;
+		}
+	}
+	return false;
+}
+
+bool SampleStoreReader::read(uint64_t* value, uint64_t* n){
+	while ( ptr == end ){
+		if ( !next_chunk() ) return false;
+	}
+
+	uint64_t tag;
+	if ( !get_varint(&ptr, end, &tag) ){
+		ptr = end = chunk = base + size; /* corrupt, stop */
+		return false;
+	}
+
+	const uint64_t zigzag = tag >> 1;
+	const int64_t delta = (int64_t)(zigzag >> 1) ^ -(int64_t)(zigzag & 1);
+	*value = previous + (uint64_t)delta;
+	previous = *value;
+
+	*n = 1;
+	if ( tag & 1 ){
+		uint64_t extra;
+		if ( !get_varint(&ptr, end, &extra) ){
+			ptr = end = chunk = base + size;
+			return false;
+		}
+		*n = extra + 2;
+	}
+
+	return true;
+}
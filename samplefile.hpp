@@ -0,0 +1,254 @@
+#ifndef SAMPLEFILE_H
+#define SAMPLEFILE_H
+
+#include <cstdio>
+#include <cstdint>
+#include <vector>
+
+/**
+ * Binary sample files (--format=binary).
+ *
+ * A file is a fixed-size header followed by fixed-size records. All fields
+ * are little-endian, doubles are stored as IEEE-754 binary64.
+ *
+ *   header     64 bytes, see struct samplefile_header.
+ *   series     int64 time, value (double or u64)            16 bytes
+ *   timescale  u32 level, u32 reserved, u64 samples,
+ *              double tscale, double moment[num_moments]     24 + 8n bytes
+ *   store      chunks, see SampleStoreWriter
+ *
+ * Timestamps are integers in units of 10^time_exponent seconds: nanoseconds
+ * for absolute time and picoseconds for relative time.
+ */
+
+#define SAMPLEFILE_MAGIC "CBSAMPLE"
+#define SAMPLEFILE_VERSION 1
+#define SAMPLEFILE_HEADER_SIZE 64
+
+enum SampleKind {
+	SAMPLE_SERIES = 1,                /* (time, value) per sampling interval */
+	SAMPLE_TIMESCALE = 2,             /* moments per aggregation level */
+	SAMPLE_STORE = 3,                 /* compressed value per sampling interval */
+};
+
+enum SampleValue {
+	SAMPLE_DOUBLE = 1,
+	SAMPLE_U64 = 2,
+};
+
+enum SampleQuantity {
+	QUANTITY_PACKETS = 1,             /* packets per interval (wavelet) */
+	QUANTITY_BITRATE = 2,             /* bits per second (timescale) */
+};
+
+struct samplefile_header {
+	char magic[8];
+	uint16_t version;
+	uint16_t kind;                    /* enum SampleKind */
+	uint16_t value_type;              /* enum SampleValue (series only) */
+	int16_t time_exponent;            /* -9 (ns) or -12 (ps) */
+	int32_t level;                    /* enum Level the sizes was extracted at */
+	uint32_t relative_time;           /* 1 if time is relative to the first packet */
+	uint64_t link_capacity;           /* bits per second */
+	double sampleFrequency;           /* Hz */
+	double tSample;                   /* seconds */
+	uint32_t timescale;               /* aggregation factor (timescale only) */
+	uint32_t num_moments;             /* moments per record (timescale only) */
+	uint32_t quantity;                /* enum SampleQuantity (store only) */
+};
+
+struct sample_record {
+	int64_t time;                     /* in units of 10^time_exponent seconds */
+	double value;                     /* set for SAMPLE_DOUBLE */
+	uint64_t count;                   /* set for SAMPLE_U64 */
+};
+
+struct timescale_record {
+	uint32_t level;
+	uint64_t samples;
+	double tscale;                    /* seconds */
+	double* moment;                   /* num_moments values, owned by the reader */
+};
+
+/**
+ * Convert a record time to seconds.
+ */
+double samplefile_seconds(const struct samplefile_header* header, int64_t time);
+
+/**
+ * Convert seconds to a record time, rounded to the nearest unit.
+ */
+int64_t samplefile_time(const struct samplefile_header* header, double seconds);
+
+class SampleWriter {
+public:
+	SampleWriter(FILE* dst);
+
+	void write_header(const struct samplefile_header& header);
+	void write_sample(int64_t time, double value);
+	void write_sample(int64_t time, uint64_t value);
+	void write_level(uint32_t level, uint64_t samples, double tscale, const double* moment, int num_moments);
+
+private:
+	void write_u32(uint32_t value);
+	void write_u64(uint64_t value);
+	void write_double(double value);
+
+	FILE* dst;
+};
+
+/**
+ * Reads binary sample files.
+ *
+ * Usage:
+ *   SampleReader reader;
+ *   if ( reader.open("bitrate.bin") != 0 ) { ... }
+ *   struct sample_record rec;
+ *   while ( reader.read(&rec) ) { ... }
+ */
+class SampleReader {
+public:
+	SampleReader();
+	~SampleReader();
+
+	/**
+	 * Open a file and read the header.
+	 * @return 0 on success, errno or EINVAL if the file isn't a sample file.
+	 */
+	int open(const char* filename);
+	int open(FILE* src);
+	void close();
+
+	const struct samplefile_header& header() const { return hdr; }
+
+	/**
+	 * Read the next record.
+	 * @return false on EOF, error or if the file is of the wrong kind.
+	 */
+	bool read(struct sample_record* rec);
+	bool read(struct timescale_record* rec);
+
+private:
+	bool read_u32(uint32_t* value);
+	bool read_u64(uint64_t* value);
+	bool read_double(double* value);
+
+	FILE* src;
+	bool owner;
+	struct samplefile_header hdr;
+	double* moment;
+};
+
+/* payload bytes after which a store chunk is written */
+#define SAMPLESTORE_CHUNK_SIZE (1<<20)
+#define SAMPLESTORE_CHUNK_HEADER_SIZE 16
+
+/**
+ * Writes a sample store: the series fed to an analysis, one unsigned value
+ * per sampling interval, compact enough to keep billions of samples on disk
+ * and re-run the analysis without the capture.
+ *
+ * The file header is followed by chunks, appended as they fill up:
+ *
+ *   u32 payload bytes, u32 records, u64 samples, payload
+ *
+ * The payload is a sequence of records, each a run of equal values:
+ *
+ *   varint((zigzag(value - previous) << 1) | (count > 1)) [varint(count - 2)]
+ *
+ * Varints are LEB128, previous is 0 at the start of each chunk so chunks are
+ * decoded independently. Values must be less than 2^62. A chunk cut short
+ * (e.g. the writer was killed) is ignored by the reader.
+ */
+class SampleStoreWriter {
+public:
+	SampleStoreWriter(FILE* dst);
+	~SampleStoreWriter();
+
+	/**
+	 * Write the file header, only the first call has effect.
+	 */
+	void write_header(const struct samplefile_header& header);
+	bool has_header() const { return header_written; }
+
+	/**
+	 * Append value for n consecutive samples.
+	 */
+	void write(uint64_t value, uint64_t n = 1);
+
+	/**
+	 * Write the buffered samples as a chunk and flush the stream.
+	 */
+	void flush();
+
+	uint64_t samples() const { return total; }
+
+private:
+	void write_run();
+	void write_chunk();
+	void put_varint(uint64_t value);
+
+	FILE* dst;
+	bool header_written;
+	uint64_t value;                   /* current run */
+	uint64_t count;
+	uint64_t previous;                /* value of the last record in the chunk */
+	uint32_t records;                 /* records in the chunk */
+	uint64_t chunk_samples;
+	uint64_t total;
+	std::vector<uint8_t> payload;
+};
+
+/**
+ * Reads a sample store by mapping it into memory.
+ *
+ * Usage:
+ *   SampleStoreReader reader;
+ *   if ( reader.open("series.store") != 0 ) { ... }
+ *   uint64_t value, n;
+ *   while ( reader.read(&value, &n) ) { ... }
+ */
+class SampleStoreReader {
+public:
+	SampleStoreReader();
+	~SampleStoreReader();
+
+	/**
+	 * Map the file and read the header.
+	 * @return 0 on success, errno or EINVAL if the file isn't a sample store.
+	 */
+	int open(const char* filename);
+	void close();
+
+	const struct samplefile_header& header() const { return hdr; }
+
+	/**
+	 * Total number of samples in the complete chunks.
+	 */
+	uint64_t samples() const { return total; }
+
+	/**
+	 * Read the next run of n samples with the same value.
+	 * @return false at the end of the store.
+	 */
+	bool read(uint64_t* value, uint64_t* n);
+
+	/**
+	 * Start over from the first sample.
+	 */
+	void rewind();
+
+private:
+	bool next_chunk();
+
+	const uint8_t* base;              /* mapped file */
+	size_t size;
+	const uint8_t* chunk;             /* next chunk header */
+	const uint8_t* ptr;               /* next record */
+	const uint8_t* end;               /* end of the current payload */
+	uint64_t previous;
+	uint64_t total;
+	struct samplefile_header hdr;
+};
+
+#endif /* SAMPLEFILE_H */
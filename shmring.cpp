@@ -0,0 +1,255 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "shmring.hpp"
+
+#include <cerrno>
+#include <cstring>
+#include <string>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static std::string shm_name(const char* name){
+	return name[0] == '/' ? std::string(name) : "/" + std::string(name);
+}
+
+static size_t ring_size(uint64_t capacity){
+	return sizeof(struct shmring_control) + capacity * sizeof(struct shmring_slot);
+}
+
+/**
+ * Mark a previous ring with the same name closed, so its readers move on to
+ * the new one.
+ */
+static void close_previous(const std::string& path){
+	const int fd = shm_open(path.c_str(), O_RDWR, 0);
+	if ( fd == -1 ) return;
+
+	struct stat st;
+	if ( fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(struct shmring_control) ){
+		void* base = mmap(nullptr, sizeof(struct shmring_control), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		if ( base != MAP_FAILED ){
+			struct shmring_control* ctrl = (struct shmring_control*)base;
+			if ( memcmp(ctrl->magic, SHMRING_MAGIC, 8) == 0 ){
+				ctrl->closed.store(1, std::memory_order_release);
+			}
+			munmap(base, sizeof(struct shmring_control));
+		}
+	}
+	::close(fd);
+}
+
+ShmRingWriter::ShmRingWriter()
+	: ctrl(nullptr)
+	, slots(nullptr)
+	, size(0)
+	, mask(0)
+	, head(0) {
+
+}
+
+ShmRingWriter::~ShmRingWriter(){
+	close();
+}
+
+int ShmRingWriter::open(const char* name, const struct samplefile_header& header, uint64_t capacity){
+	const std::string path = shm_name(name);
+
+	uint64_t slots_pow2 = 1;
+	while ( slots_pow2 < capacity ) slots_pow2 <<= 1;
+
+	close_previous(path);
+	shm_unlink(path.c_str());
+
+	const int fd = shm_open(path.c_str(), O_RDWR | O_CREAT | O_EXCL, 0644);
+	if ( fd == -1 ){
+		return errno;
+	}
+
+	size = ring_size(slots_pow2);
+	if ( ftruncate(fd, size) == -1 ){
+		const int saved = errno;
+		::close(fd);
+		shm_unlink(path.c_str());
+		return saved;
+	}
+
+	void* base = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	const int saved = errno;
+	::close(fd);
+	if ( base == MAP_FAILED ){
+		shm_unlink(path.c_str());
+		return saved;
+	}
+
+	/* the object is zero-filled by ftruncate, i.e. all slots are empty */
+	ctrl = (struct shmring_control*)base;
+	slots = (struct shmring_slot*)((char*)base + sizeof(struct shmring_control));
+	mask = slots_pow2 - 1;
+	head = 0;
+
+	ctrl->version = SHMRING_VERSION;
+	ctrl->slot_size = sizeof(struct shmring_slot);
+	ctrl->capacity = slots_pow2;
+	ctrl->pid = getpid();
+	ctrl->header = header;
+	ctrl->header.kind = SAMPLE_SERIES;
+	std::atomic_thread_fence(std::memory_order_release);
+	memcpy(ctrl->magic, SHMRING_MAGIC, 8);
+
+	return 0;
+}
+
+void ShmRingWriter::close(){
+	if ( !ctrl ) return;
+	ctrl->closed.store(1, std::memory_order_release);
+	munmap(ctrl, size);
+	ctrl = nullptr;
+	slots = nullptr;
+}
+
+void ShmRingWriter::write_sample(int64_t time, double value){
+	uint64_t bits;
+	memcpy(&bits, &value, sizeof(bits));
+	publish(time, bits);
+}
+
+void ShmRingWriter::write_sample(int64_t time, uint64_t value){
+	publish(time, value);
+}
+
+void ShmRingWriter::publish(int64_t time, uint64_t value){
+	struct shmring_slot& slot = slots[head & mask];
+	slot.seq.store(2 * head + 1, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+	slot.time.store(time, std::memory_order_relaxed);
+	slot.value.store(value, std::memory_order_relaxed);
+	slot.seq.store(2 * head + 2, std::memory_order_release);
+	ctrl->head.store(++head, std::memory_order_release);
+}
+
+int ShmRingWriter::unlink(const char* name){
+	return shm_unlink(shm_name(name).c_str()) == 0 ? 0 : errno;
+}
+
+ShmRingReader::ShmRingReader()
+	: ctrl(nullptr)
+	, slots(nullptr)
+	, size(0)
+	, mask(0)
+	, next(0)
+	, dropped(0) {
+
+}
+
+ShmRingReader::~ShmRingReader(){
+	close();
+}
+
+int ShmRingReader::open(const char* name, bool from_start){
+	close();
+
+	const int fd = shm_open(shm_name(name).c_str(), O_RDONLY, 0);
+	if ( fd == -1 ){
+		return errno;
+	}
+
+	struct stat st;
+	if ( fstat(fd, &st) == -1 ){
+		const int saved = errno;
+		::close(fd);
+		return saved;
+	}
+	if ( (size_t)st.st_size < sizeof(struct shmring_control) ){
+		::close(fd);
+		return EAGAIN; /* not truncated yet */
+	}
+
+	void* base = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	const int saved = errno;
+	::close(fd);
+	if ( base == MAP_FAILED ){
+		return saved;
+	}
+
+	const struct shmring_control* cur = (const struct shmring_control*)base;
+	int ret = 0;
+	if ( memcmp(cur->magic, SHMRING_MAGIC, 8) != 0 ){
+		/* either not a ring or not initialized yet */
+		ret = cur->version == 0 ? EAGAIN : EINVAL;
+	} else if ( cur->version > SHMRING_VERSION || cur->slot_size != sizeof(struct shmring_slot) ||
+	            (size_t)st.st_size < ring_size(cur->capacity) ){
+		ret = EINVAL;
+	}
+	if ( ret != 0 ){
+		munmap(base, st.st_size);
+		return ret;
+	}
+	std::atomic_thread_fence(std::memory_order_acquire);
+
+	ctrl = cur;
+	slots = (const struct shmring_slot*)((const char*)base + sizeof(struct shmring_control));
+	size = st.st_size;
+	mask = cur->capacity - 1;
+	dropped = 0;
+
+	const uint64_t head = ctrl->head.load(std::memory_order_acquire);
+	next = head;
+	if ( from_start ){
+		next = head > cur->capacity ? head - cur->capacity : 0;
+	}
+
+	return 0;
+}
+
+void ShmRingReader::close(){
+	if ( !ctrl ) return;
+	munmap(const_cast<struct shmring_control*>(ctrl), size);
+	ctrl = nullptr;
+	slots = nullptr;
+}
+
+bool ShmRingReader::read(struct sample_record* rec){
+	for (;;){
+		const uint64_t head = ctrl->head.load(std::memory_order_acquire);
+		if ( next >= head ){
+			return false;
+		}
+
+		/* lapped by the writer */
+		if ( head - next > ctrl->capacity ){
+			dropped += head - next - ctrl->capacity;
+			next = head - ctrl->capacity;
+		}
+
+		const struct shmring_slot& slot = slots[next & mask];
+		const uint64_t seq = slot.seq.load(std::memory_order_acquire);
+		const int64_t time = slot.time.load(std::memory_order_relaxed);
+		const uint64_t value = slot.value.load(std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_acquire);
+
+		if ( seq == 2 * next + 2 && slot.seq.load(std::memory_order_relaxed) == seq ){
+			rec->time = time;
+			if ( ctrl->header.value_type == SAMPLE_U64 ){
+				rec->count = value;
+				rec->value = (double)value;
+			} else {
+				rec->count = 0;
+				memcpy(&rec->value, &value, sizeof(value));
+			}
+			next++;
+			return true;
+		}
+
+		/* overwritten while reading */
+		dropped++;
+		next++;
+	}
+}
+
+bool ShmRingReader::closed() const {
+	return ctrl->closed.load(std::memory_order_acquire) != 0;
+}
@@ -0,0 +1,156 @@
+#ifndef SHMRING_H
+#define SHMRING_H
+
+#include <atomic>
+#include <cstdint>
+
+#include "samplefile.hpp"
+
+/**
+ * Shared-memory sample rings (--format=shm).
+ *
+ * A ring is a named POSIX shared memory object (see shm_open, usually
+ * /dev/shm/NAME) holding the latest samples of a series as fixed-size
+ * records. The writer never waits for readers: when the ring is full the
+ * oldest record is overwritten. Any number of local readers follow it by
+ * polling, each at its own pace, and are told how many records they lost.
+ *
+ * The object is a control block followed by capacity slots:
+ *
+ *   control    struct shmring_control, 192 bytes
+ *   slot       u64 seq, i64 time, u64 value, u64 reserved   32 bytes
+ *
+ * Record n is stored in slot n % capacity. Each slot is a seqlock: seq is
+ * 2n+1 while record n is written and 2n+2 when it is complete, so a reader
+ * detects a record overwritten while it was read. head is the number of
+ * records published. Time and value are as in sample files (see
+ * samplefile.hpp), doubles are stored by their bits. All fields are in host
+ * byte order as the ring never leaves the machine.
+ */
+
+#define SHMRING_MAGIC "CBSHMRNG"
+#define SHMRING_VERSION 1
+#define SHMRING_CAPACITY 65536            /* default slots, 2 MiB */
+
+static_assert(ATOMIC_LLONG_LOCK_FREE == 2, "shared-memory rings need lock-free 64-bit atomics");
+
+struct shmring_slot {
+	std::atomic<uint64_t> seq;
+	std::atomic<int64_t> time;
+	std::atomic<uint64_t> value;
+	uint64_t reserved;
+};
+
+struct shmring_control {
+	char magic[8];                    /* written last, when the ring is ready */
+	uint32_t version;
+	uint32_t slot_size;
+	uint64_t capacity;                /* slots, a power of two */
+	uint64_t pid;                     /* writer */
+	std::atomic<uint32_t> closed;     /* set when the writer is done */
+	uint32_t reserved;
+	struct samplefile_header header;  /* kind SAMPLE_SERIES */
+	alignas(64) std::atomic<uint64_t> head;
+};
+
+static_assert(sizeof(struct shmring_control) == 192, "unexpected shmring_control layout");
+static_assert(sizeof(struct shmring_slot) == 32, "unexpected shmring_slot layout");
+
+/**
+ * Publishes samples to a ring. An existing ring with the same name is
+ * replaced; readers still mapping it see it closed. The ring is left when the
+ * writer is closed so late readers can get the last samples, remove it with
+ * ShmRingWriter::unlink (or rm /dev/shm/NAME).
+ */
+class ShmRingWriter {
+public:
+	ShmRingWriter();
+	~ShmRingWriter();
+
+	/**
+	 * Create the ring.
+	 * @param name Shared memory name, a leading slash is added if missing.
+	 * @param capacity Slots, rounded up to a power of two.
+	 * @return 0 on success or errno.
+	 */
+	int open(const char* name, const struct samplefile_header& header, uint64_t capacity = SHMRING_CAPACITY);
+
+	/**
+	 * Mark the ring closed and unmap it.
+	 */
+	void close();
+
+	bool is_open() const { return ctrl != nullptr; }
+
+	void write_sample(int64_t time, double value);
+	void write_sample(int64_t time, uint64_t value);
+
+	static int unlink(const char* name);
+
+private:
+	void publish(int64_t time, uint64_t value);
+
+	struct shmring_control* ctrl;
+	struct shmring_slot* slots;
+	size_t size;
+	uint64_t mask;
+	uint64_t head;
+};
+
+/**
+ * Follows a ring without blocking the writer.
+ *
+ * Usage:
+ *   ShmRingReader reader;
+ *   if ( reader.open("bitrate") != 0 ) { ... }
+ *   struct sample_record rec;
+ *   for (;;){
+ *     while ( reader.read(&rec) ) { ... }
+ *     if ( reader.closed() ) break;
+ *     usleep(1000);
+ *   }
+ */
+class ShmRingReader {
+public:
+	ShmRingReader();
+	~ShmRingReader();
+
+	/**
+	 * Map a ring.
+	 * @param from_start Begin with the oldest record still in the ring instead
+	 *                   of the next one published.
+	 * @return 0 on success, errno, EINVAL if it isn't a ring of a supported
+	 *         version and EAGAIN if the writer hasn't finished creating it.
+	 */
+	int open(const char* name, bool from_start = false);
+	void close();
+
+	const struct samplefile_header& header() const { return ctrl->header; }
+
+	/**
+	 * Read the next record.
+	 * @return false if no new record has been published.
+	 */
+	bool read(struct sample_record* rec);
+
+	/**
+	 * Tells if the writer is done (or was replaced by a new ring). Records
+	 * published before may still be read.
+	 */
+	bool closed() const;
+
+	/**
+	 * Records overwritten before they could be read.
+	 */
+	uint64_t lost() const { return dropped; }
+
+private:
+	const struct shmring_control* ctrl;
+	const struct shmring_slot* slots;
+	size_t size;
+	uint64_t mask;
+	uint64_t next;                    /* next record to read */
+	uint64_t dropped;
+};
+
+#endif /* SHMRING_H */
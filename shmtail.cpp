@@ -0,0 +1,185 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <cmath>
+#include <csignal>
+#include <cinttypes>
+#include <getopt.h>
+#include <unistd.h>
+
+#include "shmring.hpp"
+
+static char delimiter = '\t';
+static bool from_start = false;
+static bool retry = false;
+static uint64_t max_samples = 0;
+static useconds_t interval = 1000;
+static volatile sig_atomic_t keep_running = 1;
+const char* program_name = NULL;
+
+static void handle_sigint(int signum){
+	keep_running = 0;
+}
+
+static void print_record(const struct samplefile_header& header, const struct sample_record& rec){
+	const int digits = -header.time_exponent;
+	const int64_t unit = (int64_t)pow(10, digits);
+	const int64_t sec = rec.time / unit;
+	const int64_t frac = rec.time < 0 ? -(rec.time % unit) : rec.time % unit;
+	const char* sign = (rec.time < 0 && sec == 0) ? "-" : "";
+	if ( header.value_type == SAMPLE_U64 ){
+		fprintf(stdout, "%s%" PRId64 ".%0*" PRId64 "%c%" PRIu64 "\n", sign, sec, digits, frac, delimiter, rec.count);
+	} else {
+		fprintf(stdout, "%s%" PRId64 ".%0*" PRId64 "%c%.15f\n", sign, sec, digits, frac, delimiter, rec.value);
+	}
+}
+
+/**
+ * Follow a ring until the writer closes it.
+ * @param first False when waiting for a ring replacing one already followed.
+ * @return false if the ring couldn't be opened.
+ */
+static bool follow(const char* name, bool first, uint64_t* samples){
+	ShmRingReader reader;
+	int ret;
+	while ( (ret = reader.open(name, first ? from_start : true)) != 0 ){
+		if ( !retry || !(ret == ENOENT || ret == EAGAIN) || !keep_running ){
+			fprintf(stderr, "%s: %s: %s\n", program_name, name, strerror(ret));
+			return false;
+		}
+		usleep(interval);
+	}
+
+	/* still the ring already followed */
+	if ( !first && reader.closed() ){
+		usleep(interval);
+		return true;
+	}
+
+	uint64_t lost = 0;
+	struct sample_record rec;
+	while ( keep_running ){
+		bool any = false;
+		while ( keep_running && reader.read(&rec) ){
+			print_record(reader.header(), rec);
+			any = true;
+			if ( max_samples > 0 && ++*samples >= max_samples ){
+				keep_running = 0;
+			}
+		}
+
+		if ( reader.lost() != lost ){
+			fprintf(stderr, "%s: %" PRIu64 " samples lost, reading too slow.\n", program_name, reader.lost() - lost);
+			lost = reader.lost();
+		}
+
+		if ( any ){
+			fflush(stdout);
+		} else if ( reader.closed() ){
+			break;
+		} else {
+			usleep(interval);
+		}
+	}
+
+	return true;
+}
+
+static const char* short_options = "bFn:i:d:h";
+static struct option long_options[]= {
+	{"from-start",       no_argument,       0, 'b'},
+	{"retry",            no_argument,       0, 'F'},
+	{"samples",          required_argument, 0, 'n'},
+	{"interval",         required_argument, 0, 'i'},
+	{"delimiter",        required_argument, 0, 'd'},
+	{"help",             no_argument,       0, 'h'},
+	{0, 0, 0, 0} /* sentinel */
+};
+
+static void show_usage(void){
+	printf("%s-" VERSION "\n", program_name);
+	printf("Usage: %s [OPTIONS] NAME\n", program_name);
+	printf("Prints the samples published to a shared-memory ring (--format=shm) as they\n"
+	       "arrive, until the writer is done. Any number of readers can follow a ring\n"
+	       "without slowing down the writer, samples are lost if a reader falls more\n"
+	       "than a ring behind.\n\n"
+	       "  -b, --from-start            Begin with the oldest sample in the ring instead\n"
+	       "                              of the next one.\n"
+	       "  -F, --retry                 Wait for the ring to be created and follow it\n"
+	       "                              when it is replaced, e.g. the tool is restarted.\n"
+	       "  -n, --samples=N             Exit after N samples.\n"
+	       "  -i, --interval=MS           Poll interval in milliseconds [default: 1].\n"
+	       "  -d, --delimiter=CHAR        Column delimiter [default: tab].\n"
+	       "  -h, --help                  This text.\n\n");
+}
+
+int main(int argc, char **argv){
+	/* extract program name from path. e.g. /path/to/MArCd -> MArCd */
+	const char* separator = strrchr(argv[0], '/');
+	if ( separator ){
+		program_name = separator + 1;
+	} else {
+		program_name = argv[0];
+	}
+
+	int op, option_index = -1;
+	while ( (op = getopt_long(argc, argv, short_options, long_options, &option_index)) != -1 ){
+		switch (op){
+		case 0:   /* long opt */
+		case '?': /* unknown opt */
+			break;
+
+		case 'b': /* --from-start */
+			from_start = true;
+			break;
+
+		case 'F': /* --retry */
+			retry = true;
+			break;
+
+		case 'n': /* --samples */
+			max_samples = strtoull(optarg, nullptr, 10);
+			break;
+
+		case 'i': /* --interval */
+			interval = (useconds_t)(atof(optarg) * 1000);
+			break;
+
+		case 'd': /* --delimiter */
+			delimiter = optarg[0];
+			break;
+
+		case 'h':
+			show_usage();
+			return 0;
+
+		default:
+			fprintf (stderr, "%s: ?? getopt returned character code 0%o ??\n", program_name, op);
+		}
+	}
+
+	if ( argc - optind != 1 ){
+		fprintf(stderr, "%s: expected a ring name, see --help.\n", program_name);
+		return 1;
+	}
+	const char* name = argv[optind];
+
+	/* handle C-c */
+	signal(SIGINT, handle_sigint);
+
+	uint64_t samples = 0;
+	bool first = true;
+	do {
+		if ( !follow(name, first, &samples) ){
+			return 1;
+		}
+		first = false;
+	} while ( retry && keep_running );
+
+	return 0;
+}
@@ -0,0 +1,252 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "stats.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cinttypes>
+#include <cerrno>
+#include <csignal>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <pthread.h>
+
+extern const char* program_name;
+
+thread_local struct stats_block* stats_thread_block = nullptr;
+bool stats_timing = true;
+
+static std::mutex mutex;
+static std::vector<struct stats_block*> blocks;   /* never freed, threads may exit */
+static std::vector<const stream_stat_t*> streams; /* open streams */
+static uint64_t stream_read_done = 0;              /* packets read by closed streams */
+static double interval = 0.0;
+static const char* summary_name = nullptr;
+
+/* reference for converting cycles to seconds */
+static const uint64_t clock_begin = stats_clock();
+static const std::chrono::steady_clock::time_point time_begin = std::chrono::steady_clock::now();
+
+static const char* counter_name[STAT_COUNTERS] = {"matched", "ignored", "samples", "split", "skipped", "late"};
+static const char* stage_name[STAGE_COUNT] = {"read", "sample", "accumulate", "output"};
+
+struct stats_block* stats_register(){
+	struct stats_block* block = new stats_block;
+	for ( auto& cur: block->counter ) cur.store(0);
+	for ( auto& cur: block->cycles ) cur.store(0);
+	block->timed.store(0);
+	block->tick = 0;
+	block->active = false;
+	block->depth = 0;
+	block->start = 0;
+
+	std::lock_guard<std::mutex> lock(mutex);
+	blocks.push_back(block);
+	stats_thread_block = block;
+	return block;
+}
+
+void stats_begin_stream(const stream_stat_t* stat){
+	std::lock_guard<std::mutex> lock(mutex);
+	streams.push_back(stat);
+}
+
+void stats_end_stream(const stream_stat_t* stat){
+	std::lock_guard<std::mutex> lock(mutex);
+	auto it = std::find(streams.begin(), streams.end(), stat);
+	if ( it != streams.end() ){
+		stream_read_done += stat->read;
+		streams.erase(it);
+	}
+}
+
+/**
+ * Totals of all threads.
+ */
+struct stats_total {
+	uint64_t read;
+	uint64_t counter[STAT_COUNTERS];
+	uint64_t cycles[STAGE_COUNT];     /* estimated for all packets */
+	uint64_t timed;
+	double clock_rate;                /* cycles per second */
+	double elapsed;                   /* seconds */
+};
+
+static struct stats_total total(){
+	struct stats_total sum;
+	memset(&sum, 0, sizeof(sum));
+
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		sum.read = stream_read_done;
+		for ( const stream_stat_t* stat: streams ){
+			sum.read += stat->read;
+		}
+		for ( const struct stats_block* block: blocks ){
+			for ( int i = 0; i < STAT_COUNTERS; i++ ){
+				sum.counter[i] += block->counter[i].load(std::memory_order_relaxed);
+			}
+			for ( int i = 0; i < STAGE_COUNT; i++ ){
+				sum.cycles[i] += block->cycles[i].load(std::memory_order_relaxed) * STATS_TIMING_PERIOD;
+			}
+			sum.timed += block->timed.load(std::memory_order_relaxed);
+		}
+	}
+
+	const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - time_begin;
+	sum.elapsed = elapsed.count();
+	sum.clock_rate = sum.elapsed > 0.0 ? (stats_clock() - clock_begin) / sum.elapsed : 0.0;
+	return sum;
+}
+
+void stats_report(FILE* dst){
+	const struct stats_total sum = total();
+
+	fprintf(dst, "%s: %'" PRIu64 " read, %'" PRIu64 " matched, %'" PRIu64 " ignored, %'" PRIu64 " samples, %'" PRIu64 " split packets, %'" PRIu64 " intervals skipped, %'" PRIu64 " late.\n",
+	        program_name, sum.read, sum.counter[STAT_MATCHED], sum.counter[STAT_IGNORED], sum.counter[STAT_SAMPLES], sum.counter[STAT_SPLIT], sum.counter[STAT_SKIPPED], sum.counter[STAT_LATE]);
+
+	if ( !stats_timing || sum.timed == 0 ) return;
+
+	uint64_t cycles = 0;
+	for ( int i = 0; i < STAGE_COUNT; i++ ){
+		cycles += sum.cycles[i];
+	}
+
+	const uint64_t packets = std::max<uint64_t>(sum.counter[STAT_MATCHED], 1);
+	fprintf(dst, "%s:", program_name);
+	for ( int i = 0; i < STAGE_COUNT; i++ ){
+		fprintf(dst, " %s %.1f%% (%.0f cycles/packet)%s", stage_name[i],
+		        cycles > 0 ? 100.0 * sum.cycles[i] / cycles : 0.0, (double)sum.cycles[i] / packets,
+		        i + 1 < STAGE_COUNT ? "," : "");
+	}
+	fprintf(dst, ", 1 in %d packets timed.\n", STATS_TIMING_PERIOD);
+}
+
+void stats_summary(FILE* dst){
+	const struct stats_total sum = total();
+
+	fprintf(dst, "{\"program\":\"%s\",\"elapsed\":%.6f,\"read\":%" PRIu64, program_name, sum.elapsed, sum.read);
+	for ( int i = 0; i < STAT_COUNTERS; i++ ){
+		fprintf(dst, ",\"%s\":%" PRIu64, counter_name[i], sum.counter[i]);
+	}
+	fprintf(dst, ",\"timed\":%" PRIu64 ",\"timing_period\":%d,\"cycles_per_second\":%.0f,\"cycles\":{", sum.timed, STATS_TIMING_PERIOD, sum.clock_rate);
+	for ( int i = 0; i < STAGE_COUNT; i++ ){
+		fprintf(dst, "%s\"%s\":%" PRIu64, i > 0 ? "," : "", stage_name[i], sum.cycles[i]);
+	}
+	fprintf(dst, "},\"seconds\":{");
+	for ( int i = 0; i < STAGE_COUNT; i++ ){
+		fprintf(dst, "%s\"%s\":%.6f", i > 0 ? "," : "", stage_name[i], sum.clock_rate > 0.0 ? sum.cycles[i] / sum.clock_rate : 0.0);
+	}
+	fprintf(dst, "}}\n");
+}
+
+static void write_summary(){
+	FILE* dst = strcmp(summary_name, "-") == 0 ? stderr : fopen(summary_name, "w");
+	if ( !dst ){
+		fprintf(stderr, "%s: %s: %s\n", program_name, summary_name, strerror(errno));
+		return;
+	}
+	stats_summary(dst);
+	if ( dst != stderr ){
+		fclose(dst);
+	}
+}
+
+/**
+ * Shows the stats on SIGUSR1 and every interval seconds. The signal is
+ * blocked in all other threads and received with sigtimedwait, so the
+ * report isn't written from a signal handler. All other signals are
+ * blocked in this thread and left to the main thread.
+ */
+static void reporter(sigset_t set){
+	for (;;){
+		int sig;
+		if ( interval > 0.0 ){
+			struct timespec ts;
+			ts.tv_sec = (time_t)interval;
+			ts.tv_nsec = (long)((interval - ts.tv_sec) * 1e9);
+			sig = sigtimedwait(&set, nullptr, &ts);
+		} else {
+			sig = sigwaitinfo(&set, nullptr);
+		}
+
+		if ( sig == SIGUSR1 || (sig == -1 && errno == EAGAIN) ){
+			stats_report(stderr);
+		}
+	}
+}
+
+/**
+ * Value of option name (either "--name=value" or "--name value") at argv[*i].
+ * @return nullptr if argv[*i] is another argument.
+ */
+static const char* option_value(int argc, char** argv, int* i, const char* name){
+	const size_t len = strlen(name);
+	const char* arg = argv[*i];
+	if ( strncmp(arg, name, len) != 0 ) return nullptr;
+	if ( arg[len] == '=' ){
+		return arg + len + 1;
+	}
+	if ( arg[len] == 0 && *i + 1 < argc ){
+		return argv[++*i];
+	}
+	return nullptr;
+}
+
+int stats_from_argv(int* argc, char** argv){
+	int dst = 1;
+	for ( int i = 1; i < *argc; i++ ){
+		const char* value;
+
+		if ( strcmp(argv[i], "--") == 0 ){
+			/* keep the rest as is */
+			while ( i < *argc ) argv[dst++] = argv[i++];
+			break;
+		} else if ( (value = option_value(*argc, argv, &i, "--stats-interval")) ){
+			interval = atof(value);
+			if ( interval < 0.0 ){
+				fprintf(stderr, "%s: invalid --stats-interval \"%s\".\n", program_name, value);
+				return 1;
+			}
+		} else if ( (value = option_value(*argc, argv, &i, "--stats-summary")) ){
+			summary_name = value;
+		} else if ( strcmp(argv[i], "--no-stats-timing") == 0 ){
+			stats_timing = false;
+		} else {
+			argv[dst++] = argv[i];
+		}
+	}
+	*argc = dst;
+	argv[dst] = nullptr;
+
+	if ( summary_name ){
+		atexit(write_summary);
+	}
+
+	sigset_t set;
+	sigemptyset(&set);
+	sigaddset(&set, SIGUSR1);
+	pthread_sigmask(SIG_BLOCK, &set, nullptr);
+
+	sigset_t all, old;
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+	std::thread(reporter, set).detach();
+	pthread_sigmask(SIG_SETMASK, &old, nullptr);
+
+	return 0;
+}
+
+void stats_from_argv_usage(){
+	printf("Statistics:\n"
+	       "Counters and the time spent reading, sampling, accumulating and writing are\n"
+	       "shown on SIGUSR1.\n"
+	       "  --stats-interval=SECONDS    Also show them every SECONDS.\n"
+	       "  --stats-summary=FILE        Write them as JSON to FILE (- for stderr) at exit.\n"
+	       "  --no-stats-timing           Only count, don't time the stages.\n\n");
+}
@@ -0,0 +1,166 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <caputils/caputils.h>
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#else
+#include <chrono>
+#endif
+
+/**
+ * Events counted by the extractors.
+ */
+enum StatCounter {
+	STAT_MATCHED,                     /* packets returned by stream_read */
+	STAT_IGNORED,                     /* marker packets ignored */
+	STAT_SAMPLES,                     /* samples written to the output, counted by the tools */
+	STAT_SPLIT,                       /* packets spanning several intervals */
+	STAT_SKIPPED,                     /* idle intervals fast-forwarded in one step */
+	STAT_LATE,                        /* live mode: packets arriving after their interval was closed */
+	STAT_COUNTERS
+};
+
+/**
+ * Stages the time is spent in. Stages nest (e.g. output is called from
+ * calculate_samples) and each is only charged its own time.
+ */
+enum StatStage {
+	STAGE_READ,                       /* stream_read */
+	STAGE_SAMPLE,                     /* calculate_samples, i.e. sizes and splitting */
+	STAGE_ACCUMULATE,                 /* Extractor::accumulate */
+	STAGE_OUTPUT,                     /* write_sample and friends */
+	STAGE_COUNT
+};
+
+/* one packet in STATS_TIMING_PERIOD is timed, the time of the others is
+ * estimated from it */
+#define STATS_TIMING_PERIOD 64
+#define STATS_MAX_DEPTH 8
+
+/**
+ * Counters of a single thread. Only the owning thread writes them, so
+ * relaxed loads and stores suffice and the reporter may read them at any
+ * time.
+ */
+struct stats_block {
+	std::atomic<uint64_t> counter[STAT_COUNTERS];
+	std::atomic<uint64_t> cycles[STAGE_COUNT];
+	std::atomic<uint64_t> timed;      /* packets timed */
+
+	/* timing state, owning thread only */
+	uint32_t tick;
+	bool active;
+	int depth;
+	enum StatStage stack[STATS_MAX_DEPTH];
+	uint64_t start;
+};
+
+extern thread_local struct stats_block* stats_thread_block;
+extern bool stats_timing;
+
+/**
+ * Counters of the calling thread, allocated on first use.
+ */
+struct stats_block* stats_register();
+
+inline struct stats_block* stats_local(){
+	struct stats_block* block = stats_thread_block;
+	return block ? block : stats_register();
+}
+
+inline uint64_t stats_clock(){
+#if defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#else
+	return std::chrono::steady_clock::now().time_since_epoch().count();
+#endif
+}
+
+inline void stats_add(enum StatCounter counter, uint64_t n = 1){
+	std::atomic<uint64_t>& value = stats_local()->counter[counter];
+	value.store(value.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+}
+
+/**
+ * Called before each packet is read or processed, decides if the packet is
+ * timed.
+ */
+inline void stats_next_packet(){
+	struct stats_block* block = stats_local();
+	block->active = stats_timing && ++block->tick % STATS_TIMING_PERIOD == 0;
+	if ( block->active ){
+		block->timed.store(block->timed.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+	}
+}
+
+/**
+ * Charges the time until it goes out of scope to a stage, if the current
+ * packet is timed.
+ */
+class StageTimer {
+public:
+	StageTimer(enum StatStage stage)
+		: block(stats_local()) {
+
+		if ( !block->active || block->depth == STATS_MAX_DEPTH ){
+			block = nullptr;
+			return;
+		}
+
+		const uint64_t now = stats_clock();
+		if ( block->depth > 0 ){
+			charge(block->stack[block->depth - 1], now);
+		}
+		block->stack[block->depth++] = stage;
+		block->start = now;
+	}
+
+	~StageTimer(){
+		if ( !block ) return;
+		const uint64_t now = stats_clock();
+		charge(block->stack[--block->depth], now);
+		block->start = now;
+	}
+
+private:
+	void charge(enum StatStage stage, uint64_t now){
+		std::atomic<uint64_t>& value = block->cycles[stage];
+		value.store(value.load(std::memory_order_relaxed) + (now - block->start), std::memory_order_relaxed);
+	}
+
+	struct stats_block* block;
+};
+
+/**
+ * Include the read counter of a stream in the stats. Streams may be processed
+ * concurrently (e.g. timescale --jobs).
+ */
+void stats_begin_stream(const stream_stat_t* stat);
+void stats_end_stream(const stream_stat_t* stat);
+
+/**
+ * Write the counters and the time per stage.
+ */
+void stats_report(FILE* dst);
+
+/**
+ * Write the counters and the time per stage as a single JSON object.
+ */
+void stats_summary(FILE* dst);
+
+/**
+ * Parse and remove the stats options from argv (see stats_from_argv_usage)
+ * and start the thread showing stats on SIGUSR1 and periodically. Must be
+ * called before any other thread is started.
+ * @return 0 on success.
+ */
+int stats_from_argv(int* argc, char** argv);
+
+void stats_from_argv_usage();
+
+#endif /* STATS_H */
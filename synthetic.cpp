@@ -0,0 +1,149 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "synthetic.hpp"
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <arpa/inet.h>
+#include <netinet/ip.h>
+#include <netinet/tcp.h>
+#include <netinet/udp.h>
+
+static const uint64_t PICOSECONDS = 1000000000000ULL;
+static const uint32_t JUMBO_SIZE = 9000;
+
+struct synthetic_config synthetic_defaults(){
+	struct synthetic_config config;
+	config.packet_rate = 100000.0;
+	config.sizes = {{64, 7.0}, {576, 4.0}, {1500, 1.0}};
+	config.jumbo = 0.0;
+	config.idle_probability = 1e-4;
+	config.idle_length = 0.05;
+	config.flows = 1000;
+	config.udp = 0.2;
+	config.seed = 4711;
+	config.start = 1700000000;
+	return config;
+}
+
+int synthetic_parse_sizes(const char* str, std::vector<struct synthetic_size>& sizes){
+	std::vector<struct synthetic_size> list;
+
+	char* tmp = strdup(str);
+	char* saveptr = nullptr;
+	for ( char* tok = strtok_r(tmp, ",", &saveptr); tok; tok = strtok_r(nullptr, ",", &saveptr) ){
+		char* end;
+		long size = strtol(tok, &end, 10);
+		double weight = 1.0;
+		if ( *end == ':' ){
+			weight = atof(end + 1);
+		} else if ( *end != 0 ){
+			size = -1;
+		}
+		if ( size < 64 || size > 65535 || weight <= 0.0 ){
+			free(tmp);
+			return 1;
+		}
+		list.push_back({(uint32_t)size, weight});
+	}
+	free(tmp);
+
+	if ( list.empty() ){
+		return 1;
+	}
+
+	sizes = list;
+	return 0;
+}
+
+SyntheticTraffic::SyntheticTraffic(const struct synthetic_config& config)
+	: config(config)
+	, gen(config.seed)
+	, interarrival(config.packet_rate)
+	, idle(1.0 / config.idle_length)
+	, jumbo(config.jumbo)
+	, gap(config.idle_probability)
+	, flow(0, std::max(config.flows, 1U) - 1)
+	, sec(config.start)
+	, psec(0) {
+
+	std::vector<double> weights;
+	for ( const struct synthetic_size& cur: config.sizes ){
+		weights.push_back(cur.weight);
+	}
+	size_dist = std::discrete_distribution<size_t>(weights.begin(), weights.end());
+
+	memset(buffer, 0, sizeof(buffer));
+	cap_head* cp = (cap_head*)buffer;
+	memcpy(cp->nic, "synth0", 6);
+	memcpy(cp->mampid, "synth", 5);
+}
+
+const cap_head* SyntheticTraffic::next(){
+	cap_head* cp = (cap_head*)buffer;
+
+	/* timestamp of this packet */
+	cp->ts.tv_sec = sec;
+	cp->ts.tv_psec = psec;
+
+	const unsigned int id = flow(gen);
+	const bool udp = (id % 1000) < config.udp * 1000;
+	const uint32_t size = jumbo(gen) ? JUMBO_SIZE : config.sizes[size_dist(gen)].size;
+	const size_t l4_size = udp ? sizeof(struct udphdr) : sizeof(struct tcphdr);
+	const size_t headers = ETH_HLEN + sizeof(struct ip) + l4_size;
+	const uint32_t len = std::max<uint32_t>(size, headers);
+
+	cp->len = len;
+	cp->caplen = std::min<uint32_t>(len, SYNTHETIC_SNAPLEN);
+
+	char* payload = cp->payload;
+	memset(payload, 0, SYNTHETIC_SNAPLEN);
+
+	struct ethhdr* eth = (struct ethhdr*)payload;
+	eth->h_dest[5] = 1;
+	eth->h_source[5] = 2;
+	eth->h_proto = htons(ETH_P_IP);
+
+	struct ip* ip = (struct ip*)(payload + ETH_HLEN);
+	ip->ip_v = 4;
+	ip->ip_hl = 5;
+	ip->ip_len = htons(len - ETH_HLEN);
+	ip->ip_ttl = 64;
+	ip->ip_p = udp ? IPPROTO_UDP : IPPROTO_TCP;
+	ip->ip_src.s_addr = htonl(0x0a000000 | (id & 0xffff));
+	ip->ip_dst.s_addr = htonl(0x0a010000 | ((id >> 16) & 0xffff));
+
+	char* l4 = payload + ETH_HLEN + sizeof(struct ip);
+	const uint16_t sport = 1024 + id % 60000;
+	if ( udp ){
+		struct udphdr* uh = (struct udphdr*)l4;
+		uh->source = htons(sport);
+		uh->dest = htons(53);
+		uh->len = htons(len - ETH_HLEN - sizeof(struct ip));
+	} else {
+		struct tcphdr* th = (struct tcphdr*)l4;
+		th->source = htons(sport);
+		th->dest = htons(80);
+		th->doff = 5;
+		th->ack = 1;
+	}
+
+	/* time of the next packet */
+	double step = interarrival(gen);
+	if ( gap(gen) ){
+		step += idle(gen);
+	}
+	psec += (uint64_t)(step * PICOSECONDS);
+	sec += psec / PICOSECONDS;
+	psec %= PICOSECONDS;
+
+	return cp;
+}
+
+size_t SyntheticTraffic::record_size() const {
+	const cap_head* cp = (const cap_head*)buffer;
+	return sizeof(cap_head) + cp->caplen;
+}
@@ -0,0 +1,82 @@
+#ifndef SYNTHETIC_H
+#define SYNTHETIC_H
+
+#include <caputils/caputils.h>
+#include <caputils/packet.h>
+#include <cstdint>
+#include <random>
+#include <vector>
+
+/* bytes of each generated packet which are captured (headers only) */
+#define SYNTHETIC_SNAPLEN 96
+
+/**
+ * Frame size drawn with a relative weight, see synthetic_parse_sizes.
+ */
+struct synthetic_size {
+	uint32_t size;                    /* frame length in bytes */
+	double weight;
+};
+
+/**
+ * Parameters of a synthetic trace.
+ */
+struct synthetic_config {
+	double packet_rate;               /* mean packets per second while busy */
+	std::vector<struct synthetic_size> sizes;
+	double jumbo;                     /* fraction of 9000 byte frames */
+	double idle_probability;          /* chance of an idle gap after a packet */
+	double idle_length;               /* mean idle gap in seconds */
+	unsigned int flows;               /* number of distinct 5-tuples */
+	double udp;                       /* fraction of flows using UDP */
+	uint64_t seed;
+	uint64_t start;                   /* timestamp of the first packet, in seconds */
+};
+
+/**
+ * Default parameters: 100 kpkt/s of a 64/576/1500 byte mix over 1000 flows
+ * with occasional idle gaps.
+ */
+struct synthetic_config synthetic_defaults();
+
+/**
+ * Parse a size mix such as "64:7,576:4,1500:1" (size:weight, weight defaults
+ * to 1).
+ * @return 0 on success.
+ */
+int synthetic_parse_sizes(const char* str, std::vector<struct synthetic_size>& sizes);
+
+/**
+ * Generates Ethernet/IPv4 TCP and UDP packets with the headers captured, as
+ * an endless stream with exponential inter-arrival times. Flows are picked
+ * uniformly. The same seed gives the same trace.
+ */
+class SyntheticTraffic {
+public:
+	SyntheticTraffic(const struct synthetic_config& config);
+
+	/**
+	 * Generate the next packet. The header is valid until the next call.
+	 */
+	const cap_head* next();
+
+	/**
+	 * Size of the packet returned by next, including the capture header.
+	 */
+	size_t record_size() const;
+
+private:
+	struct synthetic_config config;
+	std::mt19937_64 gen;
+	std::discrete_distribution<size_t> size_dist;
+	std::exponential_distribution<double> interarrival;
+	std::exponential_distribution<double> idle;
+	std::bernoulli_distribution jumbo;
+	std::bernoulli_distribution gap;
+	std::uniform_int_distribution<unsigned int> flow;
+	uint64_t sec;
+	uint64_t psec;
+	alignas(cap_head) char buffer[sizeof(cap_head) + SYNTHETIC_SNAPLEN];
+};
+
+#endif /* SYNTHETIC_H */
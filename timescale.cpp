@@ -11,12 +11,15 @@
 #include <csignal>
 #include <cinttypes>
 #include <getopt.h>
-#include <functional>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
 
-#include "extract.hpp"
+#include "timescale.hpp"
+#include "stats.hpp"
 
 static const char* iface = NULL;
-static const stream_stat* stat = NULL;
 const char* program_name = NULL;
 
 static void handle_sigint(int signum){
@@ -28,265 +31,131 @@ static void handle_sigint(int signum){
 	keep_running = false;
 }
 
-static void show_stats(int signum){
-	if ( !stat ) return;
-	fprintf(stderr, "%s:  %'" PRIu64 " packets has been read.\n", program_name, stat->read);
-};
-
-static double my_round (double value){
-	static const double bias = 0.0005;
-	return (floor(value + bias));
-}
+/**
+ * Process a single file.
+ * @return false if the file couldn't be opened.
+ */
+static bool process_file(Timescale& app, const char* filename, struct filter* filter){
+	stream_t stream;
+	stream_addr_t addr;
+	int ret;
 
-static double fastpow(double x, int y){
-	switch ( y ){
-	case 1: return x;
-	case 2: return x*x;
-	case 3: return x*x*x;
-	default: return pow(x, (double)y);
+	stream_addr_str(&addr, filename, 0);
+	if ( (ret=stream_open(&stream, &addr, nullptr, 0)) != 0 ) {
+		fprintf(stderr, "%s: stream_open() failed with code 0x%08X: %s\n", program_name, ret, caputils_error_string(ret));
+		return false;
 	}
+	app.reset();
+	app.process_stream(stream, filter);
+	stream_close(stream);
+	return true;
 }
 
-class Bin {
-public:
-	Bin(int level, int timescale, int moments, Bin* next = nullptr)
-		: next(next)
-		, level(level)
-		, timescale(timescale)
-		, num_moments(moments)
-		, accumulator(nullptr)
-		, previous(0.0)
-		, counter(0) {
-
-		setup_accumulator();
-	}
-
-	~Bin(){
-		delete [] accumulator;
-		delete next;
-	}
-
-	void setup_accumulator(){
-		accumulator = new qd_real[num_moments];
-		for ( int i = 0; i < num_moments; i++ ){
-			accumulator[i] = 0.0;
-		}
-	}
-
-	/**
-	 * Called for each value.
-	 */
-	void feed(double value){
-		for ( int i = 0; i < num_moments; i++ ){
-			accumulator[i] += fastpow(value, i+1);
-		}
-
-		if ( ++counter % timescale == 0 ){
-			sample();
-		}
-	}
-
-	/**
-	 * Called when enough datapoints was gathered.
-	 */
-	void sample(){
-		const double mean = to_double((accumulator[0] - previous) / timescale);
-		previous = accumulator[0];
-
-		if ( !next ){
-			next = new Bin(level+1, timescale, num_moments);
-		}
-		next->feed(mean);
-	}
-
-	void recursive_visit(std::function<void(Bin*)> callback){
-		callback(this);
-		if ( next ){
-			next->recursive_visit(callback);
-		}
-	}
-
-	void recursive_visit(std::function<void(const Bin*)> callback) const {
-		callback(this);
-		if ( next ){
-			((const Bin*)next)->recursive_visit(callback);
-		}
-	}
-
-private:
-	friend class Timescale;
-	friend class DefaultOutput;
-	friend class CSVOutput;
-
-	Bin* next;
-	const int level;
-	const int timescale;
-	const int num_moments;
-	qd_real* accumulator;
-	qd_real previous;
-	int counter;
-};
-
-class Output {
-public:
-	virtual ~Output(){}
-	virtual void write_output(const Bin* bin, int timescale, int num_moments, double sampleFrequency, double tSample) = 0;
-};
-
-class DefaultOutput: public Output {
-public:
-	virtual void write_output(const Bin* bin, int timescale, int num_moments, double sampleFrequency, double tSample){
-		int width[num_moments];
-		for ( int i = 0; i < num_moments; i++ ){
-			width[i] = str_width_for_moment(bin, i);
-		}
-
-		fprintf(stdout, "sampleFrequency: %.2fHz\n", sampleFrequency);
-		fprintf(stdout, "tSample:         %fs\n", tSample);
-		fprintf(stdout, "timescale:       %d\n", timescale);
-		fprintf(stdout, "\n");
-
-		fprintf(stdout, "Tscale   ");
-		for ( int i = 0; i < num_moments; i++ ){
-			fprintf(stdout, "%*s%d ", width[i], "M", i+1);
-		}
-		fprintf(stdout, " Samples\n");
-
-		bin->recursive_visit([&](const Bin* cur){
-			fprintf(stdout, "%-8g ", pow((double)cur->timescale, (double)cur->level) * tSample);
-			for ( int i = 0; i < num_moments; i++ ){
-				fprintf(stdout, "%*g ", width[i]+1, to_double(cur->accumulator[i] / cur->counter));
+/**
+ * Process files using a pool of worker threads. Each worker records the
+ * sampled bitrate of a file and the files are replayed into app in order, so
+ * the result is identical to processing them sequentially. Workers stay at
+ * most 2*jobs files ahead of the merge to bound memory.
+ */
+static void process_parallel(Timescale& app, const char** filename, int num_files, struct filter* filter, int jobs){
+	std::vector<Timescale*> result(num_files, nullptr);
+	std::vector<bool> done(num_files, false);
+	std::mutex mutex;
+	std::condition_variable cond;
+	int next = 0;
+	int merged = 0;
+
+	auto worker = [&](){
+		std::unique_lock<std::mutex> lock(mutex);
+		for (;;){
+			cond.wait(lock, [&](){ return next >= num_files || next < merged + 2 * jobs; });
+			if ( next >= num_files ) break;
+			const int i = next++;
+			lock.unlock();
+
+			Timescale* cur = nullptr;
+			if ( keep_running ){
+				cur = new Timescale;
+				cur->set_parameters(app);
+				cur->set_record(true);
+				if ( !process_file(*cur, filename[i], filter) ){
+					delete cur;
+					cur = nullptr;
+				}
 			}
-			fprintf(stdout, " %d\n", cur->counter);
-		});
-	}
-
-private:
-	size_t str_width_for_moment(const Bin* bin, int index){
-		size_t max = 0;
-		char buf[64];
-		bin->recursive_visit([&](const Bin* cur){
-			size_t width = snprintf(buf, sizeof(buf), "%g", to_double(cur->accumulator[index] / cur->counter));
-			max = width > max ? width : max;
-		});
-		return max;
-	}
-};
 
-class CSVOutput: public Output {
-public:
-	CSVOutput(char delimiter, bool show_header)
-		: delimiter(delimiter)
-		, show_header(show_header){
-
-	}
-
-	virtual void write_output(const Bin* bin, int timescale, int num_moments, double sampleFrequency, double tSample){
-		if ( show_header ){
-			fprintf(stdout, "\"Tscale (%dx, %.2fHz)\"", timescale, sampleFrequency);
-			for ( int i = 0; i < num_moments; i++ ){
-				fprintf(stdout, "%c\"M%d\"", delimiter, i+1);
-			}
-			fprintf(stdout, "%c\"Samples\"\n", delimiter);
+			lock.lock();
+			result[i] = cur;
+			done[i] = true;
+			cond.notify_all();
 		}
-
-		bin->recursive_visit([&](const Bin* cur){
-			fprintf(stdout, "%g", pow((double)cur->timescale, (double)cur->level) * tSample);
-			for ( int i = 0; i < num_moments; i++ ){
-				fprintf(stdout, "%c%f", delimiter, to_double(cur->accumulator[i] / cur->counter));
-			}
-			fprintf(stdout, "%c%d\n", delimiter, cur->counter);
-		});
 	};
 
-private:
-	char delimiter;
-	bool show_header;
-};
-
-class Timescale: public Extractor {
-public:
-	Timescale()
-		: Extractor()
-		, output(nullptr)
-		, num_moments(3)
-		, timescale(10)
-		, bin(nullptr)
-		, bits(0.0) {
-
-		set_formatter(FORMAT_DEFAULT);
-	}
-
-	virtual ~Timescale(){
-		delete bin;
-		delete output;
-	}
-
-	void set_timescale(int timescale){
-		this->timescale = timescale;
+	std::vector<std::thread> pool;
+	for ( int i = 0; i < std::min(jobs, num_files); i++ ){
+		pool.emplace_back(worker);
 	}
 
-	void set_moments(int moments){
-		num_moments = moments;
-	}
+	for ( int i = 0; i < num_files; i++ ){
+		std::unique_lock<std::mutex> lock(mutex);
+		cond.wait(lock, [&](){ return done[i]; });
+		Timescale* cur = result[i];
+		lock.unlock();
 
-	virtual void set_formatter(enum Formatter format){
-		delete output;
-		switch (format){
-		  case FORMAT_DEFAULT: output = new DefaultOutput; break;
-		  case FORMAT_CSV:     output = new CSVOutput(';', false); break;
-		  case FORMAT_TSV:     output = new CSVOutput('\t', false); break;
-		  case FORMAT_MATLAB:  output = new CSVOutput('\t', true); break;
+		if ( cur ){
+			app.reset();
+			app.replay(*cur);
+			delete cur;
 		}
-	}
 
-	using Extractor::set_formatter;
-
-	virtual void reset(){
-		Extractor::reset();
-
-		if ( !bin ){
-			bin = new Bin(0, timescale, num_moments);
-			bits = 0.0;
-		}
+		lock.lock();
+		merged++;
+		cond.notify_all();
 	}
 
-	void write_summary(){
-		output->write_output(bin, timescale, num_moments, sampleFrequency, to_double(tSample));
-	}
-
-protected:
-	virtual void write_trailer(int index){
-
+	for ( std::thread& thread: pool ){
+		thread.join();
 	}
+}
 
-	virtual void write_sample(double t){
-		const double bitrate = my_round(bits / to_double(tSample));
-		bin->feed(bitrate);
-		bits = 0.0;
+/**
+ * Calculate the moments of a stored bitrate.
+ * @return false if the store couldn't be read.
+ */
+static bool replay_store(Timescale& app, const char* filename){
+	SampleStoreReader reader;
+	int ret;
+	if ( (ret=reader.open(filename)) != 0 ){
+		fprintf(stderr, "%s: %s: %s\n", program_name, filename, ret == EINVAL ? "not a sample store" : strerror(ret));
+		return false;
 	}
-
-	virtual void accumulate(qd_real fraction, unsigned long packet_bits, const cap_head* cp, int counter){
-		bits += my_round(to_double(fraction) * packet_bits);
+	if ( reader.header().quantity != QUANTITY_BITRATE ){
+		fprintf(stderr, "%s: %s: store doesn't hold a bitrate.\n", program_name, filename);
+		return false;
 	}
 
-private:
-	Output* output;
-	int num_moments;
-	int timescale;
-	Bin* bin;
-	double bits;
-};
+	set_store_parameters(app, reader.header());
+	app.reset();
+	app.replay(reader);
+	app.write_summary();
+	return true;
+}
 
-static const char* short_options = "p:q:m:l:f:t:n:h";
+static const char* short_options = "p:q:m:l:f:e:t:n:j:Hu:s:S:h";
 static struct option long_options[]= {
 	{"packets",          required_argument, 0, 'p'},
 	{"level",            required_argument, 0, 'q'},
 	{"sampleFrequency",  required_argument, 0, 'm'},
 	{"linkCapacity",     required_argument, 0, 'l'},
 	{"format",           required_argument, 0, 'f'},
+	{"engine",           required_argument, 0, 'e'},
 	{"timescale",        required_argument, 0, 't'},
 	{"moments",          required_argument, 0, 'n'},
+	{"jobs",             required_argument, 0, 'j'},
+	{"store",            required_argument, 0, 's'},
+	{"from-store",       required_argument, 0, 'S'},
+	{"hurst",            no_argument,       0, 'H'},
+	{"update",           required_argument, 0, 'u'},
 	{"help",             no_argument,       0, 'h'},
 	{0, 0, 0, 0} /* sentinel */
 };
@@ -306,12 +175,23 @@ static void show_usage(void){
 	       "  -l, --linkCapacity          Link capacity in bits per second default 100 Mbps, (eg.input 100e6) \n"
 	       "  -p, --packets=N             Stop after N packets.\n"
 	       "  -f, --format=FORMAT         Set a specific output format. See below for list of supported formats.\n"
+	       "  -e, --engine=ENGINE         Time arithmetic used for sampling, see below [default: qd].\n"
 	       "  -t, --timescale=SCALE       Set timescale [default: 10].\n"
 	       "  -n, --moments=MOMENTS       Show N moments [default: 3].\n"
+	       "  -j, --jobs=N                Process N files in parallel. The result is the\n"
+	       "                              same as processing them in order [default: 1].\n"
+	       "  -H, --hurst                 Show the variance of each level and estimate the Hurst parameter\n"
+	       "                              from a variance-time fit (text formats only).\n"
+	       "  -u, --update=SECONDS        Show the Hurst estimate on stderr every SECONDS of traffic.\n"
+	       "  -s, --store=FILE            Also write the sampled bitrate to a sample store.\n"
+	       "  -S, --from-store=FILE       Read the bitrate from a sample store instead of\n"
+	       "                              files, i.e. repeat the analysis of a stored run.\n"
 	       "  -h, --help                  This text.\n\n");
 
 	output_format_list();
+	output_engine_list();
 	filter_from_argv_usage();
+	stats_from_argv_usage();
 }
 
 int main(int argc, char **argv){
@@ -327,9 +207,15 @@ int main(int argc, char **argv){
 	if ( filter_from_argv(&argc, argv, &filter) != 0 ){
 		return 0; /* error already shown */
 	}
+	if ( stats_from_argv(&argc, argv) != 0 ){
+		return 1;
+	}
 
 	Timescale app;
 	app.set_ignore_marker(true);
+	int jobs = 1;
+	const char* store_name = nullptr;
+	const char* from_store = nullptr;
 
 	int op, option_index = -1;
 	while ( (op = getopt_long(argc, argv, short_options, long_options, &option_index)) != -1 ){
@@ -342,6 +228,10 @@ int main(int argc, char **argv){
 			app.set_formatter(optarg);
 			break;
 
+		case 'e': /* --engine */
+			app.set_time_engine(optarg);
+			break;
+
 		case 'p':
 			app.set_max_packets(atoi(optarg));
 			break;
@@ -370,6 +260,30 @@ int main(int argc, char **argv){
 			app.set_moments(atoi(optarg));
 			break;
 
+		case 'j': /* --jobs */
+			jobs = atoi(optarg);
+			if ( jobs < 1 ){
+				fprintf(stderr, "%s: invalid --jobs \"%s\", using 1.\n", program_name, optarg);
+				jobs = 1;
+			}
+			break;
+
+		case 'H': /* --hurst */
+			app.set_variance_time(true);
+			break;
+
+		case 'u': /* --update */
+			app.set_update_interval(atof(optarg));
+			break;
+
+		case 's': /* --store */
+			store_name = optarg;
+			break;
+
+		case 'S': /* --from-store */
+			from_store = optarg;
+			break;
+
 		case 'h':
 			show_usage();
 			return 0;
@@ -381,39 +295,45 @@ int main(int argc, char **argv){
 
 	/* handle C-c */
 	signal(SIGINT, handle_sigint);
-	signal(SIGUSR1, show_stats);
+
+	if ( from_store ){
+		const bool ok = replay_store(app, from_store);
+		filter_close(&filter);
+		return ok && keep_running ? 0 : 1;
+	}
 
 	if ( optind == argc ){
 		fprintf(stderr, "%s: no input files, see -h for usage.\n", program_name);
 		exit(1);
 	}
 
-	int ret;
-
-	/* Open stream(s) */
-	stream_t stream;
-	stream_addr_t addr;
-	for ( int i = optind; i < argc; i++ ){
-		if ( !keep_running ) break;
-		const char* filename = argv[i];
-
-		stream_addr_str(&addr, filename, 0);
-		if ( (ret=stream_open(&stream, &addr, nullptr, 0)) != 0 ) {
-			fprintf(stderr, "%s: stream_open() failed with code 0x%08X: %s\n", program_name, ret, caputils_error_string(ret));
-			continue;
+	FILE* store_fp = nullptr;
+	SampleStoreWriter* store = nullptr;
+	if ( store_name ){
+		if ( !(store_fp = fopen(store_name, "wb")) ){
+			fprintf(stderr, "%s: %s: %s\n", program_name, store_name, strerror(errno));
+			return 1;
 		}
-		stat = stream_get_stat(stream);
-
-		app.reset();
-		app.process_stream(stream, &filter);
+		store = new SampleStoreWriter(store_fp);
+		app.set_store(store);
+	}
 
-		stream_close(stream);
-		stream = nullptr;
+	if ( jobs > 1 ){
+		process_parallel(app, (const char**)argv + optind, argc - optind, &filter, jobs);
+	} else {
+		for ( int i = optind; i < argc; i++ ){
+			if ( !keep_running ) break;
+			process_file(app, argv[i], &filter);
+		}
 	}
 
 	app.write_summary();
 
 	/* Release resources */
+	if ( store ){
+		delete store;
+		fclose(store_fp);
+	}
 	filter_close(&filter);
 
 	return keep_running ? 0 : 1;
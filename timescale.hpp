@@ -0,0 +1,678 @@
+#ifndef TIMESCALE_H
+#define TIMESCALE_H
+
+#include <cstdio>
+#include <cstring>
+#include <cmath>
+#include <cinttypes>
+#include <functional>
+#include <algorithm>
+#include <vector>
+
+#include "extract.hpp"
+#include "output.hpp"
+#include "samplefile.hpp"
+
+/**
+ * Add b to the compensated sum (sum, c). The rounding error of each addition
+ * is calculated exactly (Knuth's TwoSum) and accumulated in c, so the value of
+ * the sum is sum + c.
+ */
+inline void compensated_add(double& sum, double& c, double b){
+	const double t = sum + b;
+	const double bv = t - sum;
+	c += (sum - (t - bv)) + (b - bv);
+	sum = t;
+}
+
+/**
+ * Moments of the samples at each aggregation level. Level N+1 is fed with
+ * the mean of each group of timescale samples at level N.
+ *
+ * All levels are kept in flat arrays indexed by level (and moment). Moments
+ * are calculated online as the mean and the sums of powers of deviations from
+ * the mean (Pébay's update formulas) with compensated summation, so doubles
+ * suffice even for long series. Powers are built by repeated multiplication.
+ */
+class Bins {
+public:
+	Bins(int timescale, int moments)
+		: timescale(timescale)
+		, num_moments(std::max(moments, 2))
+		, stride(num_moments - 1) {
+
+		/* binomial coefficients, row p holds C(p, 0..p) */
+		binom.resize((num_moments + 1) * (num_moments + 1), 0.0);
+		for ( int p = 0; p <= num_moments; p++ ){
+			binom[p * (num_moments + 1)] = 1.0;
+			for ( int k = 1; k <= p; k++ ){
+				binom[p * (num_moments + 1) + k] = binom[(p-1) * (num_moments + 1) + k-1] + (k < p ? binom[(p-1) * (num_moments + 1) + k] : 0.0);
+			}
+		}
+		scratch.resize(2 * (num_moments + 1));
+
+		/* a 64-bit counter allows at most 64 levels, so the arrays never move */
+		const size_t max_levels = 65;
+		count.reserve(max_levels);
+		filled.reserve(max_levels);
+		mean.reserve(max_levels);
+		mean_c.reserve(max_levels);
+		group.reserve(max_levels);
+		group_c.reserve(max_levels);
+		central.reserve(max_levels * stride);
+		central_c.reserve(max_levels * stride);
+		add_level();
+	}
+
+	/**
+	 * Called for each value.
+	 */
+	void feed(double value){
+		feed(0, value, 1);
+	}
+
+	/**
+	 * Same as calling feed N times with the same value, but only visits each
+	 * level once.
+	 */
+	void feed_repeated(double value, uint64_t n){
+		feed(0, value, n);
+	}
+
+	size_t levels() const { return count.size(); }
+	uint64_t samples(size_t level) const { return count[level]; }
+
+	/**
+	 * Variance of the samples at level.
+	 */
+	double variance(size_t level) const {
+		return (central[level * stride] + central_c[level * stride]) / (double)count[level];
+	}
+
+	/**
+	 * Raw moment E[X^k] (k >= 1) of the samples at level.
+	 */
+	double moment(size_t level, int k) const {
+		const double n = (double)count[level];
+		const double mu = mean[level] + mean_c[level];
+
+		/* E[X^k] = sum C(k,j) mu^(k-j) E[(X-mu)^j], E[(X-mu)^1] = 0 */
+		double sum = 0.0;
+		double mu_pow = 1.0;
+		for ( int j = k; j >= 0; j--, mu_pow *= mu ){
+			if ( j == 1 ) continue;
+			const double central_moment = j == 0 ? 1.0 : (central[level * stride + j-2] + central_c[level * stride + j-2]) / n;
+			sum += binom[k * (num_moments + 1) + j] * mu_pow * central_moment;
+		}
+		return sum;
+	}
+
+private:
+	void add_level(){
+		count.push_back(0);
+		filled.push_back(0);
+		mean.push_back(0.0);
+		mean_c.push_back(0.0);
+		group.push_back(0.0);
+		group_c.push_back(0.0);
+		central.resize(central.size() + stride, 0.0);
+		central_c.resize(central_c.size() + stride, 0.0);
+	}
+
+	void feed(size_t level, double value, uint64_t n){
+		while ( n > 0 ){
+			if ( level == levels() ){
+				add_level();
+			}
+
+			add_moments(level, value, n);
+			count[level] += n;
+
+			/* complete the current group */
+			const uint64_t pos = filled[level];
+			const uint64_t head = std::min<uint64_t>(n, timescale - pos);
+			add_group(level, value, head);
+			if ( pos + head < (uint64_t)timescale ){
+				filled[level] = pos + head;
+				return;
+			}
+
+			const double group_mean = (group[level] + group_c[level]) / timescale;
+			group[level] = 0.0;
+			group_c[level] = 0.0;
+
+			/* the mean of each following full group is the value itself, the
+			 * remainder begins the next group */
+			n -= head;
+			if ( n > 0 ){
+				filled[level] = n % timescale;
+				add_group(level, value, filled[level]);
+				n /= timescale;
+			} else {
+				filled[level] = 0;
+			}
+
+			if ( n > 0 ){
+				feed(level + 1, group_mean, 1);
+			} else {
+				value = group_mean;
+				n = 1;
+			}
+			level++;
+		}
+	}
+
+	/**
+	 * Add n samples of value to the group sum, exactly as long as the
+	 * compensated sum can hold it.
+	 */
+	void add_group(size_t level, double value, uint64_t n){
+		if ( n == 0 ) return;
+		const double product = value * (double)n;
+		compensated_add(group[level], group_c[level], product);
+		if ( n > 1 ){
+			compensated_add(group[level], group_c[level], fma(value, (double)n, -product));
+		}
+	}
+
+	/**
+	 * Merge n samples of value into the moments of level (Pébay 2008, eq. 2.1
+	 * with a second set of n equal samples).
+	 */
+	void add_moments(size_t level, double value, uint64_t n){
+		const uint64_t na = count[level];
+		if ( na == 0 ){
+			mean[level] = value;
+			mean_c[level] = 0.0;
+			return;
+		}
+
+		const double delta = value - mean[level] - mean_c[level];
+		const double d = delta / (double)(na + n);
+		const double step = (double)n * d;  /* change of the mean */
+		double* const M = &central[level * stride];
+		double* const Mc = &central_c[level * stride];
+
+		/* powers of -n*d and na*d */
+		double* const a = &scratch[0];
+		double* const b = &scratch[num_moments + 1];
+		a[0] = b[0] = 1.0;
+		for ( int k = 1; k <= num_moments; k++ ){
+			a[k] = a[k-1] * -step;
+			b[k] = b[k-1] * ((double)na * d);
+		}
+
+		/* highest first as each update uses the lower moments before this
+		 * sample. The last terms are the deviations of the na old and n new
+		 * samples from the new mean. */
+		for ( int p = num_moments; p >= 2; p-- ){
+			double update = (double)n * b[p] + (double)na * a[p];
+			for ( int k = 1; k <= p - 2; k++ ){
+				update += binom[p * (num_moments + 1) + k] * a[k] * (M[p-k-2] + Mc[p-k-2]);
+			}
+			compensated_add(M[p-2], Mc[p-2], update);
+		}
+
+		compensated_add(mean[level], mean_c[level], step);
+	}
+
+	const int timescale;
+	const int num_moments;            /* at least 2 so the variance is known */
+	const int stride;                 /* central moments (2..num_moments) per level */
+	std::vector<double> binom;
+	std::vector<double> scratch;
+
+	/* per level */
+	std::vector<uint64_t> count;
+	std::vector<uint64_t> filled;     /* samples in the current group */
+	std::vector<double> mean;
+	std::vector<double> mean_c;
+	std::vector<double> group;        /* sum of the current group */
+	std::vector<double> group_c;
+
+	/* per level and moment: sum of (x - mean)^p for p = 2..num_moments */
+	std::vector<double> central;
+	std::vector<double> central_c;
+};
+
+/* levels with fewer samples are too noisy for the variance-time fit */
+#define VARIANCE_TIME_MIN_SAMPLES 10
+
+/**
+ * Least-squares fit of log10(variance) against log10(aggregation) over the
+ * levels of Bins. For a self-similar process the variance of the aggregated
+ * series decays as m^(2H-2), so H = 1 + slope/2.
+ */
+struct variance_time {
+	int levels;                       /* number of levels in the fit */
+	double slope;
+	double slope_ci;                  /* half-width of the 95% confidence interval */
+	double hurst;
+	double hurst_ci;
+};
+
+/**
+ * Fit the levels with at least VARIANCE_TIME_MIN_SAMPLES samples and a
+ * non-zero variance. The confidence interval needs at least three levels
+ * and is NAN otherwise.
+ * @return false if fewer than two levels could be used.
+ */
+inline bool variance_time_fit(const Bins& bins, int timescale, struct variance_time* fit){
+	/* two-sided 95% quantiles of Student's t distribution, by degrees of freedom */
+	static const double t95[] = {
+		12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306, 2.262, 2.228,
+		 2.201, 2.179, 2.160, 2.145, 2.131, 2.120, 2.110, 2.101, 2.093, 2.086,
+	};
+
+	std::vector<double> x, y;
+	for ( size_t level = 0; level < bins.levels(); level++ ){
+		const double variance = bins.variance(level);
+		if ( bins.samples(level) < VARIANCE_TIME_MIN_SAMPLES || !(variance > 0.0) ) continue;
+		x.push_back(level * log10((double)timescale));
+		y.push_back(log10(variance));
+	}
+
+	const size_t n = x.size();
+	fit->levels = n;
+	if ( n < 2 ){
+		return false;
+	}
+
+	double mx = 0.0, my = 0.0;
+	for ( size_t i = 0; i < n; i++ ){
+		mx += x[i] / n;
+		my += y[i] / n;
+	}
+
+	double sxx = 0.0, sxy = 0.0;
+	for ( size_t i = 0; i < n; i++ ){
+		sxx += (x[i] - mx) * (x[i] - mx);
+		sxy += (x[i] - mx) * (y[i] - my);
+	}
+	fit->slope = sxy / sxx;
+	fit->hurst = 1.0 + fit->slope / 2.0;
+
+	fit->slope_ci = NAN;
+	if ( n > 2 ){
+		double ssr = 0.0;
+		for ( size_t i = 0; i < n; i++ ){
+			const double r = y[i] - (my + fit->slope * (x[i] - mx));
+			ssr += r * r;
+		}
+		const size_t dof = n - 2;
+		const double t = dof <= sizeof(t95) / sizeof(t95[0]) ? t95[dof-1] : 1.960;
+		fit->slope_ci = t * sqrt(ssr / dof / sxx);
+	}
+	fit->hurst_ci = fit->slope_ci / 2.0;
+
+	return true;
+}
+
+class TimescaleOutput {
+public:
+	virtual ~TimescaleOutput(){}
+	virtual void write_output(FILE* dst, const Bins& bins, int timescale, int num_moments, bool variance_time, const struct sample_info& info) = 0;
+};
+
+class DefaultTimescaleOutput: public TimescaleOutput {
+public:
+	virtual void write_output(FILE* dst, const Bins& bins, int timescale, int num_moments, bool variance_time, const struct sample_info& info){
+		int width[num_moments];
+		for ( int i = 0; i < num_moments; i++ ){
+			width[i] = str_width_for_moment(bins, i);
+		}
+
+		fprintf(dst, "sampleFrequency: %.2fHz\n", info.sampleFrequency);
+		fprintf(dst, "tSample:         %fs\n", info.tSample);
+		fprintf(dst, "timescale:       %d\n", timescale);
+		fprintf(dst, "\n");
+
+		fprintf(dst, "Tscale   ");
+		for ( int i = 0; i < num_moments; i++ ){
+			fprintf(dst, "%*s%d ", width[i], "M", i+1);
+		}
+		if ( variance_time ){
+			fprintf(dst, "%*s ", str_width_for_variance(bins)+1, "Variance");
+		}
+		fprintf(dst, " Samples\n");
+
+		for ( size_t level = 0; level < bins.levels(); level++ ){
+			fprintf(dst, "%-8g ", pow((double)timescale, (double)level) * info.tSample);
+			for ( int i = 0; i < num_moments; i++ ){
+				fprintf(dst, "%*g ", width[i]+1, bins.moment(level, i+1));
+			}
+			if ( variance_time ){
+				fprintf(dst, "%*g ", str_width_for_variance(bins)+1, bins.variance(level));
+			}
+			fprintf(dst, " %" PRIu64 "\n", bins.samples(level));
+		}
+
+		if ( variance_time ){
+			struct variance_time fit;
+			fprintf(dst, "\n");
+			if ( variance_time_fit(bins, timescale, &fit) ){
+				fprintf(dst, "Variance-time fit over %d levels (95%% confidence):\n", fit.levels);
+				fprintf(dst, "slope: %8.4f +- %.4f\n", fit.slope, fit.slope_ci);
+				fprintf(dst, "H:     %8.4f +- %.4f\n", fit.hurst, fit.hurst_ci);
+			} else {
+				fprintf(dst, "Variance-time fit: too few levels with at least %d samples.\n", VARIANCE_TIME_MIN_SAMPLES);
+			}
+		}
+	}
+
+private:
+	size_t str_width_for_moment(const Bins& bins, int index){
+		size_t max = 0;
+		char buf[64];
+		for ( size_t level = 0; level < bins.levels(); level++ ){
+			size_t width = snprintf(buf, sizeof(buf), "%g", bins.moment(level, index+1));
+			max = width > max ? width : max;
+		}
+		return max;
+	}
+
+	int str_width_for_variance(const Bins& bins){
+		size_t max = strlen("Variance") - 1;
+		char buf[64];
+		for ( size_t level = 0; level < bins.levels(); level++ ){
+			size_t width = snprintf(buf, sizeof(buf), "%g", bins.variance(level));
+			max = width > max ? width : max;
+		}
+		return max;
+	}
+};
+
+class CSVTimescaleOutput: public TimescaleOutput {
+public:
+	CSVTimescaleOutput(char delimiter, bool show_header)
+		: delimiter(delimiter)
+		, show_header(show_header){
+
+	}
+
+	virtual void write_output(FILE* dst, const Bins& bins, int timescale, int num_moments, bool variance_time, const struct sample_info& info){
+		if ( show_header ){
+			fprintf(dst, "\"Tscale (%dx, %.2fHz)\"", timescale, info.sampleFrequency);
+			for ( int i = 0; i < num_moments; i++ ){
+				fprintf(dst, "%c\"M%d\"", delimiter, i+1);
+			}
+			if ( variance_time ){
+				fprintf(dst, "%c\"Variance\"", delimiter);
+			}
+			fprintf(dst, "%c\"Samples\"\n", delimiter);
+		}
+
+		for ( size_t level = 0; level < bins.levels(); level++ ){
+			fprintf(dst, "%g", pow((double)timescale, (double)level) * info.tSample);
+			for ( int i = 0; i < num_moments; i++ ){
+				fprintf(dst, "%c%f", delimiter, bins.moment(level, i+1));
+			}
+			if ( variance_time ){
+				fprintf(dst, "%c%f", delimiter, bins.variance(level));
+			}
+			fprintf(dst, "%c%" PRIu64 "\n", delimiter, bins.samples(level));
+		}
+
+		/* the fit follows the table as "slope" and "H" rows of value and
+		 * confidence interval half-width */
+		struct variance_time fit;
+		if ( variance_time && variance_time_fit(bins, timescale, &fit) ){
+			fprintf(dst, "\"slope\"%c%f%c%f\n", delimiter, fit.slope, delimiter, fit.slope_ci);
+			fprintf(dst, "\"H\"%c%f%c%f\n", delimiter, fit.hurst, delimiter, fit.hurst_ci);
+		}
+	};
+
+private:
+	char delimiter;
+	bool show_header;
+};
+
+class BinaryTimescaleOutput: public TimescaleOutput {
+public:
+	virtual void write_output(FILE* dst, const Bins& bins, int timescale, int num_moments, bool variance_time, const struct sample_info& info){
+		struct samplefile_header header;
+		memset(&header, 0, sizeof(header));
+		memcpy(header.magic, SAMPLEFILE_MAGIC, 8);
+		header.version = SAMPLEFILE_VERSION;
+		header.kind = SAMPLE_TIMESCALE;
+		header.level = info.level;
+		header.relative_time = info.relative_time;
+		header.link_capacity = info.link_capacity;
+		header.sampleFrequency = info.sampleFrequency;
+		header.tSample = info.tSample;
+		header.timescale = timescale;
+		header.num_moments = num_moments;
+
+		SampleWriter writer(dst);
+		writer.write_header(header);
+
+		double moment[num_moments];
+		for ( size_t level = 0; level < bins.levels(); level++ ){
+			for ( int i = 0; i < num_moments; i++ ){
+				moment[i] = bins.moment(level, i+1);
+			}
+			writer.write_level(level, bins.samples(level), pow((double)timescale, (double)level) * info.tSample, moment, num_moments);
+		}
+	}
+};
+
+class Timescale final: public StaticExtractor<Timescale> {
+	friend class StaticExtractor<Timescale>;
+
+public:
+	Timescale()
+		: StaticExtractor()
+		, output(nullptr)
+		, num_moments(3)
+		, timescale(10)
+		, bins(nullptr)
+		, dst(stdout)
+		, record(false)
+		, store(nullptr)
+		, variance_time(false)
+		, update_interval(0.0)
+		, update_samples(0)
+		, next_update(0)
+		, fed(0)
+		, bits(0.0) {
+
+		set_formatter(FORMAT_DEFAULT);
+	}
+
+	virtual ~Timescale(){
+		delete bins;
+		delete output;
+	}
+
+	void set_timescale(int timescale){
+		this->timescale = timescale;
+	}
+
+	void set_moments(int moments){
+		num_moments = moments;
+	}
+
+	/**
+	 * Write the summary to dst instead of stdout. The stream is not closed.
+	 */
+	void set_output(FILE* dst){
+		this->dst = dst;
+	}
+
+	/**
+	 * Show the variance of each level and a variance-time fit (slope and Hurst
+	 * parameter) in the summary. Not supported by the binary format.
+	 */
+	void set_variance_time(bool state){
+		variance_time = state;
+	}
+
+	/**
+	 * Show the variance-time fit on stderr every N seconds of samples, 0 to
+	 * disable.
+	 */
+	void set_update_interval(double seconds){
+		update_interval = seconds;
+	}
+
+	/**
+	 * Copy sampling parameters, timescale and number of moments.
+	 */
+	void set_parameters(const Timescale& src){
+		Extractor::set_parameters(src);
+		timescale = src.timescale;
+		num_moments = src.num_moments;
+	}
+
+	/**
+	 * Record the sampled bitrate instead of feeding it to the bins. The
+	 * higher levels group samples across stream boundaries so streams
+	 * processed in parallel are merged by replaying them in order.
+	 */
+	void set_record(bool state){
+		record = state;
+	}
+
+	/**
+	 * Feed the samples recorded by another instance, as if its streams were
+	 * processed by this instance, and clear them.
+	 */
+	void replay(Timescale& src){
+		for ( const struct run& cur: src.recorded ){
+			feed(cur.value, cur.count);
+		}
+		src.recorded.clear();
+	}
+
+	/**
+	 * Also write the sampled bitrate to a sample store so the analysis can be
+	 * repeated with replay(). The store is not closed.
+	 */
+	void set_store(SampleStoreWriter* store){
+		this->store = store;
+	}
+
+	/**
+	 * Feed the bitrate read from a sample store.
+	 */
+	void replay(SampleStoreReader& src){
+		uint64_t value, n;
+		while ( keep_running && src.read(&value, &n) ){
+			feed((double)value, n);
+		}
+	}
+
+	virtual void set_formatter(enum Formatter format){
+		delete output;
+		switch (format){
+		  case FORMAT_DEFAULT: output = new DefaultTimescaleOutput; break;
+		  case FORMAT_CSV:     output = new CSVTimescaleOutput(';', false); break;
+		  case FORMAT_TSV:     output = new CSVTimescaleOutput('\t', false); break;
+		  case FORMAT_MATLAB:  output = new CSVTimescaleOutput('\t', true); break;
+		  case FORMAT_BINARY:  output = new BinaryTimescaleOutput; break;
+		  default:
+			  fprintf(stderr, "%s: output format not supported, using default.\n", program_name);
+			  output = new DefaultTimescaleOutput;
+		}
+	}
+
+	using Extractor::set_formatter;
+
+	virtual void reset(){
+		Extractor::reset();
+
+		if ( !bins ){
+			bins = new Bins(timescale, num_moments);
+			bits = 0.0;
+			update_samples = update_interval > 0.0 ? std::max(llround(update_interval * sampleFrequency), 1LL) : 0;
+			next_update = update_samples;
+		}
+	}
+
+	void write_summary(){
+		output->write_output(dst, *bins, timescale, num_moments, variance_time, get_sample_info());
+	}
+
+protected:
+	virtual void write_trailer(int index){
+
+	}
+
+	virtual void write_sample(double t){
+		const double bitrate = my_round(bits / to_double(tSample));
+		feed(bitrate, 1);
+		bits = 0.0;
+	}
+
+	virtual void write_empty_samples(uint64_t n){
+		feed(0.0, n);
+	}
+
+	virtual void accumulate(qd_real fraction, unsigned long packet_bits, const cap_head* cp, int counter){
+		bits += my_round(to_double(fraction) * packet_bits);
+	}
+
+	virtual void accumulate_samples(qd_real fraction, unsigned long packet_bits, const cap_head* cp, int counter, uint64_t n){
+		accumulate(fraction, packet_bits, cp, counter);
+		feed(my_round(bits / to_double(tSample)), n);
+		bits = 0.0;
+	}
+
+private:
+	struct run {
+		double value;
+		uint64_t count;
+	};
+
+	void feed(double value, uint64_t n){
+		if ( store && !record ){
+			if ( !store->has_header() ){
+				store->write_header(store_header(get_sample_info(), QUANTITY_BITRATE));
+			}
+			store->write((uint64_t)value, n);
+		}
+
+		if ( record ){
+			recorded.push_back({value, n});
+		} else if ( n == 1 ){
+			bins->feed(value);
+		} else {
+			bins->feed_repeated(value, n);
+		}
+
+		fed += n;
+		if ( update_samples > 0 && fed >= next_update && !record ){
+			show_update();
+			next_update = (fed / update_samples + 1) * update_samples;
+		}
+	}
+
+	void show_update() const {
+		struct variance_time fit;
+		const double t = fed / sampleFrequency;
+		if ( !variance_time_fit(*bins, timescale, &fit) ){
+			fprintf(stderr, "%s: %.3fs: too few levels for a variance-time fit.\n", program_name, t);
+		} else if ( fit.levels < 3 ){
+			fprintf(stderr, "%s: %.3fs: H=%.4f slope=%.4f (%d levels)\n", program_name, t, fit.hurst, fit.slope, fit.levels);
+		} else {
+			fprintf(stderr, "%s: %.3fs: H=%.4f +- %.4f slope=%.4f +- %.4f (%d levels)\n", program_name, t, fit.hurst, fit.hurst_ci, fit.slope, fit.slope_ci, fit.levels);
+		}
+	}
+
+	TimescaleOutput* output;
+	int num_moments;
+	int timescale;
+	Bins* bins;
+	FILE* dst;
+	bool record;
+	std::vector<struct run> recorded;
+	SampleStoreWriter* store;
+	bool variance_time;
+	double update_interval;
+	uint64_t update_samples;          /* samples between updates */
+	uint64_t next_update;
+	uint64_t fed;                     /* samples fed to the bins */
+	double bits;
+};
+
+#endif /* TIMESCALE_H */
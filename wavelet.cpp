@@ -3,8 +3,6 @@
 #endif
 
 #include <caputils/caputils.h>
-#include <vector>
-#include <cmath>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
@@ -14,8 +12,8 @@
 #include <iomanip>
 #include <getopt.h>
 
-#include "extract.hpp"
-using namespace std;
+#include "wavelet.hpp"
+#include "stats.hpp"
 
 static int show_zero = 0;
 static const char* iface = NULL;
@@ -30,265 +28,41 @@ static void handle_sigint(int signum){
 	keep_running = false;
 }
 
-void WaveletSpectrumFunc(vector <int> timeSeriesWavelet, double ts)
-{
-  //	FILE *f = popen("/Applications/Gnuplot.app/Contents/Resources/bin/gnuplot", "w");
-  //	fprintf(f, "plot '-' w lp ");
-
-	// cout << "Band" << "\t" << "Spectrum value" << endl;
-	// int instantNumber;
-	// int packetRate;
-	int n;
-	int l;
-	double dataPoints;
-	double meu,meuC;
-
-	// char pathToFile[200];
-
-
-	// int *timeSeries=NULL;
-
-	// int indexToTimeSeries=0;
-
-	int count=0;
-	// vector <int> timeSeries;
-
-	// cout << "Enter filename:" << endl ;
-	// cin >> pathToFile;
-	// cout << endl;
-
-	n = (int) timeSeriesWavelet.size();
-	l = log2(n);
-
-	dataPoints = pow(2.0,l);									// Limiting time series to multiple of two data points
-	// cout << dataPoints <<endl;
-
-	// *** Declaring Difference and Scaling vectors ***
-
-
-	// waveletSpectrum(l, dataPoints, timeSeries);
-	// cout << "The end";
-
-
-
-
-	// void waveletSpectrum(int l, int dataPoints, vector<int> timeSeries)
-
-	// {
-
-	//	TraceFile.append("_wavelet.txt");
-
-
-	//	ofstream outPutFile(TraceFile.c_str(), ios::out);
-
-	int i;
-	int j;
-	double sum; //Made it double
-	double diff; //Made it double
-	double sumDsqr=0;
-	double sumCsqr=0;
-	int band=0;
-	double Dsqr=0;
-	double Csqr=0;
-
-	vector<vector <double> > D;
-	vector <double> Drow;
-	vector<vector <double> > C;
-	vector <double> Crow;
-
-	double Dspectrum [l];
-	double Cspectrum [l];
-	fprintf(stdout, "Ts\tBand\tD coeff\tC Coeff\n");
-	for (i=l; i>0; i--){
-	  // int k=0;
-			// *** Calculation of Difference and Scaling coefficients **
-			for (j=0; j<dataPoints; j++)				{
-			  Dsqr=0;
-			  Csqr=0;
-			  diff=0;
-			  sum=0;
-			  
-			  
-			  if(i==l){
-			    sum = timeSeriesWavelet[j] + timeSeriesWavelet[j+1];					// At finest level
-			    sum= sum/sqrt(2);
-			    Crow.push_back(sum);
-			    Csqr= sum*sum;
-			    
-			    diff = timeSeriesWavelet[j] - timeSeriesWavelet[j+1];
-			    diff = diff/sqrt(2);
-			    Drow.push_back(diff);
-			    Dsqr=diff*diff;
-			    count++;
-			    //	outPutFile << "D:  " << diff << "\t";
-			    //    outPutFile << "C:  " << sum << "\t" ;
-			  } else {
-			    sum = (C[band-1][j]) + (C[band-1][j+1]); // At coarser levels
-			    sum= sum/sqrt(2);
-			    Crow.push_back(sum);
-			    Csqr= sum*sum;
-			    
-			    diff = (C[band-1][j]) - (C[band-1][j+1]);
-			    diff= diff/sqrt(2);
-			    Drow.push_back(diff);
-			    Dsqr=diff*diff;
-			    
-			    count++;
-			    // outPutFile << "D:  " << diff << "\t";
-			    // outPutFile << "C:  " << sum << "\t" ;
-			    
-			  }
-			  
-			  
-			  sumDsqr=sumDsqr+Dsqr;
-			  sumCsqr+=Csqr;
-			  j++;
-			  
-			}
-			
-			meu=sumDsqr/count;
-			meuC=sumCsqr/count;
-			Dspectrum[band] = log2(meu);
-			Cspectrum[band] = log(meuC);
-			
-			sumDsqr=0;
-			fprintf(stdout, "%5.5g\t%d\t%f\t%f\n", ts*pow(2,l-i),i-1, Dspectrum[band],Cspectrum[band]);
-			D.push_back(Drow);
-			C.push_back(Crow);
-			dataPoints = C[band].size();
-			Drow.clear();
-			Crow.clear();
-			band++;
-			count=0;
-
-		}
-
-	// FILE* Gplt = popen(" -persist","w");
-	// fprintf(Gplt,"plot '' w lp");
-	// pclose(Gplt);
-
-
-	// fputs("plot '/Users/junaidjunaid/Desktop/UnusedDESKTOPItems/Ramu/wavelet_emacs/ducks_140_14_sc.txt'  w lp", f);
-	// fprintf(f, "set terminal x11");
-
-	//	fprintf(f, "e");
-	//fflush(f);
-	//	pclose(f);
-}
-
-
-
-
-class Output {
-public:
-	virtual void write_header(double sampleFrequency, double tSample){};
-	virtual void write_trailer(){};
-	virtual void write_sample(double t, unsigned long pkts) = 0;
-};
-
-class DefaultOutput: public Output {
-public:
-	virtual void write_header(double sampleFrequency, double tSample){
-		fprintf(stdout, "sampleFrequency: %.2fHz\n", sampleFrequency);
-		fprintf(stdout, "tSample:         %fs\n", tSample);
-		fprintf(stdout, "\n");
-		fprintf(stdout, "Time                      \t   Packets\n");
-	}
-
-	virtual void write_sample(double t, unsigned long pkts){
-		fprintf(stdout, "%.15f\t%10ld\n", t, pkts);
-	}
-};
-
-class CSVOutput: public Output {
-public:
-	CSVOutput(char delimiter, bool show_header)
-		: delimiter(delimiter)
-		, show_header(show_header){
-
-	}
-
-	virtual void write_header(double sampleFrequency, double tSample){
-		if ( show_header ){
-			fprintf(stdout, "\"Time (tSample: %f)\"%c\"Packets\"\n", tSample, delimiter);
-		}
-	}
-
-	virtual void write_sample(double t, unsigned long pkts){
-		fprintf(stdout, "%.15f%c%ld\n", t, delimiter, pkts);
-	}
-
-private:
-	char delimiter;
-	bool show_header;
-};
-
-class PacketRate: public Extractor {
-public:
-	PacketRate()
-		: Extractor()
-		, pkts(0){
-
-		set_formatter(FORMAT_DEFAULT);
-	}
-
-	virtual void set_formatter(enum Formatter format){
-		switch (format){
-		case FORMAT_DEFAULT: output = new DefaultOutput; break;
-		case FORMAT_CSV:     output = new CSVOutput(';', false); break;
-		case FORMAT_TSV:     output = new CSVOutput('\t', false); break;
-		case FORMAT_MATLAB:  output = new CSVOutput('\t', true); break;
-		}
-	}
-
-	using Extractor::set_formatter;
-
-	virtual void reset(){
-		pkts = 0;
-		Extractor::reset();
-	}
-
-  void wavelet(void){
-    WaveletSpectrumFunc(timeSeries, to_double(tSample));
-  }
-
-protected:
-	virtual void write_header(int index){
-		output->write_header(sampleFrequency, to_double(tSample));
-	}
-
-	virtual void write_trailer(int index){
-		output->write_trailer();
-	}
-
-	virtual void write_sample(double t){
-		if ( show_zero || pkts > 0 ){
-		  //output->write_sample(t, pkts);
-		}
-		timeSeries.push_back(pkts);
-
-		pkts = 0;
+/**
+ * Calculate the spectrum of a stored packet rate.
+ */
+static int replay_store(Wavelet& app, const char* filename){
+	SampleStoreReader reader;
+	int ret;
+	if ( (ret=reader.open(filename)) != 0 ){
+		fprintf(stderr, "%s: %s: %s\n", program_name, filename, ret == EINVAL ? "not a sample store" : strerror(ret));
+		return 1;
 	}
-
-	virtual void accumulate(qd_real fraction, unsigned long packet_bits, const cap_head* cp, int counter){
-		if ( counter == 1 ){
-			pkts += 1;
-		}
+	if ( reader.header().quantity != QUANTITY_PACKETS ){
+		fprintf(stderr, "%s: %s: store doesn't hold a packet rate.\n", program_name, filename);
+		return 1;
 	}
 
-private:
-	Output* output;
-	unsigned long pkts;
-  	vector <int> timeSeries;
-};
+	set_store_parameters(app, reader.header());
+	app.reset();
+	app.replay(reader);
+	app.wavelet();
+	return 0;
+}
 
-static const char* short_options = "p:i:q:m:f:zxtTh";
+static const char* short_options = "p:i:q:m:f:e:u:j:k:s:S:zxtTh";
 static struct option long_options[]= {
 	{"packets",          required_argument, 0, 'p'},
 	{"iface",            required_argument, 0, 'i'},
 	{"level",            required_argument, 0, 'q'},
 	{"sampleFrequency",  required_argument, 0, 'm'},
 	{"format",           required_argument, 0, 'f'},
+	{"engine",           required_argument, 0, 'e'},
+	{"update",           required_argument, 0, 'u'},
+	{"jobs",             required_argument, 0, 'j'},
+	{"kernel",           required_argument, 0, 'k'},
+	{"store",            required_argument, 0, 's'},
+	{"from-store",       required_argument, 0, 'S'},
 	{"show-zero",        no_argument,       0, 'z'},
 	{"no-show-zero",     no_argument,       0, 'x'},
 	{"relative-time",    no_argument,       0, 't'},
@@ -317,13 +91,24 @@ static void show_usage(void){
 	       "  -z, --show-zero             Show bitrate when zero.\n"
 	       "  -x, --no-show-zero          Don't show bitrate when zero [default]\n"
 	       "  -f, --format=FORMAT         Set a specific output format. See below for list of supported formats.\n"
+	       "  -e, --engine=ENGINE         Time arithmetic used for sampling, see below [default: qd].\n"
+	       "  -u, --update=SECONDS        Write the spectrum every SECONDS of traffic, e.g. for live streams.\n"
+	       "  -j, --jobs=N                Calculate the finest octaves using N threads. The\n"
+	       "                              spectrum is identical to a single thread.\n"
+	       "  -k, --kernel=NAME           Transform kernel, see below [default: fastest].\n"
+	       "  -s, --store=FILE            Also write the packet rate to a sample store.\n"
+	       "  -S, --from-store=FILE       Read the packet rate from a sample store instead of\n"
+	       "                              a stream, i.e. repeat the analysis of a stored run.\n"
 	       "  -t, --relative-time         Show timestamps relative to the first packet.\n"
 	       "  -T, --absolute-time         Show timestamps with absolute values (default).\n"
 	       "  -h, --help                  This text.\n\n");
 
 
 	output_format_list();
+	output_engine_list();
+	haar_kernel_list();
 	filter_from_argv_usage();
+	stats_from_argv_usage();
 }
 
 int main(int argc, char **argv){
@@ -339,8 +124,14 @@ int main(int argc, char **argv){
 	if ( filter_from_argv(&argc, argv, &filter) != 0 ){
 		return 0; /* error already shown */
 	}
+	if ( stats_from_argv(&argc, argv) != 0 ){
+		return 1;
+	}
 
-	PacketRate app;
+	Wavelet app;
+	int jobs = 1;
+	const char* store_name = nullptr;
+	const char* from_store = nullptr;
 
 	int op, option_index = -1;
 	while ( (op = getopt_long(argc, argv, short_options, long_options, &option_index)) != -1 ){
@@ -353,6 +144,10 @@ int main(int argc, char **argv){
 			app.set_formatter(optarg);
 			break;
 
+		case 'e': /* --engine */
+			app.set_time_engine(optarg);
+			break;
+
 		case 'p':
 			app.set_max_packets(atoi(optarg));
 			break;
@@ -369,6 +164,25 @@ int main(int argc, char **argv){
 			app.set_link_capacity(optarg);
 			break;
 
+		case 'u': /* --update */
+			app.set_update_interval(atof(optarg));
+			break;
+
+		case 'j': /* --jobs */
+			jobs = atoi(optarg);
+			if ( jobs < 1 ){
+				fprintf(stderr, "%s: invalid --jobs \"%s\", using 1.\n", program_name, optarg);
+				jobs = 1;
+			}
+			app.set_jobs(jobs);
+			break;
+
+		case 'k': /* --kernel */
+			if ( !haar_set_kernel(optarg) ){
+				fprintf(stderr, "%s: kernel \"%s\" is unknown or not supported by this cpu, using %s.\n", program_name, optarg, haar_kernel_name());
+			}
+			break;
+
 		case 'i':
 			iface = optarg;
 			break;
@@ -389,6 +203,14 @@ int main(int argc, char **argv){
 			app.set_relative_time(false);
 			break;
 
+		case 's': /* --store */
+			store_name = optarg;
+			break;
+
+		case 'S': /* --from-store */
+			from_store = optarg;
+			break;
+
 		case 'h':
 			show_usage();
 			return 0;
@@ -398,9 +220,28 @@ int main(int argc, char **argv){
 		}
 	}
 
+	app.set_show_zero(show_zero);
+
 	/* handle C-c */
 	signal(SIGINT, handle_sigint);
 
+	if ( from_store ){
+		const int ret = replay_store(app, from_store);
+		filter_close(&filter);
+		return ret;
+	}
+
+	FILE* store_fp = nullptr;
+	SampleStoreWriter* store = nullptr;
+	if ( store_name ){
+		if ( !(store_fp = fopen(store_name, "wb")) ){
+			fprintf(stderr, "%s: %s: %s\n", program_name, store_name, strerror(errno));
+			return 1;
+		}
+		store = new SampleStoreWriter(store_fp);
+		app.set_store(store);
+	}
+
 	int ret;
 
 	/* Open stream(s) */
@@ -415,8 +256,11 @@ int main(int argc, char **argv){
 	app.process_stream(stream, &filter);
 	app.wavelet();
 
-
 	/* Release resources */
+	if ( store ){
+		delete store;
+		fclose(store_fp);
+	}
 	stream_close(stream);
 	filter_close(&filter);
 
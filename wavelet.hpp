@@ -0,0 +1,230 @@
+#ifndef WAVELET_H
+#define WAVELET_H
+
+#include <cstdio>
+#include <cmath>
+#include <cstdint>
+#include <algorithm>
+
+#include "extract.hpp"
+#include "haar.hpp"
+#include "output.hpp"
+
+class Wavelet final: public StaticExtractor<Wavelet> {
+	friend class StaticExtractor<Wavelet>;
+
+public:
+	Wavelet()
+		: StaticExtractor()
+		, output(nullptr)
+		, format(FORMAT_DEFAULT)
+		, dst(stdout)
+		, show_zero(false)
+		, update_interval(0.0)
+		, update_samples(0)
+		, samples(0)
+		, jobs(1)
+		, store(nullptr)
+		, pkts(0){
+
+		set_formatter(FORMAT_DEFAULT);
+	}
+
+	virtual ~Wavelet(){
+		delete output;
+	}
+
+	virtual void set_formatter(enum Formatter format){
+		this->format = format;
+		delete output;
+		switch (format){
+		case FORMAT_DEFAULT: output = new DefaultOutput<unsigned long>(label, dst); break;
+		case FORMAT_CSV:     output = new CSVOutput<unsigned long>(label, ';', false, dst); break;
+		case FORMAT_TSV:     output = new CSVOutput<unsigned long>(label, '\t', false, dst); break;
+		case FORMAT_MATLAB:  output = new CSVOutput<unsigned long>(label, '\t', true, dst); break;
+		case FORMAT_RLE:     output = new RLEOutput<unsigned long>(label, dst); break;
+		case FORMAT_BINARY:  output = new BinaryOutput<unsigned long>(label, dst); break;
+		default:
+			/* the samples only feed the transform, nothing would be published */
+			fprintf(stderr, "%s: output format not supported, using default.\n", program_name);
+			this->format = FORMAT_DEFAULT;
+			output = new DefaultOutput<unsigned long>(label, dst);
+		}
+	}
+
+	using Extractor::set_formatter;
+
+	/**
+	 * Write to dst instead of stdout. The stream is not closed.
+	 */
+	void set_output(FILE* dst){
+		this->dst = dst;
+		set_formatter(format);
+	}
+
+	/**
+	 * Write samples where no packets arrived.
+	 */
+	void set_show_zero(bool state){
+		show_zero = state;
+	}
+
+	/**
+	 * Write the spectrum every N seconds of samples, 0 to only write it by
+	 * calling wavelet().
+	 */
+	void set_update_interval(double seconds){
+		update_interval = seconds;
+	}
+
+	/**
+	 * Also write the packet rate to a sample store so the analysis can be
+	 * repeated with replay(). The store is not closed.
+	 */
+	void set_store(SampleStoreWriter* store){
+		this->store = store;
+	}
+
+	/**
+	 * Feed the packet rate read from a sample store.
+	 */
+	void replay(SampleStoreReader& src){
+		uint64_t value, n;
+		write_header(0);
+		while ( keep_running && src.read(&value, &n) ){
+			feed(value, n);
+		}
+		write_trailer(0);
+	}
+
+	/**
+	 * Transform the finest octaves using N threads. The spectrum is identical
+	 * for any number of threads.
+	 */
+	void set_jobs(int jobs){
+		this->jobs = jobs;
+	}
+
+	virtual void reset(){
+		pkts = 0;
+		samples = 0;
+		pyramid = HaarPyramid();
+		batch.clear();
+		if ( jobs > 1 ){
+			batch.reserve((size_t)jobs * HAAR_PARALLEL_BLOCKS * HAAR_BLOCK_SIZE);
+		}
+		Extractor::reset();
+		update_samples = update_interval > 0.0 ? std::max(llround(update_interval * sampleFrequency), 1LL) : 0;
+	}
+
+	/**
+	 * Write the spectrum of the samples so far.
+	 */
+	void wavelet(void){
+		flush_batch();
+		pyramid.write_spectrum(dst, to_double(tSample));
+	}
+
+protected:
+	virtual void write_header(int index){
+		output->write_header(get_sample_info());
+	}
+
+	virtual void write_trailer(int index){
+		output->write_trailer();
+	}
+
+	virtual void write_sample(double t){
+		if ( show_zero || pkts > 0 ){
+		  //output->write_sample(t, pkts);
+		}
+		feed(pkts, 1);
+
+		pkts = 0;
+	}
+
+	virtual void write_empty_samples(uint64_t n){
+		feed(0, n);
+	}
+
+	virtual void accumulate(qd_real fraction, unsigned long packet_bits, const cap_head* cp, int counter){
+		if ( counter == 1 ){
+			pkts += 1;
+		}
+	}
+
+	virtual void accumulate_samples(qd_real fraction, unsigned long packet_bits, const cap_head* cp, int counter, uint64_t n){
+		/* a packet is only counted in the interval it begins in */
+		write_empty_samples(n);
+	}
+
+private:
+	static constexpr const char* label = "Packets";
+
+	void feed(uint64_t value, uint64_t n){
+		if ( store ){
+			if ( !store->has_header() ){
+				store->write_header(store_header(get_sample_info(), QUANTITY_PACKETS));
+			}
+			store->write(value, n);
+		}
+
+		if ( update_samples == 0 ){
+			transform(value, n);
+			samples += n;
+			return;
+		}
+
+		/* split at the updates */
+		while ( n > 0 ){
+			const uint64_t chunk = std::min(n, update_samples - samples % update_samples);
+			transform(value, chunk);
+			samples += chunk;
+			n -= chunk;
+			if ( samples % update_samples == 0 ){
+				fprintf(dst, "# %.3fs\n", samples / sampleFrequency);
+				wavelet();
+				fflush(dst);
+			}
+		}
+	}
+
+	void transform(double value, uint64_t n){
+		if ( jobs == 1 ){
+			pyramid.feed_repeated(value, n);
+			return;
+		}
+
+		while ( n > 0 ){
+			const size_t chunk = std::min<uint64_t>(n, batch.capacity() - batch.size());
+			batch.insert(batch.end(), chunk, value);
+			n -= chunk;
+			if ( batch.size() == batch.capacity() ){
+				flush_batch();
+			}
+		}
+	}
+
+	/**
+	 * Pass the batched samples to the pyramid using all jobs.
+	 */
+	void flush_batch(){
+		pyramid.feed(batch.data(), batch.size(), jobs);
+		batch.clear();
+	}
+
+	Output<unsigned long>* output;
+	enum Formatter format;
+	FILE* dst;
+	bool show_zero;
+	double update_interval;
+	uint64_t update_samples;          /* samples between spectrums */
+	uint64_t samples;
+	int jobs;
+	SampleStoreWriter* store;
+	unsigned long pkts;
+	HaarPyramid pyramid;
+	std::vector<double> batch;        /* samples for the parallel transform */
+};
+
+#endif /* WAVELET_H */
@@ -0,0 +1,233 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <chrono>
+#include <cinttypes>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <string>
+#include <vector>
+#include <getopt.h>
+
+#include "haar.hpp"
+
+/* series are replayed from a buffer of at most this many values so large
+ * sizes don't need the whole series in memory */
+#define SERIES_BUFFER_SIZE (1<<20)
+
+static int min_order = 20;
+static int max_order = 24;
+static int rounds = 3;
+static int jobs = 1;
+const char* program_name = NULL;
+
+/**
+ * The per-value pyramid, i.e. how HaarPyramid worked before blocks and
+ * kernels, used as the baseline.
+ */
+class ReferencePyramid {
+public:
+	void feed(double value){
+		for ( size_t octave = 0; ; octave++ ){
+			if ( octave == count.size() ){
+				pending.push_back(0.0);
+				has_pending.push_back(false);
+				sumD.push_back(0.0);
+				count.push_back(0);
+			}
+
+			if ( !has_pending[octave] ){
+				pending[octave] = value;
+				has_pending[octave] = true;
+				return;
+			}
+
+			const double c = (pending[octave] + value) / sqrt(2);
+			const double d = (pending[octave] - value) / sqrt(2);
+			has_pending[octave] = false;
+			sumD[octave] += d * d;
+			count[octave]++;
+			value = c;
+		}
+	}
+
+private:
+	std::vector<double> pending;
+	std::vector<bool> has_pending;
+	std::vector<double> sumD;
+	std::vector<uint64_t> count;
+};
+
+/**
+ * Run func and return the fastest of the rounds in seconds.
+ */
+template <class F>
+static double measure(F func){
+	double best = 0.0;
+	for ( int i = 0; i < rounds; i++ ){
+		const auto begin = std::chrono::steady_clock::now();
+		func();
+		const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - begin;
+		if ( i == 0 || elapsed.count() < best ){
+			best = elapsed.count();
+		}
+	}
+	return best;
+}
+
+static std::string spectrum(HaarPyramid& pyramid){
+	char* buf = nullptr;
+	size_t size = 0;
+	FILE* fp = open_memstream(&buf, &size);
+	pyramid.write_spectrum(fp, 1.0);
+	fclose(fp);
+	std::string str(buf, size);
+	free(buf);
+	return str;
+}
+
+static void bench(uint64_t n, const std::vector<double>& series){
+	printf("%" PRIu64 " points (2^%d)\n", n, (int)log2(n));
+
+	ReferencePyramid reference;
+	const double t0 = measure([&](){
+		reference = ReferencePyramid();
+		for ( uint64_t i = 0; i < n; i += series.size() ){
+			const size_t m = std::min<uint64_t>(series.size(), n - i);
+			for ( size_t j = 0; j < m; j++ ){
+				reference.feed(series[j]);
+			}
+		}
+	});
+	printf("  %-10s %8.3f s %8.2f ns/point\n", "reference", t0, 1e9 * t0 / n);
+
+	std::string expected;
+	for ( const char* name: {"scalar", "sse2", "avx2"} ){
+		if ( !haar_set_kernel(name) ) continue;
+
+		HaarPyramid pyramid;
+		const double t = measure([&](){
+			pyramid = HaarPyramid();
+			for ( uint64_t i = 0; i < n; i += series.size() ){
+				pyramid.feed(series.data(), std::min<uint64_t>(series.size(), n - i));
+			}
+			pyramid.flush();
+		});
+
+		/* all kernels must give the same spectrum */
+		const std::string result = spectrum(pyramid);
+		if ( expected.empty() ){
+			expected = result;
+		}
+
+		printf("  %-10s %8.3f s %8.2f ns/point %6.2fx%s\n", name, t, 1e9 * t / n, t0 / t,
+		       result == expected ? "" : " (spectrum differs from scalar)");
+	}
+
+	if ( jobs > 1 ){
+		HaarPyramid pyramid;
+		const double t = measure([&](){
+			pyramid = HaarPyramid();
+			for ( uint64_t i = 0; i < n; i += series.size() ){
+				pyramid.feed(series.data(), std::min<uint64_t>(series.size(), n - i), jobs);
+			}
+			pyramid.flush();
+		});
+
+		const std::string result = spectrum(pyramid);
+		char name[32];
+		snprintf(name, sizeof(name), "%s/%d", haar_kernel_name(), jobs);
+		printf("  %-10s %8.3f s %8.2f ns/point %6.2fx%s\n", name, t, 1e9 * t / n, t0 / t,
+		       result == expected ? "" : " (spectrum differs from scalar)");
+	}
+}
+
+static const char* short_options = "n:N:r:j:h";
+static struct option long_options[]= {
+	{"min",              required_argument, 0, 'n'},
+	{"max",              required_argument, 0, 'N'},
+	{"rounds",           required_argument, 0, 'r'},
+	{"jobs",             required_argument, 0, 'j'},
+	{"help",             no_argument,       0, 'h'},
+	{0, 0, 0, 0} /* sentinel */
+};
+
+static void show_usage(void){
+	printf("%s-" VERSION "\n", program_name);
+	printf("Usage: %s [OPTIONS]\n", program_name);
+	printf("Benchmarks the Haar wavelet kernels on synthetic packet-rate series of\n"
+	       "2^MIN to 2^MAX points.\n\n"
+	       "  -n, --min=MIN               Smallest series is 2^MIN points [default: 20].\n"
+	       "  -N, --max=MAX               Largest series is 2^MAX points [default: 24].\n"
+	       "  -r, --rounds=N              Report the fastest of N runs [default: 3].\n"
+	       "  -j, --jobs=N                Also run the fastest kernel with N threads.\n"
+	       "  -h, --help                  This text.\n\n");
+
+	haar_kernel_list();
+}
+
+int main(int argc, char **argv){
+	/* extract program name from path. e.g. /path/to/MArCd -> MArCd */
+	const char* separator = strrchr(argv[0], '/');
+	if ( separator ){
+		program_name = separator + 1;
+	} else {
+		program_name = argv[0];
+	}
+
+	int op, option_index = -1;
+	while ( (op = getopt_long(argc, argv, short_options, long_options, &option_index)) != -1 ){
+		switch (op){
+		case 0:   /* long opt */
+		case '?': /* unknown opt */
+			break;
+
+		case 'n': /* --min */
+			min_order = atoi(optarg);
+			break;
+
+		case 'N': /* --max */
+			max_order = atoi(optarg);
+			break;
+
+		case 'r': /* --rounds */
+			rounds = atoi(optarg);
+			break;
+
+		case 'j': /* --jobs */
+			jobs = atoi(optarg);
+			break;
+
+		case 'h':
+			show_usage();
+			return 0;
+
+		default:
+			fprintf (stderr, "%s: ?? getopt returned character code 0%o ??\n", program_name, op);
+		}
+	}
+
+	if ( min_order < 1 || max_order > 40 || min_order > max_order || rounds < 1 || jobs < 1 ){
+		fprintf(stderr, "%s: invalid series size, rounds or jobs.\n", program_name);
+		return 1;
+	}
+
+	/* bursty packet counts: idle most of the time, poisson bursts otherwise */
+	std::mt19937_64 gen(4711);
+	std::bernoulli_distribution busy(0.3);
+	std::poisson_distribution<int> burst(12.0);
+	std::vector<double> series(std::min<uint64_t>(SERIES_BUFFER_SIZE, 1ULL << max_order));
+	for ( double& x: series ){
+		x = busy(gen) ? burst(gen) : 0;
+	}
+
+	for ( int order = min_order; order <= max_order; order++ ){
+		bench(1ULL << order, series);
+	}
+
+	return 0;
+}